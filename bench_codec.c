@@ -0,0 +1,426 @@
+// Micro-benchmark for the PDU codec.
+//
+// Times the old way of building and parsing PDUs (fill a struct pdu after
+// clearing it, memcpy fields at fixed offsets) against the in-place cursor
+// codec in pdu_codec.c, and copying header and payload into one frame before
+// sending against handing both to a single sendmsg()/writev(). Prints one
+// JSON line per case and implementation on stdout.
+//
+// Cases:
+//   register_encode - build an 'R' request with metadata
+//   register_decode - parse an 'R' request as the index server does
+//   lookup_encode   - build an 'M' reply with LOOKUP_BATCH_MAX results
+//   lookup_send     - send that reply over a datagram socket pair
+//   chunk_send      - send a framed XFER_CHUNK_SIZE chunk over a stream socket pair
+//
+// Build: gcc -O2 -o bench_codec bench_codec.c pdu_codec.c
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "pdu.h"
+#include "pdu_codec.h"
+
+#define DEFAULT_ITERATIONS 2000000
+#define SEND_DIVISOR       20      // socket cases run this many times fewer iterations
+
+// Keep the compiler from dropping work whose result is never read
+#define KEEP(p) __asm__ volatile("" : : "r"(p) : "memory")
+
+long iterations = DEFAULT_ITERATIONS;
+char label[64] = "";
+struct sockaddr_in test_addr;
+struct content_meta test_meta;
+
+// Function prototypes
+long long now_ns(void);
+void report(const char *name, const char *impl, long n, long long ns);
+void usage(const char *prog);
+void bench_register_encode(void);
+void bench_register_decode(void);
+void bench_lookup_encode(void);
+void bench_lookup_send(void);
+void bench_chunk_send(void);
+size_t old_register(struct pdu *out);
+size_t old_lookup_reply(struct lookup_pdu *out);
+size_t new_lookup_reply(char *buf, size_t size);
+void old_pack_meta(char *buf, const struct content_meta *meta);
+void old_unpack_meta(const char *buf, struct content_meta *meta);
+void drain(int fd, size_t len, int stream);
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:l:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        case 'l':
+            strncpy(label, optarg, sizeof(label) - 1);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (iterations < SEND_DIVISOR) {
+        usage(argv[0]);
+    }
+
+    test_addr.sin_family = AF_INET;
+    test_addr.sin_addr.s_addr = htonl(0x7f000001);
+    test_addr.sin_port = htons(40000);
+    test_meta.size = 123456789;
+    test_meta.version = 1700000000;
+    test_meta.hash = 0x0123456789abcdefULL;
+
+    bench_register_encode();
+    bench_register_decode();
+    bench_lookup_encode();
+    bench_lookup_send();
+    bench_chunk_send();
+    return 0;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n iterations] [-l label]\n", prog);
+    exit(1);
+}
+
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void report(const char *name, const char *impl, long n, long long ns)
+{
+    printf("{\"bench\":\"codec\",\"label\":\"%s\",\"case\":\"%s\",\"impl\":\"%s\","
+           "\"iterations\":%ld,\"ns_per_op\":%.1f}\n",
+           label, name, impl, n, (double)ns / n);
+    fflush(stdout);
+}
+
+void bench_register_encode(void)
+{
+    struct pdu out;
+    char buf[PDU_MAX_DGRAM];
+    struct pdu_cursor c;
+    long long t0;
+    long i;
+
+    t0 = now_ns();
+    for (i = 0; i < iterations; i++) {
+        KEEP(old_register(&out));
+        KEEP(&out);
+    }
+    report("register_encode", "struct", iterations, now_ns() - t0);
+
+    t0 = now_ns();
+    for (i = 0; i < iterations; i++) {
+        pdu_cursor_init(&c, buf + PDU_HDR_SIZE, sizeof(buf) - PDU_HDR_SIZE);
+        pdu_put_name(&c, "peer1", PEER_NAME_SIZE);
+        pdu_put_name(&c, "content1", CONTENT_NAME_SIZE);
+        pdu_put_addr(&c, &test_addr);
+        pdu_put_meta(&c, &test_meta);
+        pdu_put_hdr(buf, 'R', PDU_FLAG_HDR, c.pos, (uint32_t)i);
+        KEEP(buf);
+    }
+    report("register_encode", "codec", iterations, now_ns() - t0);
+}
+
+void bench_register_decode(void)
+{
+    struct lookup_pdu in;
+    struct pdu out;
+    char dgram[PDU_MAX_DGRAM];
+    char peer_name[PEER_NAME_SIZE + 1];
+    char content_name[CONTENT_NAME_SIZE + 1];
+    struct sockaddr_in addr;
+    struct content_meta meta;
+    struct pdu_hdr h;
+    struct pdu_cursor c;
+    char *payload;
+    size_t n;
+    long long t0;
+    long i;
+
+    // The old server cleared both PDUs before every recvfrom()
+    n = old_register(&out);
+    t0 = now_ns();
+    for (i = 0; i < iterations; i++) {
+        memset(&in, 0, sizeof(in));
+        memset(&out, 0, sizeof(out));
+        old_register((struct pdu *)&in);
+        memset(peer_name, 0, sizeof(peer_name));
+        memset(content_name, 0, sizeof(content_name));
+        memcpy(peer_name, in.data, PEER_NAME_SIZE);
+        memcpy(content_name, in.data + PEER_NAME_SIZE, CONTENT_NAME_SIZE);
+        memcpy(&addr.sin_addr.s_addr, in.data + PEER_NAME_SIZE + CONTENT_NAME_SIZE, 4);
+        memcpy(&addr.sin_port, in.data + PEER_NAME_SIZE + CONTENT_NAME_SIZE + 4, 2);
+        memset(&meta, 0, sizeof(meta));
+        if (n >= 1 + PEER_NAME_SIZE + CONTENT_NAME_SIZE + 6 + CONTENT_META_SIZE) {
+            old_unpack_meta(in.data + PEER_NAME_SIZE + CONTENT_NAME_SIZE + 6, &meta);
+        }
+        KEEP(peer_name);
+        KEEP(content_name);
+        KEEP(&addr);
+        KEEP(&meta);
+    }
+    report("register_decode", "struct", iterations, now_ns() - t0);
+
+    // Same datagram contents, decoded where they landed
+    pdu_cursor_init(&c, dgram + PDU_HDR_SIZE, sizeof(dgram) - PDU_HDR_SIZE);
+    pdu_put_name(&c, "peer1", PEER_NAME_SIZE);
+    pdu_put_name(&c, "content1", CONTENT_NAME_SIZE);
+    pdu_put_addr(&c, &test_addr);
+    pdu_put_meta(&c, &test_meta);
+    pdu_put_hdr(dgram, 'R', PDU_FLAG_HDR, c.pos, 1);
+    n = PDU_HDR_SIZE + c.pos;
+    t0 = now_ns();
+    for (i = 0; i < iterations; i++) {
+        KEEP(dgram);
+        pdu_decode(dgram, n, &h, &payload);
+        pdu_cursor_init(&c, payload, h.len);
+        pdu_get_name(&c, peer_name, PEER_NAME_SIZE);
+        pdu_get_name(&c, content_name, CONTENT_NAME_SIZE);
+        pdu_get_addr(&c, &addr);
+        memset(&meta, 0, sizeof(meta));
+        if (pdu_remaining(&c) >= CONTENT_META_SIZE) {
+            pdu_get_meta(&c, &meta);
+        }
+        KEEP(peer_name);
+        KEEP(content_name);
+        KEEP(&addr);
+        KEEP(&meta);
+    }
+    report("register_decode", "codec", iterations, now_ns() - t0);
+}
+
+void bench_lookup_encode(void)
+{
+    struct lookup_pdu out;
+    char buf[PDU_MAX_PAYLOAD];
+    long n = iterations / 10;
+    long long t0;
+    long i;
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++) {
+        KEEP(old_lookup_reply(&out));
+        KEEP(&out);
+    }
+    report("lookup_encode", "struct", n, now_ns() - t0);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++) {
+        KEEP(new_lookup_reply(buf, sizeof(buf)));
+        KEEP(buf);
+    }
+    report("lookup_encode", "codec", n, now_ns() - t0);
+}
+
+void bench_lookup_send(void)
+{
+    struct lookup_pdu out;
+    char frame[PDU_MAX_DGRAM];
+    char buf[PDU_MAX_PAYLOAD];
+    struct pdu_hdr h;
+    struct iovec iov;
+    size_t len;
+    long n = iterations / SEND_DIVISOR;
+    long long t0;
+    long i;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) {
+        perror("socketpair");
+        return;
+    }
+
+    // Old: build the reply in a struct, then copy it behind a header
+    t0 = now_ns();
+    for (i = 0; i < n; i++) {
+        len = old_lookup_reply(&out);
+        pdu_put_hdr(frame, 'M', PDU_FLAG_HDR, len - 1, (uint32_t)i);
+        memcpy(frame + PDU_HDR_SIZE, out.data, len - 1);
+        send(sv[0], frame, PDU_HDR_SIZE + len - 1, 0);
+        drain(sv[1], sizeof(frame), 0);
+    }
+    report("lookup_send", "copy", n, now_ns() - t0);
+
+    // New: encode in place and gather header and payload in the send
+    t0 = now_ns();
+    for (i = 0; i < n; i++) {
+        iov.iov_base = buf;
+        iov.iov_len = new_lookup_reply(buf, sizeof(buf));
+        h.type = 'M';
+        h.flags = PDU_FLAG_HDR;
+        h.req_id = (uint32_t)i;
+        pdu_sendv(sv[0], &h, &iov, 1, NULL, 0);
+        drain(sv[1], sizeof(frame), 0);
+    }
+    report("lookup_send", "gather", n, now_ns() - t0);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+void bench_chunk_send(void)
+{
+    char *payload;
+    char *frame;
+    char hdr[CHUNK_HDR_SIZE];
+    struct iovec iov[2];
+    long n = iterations / SEND_DIVISOR;
+    long long t0;
+    long i;
+    int sv[2];
+
+    payload = (char *)malloc(XFER_CHUNK_SIZE);
+    frame = (char *)malloc(CHUNK_HDR_SIZE + XFER_CHUNK_SIZE);
+    if (!payload || !frame || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("chunk_send setup");
+        free(payload);
+        free(frame);
+        return;
+    }
+    memset(payload, 'x', XFER_CHUNK_SIZE);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++) {
+        pdu_put_hdr(frame, 'C', 0, XFER_CHUNK_SIZE, (uint32_t)i);
+        memcpy(frame + CHUNK_HDR_SIZE, payload, XFER_CHUNK_SIZE);
+        if (write(sv[0], frame, CHUNK_HDR_SIZE + XFER_CHUNK_SIZE) < 0) {
+            break;
+        }
+        drain(sv[1], CHUNK_HDR_SIZE + XFER_CHUNK_SIZE, 1);
+    }
+    report("chunk_send", "copy", n, now_ns() - t0);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++) {
+        pdu_put_hdr(hdr, 'C', 0, XFER_CHUNK_SIZE, (uint32_t)i);
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = CHUNK_HDR_SIZE;
+        iov[1].iov_base = payload;
+        iov[1].iov_len = XFER_CHUNK_SIZE;
+        if (writev(sv[0], iov, 2) < 0) {
+            break;
+        }
+        drain(sv[1], CHUNK_HDR_SIZE + XFER_CHUNK_SIZE, 1);
+    }
+    report("chunk_send", "gather", n, now_ns() - t0);
+
+    close(sv[0]);
+    close(sv[1]);
+    free(payload);
+    free(frame);
+}
+
+// 'R' request the way peers used to build it. Returns the PDU length.
+size_t old_register(struct pdu *out)
+{
+    out->type = 'R';
+    memset(out->data, 0, MAX_DATA_SIZE);
+    strncpy(out->data, "peer1", PEER_NAME_SIZE);
+    strncpy(out->data + PEER_NAME_SIZE, "content1", CONTENT_NAME_SIZE);
+    memcpy(out->data + PEER_NAME_SIZE + CONTENT_NAME_SIZE, &test_addr.sin_addr.s_addr, 4);
+    memcpy(out->data + PEER_NAME_SIZE + CONTENT_NAME_SIZE + 4, &test_addr.sin_port, 2);
+    old_pack_meta(out->data + PEER_NAME_SIZE + CONTENT_NAME_SIZE + 6, &test_meta);
+    return 1 + PEER_NAME_SIZE + CONTENT_NAME_SIZE + 6 + CONTENT_META_SIZE;
+}
+
+// 'M' reply the way the index server used to build it; every other result
+// is a miss. Returns the PDU length.
+size_t old_lookup_reply(struct lookup_pdu *out)
+{
+    char *res;
+    int i;
+
+    memset(out, 0, sizeof(*out));
+    out->type = 'M';
+    out->data[0] = (char)LOOKUP_BATCH_MAX;
+    for (i = 0; i < LOOKUP_BATCH_MAX; i++) {
+        res = out->data + 1 + i * LOOKUP_RESULT_SIZE;
+        if (i & 1) {
+            res[0] = 'E';
+            continue;
+        }
+        res[0] = 'S';
+        memcpy(res + 1, &test_addr.sin_addr.s_addr, 4);
+        memcpy(res + 5, &test_addr.sin_port, 2);
+        old_pack_meta(res + 7, &test_meta);
+    }
+    return 2 + LOOKUP_BATCH_MAX * LOOKUP_RESULT_SIZE;
+}
+
+// The same reply payload built with the codec. Returns its length.
+size_t new_lookup_reply(char *buf, size_t size)
+{
+    struct pdu_cursor c;
+    int i;
+
+    pdu_cursor_init(&c, buf, size);
+    pdu_put_u8(&c, LOOKUP_BATCH_MAX);
+    for (i = 0; i < LOOKUP_BATCH_MAX; i++) {
+        if (i & 1) {
+            pdu_put_u8(&c, 'E');
+            pdu_put_zero(&c, LOOKUP_RESULT_SIZE - 1);
+            continue;
+        }
+        pdu_put_u8(&c, 'S');
+        pdu_put_addr(&c, &test_addr);
+        pdu_put_meta(&c, &test_meta);
+    }
+    return c.pos;
+}
+
+void old_pack_meta(char *buf, const struct content_meta *meta)
+{
+    uint64_t v;
+
+    v = htobe64(meta->size);
+    memcpy(buf, &v, 8);
+    v = htobe64(meta->version);
+    memcpy(buf + 8, &v, 8);
+    v = htobe64(meta->hash);
+    memcpy(buf + 16, &v, 8);
+}
+
+void old_unpack_meta(const char *buf, struct content_meta *meta)
+{
+    uint64_t v;
+
+    memcpy(&v, buf, 8);
+    meta->size = be64toh(v);
+    memcpy(&v, buf + 8, 8);
+    meta->version = be64toh(v);
+    memcpy(&v, buf + 16, 8);
+    meta->hash = be64toh(v);
+}
+
+// Read and discard len bytes from a stream, or one datagram
+void drain(int fd, size_t len, int stream)
+{
+    static char sink[CHUNK_HDR_SIZE + XFER_CHUNK_SIZE];
+    ssize_t r;
+
+    do {
+        r = read(fd, sink, len < sizeof(sink) ? len : sizeof(sink));
+        if (r <= 0) {
+            return;
+        }
+        len -= r;
+    } while (stream && len > 0);
+}
@@ -0,0 +1,416 @@
+// DHT lookup benchmark.
+//
+// Starts a DHT of real peer processes on loopback (peer -d), all joining
+// through the first, and has them register synthetic items between them.
+// The benchmark then joins as a client node (it answers no requests and
+// isn't added to routing tables) and times value lookups of random items,
+// printing one JSON line per (nodes, alpha) run on stdout with the lookup
+// latency percentiles and the requests each lookup cost.
+//
+// Build: gcc -O2 -o bench_dht bench_dht.c dht.c pdu_codec.c
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "pdu.h"
+#include "dht.h"
+
+#define MAX_LIST        16
+#define MAX_NODES       256
+#define MAX_ITEMS       100000  // keeps "it<n>" within CONTENT_NAME_SIZE
+#define ITEM_SIZE       1024
+#define JOIN_WAIT_MS    20      // pause between starting nodes
+#define REG_TIMEOUT_MS  5000    // how long a registration may take to become visible
+#define QUIT_TIMEOUT_MS 5000
+
+char bin_dir[256] = ".";
+char work_dir[256];
+char label[64] = "";
+long node_counts[MAX_LIST];
+int nnode_counts = 0;
+long alphas[MAX_LIST];
+int nalphas = 0;
+int items = 64;
+int lookups = 500;
+
+pid_t node_pid[MAX_NODES];
+int node_stdin[MAX_NODES];
+int nodes = 0;
+int udp_sock = -1;
+struct sockaddr_in first_node;
+
+// Function prototypes
+long long now_ns(void);
+int parse_list(const char *s, long *out, int max);
+void usage(const char *prog);
+pid_t spawn(const char *prog, char *const argv[], const char *dir, int *stdin_fd, const char *log);
+int pick_udp_port(void);
+int start_nodes(int count);
+int register_items(void);
+void stop_nodes(void);
+int cmp_double(const void *a, const void *b);
+void run_lookups(int count, int alpha);
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in sin;
+    char *abs_dir;
+    int opt;
+    int i, j;
+
+    nnode_counts = parse_list("8,32,64", node_counts, MAX_LIST);
+    nalphas = parse_list("1,3", alphas, MAX_LIST);
+
+    while ((opt = getopt(argc, argv, "b:n:a:i:q:l:h")) != -1) {
+        switch (opt) {
+        case 'b':
+            strncpy(bin_dir, optarg, sizeof(bin_dir) - 1);
+            break;
+        case 'n':
+            nnode_counts = parse_list(optarg, node_counts, MAX_LIST);
+            break;
+        case 'a':
+            nalphas = parse_list(optarg, alphas, MAX_LIST);
+            break;
+        case 'i':
+            items = atoi(optarg);
+            break;
+        case 'q':
+            lookups = atoi(optarg);
+            break;
+        case 'l':
+            strncpy(label, optarg, sizeof(label) - 1);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (nnode_counts <= 0 || nalphas <= 0 || items < 1 || items > MAX_ITEMS || lookups < 1) {
+        usage(argv[0]);
+    }
+    for (i = 0; i < nnode_counts; i++) {
+        if (node_counts[i] < 2 || node_counts[i] > MAX_NODES) {
+            fprintf(stderr, "Node counts must be between 2 and %d\n", MAX_NODES);
+            exit(1);
+        }
+    }
+
+    // Nodes run in their own directories, so bin_dir has to be absolute
+    abs_dir = realpath(bin_dir, NULL);
+    if (!abs_dir || strlen(abs_dir) >= sizeof(bin_dir)) {
+        fprintf(stderr, "Can't find '%s'\n", bin_dir);
+        free(abs_dir);
+        exit(1);
+    }
+    snprintf(bin_dir, sizeof(bin_dir), "%s", abs_dir);
+    free(abs_dir);
+
+    signal(SIGPIPE, SIG_IGN);
+    udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (udp_sock < 0 || bind(udp_sock, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+        fprintf(stderr, "Can't create UDP socket\n");
+        exit(1);
+    }
+
+    for (i = 0; i < nnode_counts; i++) {
+        // A fresh client identity and routing table for every DHT
+        dht_init(udp_sock, 1);
+        if (start_nodes((int)node_counts[i]) == 0 && register_items() == 0) {
+            for (j = 0; j < nalphas; j++) {
+                run_lookups((int)node_counts[i], (int)alphas[j]);
+            }
+        }
+        stop_nodes();
+    }
+    close(udp_sock);
+    return 0;
+}
+
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Parse a comma-separated list of numbers. Returns the count.
+int parse_list(const char *s, long *out, int max)
+{
+    char buf[256];
+    char *tok;
+    char *save;
+    int n = 0;
+
+    strncpy(buf, s, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    for (tok = strtok_r(buf, ",", &save); tok && n < max; tok = strtok_r(NULL, ",", &save)) {
+        out[n] = atol(tok);
+        if (out[n] <= 0) {
+            return -1;
+        }
+        n++;
+    }
+    return n;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-b bindir] [-n nodes] [-a alpha] [-i items] [-q lookups] [-l label]\n"
+            "  nodes and alpha are comma-separated lists (e.g. -n 16,64 -a 1,3)\n", prog);
+    exit(1);
+}
+
+// Start prog in dir with its stdin on a pipe and its output appended to log
+pid_t spawn(const char *prog, char *const argv[], const char *dir, int *stdin_fd, const char *log)
+{
+    int fds[2];
+    int fd;
+    pid_t pid;
+
+    if (pipe(fds) < 0) {
+        return -1;
+    }
+    pid = fork();
+    if (pid == 0) {
+        dup2(fds[0], 0);
+        close(fds[0]);
+        close(fds[1]);
+        fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd >= 0) {
+            dup2(fd, 1);
+            dup2(fd, 2);
+            close(fd);
+        }
+        if (chdir(dir) < 0) {
+            _exit(127);
+        }
+        execv(prog, argv);
+        _exit(127);
+    }
+    close(fds[0]);
+    if (pid < 0) {
+        close(fds[1]);
+    } else {
+        *stdin_fd = fds[1];
+    }
+    return pid;
+}
+
+// Find a free UDP port for the first node
+int pick_udp_port(void)
+{
+    struct sockaddr_in sin;
+    socklen_t alen = sizeof(sin);
+    int s;
+    int port;
+
+    s = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (s < 0 || bind(s, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+        getsockname(s, (struct sockaddr *)&sin, &alen) < 0) {
+        if (s >= 0) {
+            close(s);
+        }
+        return -1;
+    }
+    port = ntohs(sin.sin_port);
+    close(s);
+    return port;
+}
+
+// Create a work directory and start count DHT nodes in it, the first on a
+// known port and the rest joining through it
+int start_nodes(int count)
+{
+    char prog[300];
+    char dir[512];
+    char log[512];
+    char port[16];
+    char boot[32];
+    char name[16];
+    char *argv[5];
+    int i;
+
+    snprintf(work_dir, sizeof(work_dir), "/tmp/bench_dht.XXXXXX");
+    if (!mkdtemp(work_dir)) {
+        fprintf(stderr, "Can't create work directory\n");
+        return -1;
+    }
+    snprintf(prog, sizeof(prog), "%s/peer", bin_dir);
+    memset(&first_node, 0, sizeof(first_node));
+    first_node.sin_family = AF_INET;
+    first_node.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    first_node.sin_port = htons(pick_udp_port());
+    snprintf(boot, sizeof(boot), "127.0.0.1:%d", ntohs(first_node.sin_port));
+
+    for (i = 0; i < count; i++) {
+        snprintf(dir, sizeof(dir), "%s/n%d", work_dir, i);
+        snprintf(log, sizeof(log), "%s/n%d.log", work_dir, i);
+        snprintf(name, sizeof(name), "d%d\n", i);
+        mkdir(dir, 0755);
+        snprintf(port, sizeof(port), "%d", i == 0 ? ntohs(first_node.sin_port) : 0);
+        argv[0] = prog;
+        argv[1] = "-d";
+        argv[2] = port;
+        argv[3] = i == 0 ? NULL : boot;
+        argv[4] = NULL;
+        node_pid[i] = spawn(prog, argv, dir, &node_stdin[i], log);
+        if (node_pid[i] < 0 || write(node_stdin[i], name, strlen(name)) < 0) {
+            fprintf(stderr, "Node %d didn't start\n", i);
+            return -1;
+        }
+        nodes = i + 1;
+
+        // Later nodes need the first one up to join
+        if (i == 0) {
+            while (dht_bootstrap(&first_node) < 0) {
+                if (waitpid(node_pid[0], NULL, WNOHANG) != 0) {
+                    fprintf(stderr, "First node exited, see %s\n", log);
+                    return -1;
+                }
+            }
+        }
+        usleep(JOIN_WAIT_MS * 1000);
+    }
+    return 0;
+}
+
+// Have the nodes register items round robin, one command at a time since a
+// peer reads a single line per wakeup, and wait until each one can be found
+int register_items(void)
+{
+    struct dht_value val;
+    struct dht_lookup_stats st;
+    char path[600];
+    char line[64];
+    char name[16];
+    char data[ITEM_SIZE];
+    long long deadline;
+    FILE *fp;
+    int i;
+
+    // Our routing table only held the first node so far
+    dht_bootstrap(&first_node);
+
+    memset(data, 'x', sizeof(data));
+    for (i = 0; i < items; i++) {
+        snprintf(name, sizeof(name), "it%d", i);
+        snprintf(path, sizeof(path), "%s/n%d/%s", work_dir, i % nodes, name);
+        fp = fopen(path, "w");
+        if (!fp || fwrite(data, 1, sizeof(data), fp) != sizeof(data) || fclose(fp) != 0) {
+            fprintf(stderr, "Can't write '%s'\n", path);
+            return -1;
+        }
+        snprintf(line, sizeof(line), "register %s %s\n", name, name);
+        if (write(node_stdin[i % nodes], line, strlen(line)) < 0) {
+            return -1;
+        }
+        deadline = now_ns() + REG_TIMEOUT_MS * 1000000LL;
+        while (dht_find_value(name, &val, 1, &st) == 0) {
+            if (now_ns() > deadline) {
+                fprintf(stderr, "Registration of '%s' didn't show up\n", name);
+                return -1;
+            }
+            usleep(5000);
+        }
+    }
+    return 0;
+}
+
+// Ask every node to quit (deregistering its items), then clean up
+void stop_nodes(void)
+{
+    char cmd[300];
+    long long deadline;
+    int i;
+
+    for (i = 0; i < nodes; i++) {
+        if (write(node_stdin[i], "quit\n", 5) < 0) {
+            kill(node_pid[i], SIGTERM);
+        }
+        close(node_stdin[i]);
+    }
+    deadline = now_ns() + QUIT_TIMEOUT_MS * 1000000LL;
+    for (i = 0; i < nodes; i++) {
+        while (waitpid(node_pid[i], NULL, WNOHANG) == 0) {
+            if (now_ns() > deadline) {
+                kill(node_pid[i], SIGKILL);
+                waitpid(node_pid[i], NULL, 0);
+                break;
+            }
+            usleep(10000);
+        }
+    }
+    nodes = 0;
+    if (work_dir[0] && !getenv("BENCH_KEEP")) {
+        snprintf(cmd, sizeof(cmd), "rm -rf '%s'", work_dir);
+        if (system(cmd) != 0) {
+            fprintf(stderr, "Can't remove '%s'\n", work_dir);
+        }
+    }
+}
+
+int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Time lookups of random items with alpha requests in flight
+void run_lookups(int count, int alpha)
+{
+    struct dht_value val;
+    struct dht_lookup_stats st;
+    char name[16];
+    double *lat;
+    double sum = 0;
+    long rpcs = 0;
+    long timeouts = 0;
+    int found = 0;
+    long long t0;
+    unsigned int seed = 1;
+    int i;
+
+    lat = (double *)malloc(lookups * sizeof(double));
+    if (!lat) {
+        return;
+    }
+    dht_set_alpha(alpha);
+    for (i = 0; i < lookups; i++) {
+        snprintf(name, sizeof(name), "it%d", rand_r(&seed) % items);
+        t0 = now_ns();
+        found += dht_find_value(name, &val, 1, &st) > 0;
+        lat[i] = (now_ns() - t0) / 1e6;
+        sum += lat[i];
+        rpcs += st.rpcs;
+        timeouts += st.timeouts;
+    }
+    qsort(lat, lookups, sizeof(double), cmp_double);
+
+    printf("{\"bench\":\"dht\",\"label\":\"%s\",\"nodes\":%d,\"items\":%d,\"alpha\":%d,"
+           "\"lookups\":%d,\"found\":%d,\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,"
+           "\"rpcs_per_lookup\":%.2f,\"timeouts\":%ld,\"client_contacts\":%d}\n",
+           label, count, items, alpha, lookups, found, sum / lookups,
+           lat[lookups / 2], lat[(int)(lookups * 0.99)], (double)rpcs / lookups, timeouts,
+           dht_contact_count());
+    fflush(stdout);
+    free(lat);
+}
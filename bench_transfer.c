@@ -0,0 +1,1074 @@
+// Loopback transfer benchmark for the peer upload/download path.
+//
+// Starts an index server and a serving peer from the built binaries, has the
+// serving peer register synthetic files, then fetches them over loopback and
+// prints one JSON line per (size, mode, concurrency) run on stdout.
+//
+// Modes:
+//   legacy    - a connection per item, plain 'D' request and PDU stream
+//   framed    - a connection per item, framed chunks without compression
+//   lz        - a connection per item, compressed framed chunks
+//   keepalive - one connection per client, one request at a time
+//   pipelined - one connection per client, BENCH_PIPELINE_DEPTH requests in flight
+//   peer      - <concurrency> real peer processes each run download-batch
+//
+// The first five use built-in clients (one thread each) that speak the
+// download protocol directly, so they time the serving side and report the
+// time to first byte. peer mode exercises the peer's own receive path; its
+// time includes the peer's shutdown after the batch.
+//
+// Build: gcc -O2 -pthread -o bench_transfer bench_transfer.c lz.c
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "pdu.h"
+#include "lz.h"
+
+#define MAX_SIZES       16
+#define MAX_CONC        16
+#define MAX_CLIENTS     64
+#define FILES_PER_SIZE  8
+#define BENCH_PIPELINE_DEPTH 16
+#define READ_BUF_SIZE   65536
+#define REAP_TIMEOUT_MS 5000
+#define PEER_START_MS   300
+
+// Built-in client modes
+#define MODE_LEGACY     0
+#define MODE_FRAMED     1
+#define MODE_LZ         2
+#define MODE_KEEPALIVE  3
+#define MODE_PIPELINED  4
+#define MODE_PEER       5
+
+// Process counters sampled around a run
+struct proc_sample {
+    double cpu_ms;              // user + system, including reaped children
+    unsigned long long rw_calls; // read/write-class system calls
+};
+
+// Buffered reader over a socket that remembers when data last arrived
+struct bench_reader {
+    int fd;
+    char buf[READ_BUF_SIZE];
+    size_t pos;
+    size_t len;
+    long long fill_ns;
+};
+
+// One built-in client thread
+struct bench_client {
+    int id;
+    int mode;
+    int conc;
+    int requests;
+    int size_idx;
+    unsigned long long bytes;
+    unsigned long long wire_bytes;
+    int errors;
+    double *ttfb_ms;
+    int nttfb;
+    pthread_t thread;
+};
+
+const char *mode_names[] = {"legacy", "framed", "lz", "keepalive", "pipelined", "peer"};
+
+char bin_dir[256] = ".";
+char work_dir[256];
+char label[64] = "";
+int random_data = 0;
+long long total_bytes = 32LL * 1024 * 1024;
+int max_requests = 2000;
+long sizes[MAX_SIZES];
+int nsizes = 0;
+int concs[MAX_CONC];
+int nconcs = 0;
+int modes[MAX_CLIENTS];
+int nmodes = 0;
+
+pid_t index_pid = -1;
+pid_t server_pid = -1;
+int server_stdin = -1;
+int index_port;
+int udp_sock = -1;
+struct sockaddr_in server_addr;
+char item_names[MAX_SIZES][FILES_PER_SIZE][CONTENT_NAME_SIZE + 1];
+
+// Function prototypes
+long long now_ns(void);
+long parse_size(const char *s);
+int parse_list(const char *s, long *out, int max, int is_size);
+int parse_modes(const char *s);
+void usage(const char *prog);
+pid_t spawn(const char *prog, char *const argv[], const char *dir, int *stdin_fd, const char *log);
+int pick_udp_port(void);
+int index_request(const struct pdu *out, size_t out_len, struct pdu *in, int timeout_ms);
+int wait_for_index(void);
+int wait_registered(const char *name, struct sockaddr_in *addr);
+int write_file(const char *path, long size, unsigned int seed);
+int setup_server(void);
+void shutdown_all(void);
+int sample_proc(pid_t pid, struct proc_sample *s);
+double self_cpu_ms(void);
+int count_children(pid_t parent);
+void wait_children_reaped(pid_t parent);
+int reader_fill(struct bench_reader *r);
+int reader_read(struct bench_reader *r, char *dst, size_t len);
+int connect_server(void);
+void put_request(char *req, const char *name, int options, uint32_t req_id);
+long long read_response(struct bench_reader *r, int framed, uint32_t req_id,
+                        unsigned long long *wire, long long *first_ns);
+void *client_main(void *arg);
+int run_clients(int mode, int size_idx, int conc, int requests, struct bench_client *clients);
+int run_peers(int size_idx, int conc, double *client_cpu, unsigned long long *client_calls,
+              unsigned long long *bytes);
+int cmp_double(const void *a, const void *b);
+void run_one(int mode, int size_idx, int conc);
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int i, j, k;
+    long tmp[MAX_CONC];
+
+    parse_list("4K,256K,8M", sizes, MAX_SIZES, 1);
+    nsizes = 3;
+    concs[0] = 1;
+    concs[1] = 4;
+    concs[2] = 16;
+    nconcs = 3;
+    parse_modes("legacy,framed,lz,keepalive,pipelined,peer");
+
+    while ((opt = getopt(argc, argv, "b:s:c:m:t:r:d:l:h")) != -1) {
+        switch (opt) {
+        case 'b':
+            strncpy(bin_dir, optarg, sizeof(bin_dir) - 1);
+            break;
+        case 's':
+            nsizes = parse_list(optarg, sizes, MAX_SIZES, 1);
+            break;
+        case 'c':
+            nconcs = parse_list(optarg, tmp, MAX_CONC, 0);
+            for (i = 0; i < nconcs; i++) {
+                concs[i] = tmp[i] < 1 ? 1 : tmp[i] > MAX_CLIENTS ? MAX_CLIENTS : (int)tmp[i];
+            }
+            break;
+        case 'm':
+            if (parse_modes(optarg) < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            total_bytes = atoll(optarg) * 1024 * 1024;
+            break;
+        case 'r':
+            max_requests = atoi(optarg);
+            break;
+        case 'd':
+            random_data = strcmp(optarg, "random") == 0;
+            break;
+        case 'l':
+            strncpy(label, optarg, sizeof(label) - 1);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (nsizes <= 0 || nconcs <= 0 || nmodes <= 0 || max_requests < 1 || total_bytes <= 0) {
+        usage(argv[0]);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    if (setup_server() < 0) {
+        shutdown_all();
+        exit(1);
+    }
+
+    for (i = 0; i < nsizes; i++) {
+        for (j = 0; j < nmodes; j++) {
+            for (k = 0; k < nconcs; k++) {
+                run_one(modes[j], i, concs[k]);
+            }
+        }
+    }
+
+    shutdown_all();
+    return 0;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-b bindir] [-s sizes] [-c concurrency] [-m modes]\n"
+            "          [-t total_MB] [-r max_requests] [-d text|random] [-l label]\n"
+            "  sizes and concurrency are comma-separated lists (e.g. -s 4K,1M -c 1,8)\n"
+            "  modes: legacy,framed,lz,keepalive,pipelined,peer\n", prog);
+    exit(1);
+}
+
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Parse "64K", "8M" or a plain byte count
+long parse_size(const char *s)
+{
+    char *end;
+    long v = strtol(s, &end, 10);
+
+    if (*end == 'K' || *end == 'k') {
+        v *= 1024;
+    } else if (*end == 'M' || *end == 'm') {
+        v *= 1024 * 1024;
+    }
+    return v;
+}
+
+// Parse a comma-separated list of sizes or numbers. Returns the count.
+int parse_list(const char *s, long *out, int max, int is_size)
+{
+    char buf[256];
+    char *tok;
+    char *save;
+    int n = 0;
+
+    strncpy(buf, s, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    for (tok = strtok_r(buf, ",", &save); tok && n < max; tok = strtok_r(NULL, ",", &save)) {
+        out[n] = is_size ? parse_size(tok) : atol(tok);
+        if (out[n] <= 0) {
+            return -1;
+        }
+        n++;
+    }
+    return n;
+}
+
+int parse_modes(const char *s)
+{
+    char buf[256];
+    char *tok;
+    char *save;
+    int i;
+
+    nmodes = 0;
+    strncpy(buf, s, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        for (i = 0; i <= MODE_PEER && strcmp(tok, mode_names[i]) != 0; i++) {
+        }
+        if (i > MODE_PEER) {
+            fprintf(stderr, "Unknown mode '%s'\n", tok);
+            return -1;
+        }
+        modes[nmodes++] = i;
+    }
+    return nmodes;
+}
+
+// Start prog in dir with its stdin on a pipe (if stdin_fd is set) and its
+// output appended to log
+pid_t spawn(const char *prog, char *const argv[], const char *dir, int *stdin_fd, const char *log)
+{
+    int fds[2] = {-1, -1};
+    int fd;
+    pid_t pid;
+
+    if (stdin_fd && pipe(fds) < 0) {
+        return -1;
+    }
+    pid = fork();
+    if (pid == 0) {
+        if (stdin_fd) {
+            dup2(fds[0], 0);
+            close(fds[0]);
+            close(fds[1]);
+        }
+        fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd >= 0) {
+            dup2(fd, 1);
+            dup2(fd, 2);
+            close(fd);
+        }
+        if (chdir(dir) < 0) {
+            _exit(127);
+        }
+        execv(prog, argv);
+        _exit(127);
+    }
+    if (stdin_fd) {
+        close(fds[0]);
+        if (pid < 0) {
+            close(fds[1]);
+        } else {
+            *stdin_fd = fds[1];
+        }
+    }
+    return pid;
+}
+
+// Find a free UDP port for the index server
+int pick_udp_port(void)
+{
+    struct sockaddr_in sin;
+    socklen_t alen = sizeof(sin);
+    int s;
+    int port;
+
+    s = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (s < 0 || bind(s, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+        getsockname(s, (struct sockaddr *)&sin, &alen) < 0) {
+        if (s >= 0) {
+            close(s);
+        }
+        return -1;
+    }
+    port = ntohs(sin.sin_port);
+    close(s);
+    return port;
+}
+
+// Send a PDU to the index server and wait up to timeout_ms for the reply.
+// Returns the reply length or -1.
+int index_request(const struct pdu *out, size_t out_len, struct pdu *in, int timeout_ms)
+{
+    struct pollfd pfd;
+    ssize_t n;
+
+    if (write(udp_sock, out, out_len) < 0) {
+        return -1;
+    }
+    pfd.fd = udp_sock;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return -1;
+    }
+    n = read(udp_sock, in, sizeof(*in));
+    return n < 0 ? -1 : (int)n;
+}
+
+// Wait until the index server answers a list request
+int wait_for_index(void)
+{
+    struct pdu out;
+    struct pdu in;
+    int i;
+
+    out.type = 'O';
+    for (i = 0; i < 50; i++) {
+        if (index_request(&out, 1, &in, 100) > 0) {
+            return 0;
+        }
+        usleep(20000);  // not bound yet: the write fails right away
+    }
+    return -1;
+}
+
+// Poll the index server until name is registered, returning its server address
+int wait_registered(const char *name, struct sockaddr_in *addr)
+{
+    struct pdu out;
+    struct pdu in;
+    int i;
+
+    out.type = 'S';
+    memset(out.data, 0, sizeof(out.data));
+    strncpy(out.data, name, CONTENT_NAME_SIZE);
+    for (i = 0; i < 500; i++) {
+        if (index_request(&out, 1 + CONTENT_NAME_SIZE, &in, 100) >= 7 && in.type == 'S') {
+            memset(addr, 0, sizeof(*addr));
+            addr->sin_family = AF_INET;
+            memcpy(&addr->sin_addr.s_addr, in.data, 4);
+            memcpy(&addr->sin_port, in.data + 4, 2);
+            return 0;
+        }
+        usleep(10000);
+    }
+    return -1;
+}
+
+// Write a synthetic file: text-like words, or incompressible bytes
+int write_file(const char *path, long size, unsigned int seed)
+{
+    static const char *words[] = {"peer", "index", "content", "server", "download",
+                                  "chunk", "socket", "transfer", "register", "the",
+                                  "of", "and", "data", "frame", "cache", "\n"};
+    FILE *fp;
+    unsigned int x = seed * 2654435761u + 1;
+    long written = 0;
+    const char *w;
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        return -1;
+    }
+    while (written < size) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        if (random_data) {
+            fputc((int)(x & 0xff), fp);
+            written++;
+            continue;
+        }
+        w = words[x % 16];
+        while (*w && written < size) {
+            fputc(*w++, fp);
+            written++;
+        }
+        if (written < size && w[-1] != '\n') {
+            fputc(' ', fp);
+            written++;
+        }
+    }
+    return fclose(fp);
+}
+
+// Create the work directory and files, and start the index server and the
+// serving peer
+int setup_server(void)
+{
+    char path[512];
+    char port[16];
+    char prog[300];
+    char line[128];
+    char log[512];
+    char *abs_dir;
+    struct sockaddr_in sin;
+    char *argv[4];
+    int i, j;
+
+    snprintf(work_dir, sizeof(work_dir), "/tmp/bench_transfer.XXXXXX");
+    if (!mkdtemp(work_dir)) {
+        fprintf(stderr, "Can't create work directory\n");
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/srv", work_dir);
+    mkdir(path, 0755);
+    for (i = 0; i < nsizes; i++) {
+        for (j = 0; j < FILES_PER_SIZE; j++) {
+            snprintf(item_names[i][j], sizeof(item_names[i][j]), "b%d_%d", i, j);
+            snprintf(path, sizeof(path), "%s/srv/%s", work_dir, item_names[i][j]);
+            if (write_file(path, sizes[i], i * FILES_PER_SIZE + j + 1) < 0) {
+                fprintf(stderr, "Can't write '%s'\n", path);
+                return -1;
+            }
+        }
+    }
+
+    index_port = pick_udp_port();
+    snprintf(port, sizeof(port), "%d", index_port);
+    // Peers run in their own directories, so bin_dir has to be absolute
+    abs_dir = realpath(bin_dir, NULL);
+    if (!abs_dir || strlen(abs_dir) >= sizeof(bin_dir)) {
+        fprintf(stderr, "Can't find '%s'\n", bin_dir);
+        free(abs_dir);
+        return -1;
+    }
+    snprintf(bin_dir, sizeof(bin_dir), "%s", abs_dir);
+    free(abs_dir);
+    snprintf(prog, sizeof(prog), "%s/index_server", bin_dir);
+    argv[0] = prog;
+    argv[1] = port;
+    argv[2] = NULL;
+    snprintf(path, sizeof(path), "%s/index.log", work_dir);
+    index_pid = spawn(prog, argv, work_dir, NULL, path);
+
+    udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(index_port);
+    if (index_pid < 0 || udp_sock < 0 || connect(udp_sock, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+        wait_for_index() < 0) {
+        fprintf(stderr, "Index server didn't start\n");
+        return -1;
+    }
+
+    snprintf(prog, sizeof(prog), "%s/peer", bin_dir);
+    argv[0] = prog;
+    argv[1] = "127.0.0.1";
+    argv[2] = port;
+    argv[3] = NULL;
+    snprintf(path, sizeof(path), "%s/srv", work_dir);
+    snprintf(log, sizeof(log), "%s/srv.log", work_dir);
+    server_pid = spawn(prog, argv, path, &server_stdin, log);
+    if (server_pid < 0 || write(server_stdin, "srv\n", 4) < 0) {
+        fprintf(stderr, "Serving peer didn't start\n");
+        return -1;
+    }
+
+    // One command at a time: the peer reads a single line per wakeup
+    for (i = 0; i < nsizes; i++) {
+        for (j = 0; j < FILES_PER_SIZE; j++) {
+            snprintf(line, sizeof(line), "register %s %s\n", item_names[i][j], item_names[i][j]);
+            usleep(i == 0 && j == 0 ? PEER_START_MS * 1000 : 0);
+            if (write(server_stdin, line, strlen(line)) < 0 ||
+                wait_registered(item_names[i][j], &server_addr) < 0) {
+                fprintf(stderr, "Registration of '%s' failed\n", item_names[i][j]);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Stop the serving peer and the index server and remove the work directory
+void shutdown_all(void)
+{
+    char cmd[300];
+
+    if (server_pid > 0) {
+        if (write(server_stdin, "quit\n", 5) < 0 || waitpid(server_pid, NULL, 0) < 0) {
+            kill(server_pid, SIGTERM);
+        }
+    }
+    if (index_pid > 0) {
+        kill(index_pid, SIGTERM);
+        waitpid(index_pid, NULL, 0);
+    }
+    if (work_dir[0] && !getenv("BENCH_KEEP")) {
+        snprintf(cmd, sizeof(cmd), "rm -rf '%s'", work_dir);
+        if (system(cmd) != 0) {
+            fprintf(stderr, "Can't remove '%s'\n", work_dir);
+        }
+    }
+}
+
+// Read CPU time (own and reaped children) and read/write syscall counts of pid
+int sample_proc(pid_t pid, struct proc_sample *s)
+{
+    char path[64];
+    char buf[1024];
+    char *p;
+    FILE *fp;
+    unsigned long ut, st;
+    long cut, cst;
+    unsigned long long v;
+    size_t n;
+
+    memset(s, 0, sizeof(*s));
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+    p = strrchr(buf, ')');
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld",
+                     &ut, &st, &cut, &cst) != 4) {
+        return -1;
+    }
+    s->cpu_ms = (ut + st + cut + cst) * 1000.0 / sysconf(_SC_CLK_TCK);
+
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    fp = fopen(path, "r");
+    while (fp && fgets(buf, sizeof(buf), fp)) {
+        if (sscanf(buf, "syscr: %llu", &v) == 1 || sscanf(buf, "syscw: %llu", &v) == 1) {
+            s->rw_calls += v;
+        }
+    }
+    if (fp) {
+        fclose(fp);
+    }
+    return 0;
+}
+
+double self_cpu_ms(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000.0 +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000.0;
+}
+
+// Count live processes whose parent is parent
+int count_children(pid_t parent)
+{
+    DIR *dir;
+    struct dirent *de;
+    char path[300];
+    char buf[512];
+    char *p;
+    FILE *fp;
+    int ppid;
+    int count = 0;
+    size_t n;
+
+    dir = opendir("/proc");
+    while (dir && (de = readdir(dir)) != NULL) {
+        if (de->d_name[0] < '0' || de->d_name[0] > '9') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%s/stat", de->d_name);
+        fp = fopen(path, "r");
+        if (!fp) {
+            continue;
+        }
+        n = fread(buf, 1, sizeof(buf) - 1, fp);
+        fclose(fp);
+        buf[n] = '\0';
+        p = strrchr(buf, ')');
+        if (p && sscanf(p + 2, "%*c %d", &ppid) == 1 && ppid == parent) {
+            count++;
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    return count;
+}
+
+// Upload children only count towards the serving peer's totals once it has
+// reaped them
+void wait_children_reaped(pid_t parent)
+{
+    long long deadline = now_ns() + REAP_TIMEOUT_MS * 1000000LL;
+
+    while (count_children(parent) > 0 && now_ns() < deadline) {
+        usleep(20000);
+    }
+}
+
+int reader_fill(struct bench_reader *r)
+{
+    ssize_t n;
+
+    if (r->pos < r->len) {
+        return 1;
+    }
+    n = read(r->fd, r->buf, sizeof(r->buf));
+    if (n <= 0) {
+        return (int)n;
+    }
+    r->fill_ns = now_ns();
+    r->pos = 0;
+    r->len = n;
+    return 1;
+}
+
+// Read exactly len bytes (dst may be NULL to skip them)
+int reader_read(struct bench_reader *r, char *dst, size_t len)
+{
+    size_t n;
+
+    while (len > 0) {
+        if (reader_fill(r) <= 0) {
+            return -1;
+        }
+        n = r->len - r->pos;
+        if (n > len) {
+            n = len;
+        }
+        if (dst) {
+            memcpy(dst, r->buf + r->pos, n);
+            dst += n;
+        }
+        r->pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int connect_server(void)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (sock >= 0 && connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        close(sock);
+        sock = -1;
+    }
+    return sock;
+}
+
+// Build a download request: name | options | request id. Without options
+// it is the plain 'D' request, of which only the name is sent.
+void put_request(char *req, const char *name, int options, uint32_t req_id)
+{
+    uint32_t id = htonl(req_id);
+
+    req[0] = options ? XFER_REQ_TYPE : 'D';
+    memset(req + 1, 0, CONTENT_NAME_SIZE);
+    strncpy(req + 1, name, CONTENT_NAME_SIZE);
+    req[1 + CONTENT_NAME_SIZE] = (char)options;
+    memcpy(req + 2 + CONTENT_NAME_SIZE, &id, 4);
+}
+
+// Consume one response and return its raw content size, or -1. first_ns is
+// set to the time the first byte of the response arrived.
+long long read_response(struct bench_reader *r, int framed, uint32_t req_id,
+                        unsigned long long *wire, long long *first_ns)
+{
+    static __thread char payload[XFER_CHUNK_SIZE];
+    static __thread char raw[XFER_CHUNK_SIZE];
+    unsigned char hdr[CHUNK_HDR_SIZE];
+    long long total = 0;
+    size_t len;
+    size_t raw_len;
+    uint32_t id;
+
+    if (reader_fill(r) <= 0) {
+        return -1;
+    }
+    *first_ns = r->fill_ns;
+
+    if (!framed) {
+        // Legacy stream: 'C' PDUs of MAX_DATA_SIZE bytes, then 'F' up to EOF
+        for (;;) {
+            if (reader_read(r, (char *)hdr, 1) < 0) {
+                return -1;
+            }
+            if (hdr[0] == 'C') {
+                if (reader_read(r, NULL, MAX_DATA_SIZE) < 0) {
+                    return -1;
+                }
+                total += MAX_DATA_SIZE;
+                *wire += 1 + MAX_DATA_SIZE;
+                continue;
+            }
+            if (hdr[0] != 'F') {
+                return -1;
+            }
+            while (reader_fill(r) > 0) {
+                total += r->len - r->pos;
+                *wire += r->len - r->pos;
+                r->pos = r->len;
+            }
+            return total;
+        }
+    }
+
+    if (reader_read(r, (char *)hdr, 2) < 0 || hdr[0] != 'A') {
+        return -1;
+    }
+    for (;;) {
+        if (reader_read(r, (char *)hdr, CHUNK_HDR_SIZE) < 0) {
+            return -1;
+        }
+        len = ((size_t)hdr[2] << 8) | hdr[3];
+        memcpy(&id, hdr + 4, 4);
+        if (len > XFER_CHUNK_SIZE || ntohl(id) != req_id || hdr[0] == 'E' ||
+            reader_read(r, payload, len) < 0) {
+            return -1;
+        }
+        *wire += CHUNK_HDR_SIZE + len;
+        raw_len = len;
+        if (hdr[1] & CHUNK_COMPRESSED) {
+            raw_len = lz_decompress(payload, len, raw, XFER_CHUNK_SIZE);
+            if (raw_len == 0) {
+                return -1;
+            }
+        }
+        total += raw_len;
+        if (hdr[0] == 'F') {
+            return total;
+        }
+    }
+}
+
+// Built-in client: fetch requests id, id + conc, ... of the run
+void *client_main(void *arg)
+{
+    struct bench_client *c = (struct bench_client *)arg;
+    struct bench_reader *r;
+    char reqs[BENCH_PIPELINE_DEPTH * XFER_REQ_SIZE];
+    long long sent_ns;
+    long long first_ns;
+    long long got;
+    int options;
+    int framed;
+    int depth;
+    int sent;
+    int req;
+    int k;
+    int sock = -1;
+    uint32_t req_id = 0;
+    const char *name;
+
+    r = (struct bench_reader *)malloc(sizeof(*r));
+    if (!r) {
+        c->errors++;
+        return NULL;
+    }
+    framed = c->mode != MODE_LEGACY;
+    options = c->mode == MODE_LEGACY ? 0 : XFER_OPT_KEEPALIVE;
+    if (c->mode == MODE_LZ) {
+        options |= XFER_OPT_LZ;
+    }
+    depth = c->mode == MODE_PIPELINED ? BENCH_PIPELINE_DEPTH : 1;
+
+    for (req = c->id; req < c->requests; req += c->conc * depth) {
+        if (sock < 0) {
+            sock = connect_server();
+            if (sock < 0) {
+                c->errors++;
+                continue;
+            }
+            r->fd = sock;
+            r->pos = 0;
+            r->len = 0;
+        }
+
+        // Requests req, req + conc, ... up to depth of them
+        for (sent = 0; sent < depth && req + sent * c->conc < c->requests; sent++) {
+            name = item_names[c->size_idx][(req + sent * c->conc) % FILES_PER_SIZE];
+            put_request(reqs + sent * XFER_REQ_SIZE, name, options, ++req_id);
+        }
+        sent_ns = now_ns();
+        if (write(sock, reqs, c->mode == MODE_LEGACY ? 1 + CONTENT_NAME_SIZE : sent * XFER_REQ_SIZE) < 0) {
+            c->errors += sent;
+            close(sock);
+            sock = -1;
+            continue;
+        }
+        for (k = 0; k < sent; k++) {
+            got = read_response(r, framed, req_id - sent + 1 + k, &c->wire_bytes, &first_ns);
+            if (got != sizes[c->size_idx]) {
+                c->errors += sent - k;
+                close(sock);
+                sock = -1;
+                break;
+            }
+            c->bytes += got;
+            c->ttfb_ms[c->nttfb++] = (first_ns - sent_ns) / 1e6;
+        }
+
+        if (sock >= 0 && c->mode != MODE_KEEPALIVE && c->mode != MODE_PIPELINED) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    if (sock >= 0) {
+        close(sock);
+    }
+    free(r);
+    return NULL;
+}
+
+// Run conc built-in clients to completion
+int run_clients(int mode, int size_idx, int conc, int requests, struct bench_client *clients)
+{
+    int i;
+
+    for (i = 0; i < conc; i++) {
+        memset(&clients[i], 0, sizeof(clients[i]));
+        clients[i].id = i;
+        clients[i].mode = mode;
+        clients[i].conc = conc;
+        clients[i].requests = requests;
+        clients[i].size_idx = size_idx;
+        clients[i].ttfb_ms = (double *)calloc(requests / conc + BENCH_PIPELINE_DEPTH, sizeof(double));
+        if (!clients[i].ttfb_ms ||
+            pthread_create(&clients[i].thread, NULL, client_main, &clients[i]) != 0) {
+            fprintf(stderr, "Can't start client %d\n", i);
+            exit(1);
+        }
+    }
+    for (i = 0; i < conc; i++) {
+        pthread_join(clients[i].thread, NULL);
+    }
+    return 0;
+}
+
+// Run conc fetching peers that each download-batch every item of the size.
+// Their counters are read while they are zombies, before they are reaped.
+int run_peers(int size_idx, int conc, double *client_cpu, unsigned long long *client_calls,
+              unsigned long long *bytes)
+{
+    pid_t pids[MAX_CLIENTS];
+    int fds[MAX_CLIENTS];
+    char dir[300];
+    char path[400];
+    char prog[300];
+    char port[16];
+    char line[64];
+    char *argv[4];
+    siginfo_t info;
+    struct proc_sample s;
+    FILE *fp;
+    int errors = 0;
+    int i, j;
+
+    snprintf(prog, sizeof(prog), "%s/peer", bin_dir);
+    snprintf(port, sizeof(port), "%d", index_port);
+    argv[0] = prog;
+    argv[1] = "127.0.0.1";
+    argv[2] = port;
+    argv[3] = NULL;
+
+    for (i = 0; i < conc; i++) {
+        snprintf(dir, sizeof(dir), "%s/f%d_%d_%d", work_dir, size_idx, conc, i);
+        mkdir(dir, 0755);
+        snprintf(path, sizeof(path), "%s/list", dir);
+        fp = fopen(path, "w");
+        for (j = 0; fp && j < FILES_PER_SIZE; j++) {
+            fprintf(fp, "%s\n", item_names[size_idx][j]);
+        }
+        if (fp) {
+            fclose(fp);
+        }
+        snprintf(path, sizeof(path), "%s/peer.log", dir);
+        pids[i] = spawn(prog, argv, dir, &fds[i], path);
+        snprintf(line, sizeof(line), "f%d\n", i);
+        if (pids[i] < 0 || write(fds[i], line, strlen(line)) < 0) {
+            fprintf(stderr, "Can't start fetching peer %d\n", i);
+            exit(1);
+        }
+    }
+    usleep(PEER_START_MS * 1000);
+
+    // Measured part: the batch and the peer's exit
+    for (i = 0; i < conc; i++) {
+        if (write(fds[i], "download-batch list 1\n", 22) < 0) {
+            errors++;
+        }
+    }
+    usleep(50000);
+    for (i = 0; i < conc; i++) {
+        if (write(fds[i], "quit\n", 5) < 0) {
+            errors++;
+        }
+    }
+    for (i = 0; i < conc; i++) {
+        if (waitid(P_PID, pids[i], &info, WEXITED | WNOWAIT) == 0 && sample_proc(pids[i], &s) == 0) {
+            *client_cpu += s.cpu_ms;
+            *client_calls += s.rw_calls;
+        }
+        waitpid(pids[i], NULL, 0);
+        close(fds[i]);
+    }
+
+    // Count what actually arrived
+    for (i = 0; i < conc; i++) {
+        for (j = 0; j < FILES_PER_SIZE; j++) {
+            struct stat sb;
+
+            snprintf(path, sizeof(path), "%s/f%d_%d_%d/cache/downloaded_%s", work_dir, size_idx,
+                     conc, i, item_names[size_idx][j]);
+            if (stat(path, &sb) == 0 && sb.st_size == sizes[size_idx]) {
+                *bytes += sb.st_size;
+            } else {
+                errors++;
+            }
+        }
+    }
+    return errors;
+}
+
+int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Run one configuration and print its JSON line
+void run_one(int mode, int size_idx, int conc)
+{
+    struct bench_client clients[MAX_CLIENTS];
+    struct proc_sample srv0, srv1;
+    struct proc_sample self0, self1;
+    double cpu0 = 0;
+    double client_cpu = 0;
+    unsigned long long client_calls = 0;
+    unsigned long long bytes = 0;
+    unsigned long long wire = 0;
+    double *ttfb = NULL;
+    int nttfb = 0;
+    int errors = 0;
+    int requests;
+    long long t0, t1;
+    double secs, mb;
+    int i;
+
+    requests = total_bytes / sizes[size_idx];
+    if (requests > max_requests) {
+        requests = max_requests;
+    }
+    if (requests < conc) {
+        requests = conc;
+    }
+    if (mode == MODE_PEER) {
+        requests = conc * FILES_PER_SIZE;
+    }
+
+    wait_children_reaped(server_pid);
+    sample_proc(server_pid, &srv0);
+    sample_proc(getpid(), &self0);
+    cpu0 = self_cpu_ms();
+    t0 = now_ns();
+
+    if (mode == MODE_PEER) {
+        errors = run_peers(size_idx, conc, &client_cpu, &client_calls, &bytes);
+        t1 = now_ns();
+        wire = bytes;
+    } else {
+        run_clients(mode, size_idx, conc, requests, clients);
+        t1 = now_ns();
+        client_cpu = self_cpu_ms() - cpu0;
+        sample_proc(getpid(), &self1);
+        client_calls = self1.rw_calls - self0.rw_calls;
+        ttfb = (double *)malloc(requests * sizeof(double));
+        for (i = 0; i < conc; i++) {
+            bytes += clients[i].bytes;
+            wire += clients[i].wire_bytes;
+            errors += clients[i].errors;
+            if (ttfb) {
+                memcpy(ttfb + nttfb, clients[i].ttfb_ms, clients[i].nttfb * sizeof(double));
+                nttfb += clients[i].nttfb;
+            }
+            free(clients[i].ttfb_ms);
+        }
+    }
+
+    wait_children_reaped(server_pid);
+    sample_proc(server_pid, &srv1);
+
+    secs = (t1 - t0) / 1e9;
+    mb = bytes / 1e6;
+    if (mb <= 0) {
+        mb = 1e-9;
+    }
+    printf("{\"bench\":\"transfer\",\"label\":\"%s\",\"mode\":\"%s\",\"data\":\"%s\","
+           "\"size\":%ld,\"concurrency\":%d,\"requests\":%d,\"errors\":%d,"
+           "\"bytes\":%llu,\"wire_bytes\":%llu,\"seconds\":%.4f,\"mb_per_s\":%.2f,",
+           label, mode_names[mode], random_data ? "random" : "text", sizes[size_idx], conc,
+           requests, errors, bytes, wire, secs, secs > 0 ? bytes / 1e6 / secs : 0.0);
+    if (nttfb > 0) {
+        qsort(ttfb, nttfb, sizeof(double), cmp_double);
+        printf("\"ttfb_ms_p50\":%.3f,\"ttfb_ms_p99\":%.3f,",
+               ttfb[nttfb / 2], ttfb[(nttfb * 99) / 100 < nttfb ? (nttfb * 99) / 100 : nttfb - 1]);
+    } else {
+        printf("\"ttfb_ms_p50\":null,\"ttfb_ms_p99\":null,");
+    }
+    printf("\"server_cpu_ms_per_mb\":%.3f,\"client_cpu_ms_per_mb\":%.3f,"
+           "\"server_syscalls_per_mb\":%.1f,\"client_syscalls_per_mb\":%.1f}\n",
+           (srv1.cpu_ms - srv0.cpu_ms) / mb, client_cpu / mb,
+           (srv1.rw_calls - srv0.rw_calls) / mb, client_calls / mb);
+    fflush(stdout);
+    free(ttfb);
+}
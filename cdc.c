@@ -0,0 +1,50 @@
+#include <stdint.h>
+#include "cdc.h"
+
+// Boundary test on the top bits, which depend on all of the last 64 bytes
+#define CDC_MASK (((1ULL << CDC_AVG_BITS) - 1) << (64 - CDC_AVG_BITS))
+#define CDC_WINDOW 64
+
+uint64_t cdc_gear[256];
+
+void cdc_init(void)
+{
+    uint64_t x = 0x6a09e667f3bcc909ULL;   // fixed seed: both ends need the same table
+    uint64_t z;
+    int i;
+
+    // splitmix64
+    for (i = 0; i < 256; i++) {
+        x += 0x9e3779b97f4a7c15ULL;
+        z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        cdc_gear[i] = z ^ (z >> 31);
+    }
+}
+
+size_t cdc_cut(const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t h = 0;
+    size_t end;
+    size_t i;
+
+    if (len <= CDC_MIN_SIZE) {
+        return len;
+    }
+    end = len < CDC_MAX_SIZE ? len : CDC_MAX_SIZE;
+
+    // The hash only remembers the last 64 bytes, so start just early enough
+    // for it to be complete at the first allowed boundary
+    for (i = CDC_MIN_SIZE - CDC_WINDOW; i < CDC_MIN_SIZE; i++) {
+        h = (h << 1) + cdc_gear[p[i]];
+    }
+    for (; i < end; i++) {
+        h = (h << 1) + cdc_gear[p[i]];
+        if ((h & CDC_MASK) == 0) {
+            return i + 1;
+        }
+    }
+    return end;
+}
@@ -0,0 +1,26 @@
+/* Content-defined chunking for delta downloads. Chunk boundaries are picked
+ * by a gear rolling hash over the last 64 bytes, so they depend only on the
+ * data around them: inserting or appending bytes moves the boundaries next
+ * to the edit and leaves every other chunk as it was. Both ends of a
+ * transfer must cut the same way, so the parameters are part of the
+ * protocol.
+ */
+
+#ifndef CDC_H
+#define CDC_H
+
+#include <stddef.h>
+
+#define CDC_MIN_SIZE  2048      // no boundary before this many bytes
+#define CDC_AVG_BITS  13        // boundary when 13 hash bits are zero: 8 KiB on average
+#define CDC_MAX_SIZE  65536     // forced boundary
+
+/* Fill in the gear table. Call once before any other cdc_ function. */
+void cdc_init(void);
+
+/* Length of the chunk starting at data. len is the number of bytes
+ * available, at least CDC_MAX_SIZE unless data runs to the end of the
+ * content. */
+size_t cdc_cut(const void *data, size_t len);
+
+#endif
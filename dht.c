@@ -0,0 +1,804 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "dht.h"
+#include "pdu_codec.h"
+
+#define DHT_SHORTLIST   (DHT_K * 4)     // candidates a lookup keeps
+#define DHT_MSG_HDR     10              // Op | Flags | Sender ID
+
+// lookup probe states
+#define PROBE_NEW       0
+#define PROBE_WAIT      1
+#define PROBE_DONE      2
+#define PROBE_FAILED    3
+
+struct dht_contact {
+    uint64_t id;
+    struct sockaddr_in addr;
+    int fails;
+};
+
+// Routing table bucket, least recently seen first
+struct dht_bucket {
+    struct dht_contact node[DHT_K];
+    int count;
+};
+
+// A candidate in a lookup's shortlist
+struct dht_probe {
+    struct dht_contact c;
+    int state;
+    uint32_t req_id;
+    long long deadline_ms;
+};
+
+struct dht_record {
+    uint64_t key;
+    char content_name[CONTENT_NAME_SIZE + 1];
+    struct dht_value val;
+    time_t expires;
+    struct dht_record *next;
+};
+
+int dht_sock = -1;
+int dht_client = 0;
+int dht_alpha = DHT_ALPHA;
+uint64_t dht_id = 0;
+uint32_t dht_next_req_id = 1;
+struct dht_bucket dht_table[DHT_ID_BITS];
+struct dht_record *dht_records = NULL;
+int dht_record_count = 0;
+time_t dht_refresh_at = 0;
+
+long long dht_now_ms(void);
+int dht_bucket_index(uint64_t id);
+void dht_seen(uint64_t id, const struct sockaddr_in *addr);
+void dht_failed(uint64_t id);
+int dht_closest(uint64_t target, struct dht_contact *out, int max);
+int dht_probe_insert(struct dht_probe *list, int n, uint64_t target, const struct dht_contact *c);
+uint32_t dht_send(const struct sockaddr_in *to, int op, uint32_t req_id,
+                  const char *body, size_t len);
+int dht_wait_reply(struct dht_probe *list, int n, char *buf, size_t size,
+                   struct pdu_cursor *c, int *op, struct dht_lookup_stats *st);
+int dht_parse(char *dgram, size_t n, const struct sockaddr_in *from, struct pdu_hdr *h,
+              struct pdu_cursor *c, int *op, uint64_t *sender);
+int dht_lookup(uint64_t target, const char *content_name, struct dht_contact *closest,
+               struct dht_value *vals, int max_vals, int *nvals, struct dht_lookup_stats *st);
+int dht_put_nodes(struct pdu_cursor *c, uint64_t target);
+int dht_store_local(const char *content_name, const struct dht_value *val, int ttl);
+int dht_get_local(const char *content_name, struct dht_value *vals, int max);
+uint64_t dht_random(void);
+
+int dht_init(int sock, int client)
+{
+    dht_sock = sock;
+    dht_client = client;
+    memset(dht_table, 0, sizeof(dht_table));
+
+    // A random ID spreads nodes evenly over the key space
+    dht_id = dht_random();
+    dht_refresh_at = time(NULL) + DHT_REFRESH;
+    return 0;
+}
+
+int dht_bootstrap(const struct sockaddr_in *addr)
+{
+    struct dht_probe probe;
+    struct dht_contact closest[DHT_K];
+    struct dht_lookup_stats st;
+    char buf[PDU_MAX_DGRAM];
+    struct pdu_cursor c;
+    int op;
+    int tries;
+    int nvals;
+
+    memset(&st, 0, sizeof(st));
+    for (tries = 0; tries < 3; tries++) {
+        memset(&probe, 0, sizeof(probe));
+        probe.c.addr = *addr;
+        probe.state = PROBE_WAIT;
+        probe.deadline_ms = dht_now_ms() + DHT_RPC_TIMEOUT_MS;
+        probe.req_id = dht_send(addr, DHT_PING, 0, NULL, 0);
+        while (probe.state == PROBE_WAIT) {
+            dht_wait_reply(&probe, 1, buf, sizeof(buf), &c, &op, &st);
+        }
+        if (probe.state == PROBE_DONE) {
+            break;
+        }
+    }
+    if (probe.state != PROBE_DONE) {
+        return -1;
+    }
+
+    // dht_wait_reply() added the node; our own neighbourhood fills the rest
+    dht_lookup(dht_id, NULL, closest, NULL, 0, &nvals, &st);
+    return dht_contact_count();
+}
+
+void dht_handle(char *dgram, size_t n, const struct sockaddr_in *from)
+{
+    struct pdu_hdr h;
+    struct pdu_cursor in;
+    struct pdu_cursor out;
+    char body[PDU_MAX_PAYLOAD];
+    char content_name[CONTENT_NAME_SIZE + 1];
+    struct dht_value vals[DHT_MAX_VALUES];
+    struct dht_value val;
+    uint64_t sender;
+    uint64_t target;
+    int op;
+    int count;
+    int ttl;
+    int i;
+
+    if (dht_parse(dgram, n, from, &h, &in, &op, &sender) < 0 || (op & 0x80) || dht_client) {
+        return;     // not a request for us
+    }
+    pdu_cursor_init(&out, body, sizeof(body));
+
+    switch (op) {
+    case DHT_PING:
+        dht_send(from, DHT_PONG, h.req_id, NULL, 0);
+        break;
+
+    case DHT_FIND_NODE:
+        target = pdu_get_u64(&in);
+        if (in.err) {
+            break;
+        }
+        dht_put_nodes(&out, target);
+        dht_send(from, DHT_NODES, h.req_id, body, out.pos);
+        break;
+
+    case DHT_FIND_VALUE:
+        target = pdu_get_u64(&in);
+        pdu_get_name(&in, content_name, CONTENT_NAME_SIZE);
+        if (in.err) {
+            break;
+        }
+        count = dht_get_local(content_name, vals, DHT_MAX_VALUES);
+        if (count == 0) {
+            dht_put_nodes(&out, target);
+            dht_send(from, DHT_NODES, h.req_id, body, out.pos);
+            break;
+        }
+        pdu_put_u8(&out, count);
+        for (i = 0; i < count; i++) {
+            pdu_put_name(&out, vals[i].peer_name, PEER_NAME_SIZE);
+            pdu_put_addr(&out, &vals[i].addr);
+            pdu_put_meta(&out, &vals[i].meta);
+        }
+        dht_send(from, DHT_VALUE, h.req_id, body, out.pos);
+        break;
+
+    case DHT_STORE:
+        ttl = pdu_get_u16(&in);
+        pdu_get_name(&in, content_name, CONTENT_NAME_SIZE);
+        pdu_get_name(&in, val.peer_name, PEER_NAME_SIZE);
+        pdu_get_addr(&in, &val.addr);
+        pdu_get_meta(&in, &val.meta);
+        if (in.err) {
+            break;
+        }
+        if (ttl > DHT_RECORD_TTL) {
+            ttl = DHT_RECORD_TTL;
+        }
+        if (dht_store_local(content_name, &val, ttl) == 0) {
+            dht_send(from, DHT_STORED, h.req_id, NULL, 0);
+        }
+        break;
+    }
+}
+
+int dht_find_value(const char *content_name, struct dht_value *vals, int max,
+                   struct dht_lookup_stats *st)
+{
+    struct dht_contact closest[DHT_K];
+    int count;
+
+    memset(st, 0, sizeof(*st));
+    count = dht_get_local(content_name, vals, max);
+    if (count > 0) {
+        return count;
+    }
+    dht_lookup(dht_key(content_name), content_name, closest, vals, max, &count, st);
+    return count;
+}
+
+int dht_publish(const char *content_name, const char *peer_name, const struct sockaddr_in *addr,
+                const struct content_meta *meta, int ttl)
+{
+    struct dht_contact closest[DHT_K];
+    struct dht_probe probes[DHT_K];
+    struct dht_lookup_stats st;
+    struct dht_value val;
+    char body[2 + CONTENT_NAME_SIZE + PEER_NAME_SIZE + 6 + CONTENT_META_SIZE];
+    char buf[PDU_MAX_DGRAM];
+    struct pdu_cursor c;
+    int nvals;
+    int count;
+    int acks = 0;
+    int op;
+    int i;
+
+    memset(&val, 0, sizeof(val));
+    strncpy(val.peer_name, peer_name, PEER_NAME_SIZE);
+    val.addr = *addr;
+    val.meta = *meta;
+    dht_store_local(content_name, &val, ttl);
+
+    memset(&st, 0, sizeof(st));
+    count = dht_lookup(dht_key(content_name), NULL, closest, NULL, 0, &nvals, &st);
+
+    pdu_cursor_init(&c, body, sizeof(body));
+    pdu_put_u16(&c, ttl);
+    pdu_put_name(&c, content_name, CONTENT_NAME_SIZE);
+    pdu_put_name(&c, peer_name, PEER_NAME_SIZE);
+    pdu_put_addr(&c, addr);
+    pdu_put_meta(&c, meta);
+
+    // Store on all of them at once, then collect the acknowledgements
+    for (i = 0; i < count; i++) {
+        probes[i].c = closest[i];
+        probes[i].state = PROBE_WAIT;
+        probes[i].deadline_ms = dht_now_ms() + DHT_RPC_TIMEOUT_MS;
+        probes[i].req_id = dht_send(&closest[i].addr, DHT_STORE, 0, body, c.pos);
+    }
+    for (;;) {
+        i = dht_wait_reply(probes, count, buf, sizeof(buf), &c, &op, &st);
+        if (i == -2) {
+            break;
+        }
+        if (i >= 0 && op == DHT_STORED) {
+            acks++;
+        }
+    }
+    return acks;
+}
+
+void dht_tick(void)
+{
+    struct dht_record **link;
+    struct dht_record *rec;
+    struct dht_contact closest[DHT_K];
+    struct dht_lookup_stats st;
+    time_t now = time(NULL);
+    uint64_t target;
+    int nvals;
+
+    memset(&st, 0, sizeof(st));
+    link = &dht_records;
+    while ((rec = *link) != NULL) {
+        if (rec->expires <= now) {
+            *link = rec->next;
+            free(rec);
+            dht_record_count--;
+        } else {
+            link = &rec->next;
+        }
+    }
+
+    // Look up a random ID near our own (to keep the neighbourhood current)
+    // and one anywhere else
+    if (now < dht_refresh_at || dht_contact_count() == 0) {
+        return;
+    }
+    dht_refresh_at = now + DHT_REFRESH;
+    target = dht_id ^ (dht_random() & 0xffff);
+    dht_lookup(target, NULL, closest, NULL, 0, &nvals, &st);
+    target = dht_random();
+    dht_lookup(target, NULL, closest, NULL, 0, &nvals, &st);
+}
+
+void dht_set_alpha(int alpha)
+{
+    dht_alpha = alpha < 1 ? 1 : alpha > DHT_K ? DHT_K : alpha;
+}
+
+// Key of a content name: FNV-1a of its zero-padded wire form
+uint64_t dht_key(const char *content_name)
+{
+    char name[CONTENT_NAME_SIZE + 1];
+    uint64_t hash = CONTENT_HASH_INIT;
+    int i;
+
+    memset(name, 0, sizeof(name));
+    strncpy(name, content_name, sizeof(name) - 1);
+    name[CONTENT_NAME_SIZE] = '\0';
+    for (i = 0; i < CONTENT_NAME_SIZE; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= CONTENT_HASH_PRIME;
+    }
+    return hash;
+}
+
+// 64 random bits from /dev/urandom. rand() only promises 15 bits a call
+// (31 with glibc), so the fallback shifts five calls across the word.
+uint64_t dht_random(void)
+{
+    uint64_t r = 0;
+    int fd;
+    int i;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0 && read(fd, &r, sizeof(r)) == sizeof(r)) {
+        close(fd);
+        return r;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    for (i = 0; i < 5; i++) {
+        r = (r << 15) ^ (uint64_t)rand();
+    }
+    return r ^ ((uint64_t)time(NULL) << 32) ^ (uint64_t)dht_now_ms();
+}
+
+uint64_t dht_self_id(void)
+{
+    return dht_id;
+}
+
+int dht_contact_count(void)
+{
+    int count = 0;
+    int i;
+
+    for (i = 0; i < DHT_ID_BITS; i++) {
+        count += dht_table[i].count;
+    }
+    return count;
+}
+
+// Print the node's ID, routing table fill and the records it holds
+void dht_print(void)
+{
+    struct dht_record *rec;
+    int i;
+
+    printf("DHT node %016llx, %d contacts\n", (unsigned long long)dht_id, dht_contact_count());
+    for (i = DHT_ID_BITS - 1; i >= 0; i--) {
+        if (dht_table[i].count > 0) {
+            printf("  bucket %2d: %d\n", i, dht_table[i].count);
+        }
+    }
+    printf("Records held (%d):\n", dht_record_count);
+    for (rec = dht_records; rec; rec = rec->next) {
+        printf("  %s|%s|%s:%d (expires in %lds)\n", rec->val.peer_name, rec->content_name,
+               inet_ntoa(rec->val.addr.sin_addr), ntohs(rec->val.addr.sin_port),
+               (long)(rec->expires - time(NULL)));
+    }
+}
+
+long long dht_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Bucket of a contact: the highest bit in which its ID differs from ours
+int dht_bucket_index(uint64_t id)
+{
+    return DHT_ID_BITS - 1 - __builtin_clzll(id ^ dht_id);
+}
+
+// Note that a node was heard from. Known contacts move to the back of their
+// bucket. A new one is added if there is room or a contact has stopped
+// answering; otherwise the bucket keeps its long-lived contacts.
+void dht_seen(uint64_t id, const struct sockaddr_in *addr)
+{
+    struct dht_bucket *b;
+    struct dht_contact c;
+    int i;
+    int victim = -1;
+
+    if (id == dht_id) {
+        return;
+    }
+    b = &dht_table[dht_bucket_index(id)];
+    for (i = 0; i < b->count; i++) {
+        if (b->node[i].id == id) {
+            victim = i;
+            break;
+        }
+        if (victim < 0 && b->node[i].fails >= DHT_MAX_FAILS) {
+            victim = i;
+        }
+    }
+    if (victim < 0 && b->count == DHT_K) {
+        return;
+    }
+    if (victim >= 0) {
+        memmove(&b->node[victim], &b->node[victim + 1],
+                (b->count - victim - 1) * sizeof(b->node[0]));
+        b->count--;
+    }
+    c.id = id;
+    c.addr = *addr;
+    c.fails = 0;
+    b->node[b->count++] = c;
+}
+
+void dht_failed(uint64_t id)
+{
+    struct dht_bucket *b;
+    int i;
+
+    if (id == dht_id) {
+        return;
+    }
+    b = &dht_table[dht_bucket_index(id)];
+    for (i = 0; i < b->count; i++) {
+        if (b->node[i].id == id) {
+            b->node[i].fails++;
+        }
+    }
+}
+
+// Fill out with the max known contacts closest to target, nearest first.
+// Contacts that stopped answering are left out. Returns the count.
+int dht_closest(uint64_t target, struct dht_contact *out, int max)
+{
+    const struct dht_contact *c;
+    int count = 0;
+    int i, j, k;
+
+    for (i = 0; i < DHT_ID_BITS; i++) {
+        for (j = 0; j < dht_table[i].count; j++) {
+            c = &dht_table[i].node[j];
+            if (c->fails >= DHT_MAX_FAILS) {
+                continue;
+            }
+            // Insertion into the sorted prefix
+            for (k = count; k > 0 && (out[k - 1].id ^ target) > (c->id ^ target); k--) {
+                if (k < max) {
+                    out[k] = out[k - 1];
+                }
+            }
+            if (k < max) {
+                out[k] = *c;
+                if (count < max) {
+                    count++;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+// Add c to a shortlist sorted by distance to target, dropping the farthest
+// entry if the list is full. Returns the new length.
+int dht_probe_insert(struct dht_probe *list, int n, uint64_t target, const struct dht_contact *c)
+{
+    int i;
+
+    if (c->id == dht_id) {
+        return n;
+    }
+    for (i = 0; i < n; i++) {
+        if (list[i].c.id == c->id) {
+            return n;
+        }
+    }
+    for (i = n; i > 0 && (list[i - 1].c.id ^ target) > (c->id ^ target); i--) {
+        if (i < DHT_SHORTLIST) {
+            list[i] = list[i - 1];
+        }
+    }
+    if (i >= DHT_SHORTLIST) {
+        return n;
+    }
+    memset(&list[i], 0, sizeof(list[i]));
+    list[i].c = *c;
+    list[i].c.fails = 0;
+    list[i].state = PROBE_NEW;
+    return n < DHT_SHORTLIST ? n + 1 : n;
+}
+
+// Send a DHT message. A request gets a fresh id (req_id 0); a reply echoes
+// the request's. Returns the id used.
+uint32_t dht_send(const struct sockaddr_in *to, int op, uint32_t req_id,
+                  const char *body, size_t len)
+{
+    char msg[DHT_MSG_HDR];
+    struct pdu_hdr h;
+    struct pdu_cursor c;
+    struct iovec iov[2];
+
+    if (req_id == 0) {
+        req_id = dht_next_req_id++;
+        if (dht_next_req_id == 0) {
+            dht_next_req_id = 1;
+        }
+    }
+    pdu_cursor_init(&c, msg, sizeof(msg));
+    pdu_put_u8(&c, op);
+    pdu_put_u8(&c, dht_client ? DHT_CLIENT : 0);
+    pdu_put_u64(&c, dht_id);
+    iov[0].iov_base = msg;
+    iov[0].iov_len = c.pos;
+    iov[1].iov_base = (void *)body;
+    iov[1].iov_len = len;
+
+    h.type = 'K';
+    h.flags = PDU_FLAG_HDR;
+    h.req_id = req_id;
+    pdu_sendv(dht_sock, &h, iov, len ? 2 : 1, (const struct sockaddr *)to, sizeof(*to));
+    return req_id;
+}
+
+// Wait for the next reply to one of the probes in flight, serving requests
+// from other nodes meanwhile. Returns the index of the probe that got its
+// reply, with the body in c; -1 if probes timed out instead; -2 if nothing
+// is in flight.
+int dht_wait_reply(struct dht_probe *list, int n, char *buf, size_t size,
+                   struct pdu_cursor *c, int *op, struct dht_lookup_stats *st)
+{
+    struct sockaddr_in from;
+    socklen_t alen;
+    struct pollfd pfd;
+    struct pdu_hdr h;
+    long long now;
+    long long deadline = 0;
+    uint64_t sender;
+    ssize_t len;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (list[i].state == PROBE_WAIT && (deadline == 0 || list[i].deadline_ms < deadline)) {
+            deadline = list[i].deadline_ms;
+        }
+    }
+    if (deadline == 0) {
+        return -2;
+    }
+
+    for (;;) {
+        now = dht_now_ms();
+        if (now >= deadline) {
+            for (i = 0; i < n; i++) {
+                if (list[i].state == PROBE_WAIT && list[i].deadline_ms <= now) {
+                    list[i].state = PROBE_FAILED;
+                    dht_failed(list[i].c.id);
+                    st->timeouts++;
+                }
+            }
+            return -1;
+        }
+        pfd.fd = dht_sock;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, (int)(deadline - now)) <= 0) {
+            continue;
+        }
+        alen = sizeof(from);
+        len = recvfrom(dht_sock, buf, size, 0, (struct sockaddr *)&from, &alen);
+        if (len <= 0) {
+            continue;
+        }
+        if (dht_parse(buf, len, &from, &h, c, op, &sender) < 0) {
+            continue;
+        }
+        if (!(*op & 0x80)) {
+            dht_handle(buf, len, &from);    // parses it again, it's small
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            if (list[i].state == PROBE_WAIT && list[i].req_id == h.req_id &&
+                list[i].c.addr.sin_addr.s_addr == from.sin_addr.s_addr &&
+                list[i].c.addr.sin_port == from.sin_port) {
+                list[i].state = PROBE_DONE;
+                list[i].c.id = sender;
+                return i;
+            }
+        }
+        // A late reply to a request we gave up on
+    }
+}
+
+// Decode a DHT message and note its sender in the routing table
+int dht_parse(char *dgram, size_t n, const struct sockaddr_in *from, struct pdu_hdr *h,
+              struct pdu_cursor *c, int *op, uint64_t *sender)
+{
+    char *payload;
+    int flags;
+
+    if (pdu_decode(dgram, n, h, &payload) < 0 || h->type != 'K' || !(h->flags & PDU_FLAG_HDR)) {
+        return -1;
+    }
+    pdu_cursor_init(c, payload, h->len);
+    *op = pdu_get_u8(c);
+    flags = pdu_get_u8(c);
+    *sender = pdu_get_u64(c);
+    if (c->err) {
+        return -1;
+    }
+    if (!(flags & DHT_CLIENT)) {
+        dht_seen(*sender, from);
+    }
+    return 0;
+}
+
+// Iterative lookup of target. With content_name set it is a value lookup
+// that stops at the first node holding a record, returning up to max_vals
+// providers in vals (count in *nvals). Otherwise it runs until the DHT_K
+// closest nodes found have all answered, and returns them in closest
+// (nearest first) with their count.
+int dht_lookup(uint64_t target, const char *content_name, struct dht_contact *closest,
+               struct dht_value *vals, int max_vals, int *nvals, struct dht_lookup_stats *st)
+{
+    struct dht_probe list[DHT_SHORTLIST];
+    struct dht_contact start[DHT_K];
+    struct dht_contact c;
+    struct pdu_cursor in;
+    char body[8 + CONTENT_NAME_SIZE];
+    char buf[PDU_MAX_DGRAM];
+    struct pdu_cursor out;
+    int n = 0;
+    int inflight;
+    int considered;
+    int count;
+    int op;
+    int i, j;
+
+    *nvals = 0;
+    count = dht_closest(target, start, DHT_K);
+    for (i = 0; i < count; i++) {
+        n = dht_probe_insert(list, n, target, &start[i]);
+    }
+
+    pdu_cursor_init(&out, body, sizeof(body));
+    pdu_put_u64(&out, target);
+    if (content_name) {
+        pdu_put_name(&out, content_name, CONTENT_NAME_SIZE);
+    }
+
+    for (;;) {
+        // Ask the closest candidates not asked yet, keeping dht_alpha in
+        // flight. Only the DHT_K closest that haven't failed are considered.
+        inflight = 0;
+        for (i = 0; i < n; i++) {
+            inflight += list[i].state == PROBE_WAIT;
+        }
+        considered = 0;
+        for (i = 0; i < n && considered < DHT_K && inflight < dht_alpha; i++) {
+            if (list[i].state == PROBE_FAILED) {
+                continue;
+            }
+            considered++;
+            if (list[i].state == PROBE_NEW) {
+                list[i].state = PROBE_WAIT;
+                list[i].deadline_ms = dht_now_ms() + DHT_RPC_TIMEOUT_MS;
+                list[i].req_id = dht_send(&list[i].c.addr, content_name ? DHT_FIND_VALUE : DHT_FIND_NODE,
+                                          0, body, out.pos);
+                st->rpcs++;
+                inflight++;
+            }
+        }
+
+        i = dht_wait_reply(list, n, buf, sizeof(buf), &in, &op, st);
+        if (i == -2) {
+            break;      // the closest candidates have all answered or failed
+        }
+        if (i < 0) {
+            continue;
+        }
+
+        if (op == DHT_VALUE && content_name) {
+            count = pdu_get_u8(&in);
+            for (j = 0; j < count && *nvals < max_vals; j++) {
+                memset(&vals[*nvals], 0, sizeof(vals[0]));
+                pdu_get_name(&in, vals[*nvals].peer_name, PEER_NAME_SIZE);
+                pdu_get_addr(&in, &vals[*nvals].addr);
+                pdu_get_meta(&in, &vals[*nvals].meta);
+                if (in.err) {
+                    break;
+                }
+                (*nvals)++;
+            }
+            if (*nvals > 0) {
+                break;
+            }
+        } else if (op == DHT_NODES) {
+            count = pdu_get_u8(&in);
+            for (j = 0; j < count; j++) {
+                memset(&c, 0, sizeof(c));
+                c.id = pdu_get_u64(&in);
+                pdu_get_addr(&in, &c.addr);
+                if (in.err) {
+                    break;
+                }
+                n = dht_probe_insert(list, n, target, &c);
+            }
+        }
+    }
+
+    count = 0;
+    for (i = 0; i < n && count < DHT_K; i++) {
+        if (list[i].state == PROBE_DONE) {
+            closest[count++] = list[i].c;
+        }
+    }
+    return count;
+}
+
+// Append a DHT_NODES body with the DHT_K contacts closest to target
+int dht_put_nodes(struct pdu_cursor *c, uint64_t target)
+{
+    struct dht_contact nodes[DHT_K];
+    int count;
+    int i;
+
+    count = dht_closest(target, nodes, DHT_K);
+    pdu_put_u8(c, count);
+    for (i = 0; i < count; i++) {
+        pdu_put_u64(c, nodes[i].id);
+        pdu_put_addr(c, &nodes[i].addr);
+    }
+    return count;
+}
+
+// Add, renew or (with ttl 0) remove a record. Returns -1 if the store is full.
+int dht_store_local(const char *content_name, const struct dht_value *val, int ttl)
+{
+    struct dht_record **link;
+    struct dht_record *rec;
+
+    for (link = &dht_records; *link; link = &(*link)->next) {
+        rec = *link;
+        if (strncmp(rec->content_name, content_name, CONTENT_NAME_SIZE) == 0 &&
+            rec->val.addr.sin_addr.s_addr == val->addr.sin_addr.s_addr &&
+            rec->val.addr.sin_port == val->addr.sin_port) {
+            if (ttl == 0) {
+                *link = rec->next;
+                free(rec);
+                dht_record_count--;
+            } else {
+                rec->val = *val;
+                rec->expires = time(NULL) + ttl;
+            }
+            return 0;
+        }
+    }
+    if (ttl == 0) {
+        return 0;
+    }
+    if (dht_record_count >= DHT_MAX_RECORDS) {
+        return -1;
+    }
+    rec = (struct dht_record *)calloc(1, sizeof(*rec));
+    if (rec == NULL) {
+        return -1;
+    }
+    rec->key = dht_key(content_name);
+    strncpy(rec->content_name, content_name, CONTENT_NAME_SIZE);
+    rec->val = *val;
+    rec->expires = time(NULL) + ttl;
+    rec->next = dht_records;
+    dht_records = rec;
+    dht_record_count++;
+    return 0;
+}
+
+// Copy up to max live records for content_name. Returns the count.
+int dht_get_local(const char *content_name, struct dht_value *vals, int max)
+{
+    struct dht_record *rec;
+    time_t now = time(NULL);
+    int count = 0;
+
+    for (rec = dht_records; rec && count < max; rec = rec->next) {
+        if (rec->expires > now && strncmp(rec->content_name, content_name, CONTENT_NAME_SIZE) == 0) {
+            vals[count++] = rec->val;
+        }
+    }
+    return count;
+}
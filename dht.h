@@ -0,0 +1,98 @@
+/* Kademlia-style distributed index, an alternative to the index server.
+ *
+ * Every node has a random 64-bit ID and keeps contacts in 64 k-buckets by
+ * the highest bit in which their ID differs from its own. A content name is
+ * stored under the FNV-1a hash of its padded name on the DHT_K nodes whose
+ * IDs are closest to it by XOR distance. Lookups are iterative: the DHT_ALPHA
+ * closest contacts not yet asked are queried in parallel, and the contacts
+ * they return narrow the search until the closest nodes have all answered
+ * (or, for a value lookup, one of them has the record).
+ *
+ * All messages are 'K' PDUs with a full header over the node's UDP socket.
+ * Replies carry the request id:
+ *   Op (1 byte) | Flags (1 byte) | Sender ID (8 bytes) | body
+ * with bodies
+ *   DHT_PING        (none)                  -> DHT_PONG (none)
+ *   DHT_FIND_NODE   Target (8 bytes)        -> DHT_NODES
+ *   DHT_FIND_VALUE  Target | Content Name   -> DHT_VALUE, or DHT_NODES if no record
+ *   DHT_STORE       TTL (2 bytes, 0 removes) | Content Name | Peer Name
+ *                   | IP | Port | metadata  -> DHT_STORED (none)
+ *   DHT_NODES       Count (1 byte) | [ID (8 bytes) | IP (4 bytes) | Port (2 bytes)] x Count
+ *   DHT_VALUE       Count (1 byte) | [Peer Name | IP | Port | metadata] x Count
+ * A sender with DHT_CLIENT set doesn't answer requests and is not added to
+ * routing tables.
+ */
+
+#ifndef DHT_H
+#define DHT_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "pdu.h"
+
+#define DHT_K           8       // bucket size, and nodes a record is stored on
+#define DHT_ALPHA       3       // requests in flight per lookup
+#define DHT_ID_BITS     64
+#define DHT_RPC_TIMEOUT_MS 300
+#define DHT_MAX_FAILS   2       // unanswered requests before a contact may be replaced
+#define DHT_RECORD_TTL  600     // seconds a stored record lives; publishers renew at half
+#define DHT_REFRESH     120     // seconds between routing table refresh lookups
+#define DHT_MAX_VALUES  4       // providers returned per value lookup
+#define DHT_MAX_RECORDS 4096    // records a node stores for others
+
+#define DHT_PING        1
+#define DHT_FIND_NODE   2
+#define DHT_FIND_VALUE  3
+#define DHT_STORE       4
+#define DHT_PONG        0x81
+#define DHT_NODES       0x82
+#define DHT_VALUE       0x83
+#define DHT_STORED      0x84
+#define DHT_CLIENT      0x01
+
+// A provider of a content item, as stored in the DHT
+struct dht_value {
+    char peer_name[PEER_NAME_SIZE + 1];
+    struct sockaddr_in addr;        // content server (TCP) address
+    struct content_meta meta;
+};
+
+// What a lookup cost
+struct dht_lookup_stats {
+    int rpcs;                       // requests sent
+    int timeouts;
+};
+
+/* Start a node on a bound UDP socket. A client node only issues lookups:
+ * it answers no requests and stays out of other nodes' routing tables. */
+int dht_init(int sock, int client);
+
+/* Join through a known node: learn its ID, then look up our own ID to fill
+ * the routing table. Returns the number of contacts afterwards, or -1 if
+ * the node didn't answer. */
+int dht_bootstrap(const struct sockaddr_in *addr);
+
+/* Handle a datagram that arrived outside of a lookup. Requests are
+ * answered; stray replies are dropped. */
+void dht_handle(char *dgram, size_t n, const struct sockaddr_in *from);
+
+/* Find up to max providers of content_name. Returns how many were found. */
+int dht_find_value(const char *content_name, struct dht_value *vals, int max,
+                   struct dht_lookup_stats *st);
+
+/* Store (or with ttl 0 remove) our record for content_name on the closest
+ * nodes and locally. Returns the number of nodes that acknowledged. */
+int dht_publish(const char *content_name, const char *peer_name, const struct sockaddr_in *addr,
+                const struct content_meta *meta, int ttl);
+
+/* Expire records and refresh the routing table when due. Call about once a
+ * second. */
+void dht_tick(void);
+
+void dht_set_alpha(int alpha);
+uint64_t dht_key(const char *content_name);
+uint64_t dht_self_id(void);
+int dht_contact_count(void);
+void dht_print(void);
+
+#endif
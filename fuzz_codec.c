@@ -0,0 +1,368 @@
+// Fuzz target for the PDU decoder.
+//
+// Feeds arbitrary bytes to pdu_decode() as a received datagram and walks
+// the payload with the cursor getters, pdu_get_text() and the payload
+// decoders (pdu_parse_*), in an order taken from the input itself, the way
+// the index server and the peer parse requests and replies. The datagram is
+// copied into a buffer of exactly its size so a read past the end shows up
+// under AddressSanitizer. Besides memory errors the target aborts when:
+//   - pdu_decode() hands back a payload that isn't inside the datagram
+//   - a cursor moves past the end of the payload, or moves after an error
+//   - a fixed-width field read back and written again doesn't give the
+//     same bytes
+//   - pdu_get_text() returns a string that isn't terminated within size
+//   - a payload decoder accepts a payload but returns counts or names out
+//     of range, consumes the wrong number of bytes, or fails on items it
+//     has already checked are there
+//
+// Input layout: the first byte gives the number of script bytes that follow
+// (mod SCRIPT_MAX + 1); each script byte picks a getter or decoder (low
+// nibble) and a width, size or decoder for it (high nibble). The rest of the
+// input is the datagram.
+//
+// Build (libFuzzer): clang -g -O1 -fsanitize=fuzzer,address -o fuzz_codec fuzz_codec.c pdu_codec.c
+// Build (AFL):       afl-clang-fast -g -DFUZZ_MAIN -o fuzz_codec fuzz_codec.c pdu_codec.c
+// Build (replay):    gcc -g -fsanitize=address -DFUZZ_MAIN -o fuzz_codec fuzz_codec.c pdu_codec.c
+//
+// With FUZZ_MAIN the program runs each file named on the command line, or
+// stdin when there are none, through the target once.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "pdu.h"
+#include "pdu_codec.h"
+
+#define SCRIPT_MAX 32
+
+// Function prototypes
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+void fuzz_step(struct pdu_cursor *c, unsigned int op);
+void fuzz_decode(struct pdu_cursor *c, unsigned int which);
+void fuzz_check(const struct pdu_cursor *c, size_t pos, int err);
+void fuzz_roundtrip(const char *field, size_t len, const void *value, int kind);
+
+// Abort unless the cursor stayed inside the payload and an earlier error
+// kept it where it was
+void fuzz_check(const struct pdu_cursor *c, size_t pos, int err)
+{
+    if (c->pos > c->size) {
+        abort();
+    }
+    if (err && (c->pos != pos || !c->err)) {
+        abort();
+    }
+    if (pdu_remaining(c) != (c->err ? 0 : c->size - c->pos)) {
+        abort();
+    }
+}
+
+// Write a value just read back out and compare it with the bytes it came
+// from. kind is the field width, or CONTENT_META_SIZE / 6 for a metadata
+// block or an address.
+void fuzz_roundtrip(const char *field, size_t len, const void *value, int kind)
+{
+    char out[CONTENT_META_SIZE];
+    struct pdu_cursor w;
+
+    pdu_cursor_init(&w, out, sizeof(out));
+    switch (kind) {
+    case 1:
+        pdu_put_u8(&w, *(const unsigned int *)value);
+        break;
+    case 2:
+        pdu_put_u16(&w, *(const unsigned int *)value);
+        break;
+    case 4:
+        pdu_put_u32(&w, *(const uint32_t *)value);
+        break;
+    case 8:
+        pdu_put_u64(&w, *(const uint64_t *)value);
+        break;
+    case 6:
+        pdu_put_addr(&w, (const struct sockaddr_in *)value);
+        break;
+    case CONTENT_META_SIZE:
+        pdu_put_meta(&w, (const struct content_meta *)value);
+        break;
+    }
+    if (w.err || w.pos != len || memcmp(out, field, len) != 0) {
+        abort();
+    }
+}
+
+// Run one getter picked by op against the cursor
+void fuzz_step(struct pdu_cursor *c, unsigned int op)
+{
+    size_t pos = c->pos;
+    int err = c->err;
+    size_t width = (op >> 4) + 1;
+    const char *field = c->err ? NULL : c->buf + c->pos;
+    unsigned int v;
+    uint32_t v32;
+    uint64_t v64;
+    struct sockaddr_in addr;
+    struct content_meta meta;
+    char name[16 + 1];
+    char text[MAX_DATA_SIZE + 1];
+    const char *p;
+
+    switch (op & 0x0f) {
+    case 0:
+        v = pdu_get_u8(c);
+        if (!c->err) {
+            fuzz_roundtrip(field, 1, &v, 1);
+        }
+        break;
+    case 1:
+        v = pdu_get_u16(c);
+        if (!c->err) {
+            fuzz_roundtrip(field, 2, &v, 2);
+        }
+        break;
+    case 2:
+        v32 = pdu_get_u32(c);
+        if (!c->err) {
+            fuzz_roundtrip(field, 4, &v32, 4);
+        }
+        break;
+    case 3:
+        v64 = pdu_get_u64(c);
+        if (!c->err) {
+            fuzz_roundtrip(field, 8, &v64, 8);
+        }
+        break;
+    case 4:
+        pdu_get_addr(c, &addr);
+        if (!c->err) {
+            fuzz_roundtrip(field, 6, &addr, 6);
+        }
+        break;
+    case 5:
+        pdu_get_meta(c, &meta);
+        if (!c->err) {
+            fuzz_roundtrip(field, CONTENT_META_SIZE, &meta, CONTENT_META_SIZE);
+        }
+        break;
+    case 6:
+        pdu_get_name(c, name, CONTENT_NAME_SIZE);
+        if (strlen(name) > CONTENT_NAME_SIZE) {
+            abort();
+        }
+        break;
+    case 7:
+        pdu_get_name(c, name, PEER_NAME_SIZE);
+        if (strlen(name) > PEER_NAME_SIZE) {
+            abort();
+        }
+        break;
+    case 8:
+        pdu_get_name(c, name, width);
+        if (strlen(name) > width) {
+            abort();
+        }
+        break;
+    case 9:
+        p = pdu_get_bytes(c, width);
+        if (p && (p != field || c->pos != pos + width)) {
+            abort();
+        }
+        break;
+    case 10:
+        p = pdu_get_bytes(c, pdu_remaining(c));
+        if (p && c->pos != c->size) {
+            abort();
+        }
+        break;
+    case 11:
+        pdu_get_text(c, text, width);
+        if (memchr(text, '\0', width) == NULL) {
+            abort();
+        }
+        break;
+    case 12:
+        fuzz_decode(c, op >> 4);
+        break;
+    default:
+        pdu_get_text(c, text, sizeof(text));
+        if (memchr(text, '\0', sizeof(text)) == NULL) {
+            abort();
+        }
+        break;
+    }
+    fuzz_check(c, pos, err);
+}
+
+// Run one payload decoder picked by which (0-15) against the cursor
+void fuzz_decode(struct pdu_cursor *c, unsigned int which)
+{
+    size_t pos = c->pos;
+    const char *field = c->err ? NULL : c->buf + c->pos;
+    struct pdu_reg reg;
+    struct sockaddr_in addr[SEARCH_MAX_CANDIDATES];
+    struct content_meta meta[SEARCH_MAX_CANDIDATES];
+    char peer_name[PEER_NAME_SIZE + 1];
+    const char *names;
+    int count;
+    int max;
+    int op;
+    int n;
+    int i;
+
+    switch (which % 6) {
+    case 0:
+        // 'R' request: the metadata is there in full or not at all
+        if (pdu_parse_reg(c, &reg) == 0) {
+            if (strlen(reg.peer_name) > PEER_NAME_SIZE ||
+                strlen(reg.content_name) > CONTENT_NAME_SIZE ||
+                (c->pos != pos + PEER_NAME_SIZE + CONTENT_NAME_SIZE + 6 &&
+                 c->pos != pos + PEER_NAME_SIZE + CONTENT_NAME_SIZE + 6 + CONTENT_META_SIZE)) {
+                abort();
+            }
+        }
+        break;
+    case 1:
+        // 'B' request: every item counted in the head has to be readable
+        if (pdu_parse_batch(c, peer_name, &count) == 0) {
+            if (count < 1 || count > REG_BATCH_MAX || strlen(peer_name) > PEER_NAME_SIZE) {
+                abort();
+            }
+            for (i = 0; i < count; i++) {
+                pdu_parse_batch_item(c, &reg, &op);
+                if (c->err || reg.peer_name[0] != '\0' ||
+                    strlen(reg.content_name) > CONTENT_NAME_SIZE) {
+                    abort();
+                }
+            }
+        }
+        break;
+    case 2:
+        // 'M' request
+        n = pdu_parse_multi(c, &names);
+        if (n >= 0 && (n < 1 || n > LOOKUP_BATCH_MAX || names != field + 1 ||
+                       c->pos != pos + 1 + (size_t)n * CONTENT_NAME_SIZE)) {
+            abort();
+        }
+        break;
+    case 3:
+        // 'S' reply, taking up to max candidates
+        max = SEARCH_MAX_CANDIDATES - which / 6;
+        n = pdu_parse_search_reply(c, addr, meta, max);
+        if (n >= 0 && (n < 1 || n > max || c->err)) {
+            abort();
+        }
+        for (i = 0; i < n; i++) {
+            if (addr[i].sin_family != AF_INET) {
+                abort();
+            }
+        }
+        break;
+    case 4:
+        // 'M' reply, for as many names as its first byte says were asked for
+        count = field && c->pos < c->size ? (unsigned char)field[0] : 1;
+        if (pdu_parse_lookup_reply(c, count) == 0) {
+            for (i = 0; i < count; i++) {
+                if (pdu_parse_lookup_result(c, &addr[0], &meta[0]) < 0) {
+                    abort();
+                }
+            }
+        }
+        break;
+    default:
+        // One 'M' reply result
+        n = pdu_parse_lookup_result(c, &addr[0], &meta[0]);
+        if ((n < 0) != (c->err != 0) || (n >= 0 && c->pos != pos + LOOKUP_RESULT_SIZE)) {
+            abort();
+        }
+        break;
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    size_t script_len;
+    size_t n;
+    size_t i;
+    char *dgram;
+    char *payload;
+    struct pdu_hdr h;
+    struct pdu_cursor c;
+
+    if (size == 0) {
+        return 0;
+    }
+    script_len = data[0] % (SCRIPT_MAX + 1);
+    if (script_len > size - 1) {
+        script_len = size - 1;
+    }
+    n = size - 1 - script_len;
+    if (n > PDU_MAX_DGRAM) {
+        n = PDU_MAX_DGRAM;   // what recvfrom() into a PDU_MAX_DGRAM buffer keeps
+    }
+
+    dgram = malloc(n ? n : 1);
+    if (dgram == NULL) {
+        return 0;
+    }
+    if (n > 0) {
+        memcpy(dgram, data + 1 + script_len, n);
+    }
+
+    if (pdu_decode(dgram, n, &h, &payload) != 0) {
+        if (n != 0) {
+            abort();
+        }
+        free(dgram);
+        return 0;
+    }
+    if (payload < dgram || payload > dgram + n || h.len != (size_t)(dgram + n - payload)) {
+        abort();
+    }
+    if ((h.flags & PDU_FLAG_HDR) && payload != dgram + PDU_HDR_SIZE) {
+        abort();
+    }
+
+    pdu_cursor_init(&c, payload, h.len);
+    for (i = 0; i < script_len; i++) {
+        fuzz_step(&c, data[1 + i]);
+    }
+    // Whatever the script left, the text reader has to cope with
+    fuzz_step(&c, 0x0f);
+
+    free(dgram);
+    return 0;
+}
+
+#ifdef FUZZ_MAIN
+// Run each input through the target once, for AFL and for replaying crashes
+// found by libFuzzer without it
+int main(int argc, char *argv[])
+{
+    FILE *f;
+    uint8_t *buf;
+    size_t len;
+    size_t cap = 1 << 16;
+    int i;
+
+    buf = malloc(cap);
+    if (buf == NULL) {
+        return 1;
+    }
+    for (i = 1; i < argc || i == 1; i++) {
+        f = argc > 1 ? fopen(argv[i], "rb") : stdin;
+        if (f == NULL) {
+            printf("Error: Cannot open %s\n", argv[i]);
+            continue;
+        }
+        len = fread(buf, 1, cap, f);
+        if (f != stdin) {
+            fclose(f);
+        }
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+    free(buf);
+    return 0;
+}
+#endif
@@ -1,24 +1,226 @@
 
+#define _GNU_SOURCE     // sendmmsg()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include "pdu.h"
+#include "pdu_codec.h"
 
 #define BUFLEN 256
+#define SUB_MAX_LEASE    600    // seconds a subscription may be granted at most
+#define SUB_MAX_PER_ADDR 64     // live subscriptions per subscriber address
+#define NOTIFY_BATCH     64     // notifications sent per sendmmsg() between requests
+#define REPL_TICK        5      // seconds between replication decisions
+#define REPL_RATE_PER_REPLICA 5.0 // lookups/s one replica is expected to absorb
+#define REPL_MAX_REPLICAS 8     // replicas an item is grown to at most
+#define REPL_ORDER_TIMEOUT 60   // seconds a fetch order may take before another is sent
+#define REPL_PEER_TIMEOUT 30    // a peer whose heartbeats stop is forgotten after this
+#define REPL_IDLE_RATE   0.05   // lookups/s below which an item's demand is forgotten
+#define DRAIN_BATCH      32     // datagrams read per recvmmsg() between requests
+#define BUSY_MIN_MS      20     // bounds of the retry-after hint in busy replies
+#define BUSY_MAX_MS      2000
+#define QUEUE_REPORT     10     // seconds between queue reports while shedding
+#define RCVBUF_SIZE      (1024 * 1024)
+#define CONTENT_BUCKETS  65536  // (peer, name) hash table size, a power of two
+#define HEALTH_DECAY     0.98   // share of a replica's failure score kept per second
+#define HEALTH_TRIP      3.0    // failure score at which a replica's circuit opens
+#define HEALTH_MARGIN    0.5    // score difference that outweighs usage when choosing a replica
+#define BREAKER_OPEN     15     // seconds a circuit first stays open, doubled on each re-trip
+#define BREAKER_MAX_OPEN 300
+#define BREAKER_PROBATION 60    // seconds without failure after reopening before the circuit closes
+#define STANDBY_KEEPALIVE_MS 250  // primary sends a keepalive after this much silence
+#define STANDBY_TIMEOUT_MS   1000 // standby takes over after this much silence
+#define STANDBY_CONNECT_MS   200  // connect timeout towards the standby
+#define STANDBY_SYNC_MS      50   // wait for room in the stream before a reply
+#define STANDBY_RETRY        1    // seconds between connection attempts to the standby
+#define STANDBY_BATCH        16384 // buffered records are written once they reach this size
+#define STANDBY_MAX_BACKLOG  (64 * 1024 * 1024) // unsent bytes before the standby is dropped
+#define STANDBY_IN_SIZE      65536
 
+// Request classes, in the order they are served
+#define CLASS_LOOKUP     0      // 'S', 'M', 'H': gate downloads and replication
+#define CLASS_UPDATE     1      // 'R', 'T', 'B', 'U', 'X'
+#define CLASS_LIST       2      // 'O' and anything unknown
+#define QUEUE_CLASSES    3
+
+// Interest in new registrations of a name or prefix
+struct subscription {
+    char name[CONTENT_NAME_SIZE + 1];
+    int prefix;
+    struct sockaddr_in addr;
+    time_t expires;             // 0 once cancelled
+    struct subscription *next;
+};
+
+// Pending fan-out of one registration. Subscriptions are only unlinked
+// while no fan-out is pending, so next_sub stays valid between batches.
+struct notify_job {
+    char hdr[PDU_HDR_SIZE];
+    char payload[NOTIFY_SIZE];
+    char content_name[CONTENT_NAME_SIZE + 1];
+    struct sockaddr_in from;    // the registering peer isn't notified
+    struct subscription *next_sub;
+    int sent;
+    struct notify_job *next;
+};
+
+// Peer that advertised spare capacity for replicas
+struct repl_peer {
+    char peer_name[PEER_NAME_SIZE + 1];
+    struct sockaddr_in addr;    // where its heartbeats come from
+    int active_uploads;
+    int upload_slots;
+    unsigned long long spare;   // cache bytes it can still fill
+    time_t last_seen;
+    struct repl_peer *next;
+};
+
+// Lookup rate of an item and the fetch order in progress for it
+struct demand {
+    char content_name[CONTENT_NAME_SIZE + 1];
+    int hits;                   // lookups since the last tick
+    double rate;                // smoothed lookups/s
+    struct sockaddr_in order_addr; // peer asked to fetch a replica
+    time_t order_until;         // 0 if no order is pending
+    struct demand *next;
+};
+
+// Request read off the socket, waiting for its turn
+struct queued_req {
+    char buf[PDU_MAX_DGRAM];
+    size_t len;
+    struct sockaddr_in from;
+    socklen_t alen;
+    long long arrived_ns;
+};
+
+// Bounded FIFO of one request class. A request that finds it full, or
+// that waited longer than max_wait_ms, gets a busy reply instead.
+struct req_queue {
+    const char *name;
+    int cap;
+    int max_wait_ms;            // 0 = no limit
+    struct queued_req *slot;    // ring of cap requests
+    int head;
+    int count;
+    int max_depth;              // since the last report
+    unsigned long served;
+    unsigned long shed;
+    unsigned long shed_reported;
+    long long service_ns;       // smoothed time to process one request
+};
 
 struct content_entry *content_list = NULL;
+struct content_entry *content_table[CONTENT_BUCKETS]; // by peer and name
+struct req_queue queues[QUEUE_CLASSES] = {
+    { .name = "lookup", .cap = 1024, .max_wait_ms = 0 },
+    { .name = "update", .cap = 512, .max_wait_ms = 0 },
+    { .name = "list", .cap = 256, .max_wait_ms = 100 },
+};
+time_t next_queue_report = 0;
+struct repl_peer *repl_peers = NULL;
+struct demand *demand_list = NULL;
+time_t next_repl_tick = 0;
+struct subscription *sub_list = NULL;
+struct notify_job *notify_head = NULL;
+struct notify_job *notify_tail = NULL;
+int standby_listen = -1;        // -R: accepts the primary's stream
+int standby_sock = -1;          // stream to the standby, or from the primary
+int standby_conn = -1;          // connect to the standby in progress
+long long standby_conn_ns = 0;  // when it started
+struct sockaddr_in standby_addr; // -r: where to stream the registry while primary
+int standby_target = 0;         // standby_addr is set
+int standby_passive = 0;        // not serving peers: a standby, or a primary fenced off
+int standby_synced = 0;         // a standby holding a whole snapshot of the registry
+int standby_dirty = 0;          // registry records wait to be written
+int standby_warned = 0;         // connecting to the standby failed already
+uint32_t standby_seq = 0;       // next record's sequence number, sent or expected
+long long standby_last_ns = 0;  // last record written or read
+time_t standby_retry_at = 0;
+char *standby_out = NULL;       // records not written yet
+size_t standby_out_len = 0;
+size_t standby_out_cap = 0;
+char standby_in[STANDBY_IN_SIZE];
+size_t standby_in_len = 0;
 
-void add_content(const char *peer_name, const char *content_name, struct sockaddr_in *addr);
+struct content_entry *add_content(const char *peer_name, const char *content_name,
+                                  struct sockaddr_in *addr, const struct content_meta *meta);
 struct content_entry *find_content(const char *content_name);
+struct content_entry *find_peer_content(const char *peer_name, const char *content_name);
+unsigned int content_bucket(const char *peer_name, const char *content_name);
 struct content_entry *find_least_used_content(const char *content_name);
+int find_candidates(const char *content_name, struct content_entry **out, int max);
+int replica_usable(struct content_entry *e, time_t now);
+int replica_better(struct content_entry *a, struct content_entry *b, time_t now);
+double replica_score(const struct content_entry *e, time_t now);
+void replica_failed(struct content_entry *e, time_t now);
+int health_report(int reason, const char *content_name, const struct sockaddr_in *addr);
+void find_least_used_batch(const char *names, int count, struct content_entry **best);
 int remove_content(const char *peer_name, const char *content_name);
 void free_content_list(void);
 void list_all_contents(char *buffer, int max_size);
+void send_reply(int s, const struct pdu_hdr *req, int type, const char *data, size_t len,
+                struct sockaddr_in *to, socklen_t alen);
+void send_text(int s, const struct pdu_hdr *req, int type, const char *text,
+               struct sockaddr_in *to, socklen_t alen);
+int subscribe(const char *name, int prefix, const struct sockaddr_in *addr, int lease);
+int sub_matches(const struct subscription *sub, const char *content_name);
+int count_matching_content(const char *name, int prefix);
+void sub_reap(void);
+void free_sub_list(void);
+void notify_queue_add(const char *content_name, const struct sockaddr_in *addr,
+                      const struct content_meta *meta, const struct sockaddr_in *from);
+void notify_flush(int s);
+void repl_heartbeat(const char *peer_name, int flags, int active, int slots,
+                    unsigned long long spare, const struct sockaddr_in *addr);
+void demand_hit(const char *content_name);
+int demand_registered(const char *content_name, const struct sockaddr_in *from);
+void repl_tick(int s);
+struct repl_peer *repl_pick_target(const struct content_entry *source);
+struct repl_peer *find_repl_peer(const char *peer_name);
+void repl_send(int s, const struct repl_peer *peer, int action, const char *content_name,
+               const struct content_entry *source);
+void free_repl_state(void);
+long long now_ns(void);
+int request_class(int type);
+int queue_init(void);
+int queue_pending(void);
+void queue_drain(int s, int block);
+struct queued_req *queue_pop(int s, int *cls);
+void queue_done(int cls, long long start_ns);
+void send_busy(int s, int cls, char *dgram, size_t n, struct sockaddr_in *to, socklen_t alen);
+void queue_report(void);
+void free_queues(void);
+int parse_host_port(const char *arg, struct sockaddr_in *addr);
+int standby_listen_on(int port);
+void standby_poll(int s, int block);
+void standby_tick(void);
+void standby_connect(void);
+void standby_connected(void);
+void standby_snapshot(void);
+void standby_record(int type, const char *payload, size_t len);
+void standby_log_entry(const struct content_entry *e);
+void standby_log_remove(const char *peer_name, const char *content_name);
+void standby_log_usage(const struct content_entry *e);
+void standby_flush(void);
+int standby_sync(void);
+void standby_accept(void);
+void standby_read(void);
+int standby_apply(const struct pdu_hdr *h, char *payload);
+void standby_close(void);
+void standby_promote(const char *why);
+int count_entries(void);
 
 int main(int argc, char *argv[])
 {
@@ -26,18 +228,38 @@ int main(int argc, char *argv[])
     socklen_t alen;
     int s;
     int port = 3000;
-    struct pdu in, out;
+    struct queued_req *qr;
+    int cls;
+    long long start_ns;
+    char reply[PDU_MAX_PAYLOAD];
+    char *payload;
+    struct pdu_hdr req;
+    struct pdu_cursor in;
+    struct pdu_cursor out;
+    struct content_entry *found[LOOKUP_BATCH_MAX];
+    struct timeval tv;
+    int rcvbuf;
+    int count, hits, i;
+    int lease, granted;
+    int repl_port = 0;
+    int block;
 
-    // Parse command line arguments 
-    switch (argc) {
-    case 1:
-        break;
-    case 2:
-        port = atoi(argv[1]);
-        break;
-    default:
-        fprintf(stderr, "Usage: %s [port]\n", argv[0]);
-        exit(1);
+    // Parse command line arguments: [port] [-r standby_host:port] [-R repl_port]
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            if (parse_host_port(argv[++i], &standby_addr) < 0) {
+                fprintf(stderr, "Can't get standby address '%s'\n", argv[i]);
+                exit(1);
+            }
+            standby_target = 1;
+        } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+            repl_port = atoi(argv[++i]);
+        } else if (i == 1 && argv[i][0] != '-') {
+            port = atoi(argv[i]);
+        } else {
+            fprintf(stderr, "Usage: %s [port] [-r standby_host:port] [-R repl_port]\n", argv[0]);
+            exit(1);
+        }
     }
 
     // Initialize server address
@@ -60,129 +282,293 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    // Wake up at least once a second for replication decisions
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // Room for a burst to wait in the kernel until it is sorted into the
+    // class queues, rather than being dropped before a lookup is seen
+    rcvbuf = RCVBUF_SIZE;
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    if (queue_init() < 0) {
+        fprintf(stderr, "Memory allocation error\n");
+        close(s);
+        exit(1);
+    }
+
+    // A standby follows the primary's stream and keeps quiet until it ends
+    if (repl_port > 0) {
+        standby_listen = standby_listen_on(repl_port);
+        if (standby_listen < 0) {
+            fprintf(stderr, "can't listen for the primary on port %d\n", repl_port);
+            close(s);
+            exit(1);
+        }
+        standby_passive = 1;
+    }
+
     printf("Index Server started on port %d\n", port);
-    alen = sizeof(fsin);
+    if (standby_passive) {
+        printf("Standby: waiting for the primary's stream on TCP port %d\n", repl_port);
+    }
 
     //Main Loop
     for (;;) {
-        memset(&in, 0, sizeof(in));
-        memset(&out, 0, sizeof(out));
+        repl_tick(s);
+        queue_report();
 
-        // Wait for incoming PDU and read it
-        ssize_t n = recvfrom(s, &in, sizeof(in), 0, (struct sockaddr *)&fsin, &alen);
-        if (n < 0) {
-            fprintf(stderr, "recvfrom error\n");
+        // Move whatever has arrived into the class queues, and only block
+        // when there is nothing queued and no notification pending. Draining
+        // before every request lets a lookup overtake a backlog of listings.
+        block = !queue_pending() && !notify_head;
+        if (standby_listen >= 0 || standby_target) {
+            standby_poll(s, block);     // waits on the UDP socket too
+            block = 0;
+        }
+        queue_drain(s, block);
+        qr = queue_pop(s, &cls);
+        if (qr == NULL) {
+            if (notify_head) {
+                notify_flush(s);
+            }
+            continue;
+        }
+        start_ns = now_ns();
+        fsin = qr->from;
+        alen = qr->alen;
+        if (pdu_decode(qr->buf, qr->len, &req, &payload) < 0) {
+            continue;
+        }
+        pdu_cursor_init(&in, payload, req.len);
+
+        // Point peers at the other server until this one takes over
+        if (standby_passive) {
+            if (req.type != 'H' && req.type != 'X') {
+                send_text(s, &req, 'E', STANDBY_TEXT, &fsin, alen);
+            }
+            queue_done(cls, start_ns);
             continue;
         }
 
         // Process based on PDU type
-        switch (in.type) {
+        switch (req.type) {
         case 'R': { // R for Registration
             // Format: Peer Name (10 bytes) | Content Name (10 bytes) | IP (4 bytes) | Port (2 bytes) 
-            if (n < 1 + PEER_NAME_SIZE + CONTENT_NAME_SIZE + 6) {
-                out.type = 'E';
-                strncpy(out.data, "Invalid registration format", MAX_DATA_SIZE - 1);
-                sendto(s, &out, 1 + strlen(out.data) + 1, 0, (struct sockaddr *)&fsin, alen);
+            //         [| Size (8 bytes) | Version (8 bytes) | Hash (8 bytes)]
+            struct pdu_reg reg;
+
+            if (pdu_parse_reg(&in, &reg) < 0) {
+                send_text(s, &req, 'E', "Invalid registration format", &fsin, alen);
                 break;
             }
 
-            char peer_name[PEER_NAME_SIZE + 1] = {0};
-            char content_name[CONTENT_NAME_SIZE + 1] = {0};
-            struct sockaddr_in reg_addr;
+            // Check if already registered 
+            struct content_entry *existing = find_peer_content(reg.peer_name, reg.content_name);
 
-            memcpy(peer_name, in.data, PEER_NAME_SIZE);
-            memcpy(content_name, in.data + PEER_NAME_SIZE, CONTENT_NAME_SIZE);
-            
-            // Extract IP and Port from data 
-            memcpy(&reg_addr.sin_addr.s_addr, in.data + PEER_NAME_SIZE + CONTENT_NAME_SIZE, 4);
-            memcpy(&reg_addr.sin_port, in.data + PEER_NAME_SIZE + CONTENT_NAME_SIZE + 4, 2);
-            reg_addr.sin_family = AF_INET;
+            if (existing && existing->addr.sin_addr.s_addr == reg.addr.sin_addr.s_addr &&
+                existing->addr.sin_port == reg.addr.sin_port) {
+                // The same registration again, e.g. retried against a standby
+                // that took over. The server is evidently back: hand it out again
+                existing->meta = reg.meta;
+                existing->fail_score = 0;
+                existing->open_until = 0;
+                existing->trips = 0;
+                standby_log_entry(existing);
+                send_text(s, &req, 'A', "Registration successful", &fsin, alen);
+            } else if (existing) {
+                send_text(s, &req, 'E', "Peer name and content already registered", &fsin, alen);
+            } else {
+                existing = add_content(reg.peer_name, reg.content_name, &reg.addr, &reg.meta);
+                if (existing && demand_registered(reg.content_name, &fsin)) {
+                    existing->replica = 1;
+                }
+                if (existing) {
+                    standby_log_entry(existing);
+                }
+                send_text(s, &req, 'A', "Registration successful", &fsin, alen);
+                notify_queue_add(reg.content_name, &reg.addr, &reg.meta, &fsin);
+                printf("Registered: Peer='%s' Content='%s' Address=%s:%d Size=%llu Hash=%016llx\n",
+                       reg.peer_name, reg.content_name,
+                       inet_ntoa(reg.addr.sin_addr), ntohs(reg.addr.sin_port),
+                       (unsigned long long)reg.meta.size, (unsigned long long)reg.meta.hash);
+            }
+            break;
+        }
 
-            // Check if already registered 
-            struct content_entry *existing = content_list;
-            int duplicate = 0;
-            while (existing) { // Loops through linked list to make sure not duplicate
-                if (strncmp(existing->peer_name, peer_name, PEER_NAME_SIZE) == 0 &&
-                    strncmp(existing->content_name, content_name, CONTENT_NAME_SIZE) == 0) {
-                    duplicate = 1;
-                    break;
+        case 'S': { // S for Search for content and server
+            // Format: Content Name (10 bytes) [| Count (1 byte)]
+            char content_name[CONTENT_NAME_SIZE + 1];
+            struct content_entry *cand[SEARCH_MAX_CANDIDATES];
+            int want = 1;
+
+            pdu_get_name(&in, content_name, CONTENT_NAME_SIZE);
+            if (in.err) {
+                send_text(s, &req, 'E', "Invalid search format", &fsin, alen);
+                break;
+            }
+            if (pdu_remaining(&in) >= 1) {
+                want = pdu_get_u8(&in);
+                if (want < 1) {
+                    want = 1;
+                } else if (want > SEARCH_MAX_CANDIDATES) {
+                    want = SEARCH_MAX_CANDIDATES;
                 }
-                existing = existing->next;
             }
 
-            if (duplicate) {
-                out.type = 'E';
-                strncpy(out.data, "Peer name and content already registered", MAX_DATA_SIZE - 1);
-                sendto(s, &out, 1 + strlen(out.data) + 1, 0, (struct sockaddr *)&fsin, alen);
+            count = find_candidates(content_name, cand, want);
+            if (count == 0) {
+                send_text(s, &req, 'E', "Content not found", &fsin, alen);
             } else {
-                add_content(peer_name, content_name, &reg_addr);
-                out.type = 'A';
-                strncpy(out.data, "Registration successful", MAX_DATA_SIZE - 1);
-                sendto(s, &out, 1 + strlen(out.data) + 1, 0, (struct sockaddr *)&fsin, alen);
-                printf("Registered: Peer='%s' Content='%s' Address=%s:%d\n",
-                       peer_name, content_name,
-                       inet_ntoa(reg_addr.sin_addr), ntohs(reg_addr.sin_port));
+                // Increment usage count of the server handed out first
+                cand[0]->usage_count++;
+                standby_log_usage(cand[0]);
+                demand_hit(content_name);
+                
+                //Format response: [IP (4 bytes) | Port (2 bytes) | Size | Version | Hash] x count
+                pdu_cursor_init(&out, reply, sizeof(reply));
+                for (i = 0; i < count; i++) {
+                    pdu_put_addr(&out, &cand[i]->addr);
+                    pdu_put_meta(&out, &cand[i]->meta);
+                }
+                send_reply(s, &req, 'S', reply, out.pos, &fsin, alen);
+                printf("Search: Content='%s' -> Peer='%s' Address=%s:%d",
+                       content_name, cand[0]->peer_name,
+                       inet_ntoa(cand[0]->addr.sin_addr), ntohs(cand[0]->addr.sin_port));
+                if (count > 1) {
+                    printf(" (+%d more)", count - 1);
+                }
+                printf("\n");
             }
             break;
         }
 
-        case 'S': { // S for Search for content and server
-            // Format: Content Name (10 bytes) 
-            if (n < 1 + CONTENT_NAME_SIZE) {
-                out.type = 'E';
-                strncpy(out.data, "Invalid search format", MAX_DATA_SIZE - 1);
-                sendto(s, &out, 1 + strlen(out.data) + 1, 0, (struct sockaddr *)&fsin, alen);
+        case 'M': { // M for Multi-name search
+            // Format: Count (1 byte) | Content Name (10 bytes) x Count
+            const char *names;
+
+            count = pdu_parse_multi(&in, &names);
+            if (count < 0) {
+                send_text(s, &req, 'E', "Invalid search format", &fsin, alen);
                 break;
             }
 
-            char content_name[CONTENT_NAME_SIZE + 1] = {0};
-            memcpy(content_name, in.data, CONTENT_NAME_SIZE);
+            find_least_used_batch(names, count, found);
 
-            struct content_entry *entry = find_least_used_content(content_name);
-            if (entry == NULL) {
-                out.type = 'E';
-                strncpy(out.data, "Content not found", MAX_DATA_SIZE - 1);
-                sendto(s, &out, 1 + strlen(out.data) + 1, 0, (struct sockaddr *)&fsin, alen);
-            } else {
-                // Increment usage count 
-                entry->usage_count++;
-                
-                //Format response: IP (4 bytes) | Port (2 bytes) 
-                out.type = 'S';
-                memcpy(out.data, &entry->addr.sin_addr.s_addr, 4);
-                memcpy(out.data + 4, &entry->addr.sin_port, 2);
-                sendto(s, &out, 1 + 6, 0, (struct sockaddr *)&fsin, alen);
-                printf("Search: Content='%s' -> Peer='%s' Address=%s:%d\n",
-                       content_name, entry->peer_name,
-                       inet_ntoa(entry->addr.sin_addr), ntohs(entry->addr.sin_port));
+            // Format response: Count | [Status | IP | Port | Size | Version | Hash] x Count
+            pdu_cursor_init(&out, reply, sizeof(reply));
+            pdu_put_u8(&out, count);
+            hits = 0;
+            for (i = 0; i < count; i++) {
+                if (found[i] == NULL) {
+                    pdu_put_u8(&out, 'E');
+                    pdu_put_zero(&out, LOOKUP_RESULT_SIZE - 1);
+                    continue;
+                }
+                found[i]->usage_count++;
+                standby_log_usage(found[i]);
+                demand_hit(found[i]->content_name);
+                hits++;
+                pdu_put_u8(&out, 'S');
+                pdu_put_addr(&out, &found[i]->addr);
+                pdu_put_meta(&out, &found[i]->meta);
             }
+            send_reply(s, &req, 'M', reply, out.pos, &fsin, alen);
+            printf("Batch search: %d names, %d found, from %s:%d\n", count, hits,
+                   inet_ntoa(fsin.sin_addr), ntohs(fsin.sin_port));
             break;
         }
 
         case 'T': { // De-registration 
             // Format: Peer Name (10 bytes) | Content Name (10 bytes) 
-            if (n < 1 + PEER_NAME_SIZE + CONTENT_NAME_SIZE) {
-                out.type = 'E';
-                strncpy(out.data, "Invalid deregistration format", MAX_DATA_SIZE - 1);
-                sendto(s, &out, 1 + strlen(out.data) + 1, 0, (struct sockaddr *)&fsin, alen);
+            char peer_name[PEER_NAME_SIZE + 1];
+            char content_name[CONTENT_NAME_SIZE + 1];
+
+            pdu_get_name(&in, peer_name, PEER_NAME_SIZE);
+            pdu_get_name(&in, content_name, CONTENT_NAME_SIZE);
+            if (in.err) {
+                send_text(s, &req, 'E', "Invalid deregistration format", &fsin, alen);
                 break;
             }
 
-            char peer_name[PEER_NAME_SIZE + 1] = {0};
-            char content_name[CONTENT_NAME_SIZE + 1] = {0};
-            memcpy(peer_name, in.data, PEER_NAME_SIZE);
-            memcpy(content_name, in.data + PEER_NAME_SIZE, CONTENT_NAME_SIZE);
-
+            // A name that is gone already counts as removed: the request may be
+            // a retransmission, or have gone to the other server of a pair too
             if (remove_content(peer_name, content_name)) {
-                out.type = 'A';
-                strncpy(out.data, "Deregistration successful", MAX_DATA_SIZE - 1);
-                sendto(s, &out, 1 + strlen(out.data) + 1, 0, (struct sockaddr *)&fsin, alen);
+                send_text(s, &req, 'A', "Deregistration successful", &fsin, alen);
                 printf("Deregistered: Peer='%s' Content='%s'\n", peer_name, content_name);
             } else {
-                out.type = 'E';
-                strncpy(out.data, "Content not found for deregistration", MAX_DATA_SIZE - 1);
-                sendto(s, &out, 1 + strlen(out.data) + 1, 0, (struct sockaddr *)&fsin, alen);
+                send_text(s, &req, 'A', "Not registered", &fsin, alen);
+            }
+            break;
+        }
+
+        case 'B': { // B for Batch of registrations and de-registrations
+            // Format: Peer Name (10 bytes) | Count (1 byte) | [Op (1 byte) | Content Name (10 bytes)
+            //         | IP (4 bytes) | Port (2 bytes) | metadata (24 bytes)] x Count
+            char peer_name[PEER_NAME_SIZE + 1];
+            struct pdu_reg item;
+            struct content_entry *entry;
+            int op, added = 0, updated = 0, removed = 0, failed = 0;
+
+            if (pdu_parse_batch(&in, peer_name, &count) < 0) {
+                send_text(s, &req, 'E', "Invalid batch registration format", &fsin, alen);
+                break;
+            }
+
+            // Reply: Count (1 byte) | Status (1 byte) x Count
+            pdu_cursor_init(&out, reply, sizeof(reply));
+            pdu_put_u8(&out, count);
+            for (i = 0; i < count; i++) {
+                pdu_parse_batch_item(&in, &item, &op);
+
+                if (op == REG_REMOVE) {
+                    // Gone already is fine, as for 'T'
+                    if (remove_content(peer_name, item.content_name)) {
+                        removed++;
+                    }
+                    pdu_put_u8(&out, 'A');
+                    continue;
+                }
+                if (op != REG_ADD || item.content_name[0] == '\0') {
+                    failed++;
+                    pdu_put_u8(&out, 'E');
+                    continue;
+                }
+
+                entry = find_peer_content(peer_name, item.content_name);
+                if (entry) {
+                    // New version or new address; subscribers hear of it only when
+                    // the content itself changed, not when it just moved
+                    if (entry->meta.hash != item.meta.hash) {
+                        notify_queue_add(item.content_name, &item.addr, &item.meta, &fsin);
+                    }
+                    entry->addr = item.addr;
+                    entry->meta = item.meta;
+                    entry->fail_score = 0;
+                    entry->open_until = 0;
+                    entry->trips = 0;
+                    standby_log_entry(entry);
+                    updated++;
+                } else {
+                    entry = add_content(peer_name, item.content_name, &item.addr, &item.meta);
+                    if (!entry) {
+                        failed++;
+                        pdu_put_u8(&out, 'E');
+                        continue;
+                    }
+                    if (demand_registered(item.content_name, &fsin)) {
+                        entry->replica = 1;
+                    }
+                    standby_log_entry(entry);
+                    notify_queue_add(item.content_name, &item.addr, &item.meta, &fsin);
+                    added++;
+                }
+                pdu_put_u8(&out, 'A');
             }
+            send_reply(s, &req, 'A', reply, out.pos, &fsin, alen);
+            printf("Batch registration: Peer='%s' %d added, %d updated, %d removed, %d failed\n",
+                   peer_name, added, updated, removed, failed);
             break;
         }
 
@@ -190,33 +576,153 @@ int main(int argc, char *argv[])
             char list_buffer[BUFLEN] = {0};
             list_all_contents(list_buffer, BUFLEN);
             
-            out.type = 'O';
-            strncpy(out.data, list_buffer, MAX_DATA_SIZE - 1);
-            sendto(s, &out, 1 + strlen(out.data) + 1, 0, (struct sockaddr *)&fsin, alen);
+            // Older peers read the reply into a struct pdu
+            if (!(req.flags & PDU_FLAG_HDR)) {
+                list_buffer[MAX_DATA_SIZE - 1] = '\0';
+            }
+            send_text(s, &req, 'O', list_buffer, &fsin, alen);
             printf("List request from %s:%d\n", inet_ntoa(fsin.sin_addr), ntohs(fsin.sin_port));
             break;
         }
 
+        case 'U': { // U for Subscription to new registrations
+            // Format: Lease (2 bytes) | Flags (1 byte) | Content Name or prefix (10 bytes)
+            char content_name[CONTENT_NAME_SIZE + 1];
+            int sub_flags;
+
+            lease = pdu_get_u16(&in);
+            sub_flags = pdu_get_u8(&in);
+            pdu_get_name(&in, content_name, CONTENT_NAME_SIZE);
+            if (in.err) {
+                send_text(s, &req, 'E', "Invalid subscription format", &fsin, alen);
+                break;
+            }
+
+            granted = subscribe(content_name, sub_flags & SUB_PREFIX, &fsin, lease);
+            if (granted < 0) {
+                send_text(s, &req, 'E', "Too many subscriptions", &fsin, alen);
+                break;
+            }
+
+            // Format response: Granted lease (2 bytes) | Already registered (2 bytes)
+            count = count_matching_content(content_name, sub_flags & SUB_PREFIX);
+            pdu_cursor_init(&out, reply, sizeof(reply));
+            pdu_put_u16(&out, granted);
+            pdu_put_u16(&out, count > 0xffff ? 0xffff : count);
+            send_reply(s, &req, 'A', reply, out.pos, &fsin, alen);
+            printf("%s: '%s%s' from %s:%d, lease %ds\n", granted ? "Subscribe" : "Unsubscribe",
+                   content_name, (sub_flags & SUB_PREFIX) ? "*" : "",
+                   inet_ntoa(fsin.sin_addr), ntohs(fsin.sin_port), granted);
+            break;
+        }
+
+        case 'H': { // H for capacity Heartbeat, not answered
+            // Format: Peer Name (10 bytes) | Flags (1 byte) | Active uploads (2 bytes)
+            //         | Upload slots (2 bytes) | Spare cache (8 bytes)
+            char peer_name[PEER_NAME_SIZE + 1];
+            int hb_flags, active, slots;
+            unsigned long long spare;
+
+            pdu_get_name(&in, peer_name, PEER_NAME_SIZE);
+            hb_flags = pdu_get_u8(&in);
+            active = pdu_get_u16(&in);
+            slots = pdu_get_u16(&in);
+            spare = pdu_get_u64(&in);
+            if (!in.err) {
+                repl_heartbeat(peer_name, hb_flags, active, slots, spare, &fsin);
+            }
+            break;
+        }
+
+        case 'X': { // X for failure report, not answered
+            // Format: Reason (1 byte) | Content Name (10 bytes) | IP (4 bytes) | Port (2 bytes)
+            char content_name[CONTENT_NAME_SIZE + 1];
+            struct sockaddr_in fail_addr;
+            int reason;
+
+            reason = pdu_get_u8(&in);
+            pdu_get_name(&in, content_name, CONTENT_NAME_SIZE);
+            pdu_get_addr(&in, &fail_addr);
+            if (in.err || (reason != FAIL_CONNECT && reason != FAIL_TRANSFER)) {
+                break;
+            }
+            hits = health_report(reason, content_name, &fail_addr);
+            printf("Failure report: %s '%s' at %s:%d from %s:%d, %d replica(s)\n",
+                   reason == FAIL_CONNECT ? "can't connect for" : "transfer failed for",
+                   content_name, inet_ntoa(fail_addr.sin_addr), ntohs(fail_addr.sin_port),
+                   inet_ntoa(fsin.sin_addr), ntohs(fsin.sin_port), hits);
+            break;
+        }
+
         default:
-            out.type = 'E';
-            strncpy(out.data, "Unknown PDU type", MAX_DATA_SIZE - 1);
-            sendto(s, &out, 1 + strlen(out.data) + 1, 0, (struct sockaddr *)&fsin, alen);
+            send_text(s, &req, 'E', "Unknown PDU type", &fsin, alen);
             break;
         }
+        queue_done(cls, start_ns);
+
+        // Records for the standby go out in batches, at the latest once
+        // the queues are empty; registry changes also go before any reply
+        if (standby_sock >= 0 && (standby_out_len >= STANDBY_BATCH || !queue_pending())) {
+            standby_flush();
+        }
+
+        // Keep fan-out going between requests
+        if (notify_head) {
+            notify_flush(s);
+        }
     }
 
     free_content_list();
+    free_sub_list();
+    free_repl_state();
+    free_queues();
+    standby_close();
+    free(standby_out);
     close(s);
     return 0;
 }
 
+// Answer req with a single-buffer payload, in the format req came in
+void send_reply(int s, const struct pdu_hdr *req, int type, const char *data, size_t len,
+                struct sockaddr_in *to, socklen_t alen)
+{
+    struct pdu_hdr rep;
+    struct iovec iov;
+
+    // The standby hears of a registry change before the peer that made it.
+    // If the stream has no room, the reply is dropped: the peer sends the
+    // request again and repeating it does no harm.
+    if (standby_dirty && standby_sync() < 0) {
+        return;
+    }
+
+    rep.type = type;
+    rep.flags = req->flags & PDU_FLAG_HDR;
+    rep.req_id = req->req_id;
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    if (pdu_sendv(s, &rep, &iov, 1, (struct sockaddr *)to, alen) < 0) {
+        fprintf(stderr, "sendto error\n");
+    }
+}
+
+// Answer req with a NUL-terminated message
+void send_text(int s, const struct pdu_hdr *req, int type, const char *text,
+               struct sockaddr_in *to, socklen_t alen)
+{
+    send_reply(s, req, type, text, strlen(text) + 1, to, alen);
+}
+
 // Add content to the linked list list 
-void add_content(const char *peer_name, const char *content_name, struct sockaddr_in *addr)
+struct content_entry *add_content(const char *peer_name, const char *content_name,
+                                  struct sockaddr_in *addr, const struct content_meta *meta)
 {
     struct content_entry *new_entry = (struct content_entry *)malloc(sizeof(struct content_entry));
+    unsigned int bucket;
+
     if (new_entry == NULL) {
         fprintf(stderr, "Memory allocation error\n");
-        return;
+        return NULL;
     }
 
     strncpy(new_entry->peer_name, peer_name, PEER_NAME_SIZE);
@@ -224,9 +730,23 @@ void add_content(const char *peer_name, const char *content_name, struct sockadd
     strncpy(new_entry->content_name, content_name, CONTENT_NAME_SIZE);
     new_entry->content_name[CONTENT_NAME_SIZE] = '\0';
     memcpy(&new_entry->addr, addr, sizeof(struct sockaddr_in));
+    new_entry->meta = *meta;
     new_entry->usage_count = 0;
+    new_entry->replica = 0;
+    new_entry->fail_score = 0;
+    new_entry->fail_at = 0;
+    new_entry->open_until = 0;
+    new_entry->trips = 0;
     new_entry->next = content_list;
+    new_entry->pprev = &content_list;
+    if (content_list) {
+        content_list->pprev = &new_entry->next;
+    }
     content_list = new_entry;
+    bucket = content_bucket(peer_name, content_name);
+    new_entry->hash_next = content_table[bucket];
+    content_table[bucket] = new_entry;
+    return new_entry;
 }
 
 // Find content entry by name 
@@ -242,44 +762,237 @@ struct content_entry *find_content(const char *content_name)
     return NULL;
 }
 
-// Find least used content server for load balancing 
+// Find the entry a peer registered for content_name
+struct content_entry *find_peer_content(const char *peer_name, const char *content_name)
+{
+    struct content_entry *current;
+
+    current = content_table[content_bucket(peer_name, content_name)];
+    for (; current; current = current->hash_next) {
+        if (strncmp(current->peer_name, peer_name, PEER_NAME_SIZE) == 0 &&
+            strncmp(current->content_name, content_name, CONTENT_NAME_SIZE) == 0) {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+// Hash table bucket of a (peer, name) pair: FNV-1a over both padded names
+unsigned int content_bucket(const char *peer_name, const char *content_name)
+{
+    uint64_t hash = CONTENT_HASH_INIT;
+    int i;
+
+    for (i = 0; i < PEER_NAME_SIZE && peer_name[i]; i++) {
+        hash = (hash ^ (unsigned char)peer_name[i]) * CONTENT_HASH_PRIME;
+    }
+    hash = (hash ^ '|') * CONTENT_HASH_PRIME;
+    for (i = 0; i < CONTENT_NAME_SIZE && content_name[i]; i++) {
+        hash = (hash ^ (unsigned char)content_name[i]) * CONTENT_HASH_PRIME;
+    }
+    return (unsigned int)(hash ^ (hash >> 32)) & (CONTENT_BUCKETS - 1);
+}
+
+// Find least used content server for load balancing, skipping servers
+// whose circuit is open
 struct content_entry *find_least_used_content(const char *content_name)
 {
-    struct content_entry *current = content_list;
-    struct content_entry *best = NULL;
-    int min_usage = -1;
+    struct content_entry *best;
 
-    while (current) {
-        if (strncmp(current->content_name, content_name, CONTENT_NAME_SIZE) == 0) {
-            if (min_usage == -1 || current->usage_count < min_usage) {
-                min_usage = current->usage_count;
-                best = current;
+    return find_candidates(content_name, &best, 1) ? best : NULL;
+}
+
+// Collect up to max servers of content_name, best first. Servers whose
+// circuit is open are left out, unless no other server holds the item: then
+// the one due to reopen first is returned alone, as a probe. Returns how
+// many were found.
+int find_candidates(const char *content_name, struct content_entry **out, int max)
+{
+    struct content_entry *current;
+    time_t now = time(NULL);
+    int count = 0;
+    int i;
+
+    for (current = content_list; current; current = current->next) {
+        if (strncmp(current->content_name, content_name, CONTENT_NAME_SIZE) != 0) {
+            continue;
+        }
+        // Insertion into the sorted top max
+        for (i = count; i > 0 && replica_better(current, out[i - 1], now); i--) {
+            if (i < max) {
+                out[i] = out[i - 1];
+            }
+        }
+        if (i < max) {
+            out[i] = current;
+            if (count < max) {
+                count++;
             }
         }
-        current = current->next;
     }
-    return best;
+
+    if (count > 0 && !replica_usable(out[0], now)) {
+        return 1;
+    }
+    while (count > 0 && !replica_usable(out[count - 1], now)) {
+        count--;
+    }
+    return count;
+}
+
+// Resolve several names in one pass over the list, choosing the best
+// server for each like find_least_used_content(). names holds count
+// CONTENT_NAME_SIZE-byte fields.
+void find_least_used_batch(const char *names, int count, struct content_entry **best)
+{
+    struct content_entry *current;
+    time_t now = time(NULL);
+    int i;
+
+    for (i = 0; i < count; i++) {
+        best[i] = NULL;
+    }
+    for (current = content_list; current; current = current->next) {
+        for (i = 0; i < count; i++) {
+            if (strncmp(current->content_name, names + i * CONTENT_NAME_SIZE, CONTENT_NAME_SIZE) == 0 &&
+                (best[i] == NULL || replica_better(current, best[i], now))) {
+                best[i] = current;
+            }
+        }
+    }
+}
+
+// May e be handed out? A circuit that has been open is half-open once its
+// time is up, and closes for good after BREAKER_PROBATION seconds without
+// a failure.
+int replica_usable(struct content_entry *e, time_t now)
+{
+    if (e->open_until == 0) {
+        return 1;
+    }
+    if (now < e->open_until) {
+        return 0;
+    }
+    if (now - e->open_until >= BREAKER_PROBATION) {
+        e->open_until = 0;
+        e->trips = 0;
+    }
+    return 1;
+}
+
+// Is a a better server to hand out than b? Usable servers beat ones with an
+// open circuit. Among usable ones, a server with clearly fewer recent
+// failures wins, and otherwise the least used one; among the others, the
+// one that reopens first.
+int replica_better(struct content_entry *a, struct content_entry *b, time_t now)
+{
+    int ua = replica_usable(a, now);
+    int ub = replica_usable(b, now);
+    double sa, sb;
+
+    if (ua != ub) {
+        return ua;
+    }
+    if (!ua) {
+        return a->open_until < b->open_until;
+    }
+    sa = replica_score(a, now);
+    sb = replica_score(b, now);
+    if (sa - sb >= HEALTH_MARGIN || sb - sa >= HEALTH_MARGIN) {
+        return sa < sb;
+    }
+    return a->usage_count < b->usage_count;
+}
+
+// Failure score of e decayed to now
+double replica_score(const struct content_entry *e, time_t now)
+{
+    double score = e->fail_score;
+    time_t dt;
+
+    for (dt = now - e->fail_at; dt > 0 && score > 0.01; dt--) {
+        score *= HEALTH_DECAY;
+    }
+    return score;
+}
+
+// Count a failure against a server. The score decays by HEALTH_DECAY per
+// second; reaching HEALTH_TRIP opens the circuit, and so does any failure
+// while it is half-open, each time for twice as long.
+void replica_failed(struct content_entry *e, time_t now)
+{
+    time_t dt;
+    int open_for;
+
+    replica_usable(e, now);     // let a probation that passed close the circuit
+    e->fail_score = replica_score(e, now) + 1.0;
+    e->fail_at = now;
+
+    if (e->open_until != 0 && now < e->open_until) {
+        return;     // already open
+    }
+    if (e->fail_score < HEALTH_TRIP && e->open_until == 0) {
+        return;
+    }
+
+    open_for = BREAKER_OPEN;
+    for (dt = 0; dt < e->trips && open_for < BREAKER_MAX_OPEN; dt++) {
+        open_for *= 2;
+    }
+    if (open_for > BREAKER_MAX_OPEN) {
+        open_for = BREAKER_MAX_OPEN;
+    }
+    e->trips++;
+    e->open_until = now + open_for;
+    e->fail_score = 0;
+    printf("Circuit open: Peer='%s' Content='%s' Address=%s:%d for %ds\n",
+           e->peer_name, e->content_name, inet_ntoa(e->addr.sin_addr),
+           ntohs(e->addr.sin_port), open_for);
+}
+
+// Apply a failure report: a connect failure to every item served from addr,
+// a transfer failure to the named item only. Returns the number of entries
+// affected.
+int health_report(int reason, const char *content_name, const struct sockaddr_in *addr)
+{
+    struct content_entry *current;
+    time_t now = time(NULL);
+    int hits = 0;
+
+    for (current = content_list; current; current = current->next) {
+        if (current->addr.sin_addr.s_addr != addr->sin_addr.s_addr ||
+            current->addr.sin_port != addr->sin_port) {
+            continue;
+        }
+        if (reason == FAIL_TRANSFER &&
+            strncmp(current->content_name, content_name, CONTENT_NAME_SIZE) != 0) {
+            continue;
+        }
+        replica_failed(current, now);
+        hits++;
+    }
+    return hits;
 }
 
 //Remove content from linked list 
 int remove_content(const char *peer_name, const char *content_name)
 {
-    struct content_entry *current = content_list;
-    struct content_entry *prev = NULL;
+    struct content_entry **link;
+    struct content_entry *current;
 
-    while (current) {
+    link = &content_table[content_bucket(peer_name, content_name)];
+    for (current = *link; current; link = &current->hash_next, current = *link) {
         if (strncmp(current->peer_name, peer_name, PEER_NAME_SIZE) == 0 &&
             strncmp(current->content_name, content_name, CONTENT_NAME_SIZE) == 0) {
-            if (prev) {
-                prev->next = current->next;
-            } else {
-                content_list = current->next;
+            *link = current->hash_next;
+            *current->pprev = current->next;
+            if (current->next) {
+                current->next->pprev = current->pprev;
             }
+            standby_log_remove(current->peer_name, current->content_name);
             free(current);
             return 1;
         }
-        prev = current;
-        current = current->next;
     }
     return 0;
 }
@@ -294,6 +1007,7 @@ void free_content_list(void)
         current = next;
     }
     content_list = NULL;
+    memset(content_table, 0, sizeof(content_table));
 }
 
 // List all registered contents 
@@ -320,3 +1034,1262 @@ void list_all_contents(char *buffer, int max_size)
     buffer[max_size - 1] = '\0';
 }
 
+// Add, renew or (with lease 0) cancel a subscription. Returns the granted
+// lease in seconds, or -1 if addr already holds too many subscriptions.
+int subscribe(const char *name, int prefix, const struct sockaddr_in *addr, int lease)
+{
+    struct subscription *sub;
+    struct subscription *found = NULL;
+    time_t now = time(NULL);
+    int live = 0;
+
+    if (lease > SUB_MAX_LEASE) {
+        lease = SUB_MAX_LEASE;
+    }
+    for (sub = sub_list; sub; sub = sub->next) {
+        if (sub->expires <= now ||
+            sub->addr.sin_addr.s_addr != addr->sin_addr.s_addr ||
+            sub->addr.sin_port != addr->sin_port) {
+            continue;
+        }
+        if (sub->prefix == prefix && strncmp(sub->name, name, CONTENT_NAME_SIZE) == 0) {
+            found = sub;
+        }
+        live++;
+    }
+
+    if (lease == 0) {
+        if (found) {
+            found->expires = 0;
+        }
+        return 0;
+    }
+    if (found) {
+        found->expires = now + lease;
+        return lease;
+    }
+    if (live >= SUB_MAX_PER_ADDR) {
+        return -1;
+    }
+
+    sub = (struct subscription *)malloc(sizeof(struct subscription));
+    if (sub == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return -1;
+    }
+    strncpy(sub->name, name, CONTENT_NAME_SIZE);
+    sub->name[CONTENT_NAME_SIZE] = '\0';
+    sub->prefix = prefix;
+    sub->addr = *addr;
+    sub->expires = now + lease;
+    sub->next = sub_list;
+    sub_list = sub;
+    sub_reap();
+    return lease;
+}
+
+// Does a new registration of content_name match sub?
+int sub_matches(const struct subscription *sub, const char *content_name)
+{
+    if (sub->prefix) {
+        return strncmp(sub->name, content_name, strlen(sub->name)) == 0;
+    }
+    return strncmp(sub->name, content_name, CONTENT_NAME_SIZE) == 0;
+}
+
+// Count registered entries matching a name or prefix
+int count_matching_content(const char *name, int prefix)
+{
+    struct content_entry *current;
+    size_t len = prefix ? strlen(name) : CONTENT_NAME_SIZE;
+    int count = 0;
+
+    for (current = content_list; current; current = current->next) {
+        if (strncmp(current->content_name, name, len) == 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Free expired and cancelled subscriptions, unless a fan-out is walking
+// the list
+void sub_reap(void)
+{
+    struct subscription **link = &sub_list;
+    struct subscription *sub;
+    time_t now = time(NULL);
+
+    if (notify_head) {
+        return;
+    }
+    while ((sub = *link) != NULL) {
+        if (sub->expires <= now) {
+            *link = sub->next;
+            free(sub);
+        } else {
+            link = &sub->next;
+        }
+    }
+}
+
+// Free all subscriptions and pending notifications
+void free_sub_list(void)
+{
+    struct subscription *sub;
+    struct notify_job *job;
+
+    while ((job = notify_head) != NULL) {
+        notify_head = job->next;
+        free(job);
+    }
+    notify_tail = NULL;
+    while ((sub = sub_list) != NULL) {
+        sub_list = sub->next;
+        free(sub);
+    }
+}
+
+// Queue notifications of a new registration. They are sent NOTIFY_BATCH at
+// a time between requests by notify_flush().
+void notify_queue_add(const char *content_name, const struct sockaddr_in *addr,
+                      const struct content_meta *meta, const struct sockaddr_in *from)
+{
+    struct notify_job *job;
+    struct pdu_cursor c;
+
+    if (sub_list == NULL) {
+        return;
+    }
+    job = (struct notify_job *)malloc(sizeof(struct notify_job));
+    if (job == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return;
+    }
+
+    // Format: Content Name (10 bytes) | IP (4 bytes) | Port (2 bytes) | metadata
+    pdu_cursor_init(&c, job->payload, sizeof(job->payload));
+    pdu_put_name(&c, content_name, CONTENT_NAME_SIZE);
+    pdu_put_addr(&c, addr);
+    pdu_put_meta(&c, meta);
+    pdu_put_hdr(job->hdr, 'N', PDU_FLAG_HDR, c.pos, 0);
+    strncpy(job->content_name, content_name, CONTENT_NAME_SIZE);
+    job->content_name[CONTENT_NAME_SIZE] = '\0';
+    job->from = *from;
+    job->next_sub = sub_list;
+    job->sent = 0;
+    job->next = NULL;
+    if (notify_tail) {
+        notify_tail->next = job;
+    } else {
+        notify_head = job;
+    }
+    notify_tail = job;
+}
+
+// Send the next batch of notifications for the oldest pending registration
+// with one sendmmsg(). Every message shares the same header and payload.
+void notify_flush(int s)
+{
+    struct notify_job *job = notify_head;
+    struct subscription *sub;
+    struct mmsghdr msgs[NOTIFY_BATCH];
+    struct iovec iov[2];
+    time_t now = time(NULL);
+    int count = 0;
+    int sent;
+
+    if (job == NULL) {
+        return;
+    }
+    iov[0].iov_base = job->hdr;
+    iov[0].iov_len = PDU_HDR_SIZE;
+    iov[1].iov_base = job->payload;
+    iov[1].iov_len = NOTIFY_SIZE;
+
+    for (sub = job->next_sub; sub && count < NOTIFY_BATCH; sub = sub->next) {
+        if (sub->expires <= now || !sub_matches(sub, job->content_name) ||
+            (sub->addr.sin_addr.s_addr == job->from.sin_addr.s_addr &&
+             sub->addr.sin_port == job->from.sin_port)) {
+            continue;
+        }
+        memset(&msgs[count], 0, sizeof(msgs[count]));
+        msgs[count].msg_hdr.msg_name = &sub->addr;
+        msgs[count].msg_hdr.msg_namelen = sizeof(sub->addr);
+        msgs[count].msg_hdr.msg_iov = iov;
+        msgs[count].msg_hdr.msg_iovlen = 2;
+        count++;
+    }
+    job->next_sub = sub;
+
+    // Notifications are best effort; a failed batch is not retried
+    if (count > 0) {
+        sent = sendmmsg(s, msgs, count, 0);
+        if (sent < 0) {
+            fprintf(stderr, "sendmmsg error\n");
+        } else {
+            job->sent += sent;
+        }
+    }
+
+    if (job->next_sub == NULL) {
+        if (job->sent > 0) {
+            printf("Notified %d subscriber(s) of '%s'\n", job->sent, job->content_name);
+        }
+        notify_head = job->next;
+        if (notify_head == NULL) {
+            notify_tail = NULL;
+        }
+        free(job);
+        sub_reap();
+    }
+}
+
+// Record a heartbeat. Peers that clear HB_REPLICATE are forgotten.
+void repl_heartbeat(const char *peer_name, int flags, int active, int slots,
+                    unsigned long long spare, const struct sockaddr_in *addr)
+{
+    struct repl_peer **link;
+    struct repl_peer *peer;
+
+    for (link = &repl_peers; *link; link = &(*link)->next) {
+        if (strncmp((*link)->peer_name, peer_name, PEER_NAME_SIZE) == 0) {
+            break;
+        }
+    }
+    peer = *link;
+    if (!(flags & HB_REPLICATE)) {
+        if (peer) {
+            *link = peer->next;
+            free(peer);
+            printf("Replication: peer '%s' opted out\n", peer_name);
+        }
+        return;
+    }
+    if (peer == NULL) {
+        peer = (struct repl_peer *)calloc(1, sizeof(struct repl_peer));
+        if (peer == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            return;
+        }
+        strncpy(peer->peer_name, peer_name, PEER_NAME_SIZE);
+        peer->next = repl_peers;
+        repl_peers = peer;
+        printf("Replication: peer '%s' at %s:%d opted in\n", peer_name,
+               inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+    }
+    peer->addr = *addr;
+    peer->active_uploads = active;
+    peer->upload_slots = slots;
+    peer->spare = spare;
+    peer->last_seen = time(NULL);
+}
+
+// Count a successful lookup of content_name towards its demand
+void demand_hit(const char *content_name)
+{
+    struct demand *d;
+
+    for (d = demand_list; d; d = d->next) {
+        if (strncmp(d->content_name, content_name, CONTENT_NAME_SIZE) == 0) {
+            d->hits++;
+            return;
+        }
+    }
+    d = (struct demand *)calloc(1, sizeof(struct demand));
+    if (d == NULL) {
+        return;
+    }
+    strncpy(d->content_name, content_name, CONTENT_NAME_SIZE);
+    d->hits = 1;
+    d->next = demand_list;
+    demand_list = d;
+}
+
+// A registration arrived from from: is it the replica we asked for?
+int demand_registered(const char *content_name, const struct sockaddr_in *from)
+{
+    struct demand *d;
+
+    for (d = demand_list; d; d = d->next) {
+        if (d->order_until != 0 &&
+            strncmp(d->content_name, content_name, CONTENT_NAME_SIZE) == 0 &&
+            d->order_addr.sin_addr.s_addr == from->sin_addr.s_addr &&
+            d->order_addr.sin_port == from->sin_port) {
+            d->order_until = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Every REPL_TICK seconds, fold the lookups counted since the last tick into
+// each item's rate and compare its replica count with what the rate calls
+// for: one replica per REPL_RATE_PER_REPLICA lookups/s. A hot item gets one
+// more replica per tick, on the least loaded peer with room for it. Once the
+// rate would keep even one replica fewer at half load, one of the replicas
+// we placed is dropped again. Items that went quiet are forgotten.
+void repl_tick(int s)
+{
+    struct demand **link;
+    struct demand *d;
+    struct repl_peer **plink;
+    struct repl_peer *peer;
+    struct content_entry *entry;
+    struct content_entry *placed;
+    time_t now = time(NULL);
+    int replicas;
+    int want;
+
+    if (now < next_repl_tick) {
+        return;
+    }
+    next_repl_tick = now + REPL_TICK;
+
+    // Forget peers that stopped sending heartbeats
+    plink = &repl_peers;
+    while ((peer = *plink) != NULL) {
+        if (now - peer->last_seen > REPL_PEER_TIMEOUT) {
+            *plink = peer->next;
+            free(peer);
+        } else {
+            plink = &peer->next;
+        }
+    }
+
+    link = &demand_list;
+    while ((d = *link) != NULL) {
+        d->rate = (d->rate + (double)d->hits / REPL_TICK) / 2;
+        d->hits = 0;
+        if (d->order_until != 0 && now >= d->order_until) {
+            d->order_until = 0;     // the order got lost or the fetch failed
+        }
+
+        replicas = 0;
+        placed = NULL;
+        for (entry = content_list; entry; entry = entry->next) {
+            if (strncmp(entry->content_name, d->content_name, CONTENT_NAME_SIZE) == 0) {
+                replicas++;
+                if (entry->replica) {
+                    placed = entry;
+                }
+            }
+        }
+        want = 1 + (int)(d->rate / REPL_RATE_PER_REPLICA);
+        if (want > REPL_MAX_REPLICAS) {
+            want = REPL_MAX_REPLICAS;
+        }
+
+        if (replicas > 0 && replicas < want && d->order_until == 0) {
+            entry = find_least_used_content(d->content_name);
+            peer = repl_pick_target(entry);
+            if (peer) {
+                repl_send(s, peer, REPL_FETCH, d->content_name, entry);
+                d->order_addr = peer->addr;
+                d->order_until = now + REPL_ORDER_TIMEOUT;
+                printf("Replicate: '%s' at %.1f lookups/s on %d peer(s) -> '%s'\n",
+                       d->content_name, d->rate, replicas, peer->peer_name);
+            }
+        } else if (placed && d->rate < (replicas - 1) * REPL_RATE_PER_REPLICA / 2) {
+            // Not ours to manage any more once the drop is sent
+            placed->replica = 0;
+            standby_log_entry(placed);
+            peer = find_repl_peer(placed->peer_name);
+            if (peer) {
+                repl_send(s, peer, REPL_DROP, d->content_name, NULL);
+                printf("Replica drop: '%s' at %.1f lookups/s on %d peer(s) -> '%s'\n",
+                       d->content_name, d->rate, replicas, peer->peer_name);
+            }
+        }
+
+        if (d->rate < REPL_IDLE_RATE && d->order_until == 0 && placed == NULL) {
+            *link = d->next;
+            free(d);
+        } else {
+            link = &d->next;
+        }
+    }
+}
+
+// Choose the peer to hold another replica of source's item: one with a
+// fresh heartbeat, room in its cache and a free upload slot that doesn't
+// hold the item yet. Fewest active uploads wins, then the most spare room.
+struct repl_peer *repl_pick_target(const struct content_entry *source)
+{
+    struct repl_peer *peer;
+    struct repl_peer *best = NULL;
+    struct content_entry *entry;
+    int holds;
+
+    if (source == NULL) {
+        return NULL;
+    }
+    for (peer = repl_peers; peer; peer = peer->next) {
+        if (peer->spare < source->meta.size || peer->active_uploads >= peer->upload_slots) {
+            continue;
+        }
+        holds = 0;
+        for (entry = content_list; entry && !holds; entry = entry->next) {
+            holds = strncmp(entry->content_name, source->content_name, CONTENT_NAME_SIZE) == 0 &&
+                    strncmp(entry->peer_name, peer->peer_name, PEER_NAME_SIZE) == 0;
+        }
+        if (holds) {
+            continue;
+        }
+        if (best == NULL || peer->active_uploads < best->active_uploads ||
+            (peer->active_uploads == best->active_uploads && peer->spare > best->spare)) {
+            best = peer;
+        }
+    }
+    return best;
+}
+
+// Find a replication peer by name
+struct repl_peer *find_repl_peer(const char *peer_name)
+{
+    struct repl_peer *peer;
+
+    for (peer = repl_peers; peer; peer = peer->next) {
+        if (strncmp(peer->peer_name, peer_name, PEER_NAME_SIZE) == 0) {
+            return peer;
+        }
+    }
+    return NULL;
+}
+
+// Send a replication order. source is where to fetch from, NULL for a drop.
+void repl_send(int s, const struct repl_peer *peer, int action, const char *content_name,
+               const struct content_entry *source)
+{
+    char payload[REPL_SIZE];
+    struct pdu_hdr h;
+    struct pdu_cursor c;
+    struct iovec iov;
+
+    // Format: Action (1 byte) | Content Name (10 bytes) | IP (4 bytes) | Port (2 bytes) | metadata
+    pdu_cursor_init(&c, payload, sizeof(payload));
+    pdu_put_u8(&c, action);
+    pdu_put_name(&c, content_name, CONTENT_NAME_SIZE);
+    if (source) {
+        pdu_put_addr(&c, &source->addr);
+        pdu_put_meta(&c, &source->meta);
+    } else {
+        pdu_put_zero(&c, 6 + CONTENT_META_SIZE);
+    }
+
+    h.type = 'P';
+    h.flags = PDU_FLAG_HDR;
+    h.req_id = 0;
+    iov.iov_base = payload;
+    iov.iov_len = c.pos;
+    if (pdu_sendv(s, &h, &iov, 1, (const struct sockaddr *)&peer->addr, sizeof(peer->addr)) < 0) {
+        fprintf(stderr, "sendto error\n");
+    }
+}
+
+// Free replication peers and demand records
+void free_repl_state(void)
+{
+    struct repl_peer *peer;
+    struct demand *d;
+
+    while ((peer = repl_peers) != NULL) {
+        repl_peers = peer->next;
+        free(peer);
+    }
+    while ((d = demand_list) != NULL) {
+        demand_list = d->next;
+        free(d);
+    }
+}
+
+// Monotonic time in nanoseconds
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Which queue a request type waits in
+int request_class(int type)
+{
+    switch (type) {
+    case 'S':
+    case 'M':
+    case 'H':
+        return CLASS_LOOKUP;
+    case 'R':
+    case 'T':
+    case 'B':
+    case 'U':
+    case 'X':
+        return CLASS_UPDATE;
+    default:
+        return CLASS_LIST;
+    }
+}
+
+// Allocate the class queues
+int queue_init(void)
+{
+    int i;
+
+    for (i = 0; i < QUEUE_CLASSES; i++) {
+        queues[i].slot = (struct queued_req *)malloc(queues[i].cap * sizeof(struct queued_req));
+        if (queues[i].slot == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Is any request waiting?
+int queue_pending(void)
+{
+    int i;
+
+    for (i = 0; i < QUEUE_CLASSES; i++) {
+        if (queues[i].count > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Read the datagrams that have arrived into their class queues, shedding
+// those whose queue is full. With block set, wait (at most the socket's
+// receive timeout) for the first one.
+void queue_drain(int s, int block)
+{
+    char bufs[DRAIN_BATCH][PDU_MAX_DGRAM];
+    struct sockaddr_in addrs[DRAIN_BATCH];
+    struct iovec iov[DRAIN_BATCH];
+    struct mmsghdr msgs[DRAIN_BATCH];
+    struct pdu_hdr h;
+    char *payload;
+    struct req_queue *q;
+    struct queued_req *r;
+    long long now;
+    int n, i, cls, rounds;
+
+    for (rounds = 0; rounds < 8; rounds++) {
+        for (i = 0; i < DRAIN_BATCH; i++) {
+            iov[i].iov_base = bufs[i];
+            iov[i].iov_len = sizeof(bufs[i]);
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        n = recvmmsg(s, msgs, DRAIN_BATCH, block && rounds == 0 ? MSG_WAITFORONE : MSG_DONTWAIT,
+                     NULL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "recvmmsg error\n");
+            }
+            return;
+        }
+
+        now = now_ns();
+        for (i = 0; i < n; i++) {
+            if (pdu_decode(bufs[i], msgs[i].msg_len, &h, &payload) < 0) {
+                continue;
+            }
+            cls = request_class(h.type);
+            q = &queues[cls];
+            if (q->count == q->cap) {
+                q->shed++;
+                send_busy(s, cls, bufs[i], msgs[i].msg_len, &addrs[i], msgs[i].msg_hdr.msg_namelen);
+                continue;
+            }
+            r = &q->slot[(q->head + q->count) % q->cap];
+            memcpy(r->buf, bufs[i], msgs[i].msg_len);
+            r->len = msgs[i].msg_len;
+            r->from = addrs[i];
+            r->alen = msgs[i].msg_hdr.msg_namelen;
+            r->arrived_ns = now;
+            q->count++;
+            if (q->count > q->max_depth) {
+                q->max_depth = q->count;
+            }
+        }
+        if (n < DRAIN_BATCH) {
+            return;
+        }
+    }
+}
+
+// Take the next request from the highest-priority queue that has one.
+// Requests that waited too long get a busy reply instead. The request
+// stays valid until the next queue_drain().
+struct queued_req *queue_pop(int s, int *cls)
+{
+    struct req_queue *q;
+    struct queued_req *r;
+    int i;
+
+    for (i = 0; i < QUEUE_CLASSES; i++) {
+        q = &queues[i];
+        while (q->count > 0) {
+            r = &q->slot[q->head];
+            q->head = (q->head + 1) % q->cap;
+            q->count--;
+            if (q->max_wait_ms > 0 && now_ns() - r->arrived_ns > q->max_wait_ms * 1000000LL) {
+                q->shed++;
+                send_busy(s, i, r->buf, r->len, &r->from, r->alen);
+                continue;
+            }
+            *cls = i;
+            return r;
+        }
+    }
+    return NULL;
+}
+
+// Account for a processed request
+void queue_done(int cls, long long start_ns)
+{
+    struct req_queue *q = &queues[cls];
+    long long elapsed = now_ns() - start_ns;
+
+    q->served++;
+    q->service_ns = q->service_ns ? (q->service_ns * 7 + elapsed) / 8 : elapsed;
+}
+
+// Turn a request away with a hint of when to retry: about twice the time
+// the requests queued at its priority and above will take. Heartbeats
+// aren't answered, so they are just dropped.
+void send_busy(int s, int cls, char *dgram, size_t n, struct sockaddr_in *to, socklen_t alen)
+{
+    struct pdu_hdr h;
+    char *payload;
+    char data[BUSY_SIZE];
+    struct pdu_cursor c;
+    long long backlog_ns = 0;
+    long long ms;
+    int i;
+
+    if (pdu_decode(dgram, n, &h, &payload) < 0 || h.type == 'H') {
+        return;
+    }
+    for (i = 0; i <= cls; i++) {
+        backlog_ns += (long long)queues[i].count * queues[i].service_ns;
+    }
+    ms = backlog_ns * 2 / 1000000;
+    if (ms < BUSY_MIN_MS) {
+        ms = BUSY_MIN_MS;
+    } else if (ms > BUSY_MAX_MS) {
+        ms = BUSY_MAX_MS;
+    }
+
+    pdu_cursor_init(&c, data, sizeof(data));
+    pdu_put_bytes(&c, BUSY_TEXT, sizeof(BUSY_TEXT));
+    pdu_put_u16(&c, ms);
+    send_reply(s, &h, 'E', data, c.pos, to, alen);
+}
+
+// Print queue depths and shed counts now and then while requests are shed
+void queue_report(void)
+{
+    time_t now = time(NULL);
+    int i, shedding = 0;
+
+    if (now < next_queue_report) {
+        return;
+    }
+    next_queue_report = now + QUEUE_REPORT;
+
+    for (i = 0; i < QUEUE_CLASSES; i++) {
+        if (queues[i].shed != queues[i].shed_reported) {
+            shedding = 1;
+        }
+    }
+    if (shedding) {
+        printf("Overload:");
+        for (i = 0; i < QUEUE_CLASSES; i++) {
+            printf(" %s depth %d (max %d/%d) served %lu shed %lu (+%lu)%s", queues[i].name,
+                   queues[i].count, queues[i].max_depth, queues[i].cap, queues[i].served,
+                   queues[i].shed, queues[i].shed - queues[i].shed_reported,
+                   i < QUEUE_CLASSES - 1 ? "," : "\n");
+        }
+    }
+    for (i = 0; i < QUEUE_CLASSES; i++) {
+        queues[i].shed_reported = queues[i].shed;
+        queues[i].max_depth = queues[i].count;
+    }
+}
+
+// Free the class queues
+void free_queues(void)
+{
+    int i;
+
+    for (i = 0; i < QUEUE_CLASSES; i++) {
+        free(queues[i].slot);
+        queues[i].slot = NULL;
+    }
+}
+
+// Parse host:port into addr. Returns 0, or -1 if it can't be resolved.
+int parse_host_port(const char *arg, struct sockaddr_in *addr)
+{
+    char host[BUFLEN];
+    const char *colon;
+    struct hostent *hp;
+
+    colon = strrchr(arg, ':');
+    if (!colon || colon == arg || (size_t)(colon - arg) >= sizeof(host) || atoi(colon + 1) <= 0) {
+        return -1;
+    }
+    memcpy(host, arg, colon - arg);
+    host[colon - arg] = '\0';
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(atoi(colon + 1));
+    hp = gethostbyname(host);
+    if (hp != NULL) {
+        memcpy(&addr->sin_addr, hp->h_addr, hp->h_length);
+    } else if ((addr->sin_addr.s_addr = inet_addr(host)) == INADDR_NONE) {
+        return -1;
+    }
+    return 0;
+}
+
+// TCP socket a standby accepts the primary's stream on
+int standby_listen_on(int port)
+{
+    struct sockaddr_in sin;
+    int sock;
+    int on = 1;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = INADDR_ANY;
+    sin.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(sock, 4) < 0) {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    return sock;
+}
+
+// Wait for a datagram on s or traffic on the replication sockets, at most
+// a keepalive interval with block set, and handle the latter
+void standby_poll(int s, int block)
+{
+    struct pollfd pfds[4];
+    int n = 0;
+    int i;
+
+    pfds[n].fd = s;
+    pfds[n].events = POLLIN;
+    n++;
+    if (standby_listen >= 0) {
+        pfds[n].fd = standby_listen;
+        pfds[n].events = POLLIN;
+        n++;
+    }
+    if (standby_sock >= 0) {
+        pfds[n].fd = standby_sock;
+        pfds[n].events = POLLIN | (standby_out_len ? POLLOUT : 0);
+        n++;
+    }
+    if (standby_conn >= 0) {
+        pfds[n].fd = standby_conn;
+        pfds[n].events = POLLOUT;
+        n++;
+    }
+
+    if (poll(pfds, n, block ? STANDBY_KEEPALIVE_MS : 0) > 0) {
+        for (i = 1; i < n; i++) {
+            if (!pfds[i].revents) {
+                continue;
+            }
+            if (pfds[i].fd == standby_listen) {
+                standby_accept();
+                continue;
+            }
+            if (pfds[i].fd == standby_conn) {
+                standby_connected();
+                continue;
+            }
+            if ((pfds[i].revents & POLLOUT) && standby_sock == pfds[i].fd) {
+                standby_flush();
+            }
+            if ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) && standby_sock == pfds[i].fd) {
+                standby_read();
+            }
+        }
+    }
+    standby_tick();
+}
+
+// Timers of either side: a primary (re)connects to its standby and keeps
+// the stream alive, a standby takes over once the primary falls silent
+void standby_tick(void)
+{
+    long long now = now_ns();
+
+    if (!standby_passive) {
+        if (standby_conn >= 0 && now - standby_conn_ns > STANDBY_CONNECT_MS * 1000000LL) {
+            close(standby_conn);
+            standby_conn = -1;
+            if (!standby_warned) {
+                printf("Standby at %s:%d not reachable, retrying\n",
+                       inet_ntoa(standby_addr.sin_addr), ntohs(standby_addr.sin_port));
+                standby_warned = 1;
+            }
+        }
+        if (standby_target && standby_sock < 0 && standby_conn < 0 &&
+            time(NULL) >= standby_retry_at) {
+            standby_connect();
+        }
+        if (standby_sock >= 0 && now - standby_last_ns > STANDBY_KEEPALIVE_MS * 1000000LL) {
+            standby_record('H', NULL, 0);
+            standby_flush();
+        }
+    } else if (standby_sock >= 0 && standby_synced &&
+               now - standby_last_ns > STANDBY_TIMEOUT_MS * 1000000LL) {
+        standby_close();
+        standby_promote("the primary went silent");
+    }
+}
+
+// Start connecting to the standby without waiting; standby_poll() finishes
+// the connect once the socket is writable, and standby_tick() gives up on
+// it after STANDBY_CONNECT_MS
+void standby_connect(void)
+{
+    int sock;
+
+    standby_retry_at = time(NULL) + STANDBY_RETRY;
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return;
+    }
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    if (connect(sock, (struct sockaddr *)&standby_addr, sizeof(standby_addr)) < 0 &&
+        errno != EINPROGRESS) {
+        if (!standby_warned) {
+            printf("Standby at %s:%d not reachable, retrying\n",
+                   inet_ntoa(standby_addr.sin_addr), ntohs(standby_addr.sin_port));
+            standby_warned = 1;
+        }
+        close(sock);
+        return;
+    }
+    standby_conn = sock;
+    standby_conn_ns = now_ns();
+}
+
+// The connect to the standby finished: queue a snapshot of the registry,
+// which the records of later changes follow on the same stream
+void standby_connected(void)
+{
+    int sock = standby_conn;
+    int err = 0;
+    int on = 1;
+    socklen_t len = sizeof(err);
+
+    standby_conn = -1;
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        if (!standby_warned) {
+            printf("Standby at %s:%d not reachable, retrying\n",
+                   inet_ntoa(standby_addr.sin_addr), ntohs(standby_addr.sin_port));
+            standby_warned = 1;
+        }
+        close(sock);
+        return;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    standby_sock = sock;
+    standby_warned = 0;
+    standby_seq = 0;
+    standby_in_len = 0;
+    standby_snapshot();
+    standby_flush();
+    if (standby_sock >= 0) {
+        printf("Streaming the registry to the standby at %s:%d (%d entries)\n",
+               inet_ntoa(standby_addr.sin_addr), ntohs(standby_addr.sin_port), count_entries());
+    }
+}
+
+// Queue the whole registry, oldest entry first so the standby's list ends
+// up in the same order
+void standby_snapshot(void)
+{
+    struct content_entry *e;
+
+    standby_record('Y', NULL, 0);
+    for (e = content_list; e && e->next; e = e->next) {
+    }
+    while (e) {
+        standby_log_entry(e);
+        e = e->pprev == &content_list ? NULL :
+            (struct content_entry *)((char *)e->pprev - offsetof(struct content_entry, next));
+    }
+    standby_record('Z', NULL, 0);
+}
+
+// Append a record to the stream's buffer. A standby that falls too far
+// behind is dropped; it gets a fresh snapshot when it is reconnected.
+void standby_record(int type, const char *payload, size_t len)
+{
+    size_t need;
+    size_t cap;
+    char *grown;
+
+    if (standby_sock < 0 || standby_passive) {
+        return;
+    }
+    need = standby_out_len + PDU_HDR_SIZE + len;
+    if (need > standby_out_cap) {
+        cap = standby_out_cap ? standby_out_cap : STANDBY_IN_SIZE;
+        while (cap < need) {
+            cap *= 2;
+        }
+        grown = cap <= STANDBY_MAX_BACKLOG ? (char *)realloc(standby_out, cap) : NULL;
+        if (!grown) {
+            printf("Standby can't keep up, dropping its stream\n");
+            standby_close();
+            return;
+        }
+        standby_out = grown;
+        standby_out_cap = cap;
+    }
+    pdu_put_hdr(standby_out + standby_out_len, type, 0, len, standby_seq++);
+    if (len > 0) {
+        memcpy(standby_out + standby_out_len + PDU_HDR_SIZE, payload, len);
+    }
+    standby_out_len = need;
+    if (type != 'U' && type != 'H') {
+        standby_dirty = 1;
+    }
+}
+
+// Stream an entry's full state; the standby adds it or overwrites its copy
+void standby_log_entry(const struct content_entry *e)
+{
+    char rec[STANDBY_ENTRY_SIZE];
+    struct pdu_cursor c;
+
+    if (standby_sock < 0 || standby_passive) {
+        return;
+    }
+
+    // Format: Peer Name | Content Name | IP | Port | metadata | Usage (4 bytes) | Flags (1 byte)
+    pdu_cursor_init(&c, rec, sizeof(rec));
+    pdu_put_name(&c, e->peer_name, PEER_NAME_SIZE);
+    pdu_put_name(&c, e->content_name, CONTENT_NAME_SIZE);
+    pdu_put_addr(&c, &e->addr);
+    pdu_put_meta(&c, &e->meta);
+    pdu_put_u32(&c, e->usage_count);
+    pdu_put_u8(&c, e->replica ? STANDBY_REPLICA : 0);
+    standby_record('R', rec, c.pos);
+}
+
+void standby_log_remove(const char *peer_name, const char *content_name)
+{
+    char rec[PEER_NAME_SIZE + CONTENT_NAME_SIZE];
+    struct pdu_cursor c;
+
+    if (standby_sock < 0 || standby_passive) {
+        return;
+    }
+
+    // Format: Peer Name (10 bytes) | Content Name (10 bytes)
+    pdu_cursor_init(&c, rec, sizeof(rec));
+    pdu_put_name(&c, peer_name, PEER_NAME_SIZE);
+    pdu_put_name(&c, content_name, CONTENT_NAME_SIZE);
+    standby_record('T', rec, c.pos);
+}
+
+// Usage counts steer the choice among replicas, so the standby tracks them
+// too; they ride along with the next batch rather than forcing a write
+void standby_log_usage(const struct content_entry *e)
+{
+    char rec[PEER_NAME_SIZE + CONTENT_NAME_SIZE + 4];
+    struct pdu_cursor c;
+
+    if (standby_sock < 0 || standby_passive) {
+        return;
+    }
+
+    // Format: Peer Name (10 bytes) | Content Name (10 bytes) | Usage (4 bytes)
+    pdu_cursor_init(&c, rec, sizeof(rec));
+    pdu_put_name(&c, e->peer_name, PEER_NAME_SIZE);
+    pdu_put_name(&c, e->content_name, CONTENT_NAME_SIZE);
+    pdu_put_u32(&c, e->usage_count);
+    standby_record('U', rec, c.pos);
+}
+
+// Hand buffered records to the kernel without blocking. Once there, they
+// reach the standby even if this process dies right after.
+void standby_flush(void)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < standby_out_len) {
+        n = send(standby_sock, standby_out + off, standby_out_len - off,
+                 MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            printf("Lost the stream to the standby\n");
+            standby_close();
+            return;
+        }
+        off += n;
+    }
+    if (off > 0) {
+        memmove(standby_out, standby_out + off, standby_out_len - off);
+        standby_out_len -= off;
+        standby_last_ns = now_ns();
+    }
+    if (standby_out_len == 0) {
+        standby_dirty = 0;
+    }
+}
+
+// Flush the stream before a reply that depends on it, waiting up to
+// STANDBY_SYNC_MS for the standby to make room. Returns 0 once every
+// record is with the kernel (or there is no stream any more), -1 if some
+// are still waiting.
+int standby_sync(void)
+{
+    struct pollfd pfd;
+    long long deadline = now_ns() + STANDBY_SYNC_MS * 1000000LL;
+    long long left;
+
+    standby_flush();
+    while (standby_sock >= 0 && standby_out_len > 0) {
+        left = deadline - now_ns();
+        if (left <= 0) {
+            return -1;
+        }
+        pfd.fd = standby_sock;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, (int)((left + 999999) / 1000000)) < 0 && errno != EINTR) {
+            return -1;
+        }
+        standby_flush();
+    }
+    return 0;
+}
+
+// Accept a primary's stream. One that took over answers with a 'P' record
+// instead, so an old primary coming back stops serving.
+void standby_accept(void)
+{
+    struct sockaddr_in from;
+    socklen_t alen = sizeof(from);
+    char rec[PDU_HDR_SIZE];
+    int sock;
+
+    sock = accept(standby_listen, (struct sockaddr *)&from, &alen);
+    if (sock < 0) {
+        return;
+    }
+    if (!standby_passive) {
+        pdu_put_hdr(rec, 'P', 0, 0, 0);
+        send(sock, rec, sizeof(rec), MSG_NOSIGNAL);
+        close(sock);
+        printf("Fenced off the old primary at %s: serving as primary\n", inet_ntoa(from.sin_addr));
+        return;
+    }
+
+    // A newer primary replaces the one followed so far
+    standby_close();
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    standby_sock = sock;
+    standby_seq = 0;
+    standby_last_ns = now_ns();
+    printf("Following the primary at %s:%d\n", inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+}
+
+// Read the stream. A standby applies the primary's records and takes over
+// when the stream ends after a complete snapshot; a primary only expects
+// to be fenced off.
+void standby_read(void)
+{
+    struct pdu_hdr h;
+    size_t off = 0;
+    ssize_t n;
+    int synced;
+
+    n = recv(standby_sock, standby_in + standby_in_len, sizeof(standby_in) - standby_in_len,
+             MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0) {
+        synced = standby_synced;
+        standby_close();
+        if (!standby_passive) {
+            printf("Lost the stream to the standby\n");
+        } else if (synced) {
+            standby_promote("the primary closed the stream");
+        } else {
+            printf("The primary's stream ended before a complete snapshot\n");
+        }
+        return;
+    }
+    standby_in_len += n;
+    standby_last_ns = now_ns();
+
+    while (standby_in_len - off >= PDU_HDR_SIZE) {
+        pdu_get_hdr(standby_in + off, &h);
+        if (standby_in_len - off < PDU_HDR_SIZE + h.len) {
+            break;
+        }
+        if (!standby_passive) {
+            if (h.type == 'P') {
+                printf("The standby has taken over: no longer serving peers\n");
+                standby_close();
+                standby_passive = 1;
+                standby_target = 0;
+                return;
+            }
+        } else if (standby_apply(&h, standby_in + off + PDU_HDR_SIZE) < 0) {
+            // Drop the stream; the primary reconnects with a fresh snapshot
+            printf("Replication stream out of sequence, waiting for a new snapshot\n");
+            standby_close();
+            return;
+        }
+        off += PDU_HDR_SIZE + h.len;
+    }
+    memmove(standby_in, standby_in + off, standby_in_len - off);
+    standby_in_len -= off;
+}
+
+// Apply one record of the primary's stream. Returns 0, or -1 if it is out
+// of sequence or malformed.
+int standby_apply(const struct pdu_hdr *h, char *payload)
+{
+    char peer_name[PEER_NAME_SIZE + 1];
+    char content_name[CONTENT_NAME_SIZE + 1];
+    struct sockaddr_in addr;
+    struct content_meta meta;
+    struct content_entry *e;
+    struct pdu_cursor c;
+    uint32_t usage;
+    int flags;
+
+    if (h->req_id != standby_seq) {
+        return -1;
+    }
+    standby_seq++;
+    pdu_cursor_init(&c, payload, h->len);
+
+    switch (h->type) {
+    case 'Y':
+        free_content_list();
+        standby_synced = 0;
+        break;
+    case 'Z':
+        standby_synced = 1;
+        printf("Standby in sync: %d entries\n", count_entries());
+        break;
+    case 'R':
+        pdu_get_name(&c, peer_name, PEER_NAME_SIZE);
+        pdu_get_name(&c, content_name, CONTENT_NAME_SIZE);
+        pdu_get_addr(&c, &addr);
+        pdu_get_meta(&c, &meta);
+        usage = pdu_get_u32(&c);
+        flags = pdu_get_u8(&c);
+        if (c.err) {
+            return -1;
+        }
+        e = find_peer_content(peer_name, content_name);
+        if (!e) {
+            e = add_content(peer_name, content_name, &addr, &meta);
+            if (!e) {
+                return -1;
+            }
+        }
+        e->addr = addr;
+        e->meta = meta;
+        e->usage_count = usage;
+        e->replica = (flags & STANDBY_REPLICA) != 0;
+        break;
+    case 'T':
+        pdu_get_name(&c, peer_name, PEER_NAME_SIZE);
+        pdu_get_name(&c, content_name, CONTENT_NAME_SIZE);
+        if (c.err) {
+            return -1;
+        }
+        remove_content(peer_name, content_name);
+        break;
+    case 'U':
+        pdu_get_name(&c, peer_name, PEER_NAME_SIZE);
+        pdu_get_name(&c, content_name, CONTENT_NAME_SIZE);
+        usage = pdu_get_u32(&c);
+        if (c.err) {
+            return -1;
+        }
+        e = find_peer_content(peer_name, content_name);
+        if (e) {
+            e->usage_count = usage;
+        }
+        break;
+    case 'H':
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+// Close the replication stream, dropping whatever wasn't written
+void standby_close(void)
+{
+    if (standby_sock >= 0) {
+        close(standby_sock);
+        standby_sock = -1;
+    }
+    if (standby_conn >= 0) {
+        close(standby_conn);
+        standby_conn = -1;
+    }
+    standby_out_len = 0;
+    standby_in_len = 0;
+    standby_dirty = 0;
+    standby_synced = 0;
+}
+
+// Start serving peers with the registry followed so far, and stream it on
+// to our own standby if one was given
+void standby_promote(const char *why)
+{
+    standby_passive = 0;
+    standby_retry_at = 0;
+    printf("Taking over as primary (%s) with %d entries\n", why, count_entries());
+}
+
+// Number of registered entries
+int count_entries(void)
+{
+    struct content_entry *e;
+    int n = 0;
+
+    for (e = content_list; e; e = e->next) {
+        n++;
+    }
+    return n;
+}
@@ -0,0 +1,137 @@
+#include <string.h>
+#include <stdint.h>
+#include "lz.h"
+
+#define LZ_HLOG     13
+#define LZ_HSIZE    (1 << LZ_HLOG)
+#define LZ_MAX_LIT  (1 << 5)
+#define LZ_MAX_OFF  (1 << 13)
+#define LZ_MAX_REF  ((1 << 8) + (1 << 3))   // longest back-reference (264)
+
+// Hash of the 3 bytes at p
+#define LZ_HASH(p) ((((uint32_t)(p)[0] << 16 | (uint32_t)(p)[1] << 8 | (p)[2]) \
+                     * 2654435761u) >> (32 - LZ_HLOG))
+
+size_t lz_compress(const void *in_data, size_t in_len, void *out_data, size_t out_size)
+{
+    const unsigned char *in = (const unsigned char *)in_data;
+    unsigned char *out = (unsigned char *)out_data;
+    uint32_t htab[LZ_HSIZE];  // last position + 1 seen for each hash, 0 if none
+    size_t ip = 0;
+    size_t op = 1;            // out[0] is the control byte of the first literal run
+    size_t lit = 0;
+
+    if (in_len == 0 || out_size < 2) {
+        return 0;
+    }
+    memset(htab, 0, sizeof(htab));
+
+    while (ip < in_len) {
+        if (ip + 2 < in_len) {
+            uint32_t h = LZ_HASH(in + ip);
+            size_t ref = htab[h];
+            htab[h] = (uint32_t)(ip + 1);
+
+            if (ref > 0 && ip - ref < LZ_MAX_OFF &&
+                in[ref - 1] == in[ip] && in[ref] == in[ip + 1] &&
+                in[ref + 1] == in[ip + 2]) {
+                size_t r = ref - 1;
+                size_t off = ip - r - 1;
+                size_t maxlen = in_len - ip;
+                size_t len = 3;
+
+                if (maxlen > LZ_MAX_REF) {
+                    maxlen = LZ_MAX_REF;
+                }
+                while (len < maxlen && in[r + len] == in[ip + len]) {
+                    len++;
+                }
+
+                // Close the current literal run, or drop its unused control byte
+                if (lit > 0) {
+                    out[op - lit - 1] = (unsigned char)(lit - 1);
+                } else {
+                    op--;
+                }
+                if (op + 4 > out_size) {
+                    return 0;
+                }
+                len -= 2;
+                if (len < 7) {
+                    out[op++] = (unsigned char)((len << 5) | (off >> 8));
+                } else {
+                    out[op++] = (unsigned char)((7 << 5) | (off >> 8));
+                    out[op++] = (unsigned char)(len - 7);
+                }
+                out[op++] = (unsigned char)(off & 0xff);
+                op++;     // control byte of the next literal run
+                lit = 0;
+
+                ip += len + 2;
+                continue;
+            }
+        }
+
+        if (op >= out_size) {
+            return 0;
+        }
+        out[op++] = in[ip++];
+        if (++lit == LZ_MAX_LIT) {
+            out[op - lit - 1] = (unsigned char)(lit - 1);
+            lit = 0;
+            op++;
+        }
+    }
+
+    if (lit > 0) {
+        out[op - lit - 1] = (unsigned char)(lit - 1);
+    } else {
+        op--;
+    }
+    return op <= out_size ? op : 0;
+}
+
+size_t lz_decompress(const void *in_data, size_t in_len, void *out_data, size_t out_size)
+{
+    const unsigned char *in = (const unsigned char *)in_data;
+    unsigned char *out = (unsigned char *)out_data;
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < in_len) {
+        unsigned int ctrl = in[ip++];
+
+        if (ctrl < LZ_MAX_LIT) {
+            size_t run = ctrl + 1;
+            if (ip + run > in_len || op + run > out_size) {
+                return 0;
+            }
+            memcpy(out + op, in + ip, run);
+            ip += run;
+            op += run;
+        } else {
+            size_t len = ctrl >> 5;
+            size_t dist = (size_t)(ctrl & 0x1f) << 8;
+
+            if (len == 7) {
+                if (ip >= in_len) {
+                    return 0;
+                }
+                len += in[ip++];
+            }
+            if (ip >= in_len) {
+                return 0;
+            }
+            dist += in[ip++];
+            len += 2;
+            if (dist + 1 > op || op + len > out_size) {
+                return 0;
+            }
+            // Byte-wise copy: source and destination may overlap
+            for (; len > 0; len--, op++) {
+                out[op] = out[op - dist - 1];
+            }
+        }
+    }
+    return op;
+}
@@ -0,0 +1,25 @@
+/* Built-in LZ77 codec (LZF-style byte format) used to compress content
+ * chunks in transit. No external library is needed on either side.
+ *
+ * Compressed stream is a sequence of:
+ *   000LLLLL <L+1 literal bytes>              literal run of 1..32 bytes
+ *   LLLooooo oooooooo                         back-reference, length L+2
+ *   111ooooo LLLLLLLL oooooooo                back-reference, length L+9
+ * where the 13-bit o is the distance back from the current position minus 1.
+ */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/* Compress in_len bytes into out. Returns the compressed size, or 0 if the
+ * result would not fit in out_size bytes (i.e. the data is incompressible
+ * when out_size < in_len). */
+size_t lz_compress(const void *in, size_t in_len, void *out, size_t out_size);
+
+/* Decompress in_len bytes into out. Returns the decompressed size, or 0 if
+ * the input is malformed or would overflow out_size bytes. */
+size_t lz_decompress(const void *in, size_t in_len, void *out, size_t out_size);
+
+#endif
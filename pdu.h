@@ -2,9 +2,17 @@
  * R - Content Registration (Peer -> Index Server)
  * D - Content Download Request (Client -> Content Server)
  * S - Search for content and server (Peer <-> Index Server)
+ * M - Search for several contents at once (Peer <-> Index Server)
  * T - Content De-Registration (Peer -> Index Server)
  * C - Content Data (Content Server -> Content Client)
  * O - List of Online Registered Content (Peer <-> Index Server)
+ * U - Subscribe to new registrations of a content name or prefix (Peer -> Index Server)
+ * N - Notification of a new registration (Index Server -> Peer)
+ * H - Capacity heartbeat of a peer taking part in replication (Peer -> Index Server)
+ * P - Replication order: fetch or drop a replica (Index Server -> Peer)
+ * X - Failure report about a content server (Peer -> Index Server)
+ * B - Batch of registrations and de-registrations (Peer <-> Index Server)
+ * G - Small item request over UDP (Client -> Content Server)
  * A - Acknowledgement (Index Server -> Peer)
  * E - Error (Between Peers or Peer <-> Index Server)
  */
@@ -16,24 +24,214 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <stdint.h>
+#include <time.h>
 
 #define MAX_DATA_SIZE 100
 #define PEER_NAME_SIZE 10
 #define CONTENT_NAME_SIZE 10
 
+/* Download request (XFER_REQ_TYPE PDU):
+ *   Content Name (10 bytes) | Options (1 byte) | Request ID (4 bytes, network order)
+ * The type byte is 'D' with the PDU_FLAG_HDR bit set. Peers predating
+ * transfer options send a plain 'D' PDU with the content name alone, one per
+ * connection, and are answered in the old PDU stream. A server that predates
+ * XFER_REQ_TYPE answers it with an old-style 'E' PDU, "Invalid download
+ * request"; the client then asks again with a plain 'D' on a new connection.
+ * A server that accepts any of the options answers with an 'A' PDU holding
+ * the accepted options, and the content then follows as framed chunks:
+ *   type ('C', 'F' or 'E') | flags (1 byte) | length (2 bytes) | Request ID (4 bytes) | payload
+ * with multi-byte fields in network order.
+ * 'F' and 'E' end the response. Chunks with CHUNK_COMPRESSED set hold
+ * lz_compress() output of at most XFER_CHUNK_SIZE raw bytes. With
+ * XFER_OPT_KEEPALIVE the connection stays open for further requests, which
+ * may be pipelined; responses come back in request order.
+ */
+#define XFER_OPT_LZ        0x01
+#define XFER_OPT_KEEPALIVE 0x02
+#define XFER_OPT_DELTA     0x04
+#define XFER_REQ_TYPE    ('D' | 0x80)
+#define XFER_REQ_SIZE    (1 + CONTENT_NAME_SIZE + 1 + 4)
+#define CHUNK_HDR_SIZE   8
+#define CHUNK_COMPRESSED 0x01
+#define XFER_CHUNK_SIZE  16384
+
+/* Delta download: with XFER_OPT_DELTA the request is followed by the chunk
+ * manifest of the client's old copy of the item, cut with cdc_cut():
+ *   Count (4 bytes) | [Length (4 bytes) | Hash (8 bytes, FNV-1a 64)] x Count
+ * A server that accepts the option sends the current content as usual, but
+ * may replace runs of chunks the client already holds with 'K' chunks:
+ *   First (4 bytes) | Count (4 bytes)
+ * meaning Count consecutive chunks of the client's manifest starting at
+ * index First. A server that doesn't acknowledge the option has read the
+ * manifest as a further request, so the connection can't be reused.
+ */
+#define DELTA_ENTRY_SIZE  (4 + 8)
+#define DELTA_MAX_CHUNKS  (1 << 20)
+#define DELTA_REF_SIZE    8
+
+/* Small-item fast path: a peer also reads datagrams on the UDP port with the
+ * number of its TCP download port. A 'G' PDU (with PDU_FLAG_HDR) asks for a
+ * whole item:
+ *   Content Name (10 bytes) | Wanted (4 bytes, bit i asks for segment i) |
+ *   Cookie (8 bytes, 0 if none) | padding
+ * If the item fits the server's size limit, every wanted segment comes back
+ * as a 'C' PDU carrying the request's id:
+ *   Segment (1 byte) | Segments (1 byte) | metadata (24 bytes) | data
+ * Segment i holds bytes i * FAST_SEGMENT_SIZE up to the next segment's
+ * start. Otherwise the server answers with an 'E' PDU and the client uses
+ * TCP. Lost segments are asked for again with only their bits set.
+ *
+ * Unless the request carries the cookie the server issued to its address,
+ * the answer is at most three times the request's size: first a 'V' PDU
+ *   Cookie (8 bytes) | Sent (4 bytes, the segments that follow)
+ * then only those segments. The client keeps the cookie and asks for the
+ * rest with it. A request without a cookie is padded to FAST_REQ_PAD bytes
+ * (header included) so that its first answer can hold a few segments.
+ */
+#define FAST_SEGMENT_SIZE 1200
+#define FAST_MAX_SEGMENTS 32
+#define FAST_REQ_SIZE     (CONTENT_NAME_SIZE + 4 + 8)
+#define FAST_REQ_PAD      1200
+#define FAST_HDR_SIZE     (1 + 1 + CONTENT_META_SIZE)
+
+/* Content metadata, appended to 'R' PDUs and 'S' replies (network order):
+ * Size (8 bytes) | Version (8 bytes, file mtime) | Hash (8 bytes, FNV-1a 64)
+ * All zero when the registering peer didn't supply it.
+ */
+#define CONTENT_META_SIZE 24
+#define CONTENT_HASH_INIT 0xcbf29ce484222325ULL
+#define CONTENT_HASH_PRIME 0x100000001b3ULL
+
+struct content_meta {
+    uint64_t size;
+    uint64_t version;
+    uint64_t hash;
+};
+
 /* PDU structure */
 struct pdu {
     char type;              
     char data[MAX_DATA_SIZE];
 };
 
+/* Multi-name lookup ('M' PDU), larger than a regular PDU. Request:
+ *   Count (1 byte) | Content Name (10 bytes) x Count
+ * Reply, one result per requested name in request order:
+ *   Count (1 byte) | [Status (1 byte, 'S' found / 'E' not found) | IP (4 bytes)
+ *   | Port (2 bytes) | metadata (24 bytes)] x Count
+ */
+#define LOOKUP_BATCH_MAX   40
+#define LOOKUP_RESULT_SIZE (1 + 6 + CONTENT_META_SIZE)
+#define LOOKUP_DATA_SIZE   (1 + LOOKUP_BATCH_MAX * LOOKUP_RESULT_SIZE)
+
+struct lookup_pdu {
+    char type;
+    char data[LOOKUP_DATA_SIZE];
+};
+
+/* Subscription ('U' PDU):
+ *   Lease (2 bytes, seconds, 0 cancels) | Flags (1 byte) | Content Name or prefix (10 bytes)
+ * Answered with an 'A' PDU holding the granted lease (2 bytes) and the
+ * number of matching items already registered (2 bytes), or an 'E' PDU.
+ * Until the lease runs out, every new registration of a matching item is
+ * pushed to the subscriber as an 'N' PDU with request id 0:
+ *   Content Name (10 bytes) | IP (4 bytes) | Port (2 bytes) | metadata (24 bytes)
+ */
+#define SUB_PREFIX   0x01   // match every name starting with the given one
+#define SUB_REQ_SIZE (2 + 1 + CONTENT_NAME_SIZE)
+#define NOTIFY_SIZE  (CONTENT_NAME_SIZE + 6 + CONTENT_META_SIZE)
+
+/* Capacity heartbeat ('H' PDU), sent every few seconds by peers that take
+ * part in replication; not answered:
+ *   Peer Name (10 bytes) | Flags (1 byte) | Active uploads (2 bytes)
+ *   | Upload slots (2 bytes) | Spare cache (8 bytes)
+ * Without HB_REPLICATE the index server forgets the peer.
+ *
+ * Replication order ('P' PDU), index server to peer, request id 0:
+ *   Action (1 byte) | Content Name (10 bytes) | IP (4 bytes) | Port (2 bytes) | metadata (24 bytes)
+ * REPL_FETCH asks the peer to download the item from the given server and
+ * register it; REPL_DROP to deregister and delete a replica it was asked to
+ * fetch earlier (address and metadata are zero).
+ */
+#define HB_REPLICATE  0x01
+#define HB_SIZE       (PEER_NAME_SIZE + 1 + 2 + 2 + 8)
+#define REPL_FETCH    'F'
+#define REPL_DROP     'D'
+#define REPL_SIZE     (1 + CONTENT_NAME_SIZE + 6 + CONTENT_META_SIZE)
+
+/* Batch registration ('B' PDU):
+ *   Peer Name (10 bytes) | Count (1 byte) | [Op (1 byte) | Content Name (10 bytes)
+ *   | IP (4 bytes) | Port (2 bytes) | metadata (24 bytes)] x Count
+ * REG_ADD registers an item, or updates the address and metadata of one the
+ * peer registered before; REG_REMOVE deregisters it (address and metadata
+ * are zero). Answered with an 'A' PDU:
+ *   Count (1 byte) | Status (1 byte, 'A' done / 'E' failed) x Count
+ */
+#define REG_ADD        'R'
+#define REG_REMOVE     'T'
+#define REG_BATCH_MAX  30
+#define REG_ITEM_SIZE  (1 + CONTENT_NAME_SIZE + 6 + CONTENT_META_SIZE)
+#define REG_BATCH_SIZE (PEER_NAME_SIZE + 1 + REG_BATCH_MAX * REG_ITEM_SIZE)
+
+/* Failure report ('X' PDU), sent by a peer that couldn't fetch an item from
+ * the server a lookup returned; not answered:
+ *   Reason (1 byte) | Content Name (10 bytes) | IP (4 bytes) | Port (2 bytes)
+ * FAIL_CONNECT counts against every item the server at IP:Port holds,
+ * FAIL_TRANSFER only against the named one.
+ *
+ * A search ('S' PDU) may append Count (1 byte), the number of candidates
+ * wanted (at most SEARCH_MAX_CANDIDATES). The reply then holds up to Count
+ * servers, best first, each as IP (4 bytes) | Port (2 bytes) | metadata.
+ */
+#define FAIL_CONNECT  'C'
+#define FAIL_TRANSFER 'T'
+#define FAIL_REPORT_SIZE (1 + CONTENT_NAME_SIZE + 6)
+#define SEARCH_MAX_CANDIDATES 4
+#define SEARCH_RESULT_SIZE (6 + CONTENT_META_SIZE)
+
+/* Busy reply: an 'E' PDU the index server sends instead of processing a
+ * request it has no room to queue:
+ *   BUSY_TEXT (NUL-terminated) | Retry after (2 bytes, milliseconds)
+ * Peers that don't know the hint just print the text.
+ */
+#define BUSY_TEXT     "Server busy, retry later"
+#define BUSY_SIZE     (sizeof(BUSY_TEXT) + 2)
+
+/* Hot standby: a primary index server streams its registry over TCP to a
+ * standby. Every record has a PDU header whose request id field holds the
+ * record's sequence number, consecutive from the snapshot start:
+ *   'Y' snapshot start: the standby clears its registry (no payload)
+ *   'Z' snapshot end: the standby now holds the whole registry
+ *   'R' entry: Peer Name (10 bytes) | Content Name (10 bytes) | IP (4 bytes)
+ *       | Port (2 bytes) | metadata (24 bytes) | Usage (4 bytes) | Flags (1 byte)
+ *   'T' removal: Peer Name (10 bytes) | Content Name (10 bytes)
+ *   'U' usage: Peer Name (10 bytes) | Content Name (10 bytes) | Usage (4 bytes)
+ *   'H' keepalive, sent while there is nothing else to send
+ * A standby that has taken over answers a connecting primary with a single
+ * 'P' record and closes, and the primary stops serving. Until it takes over,
+ * a standby answers peers with an 'E' PDU holding STANDBY_TEXT, and peers
+ * that know the other server's address switch to it.
+ */
+#define STANDBY_REPLICA  0x01
+#define STANDBY_ENTRY_SIZE (PEER_NAME_SIZE + CONTENT_NAME_SIZE + 6 + CONTENT_META_SIZE + 4 + 1)
+#define STANDBY_TEXT     "Standby index server, not serving"
+
 /* Content registration entry structure */
 struct content_entry {
     char peer_name[PEER_NAME_SIZE + 1];
     char content_name[CONTENT_NAME_SIZE + 1];
     struct sockaddr_in addr;
+    struct content_meta meta;
     int usage_count;        
+    int replica;            // placed by the index server, dropped again when demand cools
+    double fail_score;      // reported failures, decayed over time
+    time_t fail_at;         // when fail_score was last updated
+    time_t open_until;      // circuit open (not handed out) until then; 0 = closed
+    int trips;              // times the circuit opened since it last closed
     struct content_entry *next;
+    struct content_entry **pprev;     // link pointing at this entry, for unlinking in place
+    struct content_entry *hash_next;  // chain in the index server's (peer, name) table
 };
 
 
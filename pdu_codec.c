@@ -0,0 +1,217 @@
+#include <errno.h>
+#include "pdu_codec.h"
+
+// Fill in a PDU header
+void pdu_put_hdr(char *buf, int type, int flags, size_t len, uint32_t req_id)
+{
+    uint32_t id = htonl(req_id);
+
+    buf[0] = (char)type;
+    buf[1] = (char)flags;
+    buf[2] = (char)(len >> 8);
+    buf[3] = (char)(len & 0xff);
+    memcpy(buf + 4, &id, 4);
+}
+
+// Read a PDU header
+void pdu_get_hdr(const char *buf, struct pdu_hdr *h)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    uint32_t id;
+
+    h->type = p[0];
+    h->flags = p[1];
+    h->len = ((size_t)p[2] << 8) | p[3];
+    memcpy(&id, p + 4, 4);
+    h->req_id = ntohl(id);
+}
+
+// Split a datagram into header and payload. Only a datagram that claims a
+// header and whose length field accounts for exactly the rest of it is
+// parsed as one; anything else is the older type-byte format.
+int pdu_decode(char *dgram, size_t n, struct pdu_hdr *h, char **payload)
+{
+    if (n == 0) {
+        return -1;
+    }
+    if (n >= PDU_HDR_SIZE && (dgram[1] & PDU_FLAG_HDR)) {
+        pdu_get_hdr(dgram, h);
+        if (h->len == n - PDU_HDR_SIZE) {
+            *payload = dgram + PDU_HDR_SIZE;
+            return 0;
+        }
+    }
+    h->type = (unsigned char)dgram[0];
+    h->flags = 0;
+    h->len = n - 1;
+    h->req_id = 0;
+    *payload = dgram + 1;
+    return 0;
+}
+
+// Copy the rest of the payload out as a string, stopping at an embedded NUL
+void pdu_get_text(struct pdu_cursor *c, char *text, size_t size)
+{
+    size_t len = pdu_remaining(c);
+    const char *p = pdu_cursor_take(c, len);
+    const char *nul;
+
+    if (!p) {
+        len = 0;
+    }
+    nul = len ? (const char *)memchr(p, '\0', len) : NULL;
+    if (nul) {
+        len = nul - p;
+    }
+    if (len > size - 1) {
+        len = size - 1;
+    }
+    if (len > 0) {
+        memcpy(text, p, len);
+    }
+    text[len] = '\0';
+}
+
+int pdu_parse_reg(struct pdu_cursor *c, struct pdu_reg *reg)
+{
+    pdu_get_name(c, reg->peer_name, PEER_NAME_SIZE);
+    pdu_get_name(c, reg->content_name, CONTENT_NAME_SIZE);
+    pdu_get_addr(c, &reg->addr);
+    if (c->err) {
+        return -1;
+    }
+
+    // Metadata is optional
+    memset(&reg->meta, 0, sizeof(reg->meta));
+    if (pdu_remaining(c) >= CONTENT_META_SIZE) {
+        pdu_get_meta(c, &reg->meta);
+    }
+    return 0;
+}
+
+int pdu_parse_batch(struct pdu_cursor *c, char *peer_name, int *count)
+{
+    pdu_get_name(c, peer_name, PEER_NAME_SIZE);
+    *count = pdu_get_u8(c);
+    if (c->err || *count < 1 || *count > REG_BATCH_MAX ||
+        pdu_remaining(c) < (size_t)*count * REG_ITEM_SIZE) {
+        return -1;
+    }
+    return 0;
+}
+
+void pdu_parse_batch_item(struct pdu_cursor *c, struct pdu_reg *item, int *op)
+{
+    *op = pdu_get_u8(c);
+    item->peer_name[0] = '\0';
+    pdu_get_name(c, item->content_name, CONTENT_NAME_SIZE);
+    pdu_get_addr(c, &item->addr);
+    pdu_get_meta(c, &item->meta);
+}
+
+int pdu_parse_multi(struct pdu_cursor *c, const char **names)
+{
+    int count;
+
+    count = pdu_get_u8(c);
+    *names = pdu_get_bytes(c, (size_t)count * CONTENT_NAME_SIZE);
+    if (count < 1 || count > LOOKUP_BATCH_MAX || !*names) {
+        return -1;
+    }
+    return count;
+}
+
+int pdu_parse_search_reply(struct pdu_cursor *c, struct sockaddr_in *addr,
+                           struct content_meta *meta, int max)
+{
+    int n = 1;
+
+    pdu_get_addr(c, &addr[0]);
+    memset(&meta[0], 0, sizeof(meta[0]));
+    if (pdu_remaining(c) >= CONTENT_META_SIZE) {
+        pdu_get_meta(c, &meta[0]);
+    }
+    while (n < max && pdu_remaining(c) >= SEARCH_RESULT_SIZE) {
+        pdu_get_addr(c, &addr[n]);
+        pdu_get_meta(c, &meta[n]);
+        n++;
+    }
+    return c->err ? -1 : n;
+}
+
+int pdu_parse_lookup_reply(struct pdu_cursor *c, int count)
+{
+    if (pdu_remaining(c) < 1 + (size_t)count * LOOKUP_RESULT_SIZE ||
+        pdu_get_u8(c) != (unsigned int)count) {
+        return -1;
+    }
+    return 0;
+}
+
+int pdu_parse_lookup_result(struct pdu_cursor *c, struct sockaddr_in *addr,
+                            struct content_meta *meta)
+{
+    if (pdu_get_u8(c) != 'S') {
+        pdu_get_bytes(c, LOOKUP_RESULT_SIZE - 1);
+        return c->err ? -1 : 0;
+    }
+    pdu_get_addr(c, addr);
+    pdu_get_meta(c, meta);
+    return c->err ? -1 : 1;
+}
+
+// Header and payload pieces go out in one sendmsg(), so nothing has to be
+// assembled in a contiguous buffer first
+ssize_t pdu_sendv(int fd, struct pdu_hdr *h, const struct iovec *iov, int iovcnt,
+                  const struct sockaddr *to, socklen_t tolen)
+{
+    struct iovec vec[PDU_MAX_IOV + 1];
+    struct msghdr msg;
+    char hdr[PDU_HDR_SIZE];
+    char type;
+    int i;
+
+    if (iovcnt > PDU_MAX_IOV) {
+        errno = EINVAL;
+        return -1;
+    }
+    h->len = 0;
+    for (i = 0; i < iovcnt; i++) {
+        vec[i + 1] = iov[i];
+        h->len += iov[i].iov_len;
+    }
+
+    if (h->flags & PDU_FLAG_HDR) {
+        if (h->len > 0xffff) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        pdu_put_hdr(hdr, h->type, h->flags, h->len, h->req_id);
+        vec[0].iov_base = hdr;
+        vec[0].iov_len = PDU_HDR_SIZE;
+    } else {
+        type = (char)h->type;
+        vec[0].iov_base = &type;
+        vec[0].iov_len = 1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *)to;
+    msg.msg_namelen = to ? tolen : 0;
+    msg.msg_iov = vec;
+    msg.msg_iovlen = iovcnt + 1;
+    return sendmsg(fd, &msg, 0);
+}
+
+void pdu_iov_advance(struct iovec **iov, int *iovcnt, size_t n)
+{
+    while (*iovcnt > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
@@ -0,0 +1,321 @@
+/* PDU codec shared by the peer and the index server.
+ *
+ * A PDU is an 8-byte header followed by its payload:
+ *   Type (1 byte) | Flags (1 byte) | Length (2 bytes) | Request ID (4 bytes)
+ * with multi-byte fields in network order. Framed content chunks use the
+ * same header (see CHUNK_HDR_SIZE in pdu.h).
+ *
+ * Datagrams to and from the index server set PDU_FLAG_HDR and carry the
+ * payload length explicitly; replies echo the request id. A datagram that
+ * doesn't pass as a header (flag clear, or a length that doesn't match its
+ * size) is taken to be the older format of a type byte followed by the
+ * payload, and replies to it go out in that format.
+ *
+ * Encoding and decoding work in place on caller-owned buffers: a cursor
+ * walks the payload field by field and nothing is allocated.
+ */
+
+#ifndef PDU_CODEC_H
+#define PDU_CODEC_H
+
+#include <stddef.h>
+#include <string.h>
+#include <endian.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "pdu.h"
+
+#define PDU_HDR_SIZE    CHUNK_HDR_SIZE
+#define PDU_FLAG_HDR    0x80    // datagram starts with a full header
+#define PDU_MAX_PAYLOAD LOOKUP_DATA_SIZE
+#define PDU_MAX_DGRAM   (PDU_HDR_SIZE + PDU_MAX_PAYLOAD)
+#define PDU_MAX_IOV     8       // payload pieces pdu_sendv() accepts
+
+struct pdu_hdr {
+    int type;
+    int flags;
+    size_t len;
+    uint32_t req_id;
+};
+
+/* Cursor over a payload. Writers fail softly: a field that doesn't fit (or
+ * isn't there, when reading) sets err and leaves the buffer alone, so a
+ * sequence of puts or gets needs a single check at the end. */
+struct pdu_cursor {
+    char *buf;
+    size_t size;    // capacity when writing, payload length when reading
+    size_t pos;
+    int err;
+};
+
+/* Header encoding */
+void pdu_put_hdr(char *buf, int type, int flags, size_t len, uint32_t req_id);
+void pdu_get_hdr(const char *buf, struct pdu_hdr *h);
+
+/* Split a received datagram of n bytes into header and payload, accepting
+ * either format. Returns 0, or -1 if the datagram is empty. */
+int pdu_decode(char *dgram, size_t n, struct pdu_hdr *h, char **payload);
+
+/* Cursor field accessors. These are inline since each one is a handful of
+ * instructions and a PDU is built or parsed from a dozen of them.
+ *
+ * Names are zero padded to width bytes on the wire and NUL-terminated when
+ * read, so a name buffer needs width + 1 bytes. Addresses are IP (4 bytes)
+ * and port (2 bytes) as stored in the sockaddr, metadata as in pdu.h.
+ * pdu_get_bytes() returns a pointer into the payload, or NULL if fewer than
+ * len bytes are left. */
+static inline void pdu_cursor_init(struct pdu_cursor *c, char *buf, size_t size)
+{
+    c->buf = buf;
+    c->size = size;
+    c->pos = 0;
+    c->err = 0;
+}
+
+/* Reserve len bytes at the cursor, or flag the cursor if they don't fit */
+static inline char *pdu_cursor_take(struct pdu_cursor *c, size_t len)
+{
+    char *p;
+
+    if (c->err || len > c->size - c->pos) {
+        c->err = 1;
+        return NULL;
+    }
+    p = c->buf + c->pos;
+    c->pos += len;
+    return p;
+}
+
+static inline void pdu_put_u8(struct pdu_cursor *c, unsigned int v)
+{
+    char *p = pdu_cursor_take(c, 1);
+
+    if (p) {
+        p[0] = (char)v;
+    }
+}
+
+static inline void pdu_put_bytes(struct pdu_cursor *c, const void *data, size_t len)
+{
+    char *p = pdu_cursor_take(c, len);
+
+    if (p) {
+        memcpy(p, data, len);
+    }
+}
+
+static inline void pdu_put_u16(struct pdu_cursor *c, unsigned int v)
+{
+    uint16_t x = htons((uint16_t)v);
+
+    pdu_put_bytes(c, &x, 2);
+}
+
+static inline void pdu_put_u32(struct pdu_cursor *c, uint32_t v)
+{
+    uint32_t x = htonl(v);
+
+    pdu_put_bytes(c, &x, 4);
+}
+
+static inline void pdu_put_u64(struct pdu_cursor *c, uint64_t v)
+{
+    uint64_t x = htobe64(v);
+
+    pdu_put_bytes(c, &x, 8);
+}
+
+static inline void pdu_put_zero(struct pdu_cursor *c, size_t len)
+{
+    char *p = pdu_cursor_take(c, len);
+
+    if (p) {
+        memset(p, 0, len);
+    }
+}
+
+static inline void pdu_put_name(struct pdu_cursor *c, const char *name, size_t width)
+{
+    char *p = pdu_cursor_take(c, width);
+
+    if (p) {
+        strncpy(p, name, width);
+    }
+}
+
+static inline void pdu_put_addr(struct pdu_cursor *c, const struct sockaddr_in *addr)
+{
+    char *p = pdu_cursor_take(c, 6);
+
+    if (p) {
+        memcpy(p, &addr->sin_addr.s_addr, 4);
+        memcpy(p + 4, &addr->sin_port, 2);
+    }
+}
+
+static inline void pdu_put_meta(struct pdu_cursor *c, const struct content_meta *meta)
+{
+    char *p = pdu_cursor_take(c, CONTENT_META_SIZE);
+    uint64_t v;
+
+    if (p) {
+        v = htobe64(meta->size);
+        memcpy(p, &v, 8);
+        v = htobe64(meta->version);
+        memcpy(p + 8, &v, 8);
+        v = htobe64(meta->hash);
+        memcpy(p + 16, &v, 8);
+    }
+}
+
+static inline unsigned int pdu_get_u8(struct pdu_cursor *c)
+{
+    const char *p = pdu_cursor_take(c, 1);
+
+    return p ? (unsigned char)p[0] : 0;
+}
+
+static inline unsigned int pdu_get_u16(struct pdu_cursor *c)
+{
+    const char *p = pdu_cursor_take(c, 2);
+    uint16_t x;
+
+    if (!p) {
+        return 0;
+    }
+    memcpy(&x, p, 2);
+    return ntohs(x);
+}
+
+static inline uint32_t pdu_get_u32(struct pdu_cursor *c)
+{
+    const char *p = pdu_cursor_take(c, 4);
+    uint32_t x;
+
+    if (!p) {
+        return 0;
+    }
+    memcpy(&x, p, 4);
+    return ntohl(x);
+}
+
+static inline uint64_t pdu_get_u64(struct pdu_cursor *c)
+{
+    const char *p = pdu_cursor_take(c, 8);
+    uint64_t x;
+
+    if (!p) {
+        return 0;
+    }
+    memcpy(&x, p, 8);
+    return be64toh(x);
+}
+
+static inline const char *pdu_get_bytes(struct pdu_cursor *c, size_t len)
+{
+    return pdu_cursor_take(c, len);
+}
+
+static inline void pdu_get_name(struct pdu_cursor *c, char *name, size_t width)
+{
+    const char *p = pdu_cursor_take(c, width);
+
+    if (p) {
+        memcpy(name, p, width);
+        name[width] = '\0';
+    } else {
+        name[0] = '\0';
+    }
+}
+
+static inline void pdu_get_addr(struct pdu_cursor *c, struct sockaddr_in *addr)
+{
+    const char *p = pdu_cursor_take(c, 6);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    if (p) {
+        memcpy(&addr->sin_addr.s_addr, p, 4);
+        memcpy(&addr->sin_port, p + 4, 2);
+    }
+}
+
+static inline void pdu_get_meta(struct pdu_cursor *c, struct content_meta *meta)
+{
+    const char *p = pdu_cursor_take(c, CONTENT_META_SIZE);
+    uint64_t v;
+
+    if (!p) {
+        memset(meta, 0, sizeof(*meta));
+        return;
+    }
+    memcpy(&v, p, 8);
+    meta->size = be64toh(v);
+    memcpy(&v, p + 8, 8);
+    meta->version = be64toh(v);
+    memcpy(&v, p + 16, 8);
+    meta->hash = be64toh(v);
+}
+
+static inline size_t pdu_remaining(const struct pdu_cursor *c)
+{
+    return c->err ? 0 : c->size - c->pos;
+}
+
+/* Take the rest of the payload as a string */
+void pdu_get_text(struct pdu_cursor *c, char *text, size_t size);
+
+/* Payload decoders for the index PDUs with more than a fixed run of fields.
+ * Each reads from the cursor and returns -1 if the payload is malformed. */
+
+/* Registration ('R'): Peer Name | Content Name | IP | Port [| metadata].
+ * meta is zeroed if the peer sent none. Batch items use the same struct
+ * with peer_name left empty. */
+struct pdu_reg {
+    char peer_name[PEER_NAME_SIZE + 1];
+    char content_name[CONTENT_NAME_SIZE + 1];
+    struct sockaddr_in addr;
+    struct content_meta meta;
+};
+int pdu_parse_reg(struct pdu_cursor *c, struct pdu_reg *reg);
+
+/* Batch registration ('B'): Peer Name | Count, then Count items of
+ * Op | Content Name | IP | Port | metadata. pdu_parse_batch() reads the head
+ * and checks that all Count items are there, so pdu_parse_batch_item() can
+ * then read them one by one without further checks. */
+int pdu_parse_batch(struct pdu_cursor *c, char *peer_name, int *count);
+void pdu_parse_batch_item(struct pdu_cursor *c, struct pdu_reg *item, int *op);
+
+/* Multi-name search ('M'): Count | Content Name x Count. Returns Count,
+ * with names pointing at the packed names. */
+int pdu_parse_multi(struct pdu_cursor *c, const char **names);
+
+/* Search reply ('S'): IP | Port [| metadata], then further candidates of
+ * IP | Port | metadata. Fills in up to max candidates and returns how many;
+ * an older server's reply without metadata gives one with meta zeroed. */
+int pdu_parse_search_reply(struct pdu_cursor *c, struct sockaddr_in *addr,
+                           struct content_meta *meta, int max);
+
+/* Multi-name search reply ('M'): Count, then Count results of
+ * Status | IP | Port | metadata. pdu_parse_lookup_reply() checks that the
+ * reply holds the count results asked for. pdu_parse_lookup_result() reads
+ * the next one and returns 1 if the item was found, 0 if not. */
+int pdu_parse_lookup_reply(struct pdu_cursor *c, int count);
+int pdu_parse_lookup_result(struct pdu_cursor *c, struct sockaddr_in *addr,
+                            struct content_meta *meta);
+
+/* Send one PDU whose payload is gathered from iov with a single sendmsg().
+ * The header format follows h->flags & PDU_FLAG_HDR; h->len is filled in.
+ * to may be NULL on a connected socket. */
+ssize_t pdu_sendv(int fd, struct pdu_hdr *h, const struct iovec *iov, int iovcnt,
+                  const struct sockaddr *to, socklen_t tolen);
+
+/* Drop n written bytes from the front of an iovec array, for resuming a
+ * short writev(). Updates *iov and *iovcnt. */
+void pdu_iov_advance(struct iovec **iov, int *iovcnt, size_t n);
+
+#endif
@@ -1,74 +1,729 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/select.h>
 #include <sys/signal.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <sys/random.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <endian.h>
 
 #include "pdu.h"
+#include "pdu_codec.h"
+#include "lz.h"
+#include "cdc.h"
+#include "dht.h"
 
 #define BUFLEN          256     // buffer length
 #define MAX_TCP_SOCKETS 10
+#define LISTEN_BACKLOG  64
+#define RECV_BUF_SIZE   65536   // socket read size on the download path
+#define SINK_ALIGN      4096    // disk buffer alignment
+#define SINK_BUF_SIZE   (256 * 1024) // size of each download sink buffer
+#define PIPE_SLOTS      4       // frames in flight between compressor and sender
+#define MAX_UPLOADS     64      // upload connections tracked by the scheduler
+#define SCHED_QUANTUM   8192    // bytes granted per scheduling round
+#define SCHED_SMALL_SIZE (1024 * 1024) // uploads up to this size get a higher weight
+#define SCHED_SMALL_WEIGHT 4
+#define SCHED_BURST_MS  100     // token bucket depth, in ms worth of the rate
+#define CACHE_DIR       "cache" // where downloaded_<name> files are kept
+#define CACHE_INDEX     ".index" // cache metadata file inside CACHE_DIR
+#define CACHE_DEFAULT_BUDGET (256LL * 1024 * 1024)
+#define CACHE_SERVE_CREDIT 600  // seconds of recency each local serve is worth
+#define SERVE_IDLE_TIMEOUT 30   // seconds a keep-alive upload waits for the next request
+#define POOL_IDLE_TIMEOUT  20   // seconds an unused pooled connection is kept
+#define MAX_DOWNLOAD_NAMES 32   // items per download command
+#define BATCH_DEFAULT_PARALLEL 4 // concurrent transfers of a download-batch
+#define BATCH_MAX_PARALLEL 32
+#define BATCH_PIPELINE_DEPTH 16 // items requested back to back on one connection
+#define SUB_LEASE          120  // seconds of subscription lease asked for; renewed at half
+#define REPL_HEARTBEAT     10   // seconds between capacity heartbeats while replicating
+#define REPL_QUEUE         8    // replication orders waiting for the main loop
+#define UDP_BUSY_RETRIES   4    // times a request turned away as busy is sent again
+#define INDEX_RTO_MS       500  // wait for an index server reply, doubled on each retry
+#define INDEX_RETRIES      3    // unanswered requests sent again before giving up
+#define CONNECT_TIMEOUT_INIT 1000 // ms to wait for a connect before any has been timed
+#define CONNECT_TIMEOUT_MIN  250
+#define CONNECT_TIMEOUT_MAX  3000
+#define FAIL_REPORT_GAP    2    // seconds during which a server is reported unreachable only once
+#define DELTA_MIN_SIZE     (64 * 1024) // old copies smaller than this are replaced in full
+#define CDC_BUF_SIZE       (4 * CDC_MAX_SIZE) // read window of a chunk_reader
+#define REG_BUCKETS        16384 // registered content hash table size, a power of two
+#define SHARE_STATE        ".share" // shared directory and its file hashes
+#define SHARE_COALESCE_MS  200  // quiet time before watched changes are sent
+#define SHARE_MAX_DELAY_MS 1000 // longest a change waits while more keep coming
+#define SHARE_HASH_THREADS 8    // parallel hashing workers at most
+#define SHARE_LIST_QUIET   16   // (de)registrations beyond this are summarised
+#define FAST_DEFAULT_MAX   (8 * 1024) // items up to this size are fetched over UDP
+#define FAST_WINDOW        64   // items fetched over UDP at once
+#define FAST_TRIES         3    // requests sent for an item before falling back to TCP
+#define FAST_RTO_INIT      100  // ms to wait for segments before any connect has been timed
+#define FAST_RTO_MIN       10
+#define FAST_RTO_MAX       500
+#define FAST_SERVE_BURST   64   // 'G' datagrams answered per main loop pass
+#define FAST_OFF_SLOTS     16   // servers remembered as not answering over UDP
+#define FAST_OFF_TIME      300  // seconds such a server is left to TCP
+#define FAST_AMPLIFY       3    // reply bytes per request byte for a client without a cookie
+#define FAST_COOKIE_SLOTS  1024 // client addresses holding a fast-path cookie
+#define FAST_COOKIE_TIME   600  // seconds a cookie is honoured
+#define SHARE_WATCH_MASK   (IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | \
+                            IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
 
-// Structure used to keep track of registered content + respective TCP sockets
+// receive_content() results
+#define RECV_REMOTE_ERROR  -1   // server reported an error, stream still usable
+#define RECV_STREAM_ERROR  -2   // connection broken or out of sync
+
+// Data-plane stats
+#define STATS_BUCKETS      24   // log2 histogram buckets
+#define STATS_MAX_CONTENT  64   // items tracked individually in served-bytes counters
+#define STATS_STALL_MS     250  // socket calls blocking longer than this count as stalls
+#define STATS_SOCKET       "stats.%d.sock" // with the TCP download port, unique per host
+#define STATS_SEND_TIMEOUT 1    // seconds a scraper may stall the main loop
+
+// download_job states
+#define JOB_PENDING     0
+#define JOB_DONE        1
+#define JOB_FAILED      2
+#define JOB_QUEUED      3
+
+// Structure used to keep track of registered content
 struct registered_content {
     char peer_name[PEER_NAME_SIZE + 1];
     char content_name[CONTENT_NAME_SIZE + 1];
     char filename[256];    
-    int tcp_socket;                   
-    struct sockaddr_in tcp_addr;
+    struct content_meta meta;
+    int replica;            // fetched at the index server's request
+    int shared;             // a file of the shared directory
+    unsigned int seen;      // share scan that last found the file
     struct registered_content *next;
+    struct registered_content **pprev; // link pointing at this entry
+    struct registered_content *hash_next; // chain in reg_table
+};
+
+// Registration change sent to the index server in a 'B' batch
+struct reg_update {
+    int op;                 // REG_ADD or REG_REMOVE
+    char content_name[CONTENT_NAME_SIZE + 1];
+    char filename[256];
+    struct content_meta meta;
+    int shared;
+};
+
+// File of the shared directory found by a scan or a watch event
+struct share_file {
+    char name[CONTENT_NAME_SIZE + 1];
+    char path[256];
+    struct content_meta meta;
+    int need_hash;          // meta holds size and mtime only
+    int remove;             // the file is gone: deregister it
+    int ok;
+};
+
+// Parallel hashing of share_files
+struct share_hasher {
+    struct share_file *files;
+    int count;
+    int next;
+    const int *stop;        // checked between files
+    pthread_mutex_t lock;
+};
+
+// Files of a scan or of a round of watched changes, hashed on a worker
+// thread while the main loop goes on
+struct share_batch {
+    struct share_file *files;
+    int count;
+    int scan;               // the whole directory rather than watched changes
+    int unchanged;          // scan: files left as registered
+    int skipped;            // scan: names unusable or registered otherwise
+    int hashed;
+    int prompt;             // summary interrupts the prompt
+    int stop;               // sharing stopped: give up hashing
+    int done;               // set by the worker once hashing is over
+    long long t0;           // scan started
+    long long t1;           // hashing started
+    pthread_t tid;
+};
+
+// Name in the shared directory that changed since the last flush
+struct share_change {
+    char name[CONTENT_NAME_SIZE + 1];
+    struct share_change *next;
+};
+
+// Double-buffered download sink: the receive loop fills one buffer while a
+// writer thread flushes the other, so disk latency doesn't stall the socket
+struct download_sink {
+    int fd;
+    char *buf[2];
+    size_t fill[2];
+    int cur;                // buffer being filled by the receive loop
+    int pending;            // buffer queued for the writer, -1 if none
+    int done;
+    int error;              // errno of the first failed write
+    off_t offset;           // file offset of the next flushed buffer
+    off_t total;            // bytes accepted so far
+    uint64_t hash;          // content hash of the bytes accepted so far
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// Per-transfer accounting for the compression stats
+struct xfer_stats {
+    int options;                // transfer options the server accepted
+    unsigned long long raw_bytes;
+    unsigned long long wire_bytes;
+    long long cpu_ns;           // CPU time spent (de)compressing
+    long long first_ns;         // when the first content byte was sent/received
+    unsigned long long reused_bytes; // taken from the client's old copy, in raw_bytes
+    int fast;                   // sent over the UDP fast path
+};
+
+// Buffered reader so the download stream can be parsed without one
+// read() per PDU
+struct stream_reader {
+    int fd;
+    char buf[RECV_BUF_SIZE];
+    size_t pos;
+    size_t len;
+};
+
+// Reads a file one content-defined chunk at a time
+struct chunk_reader {
+    int fd;
+    char *buf;              // CDC_BUF_SIZE bytes
+    size_t pos;
+    size_t len;
+    int eof;
+};
+
+// Chunk of the old copy a delta download starts from
+struct delta_chunk {
+    off_t offset;
+    uint32_t len;
+    uint64_t hash;
+};
+
+// Old copy of an item fetched as a delta, kept aside until the download is
+// finished. Unused while filename is empty.
+struct delta_base {
+    int fd;                 // the cached copy, read in place
+    struct delta_chunk *chunks;
+    uint32_t count;
+    char *manifest;         // wire form, sent after the 'D' request
+    size_t manifest_len;
+};
+
+// Client's manifest on the serving side, indexed by hash
+struct delta_index {
+    uint32_t count;
+    uint32_t *len;
+    uint64_t *hash;
+    uint32_t *slot;         // open addressing: manifest index + 1, 0 if free
+    uint32_t mask;
+};
+
+// Upload pipeline: a producer thread compresses chunks into a ring of
+// frames while the connection's thread sends them
+struct chunk_slot {
+    char hdr[CHUNK_HDR_SIZE];
+    char raw[XFER_CHUNK_SIZE];      // file data as read
+    char packed[XFER_CHUNK_SIZE];   // compressed copy, used if it came out smaller
+    const char *payload;            // raw, packed or an error message
+    size_t len;                     // payload bytes
+    int last;
+};
+
+struct send_pipeline {
+    int fd;
+    int compress;
+    uint32_t req_id;
+    struct chunk_slot slot[PIPE_SLOTS];
+    int head;
+    int tail;
+    int count;
+    int abort;
+    struct xfer_stats *st;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// Upload scheduler, shared by the forked upload children. A global token
+// bucket caps the peer's total upload rate and start-time fair queuing
+// decides which waiting connection gets the next quantum.
+struct upload_slot {
+    int active;
+    int waiting;
+    int weight;
+    pid_t pid;
+    unsigned long long vstart;   // virtual start tag of the next grant
+};
+
+struct upload_sched {
+    pthread_mutex_t lock;        // process-shared
+    long long global_rate;       // bytes/s across all uploads, 0 = unlimited
+    long long conn_rate;         // bytes/s per upload connection, 0 = unlimited
+    double tokens;
+    long long last_refill_ns;
+    unsigned long long vtime;    // start tag of the last grant
+    uint64_t reg_generation;     // the parent's reg_generation, for upload children to compare
+    uint64_t reg_added;          // the parent's reg_added, likewise
+    struct upload_slot slot[MAX_UPLOADS];
+};
+
+// Per-connection view of the scheduler, local to the upload child
+struct upload_throttle {
+    int slot;                    // -1 if the scheduler was full: served behind every slot
+    long long credit;            // bytes granted but not yet sent
+    double conn_tokens;
+    long long conn_last_ns;
+};
+
+// Downloaded content kept in CACHE_DIR, evicted least-recently-used first
+// with local serves counting as extra recency
+struct cache_entry {
+    char content_name[CONTENT_NAME_SIZE + 1];
+    char filename[256];
+    struct content_meta meta;
+    time_t last_access;
+    unsigned long serve_count;
+    struct cache_entry *next;
+};
+
+// Result of an 'S' lookup
+struct lookup_result {
+    struct sockaddr_in addr;
+    struct content_meta meta;
+    int alt_count;          // further servers to fail over to, best first
+    struct sockaddr_in alt_addr[SEARCH_MAX_CANDIDATES - 1];
+    struct content_meta alt_meta[SEARCH_MAX_CANDIDATES - 1];
+};
+
+// One item of a download command
+struct download_job {
+    char content_name[CONTENT_NAME_SIZE + 1];
+    char filename[256];
+    char tmpname[256];      // written by the transfer, renamed to filename once verified
+    struct lookup_result res;
+    struct download_sink sink;
+    struct xfer_stats st;
+    uint32_t req_id;
+    int state;              // JOB_*
+    long long start_ns;     // request sent, 0 if never requested
+    long long done_ns;
+    char err_msg[BUFLEN];
+    struct delta_base base; // old copy to reuse chunks of
+    int conn_failed;        // the server couldn't be reached
+    int remote_failed;      // the server failed to deliver the item
+    int relooked;           // failed over to a fresh lookup already
+    int tried_count;
+    struct sockaddr_in tried[2 * SEARCH_MAX_CANDIDATES]; // servers that couldn't be reached
+};
+
+// Connection to a content server, kept in conn_pool while idle
+struct peer_conn {
+    struct sockaddr_in addr;
+    int sock;
+    int reused;             // taken from the pool rather than freshly connected
+    uint32_t next_req_id;
+    time_t last_used;
+    struct peer_conn *next;
+};
+
+// Item being fetched over the UDP fast path
+struct fast_fetch {
+    struct download_job *job;
+    int sock;               // connected to the job's server, shared by its items
+    char *data;
+    int segments;
+    uint32_t have;          // segments received
+    uint32_t inflight;      // segments the server said it sent, left out of the next request
+    int tries;
+    long long start_ns;
+    long long first_ns;     // first segment received
+    long long deadline_ns;  // ask again for the missing segments then
+    unsigned long long wire_bytes;
+    int done;               // 1 fetched, -1 left to TCP
+};
+
+// Subscription to new registrations, renewed while the peer runs
+struct subscription {
+    char name[CONTENT_NAME_SIZE + 1];
+    int prefix;             // name is a prefix
+    int download;           // fetch matching items as they appear
+    time_t renew_at;
+    struct subscription *next;
+};
+
+// Replication order from the index server, run from the main loop
+struct repl_order {
+    int action;             // REPL_FETCH or REPL_DROP
+    char content_name[CONTENT_NAME_SIZE + 1];
+    struct lookup_result src;
+};
+
+// Shared state of a download-batch run
+struct batch_run {
+    struct download_job **order;    // pending jobs grouped by server
+    int *unit_start;                // units: runs of order[] fetched together
+    int *unit_len;
+    int unit_count;
+    int next_unit;
+    int total;
+    int done;
+    int skipped;
+    int failed;
+    unsigned long long bytes;
+    struct timespec start;
+    struct timespec last_report;
+    pthread_mutex_t lock;
+};
+
+// Data-plane counters, in memory shared with the upload children. Every
+// field is only updated with atomic adds, so no lock is needed.
+struct stats_hist {
+    uint64_t bucket[STATS_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+};
+
+struct content_stats {
+    uint64_t key;               // hash of the content name, 0 = free
+    int named;                  // content_name is filled in
+    char content_name[CONTENT_NAME_SIZE + 1];
+    uint64_t serves;
+    uint64_t bytes;
+};
+
+struct peer_stats {
+    uint64_t uploads_active;
+    uint64_t uploads;
+    uint64_t upload_errors;
+    uint64_t upload_bytes;
+    uint64_t upload_wire_bytes;
+    uint64_t downloads;
+    uint64_t download_errors;
+    uint64_t download_bytes;
+    uint64_t download_wire_bytes;
+    uint64_t upload_reused_bytes;   // left out of the wire bytes by delta transfers
+    uint64_t download_reused_bytes;
+    uint64_t uploads_fast;          // items sent over the UDP fast path
+    uint64_t downloads_fast;
+    uint64_t send_stalls;
+    uint64_t recv_stalls;
+    struct stats_hist upload_kbps;
+    struct stats_hist upload_ttfb_us;
+    struct stats_hist download_kbps;
+    struct stats_hist download_ttfb_us;
+    struct content_stats content[STATS_MAX_CONTENT];
+    uint64_t other_content_bytes;
 };
 
 struct registered_content *reg_list = NULL;
+uint64_t reg_generation = 0;   // bumped when an item is removed or changes; upload children keep their fork's
+uint64_t reg_added = 0;        // bumped when an item is added, likewise
+struct registered_content *reg_table[REG_BUCKETS]; // reg_list by content name
+int reg_batch_supported = 1;   // the index server understands 'B' PDUs
+char share_dir[256 - CONTENT_NAME_SIZE - 1] = ""; // directory shared as a whole, "" if none
+int share_fd = -1;             // inotify descriptor watching share_dir
+unsigned int share_generation = 0;
+struct share_change *share_changes = NULL;
+int share_pending = 0;         // entries in share_changes
+long long share_first_ns = 0;  // first and latest pending change
+long long share_last_ns = 0;
+int share_rescan = 0;          // events were lost: reconcile the whole directory
+struct share_batch *share_busy = NULL; // batch being hashed, NULL if none
+struct upload_sched *sched = NULL;
+struct peer_stats *stats = NULL;
+int stats_sock = -1;
+char stats_path[64] = "";      // STATS_SOCKET for our port
+struct cache_entry *cache_list = NULL;
+long long cache_budget = CACHE_DEFAULT_BUDGET;
+long long cache_used = 0;
+int listen_sock = -1;
+struct sockaddr_in listen_addr;
+int serve_pipe[2] = {-1, -1};  // upload children report served content here
+int fast_sock = -1;            // small-item requests, on the listen port's number
+long long fast_max = FAST_DEFAULT_MAX; // largest item fetched or served over UDP, 0 = off
+uint32_t fast_next_req_id = 1;
+struct sockaddr_in fast_off_addr[FAST_OFF_SLOTS]; // servers that didn't answer over UDP
+time_t fast_off_until[FAST_OFF_SLOTS];
+int fast_off_next = 0;
+struct sockaddr_in fast_cookie_addr[FAST_OFF_SLOTS]; // cookies servers issued to us
+uint64_t fast_cookie_val[FAST_OFF_SLOTS];
+int fast_cookie_next = 0;
+uint32_t fast_issued_ip[FAST_COOKIE_SLOTS]; // cookies we issued, by client address
+uint64_t fast_issued_val[FAST_COOKIE_SLOTS];
+time_t fast_issued_until[FAST_COOKIE_SLOTS];
+struct peer_conn *conn_pool = NULL;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t connect_lock = PTHREAD_MUTEX_INITIALIZER;
+long long connect_srtt_us = 0;  // smoothed connect time, 0 until the first sample
+long long connect_rttvar_us = 0;
+int connect_timeout = CONNECT_TIMEOUT_INIT; // ms
+struct sockaddr_in fail_reported_addr; // last server reported unreachable
+time_t fail_reported_at = 0;
+int batch_quiet = 0;    // only report failures per item during download-batch
+struct subscription *sub_list = NULL;
+char notify_names[MAX_DOWNLOAD_NAMES][CONTENT_NAME_SIZE + 1]; // announced items to fetch
+int notify_count = 0;
+int replicate_enabled = 0;     // offer spare capacity for replicas
+time_t heartbeat_at = 0;
+struct repl_order repl_queue[REPL_QUEUE];
+int repl_count = 0;
 int udp_sock = -1;
+uint32_t udp_next_req_id = 1;  // tags requests to the index server
 struct sockaddr_in index_server_addr;
+struct sockaddr_in index_standby_addr; // the other index server of a primary/standby pair
+int index_standby = 0;         // index_standby_addr is set
 char my_peer_name[PEER_NAME_SIZE + 1] = {0};
+int dht_mode = 0;              // peers index content among themselves, no index server
+struct sockaddr_in dht_local_addr; // our address as other nodes reach it
+time_t dht_republish_at = 0;
+int compression_enabled = 1;   // offer compressed transfers when downloading
 
 void register_content(const char *content_name, const char *filename);
+int register_content_meta(const char *content_name, const char *filename,
+                          const struct content_meta *meta);
 void search_and_download(const char *content_name);
+int lookup_content(const char *content_name, struct lookup_result *res);
+void download_contents(const char **names, int count);
+void lookup_contents(struct download_job *jobs, int count);
+void download_batch(const char *path, int max_parallel);
+void *batch_worker_main(void *arg);
+void batch_progress(struct batch_run *b, int final);
+int job_prepare(struct download_job *job);
+void fetch_pipelined(struct download_job **jobs, int count);
+void job_finish(struct download_job *job);
+void fetch_small(struct download_job *jobs, int count);
+void fast_fetch_window(struct fast_fetch *ff, int count);
+int fast_request(struct fast_fetch *f, long long rto_ns);
+void fast_receive(struct fast_fetch *ff, int count, int sock, long long rto_ns);
+void fast_complete(struct fast_fetch *f);
+long long fast_rto_ns(void);
+int fast_server_off(const struct sockaddr_in *addr);
+void fast_server_note_off(const struct sockaddr_in *addr);
+uint64_t fast_cookie_for(const struct sockaddr_in *addr);
+void fast_cookie_keep(const struct sockaddr_in *addr, uint64_t cookie);
+uint64_t fast_cookie_issue(uint32_t ip);
+int fast_cookie_check(uint32_t ip, uint64_t cookie);
+int create_fast_socket(const struct sockaddr_in *listen);
+void fast_serve(void);
+int job_retry(struct download_job *job);
+int job_failover(struct download_job *job);
+int job_tried(const struct download_job *job, const struct sockaddr_in *addr);
+void report_failure(int reason, const char *content_name, const struct sockaddr_in *addr);
+struct peer_conn *conn_acquire(const struct sockaddr_in *addr);
+int connect_adaptive(int sock, const struct sockaddr_in *addr);
+void connect_sample(long long us);
+void conn_release(struct peer_conn *conn, int reusable);
+void conn_pool_reap(fd_set *rfds);
+void conn_pool_close_all(void);
 void list_contents(void);
-void deregister_content(const char *content_name);
+int deregister_content(const char *content_name);
 void deregister_all(void);
-int create_tcp_socket_for_content(const char *content_name, struct sockaddr_in *addr);
-void handle_tcp_connection(int tcp_sock, const char *content_name);
+int subscribe_content(const char *pattern, int download);
+int unsubscribe_content(const char *pattern);
+void unsubscribe_all(void);
+int sub_request(const struct subscription *sub, int lease, int *granted, int *matches);
+struct subscription *find_subscription(const char *name, int prefix);
+int sub_matches(const struct subscription *sub, const char *content_name);
+void subs_renew(void);
+void handle_notification(struct pdu_cursor *c);
+void notify_downloads(void);
+void handle_index_push(const struct pdu_hdr *h, char *payload);
+void heartbeat_send(int enabled);
+void handle_replica_order(struct pdu_cursor *c);
+void replicate_tick(void);
+int create_listen_socket(struct sockaddr_in *addr);
+void handle_tcp_connection(int tcp_sock);
+int serve_wait(int tcp_sock, int check_registry);
+int serve_request(int tcp_sock, const char *content_name, int options, uint32_t req_id,
+                  const struct delta_index *delta);
+int send_transfer_error(int tcp_sock, int options, uint32_t req_id, const char *msg);
+int sink_open(struct download_sink *sink, const char *filename, off_t expected_size);
+int sink_write(struct download_sink *sink, const char *data, size_t len);
+int sink_close(struct download_sink *sink);
+void *sink_writer_main(void *arg);
+ssize_t reader_fill(struct stream_reader *r);
+int reader_read(struct stream_reader *r, char *dst, size_t len);
+int reader_drain(struct stream_reader *r, struct download_sink *sink, ssize_t len);
+int receive_content(struct stream_reader *r, struct download_sink *sink, struct xfer_stats *st,
+                    uint32_t req_id, const struct delta_base *base, char *err_msg, size_t err_size);
+int chunk_reader_open(struct chunk_reader *cr, int fd);
+int chunk_next(struct chunk_reader *cr, const char **data, size_t *len);
+int delta_prepare(struct download_job *job, const struct cache_entry *old);
+void delta_release(struct delta_base *base);
+long long delta_copy(const struct delta_base *base, uint32_t first, uint32_t count,
+                     struct download_sink *sink, char *buf, size_t size);
+int delta_read_manifest(struct stream_reader *r, struct delta_index *idx);
+int delta_find(const struct delta_index *idx, uint64_t hash, uint32_t len);
+void delta_index_free(struct delta_index *idx);
+int send_delta(int fd, int tcp_sock, struct xfer_stats *st, struct upload_throttle *th,
+               uint32_t req_id, int compress, const struct delta_index *idx);
+int send_data_frame(int tcp_sock, struct xfer_stats *st, struct upload_throttle *th, int type,
+                    const char *data, size_t len, uint32_t req_id, int compress, char *packed);
+int send_frame(int tcp_sock, struct xfer_stats *st, struct upload_throttle *th, int type,
+               int flags, const char *payload, size_t len, uint32_t req_id);
+int write_all(int fd, const void *buf, size_t len);
+int writev_all(int fd, struct iovec *iov, int iovcnt);
+int send_chunks(int fd, int tcp_sock, struct xfer_stats *st, struct upload_throttle *th,
+                uint32_t req_id, int compress);
+void *chunk_producer_main(void *arg);
+uint64_t content_hash_update(uint64_t hash, const void *data, size_t len);
+int file_meta(const char *filename, struct content_meta *meta);
+void cache_load(void);
+void cache_save(void);
+struct cache_entry *cache_find(const char *content_name);
+void cache_insert(const char *content_name, const char *filename,
+                  const struct content_meta *meta);
+void cache_touch(const char *content_name, int served);
+int cache_make_room(long long incoming);
+int cache_evict(struct cache_entry *victim);
+void cache_forget(struct cache_entry *entry);
+void cache_status(void);
+long long now_ns(void);
+int sched_init(void);
+void sched_lock(void);
+void sched_set_limits(long long global_rate, long long conn_rate);
+int parse_rate(const char *arg, long long *rate);
+int parse_megabytes(const char *arg, long long *bytes);
+void sched_reap(pid_t pid);
+int stats_init(void);
+void stats_add(uint64_t *counter, uint64_t v);
+uint64_t stats_get(const uint64_t *counter);
+void stats_observe(struct stats_hist *h, uint64_t v);
+void stats_transfer(int upload, int ok, const struct xfer_stats *st, long long start_ns,
+                    long long end_ns);
+void stats_content(const char *content_name, uint64_t bytes);
+void stats_print_hist(const char *title, const struct stats_hist *h);
+void stats_print(void);
+void stats_export_hist(FILE *fp, const char *name, const struct stats_hist *h);
+void stats_export_counter(FILE *fp, const char *name, const uint64_t *counter);
+void stats_export(FILE *fp);
+int create_stats_socket(void);
+void stats_serve(int sock);
+void throttle_start(struct upload_throttle *t, off_t size);
+void throttle_consume(struct upload_throttle *t, size_t bytes);
+int throttle_try(size_t bytes);
+void throttle_stop(struct upload_throttle *t);
 void handle_user_input(char *input);
 void handle_udp_response(void);
+int udp_transact(int type, const struct iovec *iov, int iovcnt, char *buf, size_t size,
+                 struct pdu_hdr *h, struct pdu_cursor *in);
+long busy_retry_ms(const struct pdu_hdr *h, struct pdu_cursor *in);
+int udp_wait_reply(uint32_t req_id, char *buf, size_t size, struct pdu_hdr *h, char **payload,
+                   int timeout_ms);
+int standby_reply(const struct pdu_hdr *h, const char *payload);
+void index_switch(const char *why);
+int parse_host_port(const char *arg, struct sockaddr_in *addr);
 void free_reg_list(void);
+struct registered_content *reg_add_local(const char *content_name, const char *filename,
+                                         const struct content_meta *meta);
+void reg_remove_local(struct registered_content *reg);
+void reg_changed(void);
+int reg_stale(void);
+int reg_missing(const char *content_name);
+unsigned int reg_bucket(const char *content_name);
+int content_server_addr(struct sockaddr_in *addr);
+int reg_flush(struct reg_update *ups, int count, int quiet);
+int reg_send_batch(struct reg_update *ups, int count, char *status);
+void share_start(const char *dir);
+void share_stop(int deregister);
+int share_watch(const char *dir);
+int share_file_cmp(const void *a, const void *b);
+void share_load(void);
+void share_save(void);
+void share_scan(struct reg_update *saved, int nsaved);
+void share_commit(struct share_file *files, int count, int quiet, int *added, int *removed);
+int share_hash(struct share_file *files, int count, const int *stop);
+void *share_hash_main(void *arg);
+void share_submit(struct share_batch *b);
+void *share_batch_main(void *arg);
+void share_finish(struct share_batch *b);
+void share_cancel(void);
+void share_events(void);
+void share_note(const char *name);
+void share_tick(void);
+void share_status(void);
+int share_valid_name(const char *name);
+int reg_update_cmp(const void *a, const void *b);
+int dht_start(int port, const char *bootstrap);
+int dht_lookup_content(const char *content_name, struct lookup_result *res);
+void dht_maintain(void);
 struct registered_content *find_registered_content(const char *content_name);
 
 int main(int argc, char **argv)
 {
     const char *index_server = "127.0.0.1";
     int index_port = 3000;
+    const char *bootstrap = NULL;
+    int dht_port = 0;
     struct hostent *hp;
     fd_set rfds, afds;
     char input[BUFLEN];
-    struct registered_content *reg;
     int nready;
+    int new_sd;
+    pid_t pid;
+    struct timeval tv;
+    struct peer_conn *conn;
+    char served[CONTENT_NAME_SIZE * 64];
+    char name[CONTENT_NAME_SIZE + 1];
+    ssize_t n;
+    ssize_t i;
 
     // Parse command line arguments
-    switch (argc) {
-    case 1:
-        break;
-    case 2:
-        index_server = argv[1];
-        break;
-    case 3:
-        index_server = argv[1];
-        index_port = atoi(argv[2]);
-        break;
-    default:
-        fprintf(stderr, "Usage: %s [index_server] [index_port]\n", argv[0]);
-        exit(1);
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "-d") == 0) {
+        // DHT mode: -d <udp_port> [bootstrap_host:port]
+        dht_mode = 1;
+        dht_port = atoi(argv[2]);
+        bootstrap = argc == 4 ? argv[3] : NULL;
+    } else {
+        switch (argc) {
+        case 1:
+            break;
+        case 2:
+            index_server = argv[1];
+            break;
+        case 3:
+            index_server = argv[1];
+            index_port = atoi(argv[2]);
+            break;
+        case 4:
+            // The standby index server peers switch to if the primary fails
+            index_server = argv[1];
+            index_port = atoi(argv[2]);
+            if (parse_host_port(argv[3], &index_standby_addr) < 0) {
+                fprintf(stderr, "Can't get standby index server address '%s'\n", argv[3]);
+                exit(1);
+            }
+            index_standby = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [index_server] [index_port] [standby_host:port]\n"
+                    "       %s -d <udp_port> [bootstrap_host:port]\n", argv[0], argv[0]);
+            exit(1);
+        }
     }
 
     // Get peer name
@@ -83,40 +738,105 @@ int main(int argc, char **argv)
         fprintf(stderr, "Invalid peer name\n");
         exit(1);
     }
+    srand(time(NULL) ^ getpid());   // peers started together still pick different retry delays
+    // A scraper or peer that hangs up mid-write must not kill us; the
+    // write fails with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+    cdc_init();
 
-    // Initialize and set up the UDP socket
-    memset(&index_server_addr, 0, sizeof(index_server_addr));
-    index_server_addr.sin_family = AF_INET;
-    index_server_addr.sin_port = htons(index_port);
-
-    hp = gethostbyname(index_server);
-    if (hp != NULL) {
-        memcpy(&index_server_addr.sin_addr, hp->h_addr, hp->h_length);
-    } else if ((index_server_addr.sin_addr.s_addr = inet_addr(index_server)) == INADDR_NONE) {
-        fprintf(stderr, "Can't get index server address\n");
+    // Upload scheduler must exist before any upload child is forked
+    if (sched_init() < 0 || stats_init() < 0) {
+        fprintf(stderr, "Can't set up upload scheduler\n");
         exit(1);
     }
-    //ERRORs for UDP socket
-    udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (udp_sock < 0) {
-        fprintf(stderr, "Can't create UDP socket\n");
-        exit(1);
+
+    if (dht_mode) {
+        // The UDP socket talks to other DHT nodes instead of an index server
+        if (dht_start(dht_port, bootstrap) < 0) {
+            exit(1);
+        }
+    } else {
+        // Initialize and set up the UDP socket
+        memset(&index_server_addr, 0, sizeof(index_server_addr));
+        index_server_addr.sin_family = AF_INET;
+        index_server_addr.sin_port = htons(index_port);
+
+        hp = gethostbyname(index_server);
+        if (hp != NULL) {
+            memcpy(&index_server_addr.sin_addr, hp->h_addr, hp->h_length);
+        } else if ((index_server_addr.sin_addr.s_addr = inet_addr(index_server)) == INADDR_NONE) {
+            fprintf(stderr, "Can't get index server address\n");
+            exit(1);
+        }
+
+        //ERRORs for UDP socket
+        udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (udp_sock < 0) {
+            fprintf(stderr, "Can't create UDP socket\n");
+            exit(1);
+        }
+
+        if (connect(udp_sock, (struct sockaddr *)&index_server_addr,
+                    sizeof(index_server_addr)) < 0) {
+            fprintf(stderr, "Can't connect to index server\n");
+            close(udp_sock);
+            exit(1);
+        }
     }
 
-    if (connect(udp_sock, (struct sockaddr *)&index_server_addr,
-                sizeof(index_server_addr)) < 0) {
-        fprintf(stderr, "Can't connect to index server\n");
+    // One TCP socket serves downloads of every registered item
+    listen_sock = create_listen_socket(&listen_addr);
+    if (listen_sock < 0 || pipe(serve_pipe) < 0) {
+        fprintf(stderr, "Can't create TCP listening socket\n");
         close(udp_sock);
         exit(1);
     }
+    fcntl(serve_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(serve_pipe[1], F_SETFL, O_NONBLOCK);
+
+    // Small items are also served over UDP, on the same port number
+    fast_sock = create_fast_socket(&listen_addr);
+    if (fast_sock < 0) {
+        printf("Warning: Cannot serve small items on UDP port %d\n", ntohs(listen_addr.sin_port));
+    }
 
-    printf("Connected to index server at %s:%d\n", index_server, index_port);
+    stats_sock = create_stats_socket();
+    if (stats_sock < 0) {
+        printf("Warning: Cannot create stats socket '%s'\n", stats_path);
+    }
+
+    if (!dht_mode) {
+        printf("Connected to index server at %s:%d\n", index_server, index_port);
+    }
+    if (index_standby) {
+        printf("Standby index server at %s:%d\n", inet_ntoa(index_standby_addr.sin_addr),
+               ntohs(index_standby_addr.sin_port));
+    }
     printf("Peer name: %s\n", my_peer_name);
+    if (stats_sock >= 0) {
+        printf("Stats socket: %s\n", stats_path);
+    }
+
+    // Re-share whatever the content cache and the shared directory held
+    // before a restart
+    cache_load();
+    share_load();
     printf("\nCommands:\n");
     printf("  register <content_name> <filename>  - Register content\n");
-    printf("  download <content_name>             - Download content\n");
+    printf("  download <content_name> [...]       - Download content\n");
+    printf("  download-batch <file> [parallel]    - Download every name listed in file\n");
     printf("  list                                - List all registered content\n");
     printf("  deregister <content_name>           - Deregister content\n");
+    printf("  share [dir]                         - Share (and watch) every file in dir\n");
+    printf("  unshare                             - Stop sharing the directory\n");
+    printf("  subscribe [name|prefix*] [get]      - Announce (and get) new registrations\n");
+    printf("  unsubscribe <name|prefix*>          - Cancel a subscription\n");
+    printf("  replicate [on|off]                  - Offer spare capacity for replicas\n");
+    printf("  compress <on|off>                   - Offer compressed downloads\n");
+    printf("  fastpath [max_bytes]                - Show/set the UDP size limit (0 = off)\n");
+    printf("  ratelimit [global_KBps] [conn_KBps] - Show/set upload limits (0 = none)\n");
+    printf("  cache [budget_MB]                   - Show content cache / set its budget\n");
+    printf("  stats                               - Show transfer statistics\n");
     printf("  quit                                - Quit (auto-deregisters all)\n");
     printf("\n> ");
 
@@ -125,22 +845,33 @@ int main(int argc, char **argv)
     FD_ZERO(&afds);
     FD_SET(0, &afds);        // stdin
     FD_SET(udp_sock, &afds); // UDP socket
+    FD_SET(listen_sock, &afds); // TCP download requests
+    FD_SET(serve_pipe[0], &afds); // served content reports
+    if (fast_sock >= 0) {
+        FD_SET(fast_sock, &afds); // small-item requests
+    }
+    if (stats_sock >= 0) {
+        FD_SET(stats_sock, &afds); // stats scrapers
+    }
 
     // Main loop, will use select() to read inputs
     for (;;) {
         rfds = afds; // The working set of file descriptors
 
-        // ADD in all possible TCP listening sockets for download requests
-        reg = reg_list;
-        while (reg) {
-            if (reg->tcp_socket >= 0) {
-                FD_SET(reg->tcp_socket, &rfds);
-            }
-            reg = reg->next;
+        // Watch idle pooled connections so we notice servers closing them
+        for (conn = conn_pool; conn; conn = conn->next) {
+            FD_SET(conn->sock, &rfds);
+        }
+        if (share_fd >= 0) {
+            FD_SET(share_fd, &rfds); // shared directory changes
         }
 
-        //Select() waits for on of the file descriptors to be ready
-        nready = select(FD_SETSIZE, &rfds, NULL, NULL, NULL);
+        //Select() waits for on of the file descriptors to be ready,
+        // waking up every second to expire idle pooled connections, or
+        // sooner while shared directory changes wait to be sent
+        tv.tv_sec = share_pending || share_rescan || share_busy ? 0 : 1;
+        tv.tv_usec = share_pending || share_rescan || share_busy ? 50000 : 0;
+        nready = select(FD_SETSIZE, &rfds, NULL, NULL, &tv);
         if (nready < 0) {
             if (errno == EINTR) {
                 continue;
@@ -148,6 +879,7 @@ int main(int argc, char **argv)
             fprintf(stderr, "select error\n");
             break;
         }
+        conn_pool_reap(nready > 0 ? &rfds : NULL);
 
         // Check stdin for user input
         if (FD_ISSET(0, &rfds)) {
@@ -168,41 +900,86 @@ int main(int argc, char **argv)
             handle_udp_response();
         }
 
-        // Check TCP sockets for incoming connections
-        reg = reg_list;
-        while (reg) {
-            if (reg->tcp_socket >= 0 && FD_ISSET(reg->tcp_socket, &rfds)) {
-                int new_sd;
-                pid_t pid;
-
-                new_sd = accept(reg->tcp_socket, NULL, NULL);
-                if (new_sd >= 0) {
-                    pid = fork();
-                    if (pid == 0) {
-                        // Child
-                        close(reg->tcp_socket);
-                        handle_tcp_connection(new_sd, reg->content_name);
-                        close(new_sd);
-                        exit(0);
+        // Check TCP socket for incoming connections
+        if (FD_ISSET(listen_sock, &rfds)) {
+            new_sd = accept(listen_sock, NULL, NULL);
+            if (new_sd >= 0) {
+                fflush(stdout);
+                pid = fork();
+                if (pid == 0) {
+                    // Child
+                    close(listen_sock);
+                    if (stats_sock >= 0) {
+                        close(stats_sock);
                     }
-                    if (pid < 0) {
-                        fprintf(stderr, "fork error\n");
+                    if (fast_sock >= 0) {
+                        close(fast_sock);
                     }
+                    handle_tcp_connection(new_sd);
                     close(new_sd);
+                    exit(0);
+                }
+                if (pid < 0) {
+                    fprintf(stderr, "fork error\n");
+                }
+                close(new_sd);
+            }
+        }
+
+        if (fast_sock >= 0 && FD_ISSET(fast_sock, &rfds)) {
+            fast_serve();
+        }
+
+        if (stats_sock >= 0 && FD_ISSET(stats_sock, &rfds)) {
+            stats_serve(stats_sock);
+        }
+
+        // Count serves reported by upload children
+        if (FD_ISSET(serve_pipe[0], &rfds)) {
+            while ((n = read(serve_pipe[0], served, sizeof(served))) > 0) {
+                for (i = 0; i + CONTENT_NAME_SIZE <= n; i += CONTENT_NAME_SIZE) {
+                    memcpy(name, served + i, CONTENT_NAME_SIZE);
+                    name[CONTENT_NAME_SIZE] = '\0';
+                    cache_touch(name, 1);
                 }
             }
-            reg = reg->next;
         }
 
         // Reap zombie processes
-        while (waitpid(-1, NULL, WNOHANG) > 0) {
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            sched_reap(pid);
+        }
 
+        if (share_fd >= 0 && FD_ISSET(share_fd, &rfds)) {
+            share_events();
+        }
+        share_tick();
+
+        subs_renew();
+        notify_downloads();
+        replicate_tick();
+        if (dht_mode) {
+            dht_maintain();
         }
     }
 
     // Cleanup
+    cache_save();
+    if (replicate_enabled) {
+        heartbeat_send(0);
+    }
+    unsubscribe_all();
     deregister_all();
     free_reg_list();
+    conn_pool_close_all();
+    close(listen_sock);
+    if (fast_sock >= 0) {
+        close(fast_sock);
+    }
+    if (stats_sock >= 0) {
+        close(stats_sock);
+        unlink(stats_path);
+    }
     close(udp_sock);
     return 0;
 }
@@ -213,6 +990,12 @@ void handle_user_input(char *input)
     char cmd[32];
     char arg1[64];
     char arg2[64];
+    const char *names[MAX_DOWNLOAD_NAMES];
+    char *tok;
+    struct subscription *sub;
+    long long global_rate;
+    long long conn_rate;
+    int count;
     int n;
 
     cmd[0] = '\0';
@@ -229,10 +1012,23 @@ void handle_user_input(char *input)
         register_content(arg1, arg2);
     } else if (strcmp(cmd, "download") == 0) {
         if (n < 2) {
-            printf("Usage: download <content_name>\n");
+            printf("Usage: download <content_name> [content_name ...]\n");
+            return;
+        }
+        count = 0;
+        strtok(input, " \t");
+        while ((tok = strtok(NULL, " \t")) != NULL && count < MAX_DOWNLOAD_NAMES) {
+            names[count++] = tok;
+        }
+        download_contents(names, count);
+    } else if (strcmp(cmd, "download-batch") == 0) {
+        if (n < 2) {
+            printf("Usage: download-batch <file> [max_parallel]\n");
             return;
         }
-        search_and_download(arg1);
+        download_batch(arg1, n >= 3 ? atoi(arg2) : BATCH_DEFAULT_PARALLEL);
+    } else if (strcmp(cmd, "stats") == 0) {
+        stats_print();
     } else if (strcmp(cmd, "list") == 0) {
         list_contents();
     } else if (strcmp(cmd, "deregister") == 0) {
@@ -241,10 +1037,118 @@ void handle_user_input(char *input)
             return;
         }
         deregister_content(arg1);
+    } else if (strcmp(cmd, "share") == 0) {
+        if (n < 2) {
+            share_status();
+            return;
+        }
+        share_start(arg1);
+    } else if (strcmp(cmd, "unshare") == 0) {
+        if (!share_dir[0]) {
+            printf("No shared directory\n");
+            return;
+        }
+        share_stop(1);
+        share_save();
+    } else if (dht_mode && (strcmp(cmd, "subscribe") == 0 || strcmp(cmd, "unsubscribe") == 0 ||
+                            strcmp(cmd, "replicate") == 0)) {
+        printf("Error: '%s' needs an index server\n", cmd);
+    } else if (strcmp(cmd, "subscribe") == 0) {
+        if (n < 2) {
+            if (!sub_list) {
+                printf("No subscriptions\n");
+            }
+            for (sub = sub_list; sub; sub = sub->next) {
+                printf("  %s%s%s\n", sub->name, sub->prefix ? "*" : "",
+                       sub->download ? " (get)" : "");
+            }
+            return;
+        }
+        if (n >= 3 && strcmp(arg2, "get") != 0) {
+            printf("Usage: subscribe <content_name|prefix*> [get]\n");
+            return;
+        }
+        subscribe_content(arg1, n >= 3);
+    } else if (strcmp(cmd, "unsubscribe") == 0) {
+        if (n < 2) {
+            printf("Usage: unsubscribe <content_name|prefix*>\n");
+            return;
+        }
+        unsubscribe_content(arg1);
+    } else if (strcmp(cmd, "replicate") == 0) {
+        if (n >= 2 && strcmp(arg1, "on") != 0 && strcmp(arg1, "off") != 0) {
+            printf("Usage: replicate [on|off]\n");
+            return;
+        }
+        if (n >= 2) {
+            replicate_enabled = strcmp(arg1, "on") == 0;
+            heartbeat_send(replicate_enabled);
+        }
+        printf("Replication %s (%.1f MB spare in cache)\n",
+               replicate_enabled ? "enabled" : "disabled",
+               (cache_budget - cache_used) / 1048576.0);
+    } else if (strcmp(cmd, "compress") == 0) {
+        if (n < 2 || (strcmp(arg1, "on") != 0 && strcmp(arg1, "off") != 0)) {
+            printf("Usage: compress <on|off>\n");
+            return;
+        }
+        compression_enabled = strcmp(arg1, "on") == 0;
+        printf("Compressed downloads %s\n", compression_enabled ? "enabled" : "disabled");
+    } else if (strcmp(cmd, "fastpath") == 0) {
+        if (n >= 2) {
+            fast_max = atoll(arg1);
+            if (fast_max < 0) {
+                fast_max = 0;
+            } else if (fast_max > FAST_SEGMENT_SIZE * FAST_MAX_SEGMENTS) {
+                fast_max = FAST_SEGMENT_SIZE * FAST_MAX_SEGMENTS;
+            }
+        }
+        if (fast_max > 0) {
+            printf("Items up to %lld bytes are fetched and served over UDP%s\n", fast_max,
+                   fast_sock < 0 ? " (serving unavailable)" : "");
+        } else {
+            printf("UDP fast path disabled\n");
+        }
+    } else if (strcmp(cmd, "ratelimit") == 0) {
+        if (n >= 2) {
+            global_rate = 0;
+            conn_rate = sched->conn_rate;
+            if (parse_rate(arg1, &global_rate) < 0 || (n >= 3 && parse_rate(arg2, &conn_rate) < 0)) {
+                printf("Error: Upload limits must be whole numbers of KB/s\n");
+                return;
+            }
+            sched_set_limits(global_rate, conn_rate);
+        }
+        printf("Upload limits: global %lld KB/s, per connection %lld KB/s (0 = unlimited)\n",
+               sched->global_rate / 1024, sched->conn_rate / 1024);
+    } else if (strcmp(cmd, "cache") == 0) {
+        if (n >= 2) {
+            if (parse_megabytes(arg1, &cache_budget) < 0) {
+                printf("Error: Cache size must be a whole number of MB\n");
+                printf("Usage: cache [budget_MB]\n");
+                return;
+            }
+            cache_make_room(0);
+        }
+        cache_status();
     } else if (strcmp(cmd, "quit") == 0) {
         printf("Quitting...\n");
+        cache_save();
+        if (replicate_enabled) {
+            heartbeat_send(0);
+        }
+        unsubscribe_all();
         deregister_all();
         free_reg_list();
+        conn_pool_close_all();
+        close(listen_sock);
+        if (fast_sock >= 0) {
+            close(fast_sock);
+        }
+        if (stats_sock >= 0) {
+            close(stats_sock);
+            unlink(stats_path);
+        }
         close(udp_sock);
         exit(0);
     } else {
@@ -255,119 +1159,276 @@ void handle_user_input(char *input)
 // Register content with index server
 void register_content(const char *content_name, const char *filename)
 {
-    struct pdu out;
-    struct pdu in;
-    struct sockaddr_in tcp_addr;
+    struct content_meta meta;
+
+    if (file_meta(filename, &meta) < 0) {
+        printf("Error: Cannot open file '%s'\n", filename);
+        return;
+    }
+    register_content_meta(content_name, filename, &meta);
+}
+
+// Register content whose metadata is already known. Returns 0 on success.
+int register_content_meta(const char *content_name, const char *filename,
+                          const struct content_meta *meta)
+{
+    char req[PEER_NAME_SIZE + CONTENT_NAME_SIZE + 6 + CONTENT_META_SIZE];
+    char buf[PDU_MAX_DGRAM];
+    char msg[MAX_DATA_SIZE];
+    struct pdu_hdr h;
+    struct pdu_cursor c;
+    struct iovec iov;
     struct registered_content *existing;
-    struct registered_content *new_reg;
-    int tcp_sock;
     int fd;
+    int stored = 0;
     struct sockaddr_in local_addr;
-    socklen_t alen;
-    ssize_t n;
 
     // Check content name is valid
     if (strlen(content_name) > CONTENT_NAME_SIZE) {
         printf("Error: Content name too long (max %d characters)\n", CONTENT_NAME_SIZE);
-        return;
+        return -1;
     }
 
     // Check if already registered
     existing = find_registered_content(content_name);
     if (existing) {
         printf("Error: Content '%s' already registered\n", content_name);
-        return;
+        return -1;
     }
 
     // Check if file exists
     fd = open(filename, O_RDONLY);
     if (fd < 0) {
         printf("Error: Cannot open file '%s'\n", filename);
-        return;
+        return -1;
     }
     close(fd);
 
-    // Create TCP socket for other peers to connect and download
-    tcp_sock = create_tcp_socket_for_content(content_name, &tcp_addr);
-    if (tcp_sock < 0) {
-        printf("Error: Failed to create TCP socket\n");
-        return;
+    if (content_server_addr(&local_addr) < 0) {
+        return -1;
+    }
+    if (dht_mode) {
+        // Store our record on the nodes closest to the name
+        stored = dht_publish(content_name, my_peer_name, &local_addr, meta, DHT_RECORD_TTL);
+    } else {
+        // Prepare registration PDU:
+        // Peer Name (10 bytes) | Content Name (10 bytes) | IP (4 bytes) | Port (2 bytes)
+        // | Size (8 bytes) | Version (8 bytes) | Hash (8 bytes)
+        pdu_cursor_init(&c, req, sizeof(req));
+        pdu_put_name(&c, my_peer_name, PEER_NAME_SIZE);
+        pdu_put_name(&c, content_name, CONTENT_NAME_SIZE);
+        pdu_put_addr(&c, &local_addr);
+        pdu_put_meta(&c, meta);
+        iov.iov_base = req;
+        iov.iov_len = c.pos;
+
+        if (udp_transact('R', &iov, 1, buf, sizeof(buf), &h, &c) < 0) { // R for Registration
+            printf("Error: Registration request to index server failed\n");
+            return -1;
+        }
+        if (h.type == 'E') { // E for Error
+            pdu_get_text(&c, msg, sizeof(msg));
+            printf("Registration failed: %s\n", msg);
+            return -1;
+        }
+        if (h.type != 'A') { // A for Acknowledgement
+            return -1;
+        }
     }
 
+    if (!reg_add_local(content_name, filename, meta)) {
+        printf("Error: Memory allocation failed\n");
+        return -1;
+    }
+
+    if (batch_quiet) {
+        // download-batch reports aggregate progress instead
+    } else if (dht_mode) {
+        printf("Content '%s' registered successfully (TCP port: %d, stored on %d DHT node(s))\n",
+               content_name, ntohs(listen_addr.sin_port), stored);
+    } else {
+        printf("Content '%s' registered successfully (TCP port: %d)\n",
+               content_name, ntohs(listen_addr.sin_port));
+    }
+    return 0;
+}
+
+// Address other peers download our content from: the local IP the index
+// server (or the DHT) sees us at, with the TCP listening port
+int content_server_addr(struct sockaddr_in *addr)
+{
+    socklen_t alen = sizeof(*addr);
+
     // Get local IP address for registration from UDP socket
-    alen = sizeof(local_addr);
-    if (getsockname(udp_sock, (struct sockaddr *)&local_addr, &alen) < 0) {
+    if (dht_mode) {
+        *addr = dht_local_addr;
+    } else if (getsockname(udp_sock, (struct sockaddr *)addr, &alen) < 0) {
         printf("Error: Failed to get local IP address\n");
-        close(tcp_sock);
-        return;
+        return -1;
     }
 
-    if (local_addr.sin_addr.s_addr == INADDR_ANY ||
-        local_addr.sin_addr.s_addr == 0) {
+    if (addr->sin_addr.s_addr == INADDR_ANY ||
+        addr->sin_addr.s_addr == 0) {
         printf("Error: Could not determine local IP address\n");
-        close(tcp_sock);
-        return;
+        return -1;
     }
+    addr->sin_port = listen_addr.sin_port;
+    return 0;
+}
 
-    // Prepare registration PDU:
-    // Peer Name (10 bytes) | Content Name (10 bytes) | IP (4 bytes) | Port (2 bytes)
-    out.type = 'R';// R for Registration
-    memset(out.data, 0, MAX_DATA_SIZE);
-    strncpy(out.data, my_peer_name, PEER_NAME_SIZE);
-    strncpy(out.data + PEER_NAME_SIZE, content_name, CONTENT_NAME_SIZE);
-    memcpy(out.data + PEER_NAME_SIZE + CONTENT_NAME_SIZE,
-           &local_addr.sin_addr.s_addr, 4);
-    memcpy(out.data + PEER_NAME_SIZE + CONTENT_NAME_SIZE + 4,
-           &tcp_addr.sin_port, 2);
+// Send registration changes to the index server REG_BATCH_MAX per 'B' PDU
+// and apply the accepted ones to reg_list. Index servers that don't know
+// batches, and the DHT, get one request per item. Unless quiet, every
+// change is reported. Returns the number of changes that failed.
+int reg_flush(struct reg_update *ups, int count, int quiet)
+{
+    struct registered_content *reg;
+    char status[REG_BATCH_MAX];
+    int was_quiet = batch_quiet;
+    int failed = 0;
+    int first, k, i;
 
-    n = write(udp_sock, &out, 1 + PEER_NAME_SIZE + CONTENT_NAME_SIZE + 6);
-    if (n < 0) {
-        printf("Error: Failed to send registration\n");
-        close(tcp_sock);
-        return;
+    for (first = 0; first < count; first += k) {
+        k = count - first < REG_BATCH_MAX ? count - first : REG_BATCH_MAX;
+        if (!dht_mode && reg_batch_supported && reg_send_batch(ups + first, k, status) < 0) {
+            if (reg_batch_supported) {
+                failed += count - first;
+                break;
+            }
+        }
+
+        for (i = first; i < first + k; i++) {
+            reg = find_registered_content(ups[i].content_name);
+            if (dht_mode || !reg_batch_supported) {
+                // One request per item; an update is a new registration
+                batch_quiet = was_quiet || quiet;
+                if (reg && deregister_content(ups[i].content_name) < 0) {
+                    batch_quiet = was_quiet;
+                    failed++;
+                    continue;
+                }
+                if (ups[i].op == REG_ADD &&
+                    register_content_meta(ups[i].content_name, ups[i].filename, &ups[i].meta) == 0) {
+                    reg = find_registered_content(ups[i].content_name);
+                    reg->shared = ups[i].shared;
+                } else if (ups[i].op == REG_ADD) {
+                    failed++;
+                }
+                batch_quiet = was_quiet;
+                continue;
+            }
+
+            if (status[i - first] != 'A') {
+                failed++;
+                if (!quiet) {
+                    printf("%s of '%s' failed\n", ups[i].op == REG_ADD ? "Registration" : "Deregistration",
+                           ups[i].content_name);
+                }
+                continue;
+            }
+            if (ups[i].op == REG_REMOVE) {
+                if (reg) {
+                    reg_remove_local(reg);
+                }
+                if (!quiet) {
+                    printf("Content '%s' deregistered successfully\n", ups[i].content_name);
+                }
+                continue;
+            }
+            if (!reg) {
+                reg = reg_add_local(ups[i].content_name, ups[i].filename, &ups[i].meta);
+                if (!reg) {
+                    failed++;
+                    continue;
+                }
+            } else if (strcmp(reg->filename, ups[i].filename) != 0 ||
+                       reg->meta.size != ups[i].meta.size ||
+                       reg->meta.version != ups[i].meta.version ||
+                       reg->meta.hash != ups[i].meta.hash) {
+                reg_changed();  // upload children may be serving the old content
+            }
+            strncpy(reg->filename, ups[i].filename, sizeof(reg->filename) - 1);
+            reg->meta = ups[i].meta;
+            reg->shared = ups[i].shared;
+            if (!quiet) {
+                printf("Content '%s' registered successfully (TCP port: %d)\n",
+                       ups[i].content_name, ntohs(listen_addr.sin_port));
+            }
+        }
     }
+    return failed;
+}
 
-    // Wait for response
-    n = read(udp_sock, &in, sizeof(in));
-    if (n < 0) {
-        printf("Error: Failed to receive response\n");
-        close(tcp_sock);
-        return;
+// Send one 'B' PDU of up to REG_BATCH_MAX changes and fill in the status of
+// each. Returns -1 if the request failed; reg_batch_supported is cleared if
+// the index server doesn't know batches.
+int reg_send_batch(struct reg_update *ups, int count, char *status)
+{
+    char req[REG_BATCH_SIZE];
+    char buf[PDU_MAX_DGRAM];
+    char msg[MAX_DATA_SIZE];
+    const char *st;
+    struct pdu_hdr h;
+    struct pdu_cursor c;
+    struct iovec iov;
+    struct sockaddr_in addr;
+    struct content_meta none;
+    int i;
+
+    if (content_server_addr(&addr) < 0) {
+        return -1;
     }
+    memset(&none, 0, sizeof(none));
 
-    if (in.type == 'A') { // A for Acknowledgement
-        new_reg = (struct registered_content *)malloc(sizeof(struct registered_content));
-        if (new_reg) {
-            memset(new_reg, 0, sizeof(*new_reg));
-            strncpy(new_reg->peer_name, my_peer_name, PEER_NAME_SIZE);
-            strncpy(new_reg->content_name, content_name, CONTENT_NAME_SIZE);
-            strncpy(new_reg->filename, filename, sizeof(new_reg->filename) - 1);
-            new_reg->tcp_socket = tcp_sock;
-            memcpy(&new_reg->tcp_addr, &tcp_addr, sizeof(tcp_addr));
-            new_reg->next = reg_list; // Add to the front of the list
-            reg_list = new_reg;
+    // Format: Peer Name (10 bytes) | Count (1 byte) | [Op (1 byte) | Content Name (10 bytes)
+    //         | IP (4 bytes) | Port (2 bytes) | metadata (24 bytes)] x Count
+    pdu_cursor_init(&c, req, sizeof(req));
+    pdu_put_name(&c, my_peer_name, PEER_NAME_SIZE);
+    pdu_put_u8(&c, count);
+    for (i = 0; i < count; i++) {
+        pdu_put_u8(&c, ups[i].op);
+        pdu_put_name(&c, ups[i].content_name, CONTENT_NAME_SIZE);
+        if (ups[i].op == REG_ADD) {
+            pdu_put_addr(&c, &addr);
+            pdu_put_meta(&c, &ups[i].meta);
+        } else {
+            pdu_put_zero(&c, 6);
+            pdu_put_meta(&c, &none);
+        }
+    }
+    iov.iov_base = req;
+    iov.iov_len = c.pos;
 
-            printf("Content '%s' registered successfully (TCP port: %d)\n",
-                   content_name, ntohs(tcp_addr.sin_port));
+    if (udp_transact('B', &iov, 1, buf, sizeof(buf), &h, &c) < 0) { // B for Batch registration
+        printf("Error: Registration request to index server failed\n");
+        return -1;
+    }
+    if (h.type == 'E') {
+        pdu_get_text(&c, msg, sizeof(msg));
+        if (strcmp(msg, "Unknown PDU type") == 0) {
+            reg_batch_supported = 0;    // older index server
         } else {
-            close(tcp_sock);
-            printf("Error: Memory allocation failed\n");
+            printf("Registration failed: %s\n", msg);
         }
-    } else if (in.type == 'E') {// E for Error
-        in.data[MAX_DATA_SIZE - 1] = '\0';
-        printf("Registration failed: %s\n", in.data);
-        close(tcp_sock);
+        return -1;
+    }
+    // Reply: Count (1 byte) | Status (1 byte) x Count
+    if (h.type != 'A' || pdu_get_u8(&c) != (unsigned int)count ||
+        (st = pdu_get_bytes(&c, count)) == NULL) {
+        printf("Error: Malformed batch registration reply\n");
+        return -1;
     }
+    memcpy(status, st, count);
+    return 0;
 }
 
-// Create TCP socket for content so other peers can download
-int create_tcp_socket_for_content(const char *content_name, struct sockaddr_in *addr)
+// Create the TCP socket other peers connect to for downloads. One socket
+// serves every item this peer registers.
+int create_listen_socket(struct sockaddr_in *addr)
 {
     int sock;
     socklen_t alen;
 
-    (void)content_name; // unused parameter
-
     sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
         return -1;
@@ -389,7 +1450,7 @@ int create_tcp_socket_for_content(const char *content_name, struct sockaddr_in *
         return -1;
     }
 
-    if (listen(sock, 5) < 0) {
+    if (listen(sock, LISTEN_BACKLOG) < 0) {
         close(sock);
         return -1;
     }
@@ -400,340 +1461,5404 @@ int create_tcp_socket_for_content(const char *content_name, struct sockaddr_in *
 // Search for content and download
 void search_and_download(const char *content_name)
 {
-    struct pdu out;
-    struct pdu in;
-    struct sockaddr_in server_addr;
-    int tcp_sock;
-    char filename[256];
-    int fd;
-    char buffer[BUFLEN];
-    ssize_t n;
-    ssize_t total;
-    ssize_t data_size;
-    ssize_t written;
+    download_contents(&content_name, 1);
+}
 
-    // Send search request
-    out.type = 'S';// S for Search for content and server
-    memset(out.data, 0, MAX_DATA_SIZE);
-    strncpy(out.data, content_name, CONTENT_NAME_SIZE); // Send Content Name in data
+// Look up content on the index server
+int lookup_content(const char *content_name, struct lookup_result *res)
+{
+    char req[CONTENT_NAME_SIZE + 1];
+    char buf[PDU_MAX_DGRAM];
+    char msg[MAX_DATA_SIZE];
+    struct pdu_hdr h;
+    struct pdu_cursor c;
+    struct iovec iov;
+    struct sockaddr_in addr[SEARCH_MAX_CANDIDATES];
+    struct content_meta meta[SEARCH_MAX_CANDIDATES];
+    int n;
+    int i;
 
-    n = write(udp_sock, &out, 1 + CONTENT_NAME_SIZE);
-    if (n < 0) {
-        printf("Error: Failed to send search request\n");
-        return;
+    if (dht_mode) {
+        return dht_lookup_content(content_name, res);
     }
 
-    // Wait for response
-    n = read(udp_sock, &in, sizeof(in));
-    if (n < 0) {
-        printf("Error: Failed to receive search response\n");
-        return;
+    // Send search request: Content Name (10 bytes) | Count (1 byte)
+    pdu_cursor_init(&c, req, sizeof(req));
+    pdu_put_name(&c, content_name, CONTENT_NAME_SIZE);
+    pdu_put_u8(&c, SEARCH_MAX_CANDIDATES);
+    iov.iov_base = req;
+    iov.iov_len = c.pos;
+
+    if (udp_transact('S', &iov, 1, buf, sizeof(buf), &h, &c) < 0) { // S for Search
+        printf("Error: Search request to index server failed\n");
+        return -1;
     }
 
-    if (in.type == 'E') {
-        in.data[MAX_DATA_SIZE - 1] = '\0';
-        printf("Search failed: %s\n", in.data);
-        return;
+    if (h.type == 'E') {
+        pdu_get_text(&c, msg, sizeof(msg));
+        printf("Search for '%s' failed: %s\n", content_name, msg);
+        return -1;
     }
 
-    // Extract server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    memcpy(&server_addr.sin_addr.s_addr, in.data, 4);
-    memcpy(&server_addr.sin_port, in.data + 4, 2);
+    // Extract server address: IP (4 bytes) | Port (2 bytes) [| metadata]
+    // and further candidates, each IP | Port | metadata
+    n = h.type == 'S' ? pdu_parse_search_reply(&c, addr, meta, SEARCH_MAX_CANDIDATES) : -1;
+    if (n < 0) {
+        printf("Search for '%s' failed: Malformed response\n", content_name);
+        return -1;
+    }
+    memset(res, 0, sizeof(*res));
+    res->addr = addr[0];
+    res->meta = meta[0];
+    for (i = 1; i < n; i++) {
+        res->alt_addr[res->alt_count] = addr[i];
+        res->alt_meta[res->alt_count] = meta[i];
+        res->alt_count++;
+    }
+
+    if (!batch_quiet) {
+        printf("Found content server for '%s': %s:%d\n", content_name,
+               inet_ntoa(res->addr.sin_addr), ntohs(res->addr.sin_port));
+    }
+    return 0;
+}
+
+// Download several items. Items served by the same peer are requested
+// back to back on one pooled connection.
+void download_contents(const char **names, int count)
+{
+    struct download_job *jobs;
+    struct download_job **group;
+    int i, j, k;
+
+    jobs = (struct download_job *)calloc(count, sizeof(*jobs));
+    group = (struct download_job **)calloc(count, sizeof(*group));
+    if (!jobs || !group) {
+        printf("Error: Memory allocation failed\n");
+        free(jobs);
+        free(group);
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        strncpy(jobs[i].content_name, names[i], CONTENT_NAME_SIZE);
+    }
+    lookup_contents(jobs, count);
+    for (i = 0; i < count; i++) {
+        if (jobs[i].state == JOB_PENDING) {
+            jobs[i].state = job_prepare(&jobs[i]);
+        }
+    }
+    fetch_small(jobs, count);
+
+    for (i = 0; i < count; i++) {
+        if (jobs[i].state != JOB_PENDING) {
+            continue;
+        }
+        k = 0;
+        for (j = i; j < count; j++) {
+            if (jobs[j].state == JOB_PENDING &&
+                jobs[j].res.addr.sin_addr.s_addr == jobs[i].res.addr.sin_addr.s_addr &&
+                jobs[j].res.addr.sin_port == jobs[i].res.addr.sin_port) {
+                group[k++] = &jobs[j];
+            }
+        }
+        fetch_pipelined(group, k);
+        for (j = 0; j < k; j++) {
+            while (job_retry(group[j])) {
+                fetch_pipelined(&group[j], 1);
+            }
+            job_finish(group[j]);
+        }
+    }
+
+    free(jobs);
+    free(group);
+}
+
+// Look up several items with 'M' PDUs, LOOKUP_BATCH_MAX names per datagram.
+// Items that aren't found are marked JOB_FAILED. Falls back to one 'S' per
+// item if the index server doesn't understand 'M'.
+void lookup_contents(struct download_job *jobs, int count)
+{
+    char req[1 + LOOKUP_BATCH_MAX * CONTENT_NAME_SIZE];
+    char buf[PDU_MAX_DGRAM];
+    struct pdu_hdr h;
+    struct pdu_cursor c;
+    struct iovec iov;
+    struct download_job *job;
+    int first;
+    int k;
+    int i;
+
+    if (dht_mode) {
+        for (i = 0; i < count; i++) {
+            if (lookup_content(jobs[i].content_name, &jobs[i].res) < 0) {
+                jobs[i].state = JOB_FAILED;
+            }
+        }
+        return;
+    }
+
+    for (first = 0; first < count; first += k) {
+        k = count - first < LOOKUP_BATCH_MAX ? count - first : LOOKUP_BATCH_MAX;
+
+        // Format: Count (1 byte) | Content Name (10 bytes) x Count
+        pdu_cursor_init(&c, req, sizeof(req));
+        pdu_put_u8(&c, k);
+        for (i = 0; i < k; i++) {
+            pdu_put_name(&c, jobs[first + i].content_name, CONTENT_NAME_SIZE);
+        }
+        iov.iov_base = req;
+        iov.iov_len = c.pos;
+        if (udp_transact('M', &iov, 1, buf, sizeof(buf), &h, &c) < 0) {
+            printf("Error: Failed to look up content\n");
+            for (i = first; i < count; i++) {
+                jobs[i].state = JOB_FAILED;
+            }
+            return;
+        }
+
+        if (h.type != 'M' || pdu_parse_lookup_reply(&c, k) < 0) {
+            // Index server without multi-name search
+            for (i = first; i < count; i++) {
+                if (lookup_content(jobs[i].content_name, &jobs[i].res) < 0) {
+                    jobs[i].state = JOB_FAILED;
+                }
+            }
+            return;
+        }
+
+        // Each result: Status (1 byte) | IP (4 bytes) | Port (2 bytes) | metadata
+        for (i = 0; i < k; i++) {
+            job = &jobs[first + i];
+            memset(&job->res, 0, sizeof(job->res));
+            if (pdu_parse_lookup_result(&c, &job->res.addr, &job->res.meta) <= 0) {
+                printf("Search for '%s' failed: Content not found\n", job->content_name);
+                job->state = JOB_FAILED;
+                continue;
+            }
+            if (!batch_quiet) {
+                printf("Found content server for '%s': %s:%d\n", job->content_name,
+                       inet_ntoa(job->res.addr.sin_addr), ntohs(job->res.addr.sin_port));
+            }
+        }
+    }
+}
+
+// Decide whether a looked-up item needs fetching and make room for it.
+// Returns JOB_PENDING if it should be downloaded, JOB_DONE if the local
+// copy is already current.
+int job_prepare(struct download_job *job)
+{
+    struct content_meta local;
+    struct stat sb;
+    struct cache_entry *old;
+    const struct content_meta *meta = &job->res.meta;
+    struct sockaddr_in self;
+    long long incoming = meta->size;
+
+    // Skip the transfer if we already hold this exact version
+    snprintf(job->filename, sizeof(job->filename), "%s/downloaded_%s",
+             CACHE_DIR, job->content_name);
+    snprintf(job->tmpname, sizeof(job->tmpname), "%s/.part_%s", CACHE_DIR, job->content_name);
+    if (meta->hash != 0 && stat(job->filename, &sb) == 0 && (uint64_t)sb.st_size == meta->size &&
+        file_meta(job->filename, &local) == 0 && local.hash == meta->hash) {
+        if (!batch_quiet) {
+            printf("'%s' is already up to date (%llu bytes), skipping download\n",
+                   job->filename, (unsigned long long)meta->size);
+        }
+        cache_touch(job->content_name, 0);
+        if (!find_registered_content(job->content_name)) {
+            register_content_meta(job->content_name, job->filename, &local);
+        }
+        return JOB_DONE;
+    }
+
+    // Make room in the cache before the transfer. Any old copy stays cached
+    // until job_finish has verified the new version and moved it over the
+    // old one, so only the growth needs room. A large old copy is also the
+    // base for fetching only the changed chunks.
+    old = cache_find(job->content_name);
+    if (old) {
+        delta_prepare(job, old);
+        cache_touch(job->content_name, 0);
+        incoming = meta->size > old->meta.size ? (long long)(meta->size - old->meta.size) : 0;
+    }
+
+    // While we serve the old copy the index server may hand us out as well;
+    // our main loop is busy with this download, so never fetch from ourselves
+    if (find_registered_content(job->content_name) && content_server_addr(&self) == 0) {
+        job->tried[job->tried_count++] = self;
+        if (job->res.addr.sin_addr.s_addr == self.sin_addr.s_addr &&
+            job->res.addr.sin_port == self.sin_port && job_failover(job) < 0) {
+            delta_release(&job->base);
+            printf("Error: No other server holds '%s'\n", job->content_name);
+            return JOB_FAILED;
+        }
+    }
+    if (cache_make_room(incoming) < 0) {
+        delta_release(&job->base);
+        printf("Error: Content cache is full (budget %lld MB)\n", cache_budget / (1024 * 1024));
+        return JOB_FAILED;
+    }
+    return JOB_PENDING;
+}
+
+// Fetch a group of items from the same content server over one connection.
+// All requests are written before the first response is read; responses
+// come back in request order. If a pooled connection turns out to be stale,
+// the items it didn't deliver are retried once on a fresh connection, as
+// they are after a server that doesn't know delta downloads misread a
+// manifest, or one that doesn't know XFER_REQ_TYPE turned a request down.
+void fetch_pipelined(struct download_job **jobs, int count)
+{
+    struct peer_conn *conn;
+    struct stream_reader *r;
+    char *reqs;
+    size_t reqs_size;
+    struct pdu_cursor c;
+    int first = 0;
+    int i, j;
+    int rc;
+    int reusable;
+    int resend;
+    int plain = 0;          // the server only takes plain 'D' requests
+
+    reqs_size = (size_t)count * XFER_REQ_SIZE;
+    for (i = 0; i < count; i++) {
+        reqs_size += jobs[i]->base.manifest_len;
+    }
+    r = (struct stream_reader *)malloc(sizeof(*r));
+    reqs = (char *)malloc(reqs_size);
+    if (!r || !reqs) {
+        for (i = 0; i < count; i++) {
+            jobs[i]->state = JOB_FAILED;
+            snprintf(jobs[i]->err_msg, sizeof(jobs[i]->err_msg), "Memory allocation failed");
+        }
+        free(r);
+        free(reqs);
+        return;
+    }
+
+    while (first < count) {
+        conn = conn_acquire(&jobs[first]->res.addr);
+        if (!conn) {
+            for (i = first; i < count; i++) {
+                jobs[i]->state = JOB_FAILED;
+                jobs[i]->conn_failed = 1;
+                snprintf(jobs[i]->err_msg, sizeof(jobs[i]->err_msg),
+                         "Failed to connect to content server");
+            }
+            break;
+        }
+
+        // Send every outstanding request at once
+        pdu_cursor_init(&c, reqs, reqs_size);
+        for (i = first; i < count; i++) {
+            jobs[i]->req_id = conn->next_req_id++;
+            pdu_put_u8(&c, plain ? 'D' : XFER_REQ_TYPE);
+            pdu_put_name(&c, jobs[i]->content_name, CONTENT_NAME_SIZE);
+            pdu_put_u8(&c, XFER_OPT_KEEPALIVE | (compression_enabled ? XFER_OPT_LZ : 0) |
+                           (jobs[i]->base.manifest ? XFER_OPT_DELTA : 0));
+            pdu_put_u32(&c, jobs[i]->req_id);
+            if (jobs[i]->base.manifest) {
+                pdu_put_bytes(&c, jobs[i]->base.manifest, jobs[i]->base.manifest_len);
+            }
+        }
+        reusable = write_all(conn->sock, reqs, c.pos) == 0;
+        for (i = first; i < count; i++) {
+            jobs[i]->start_ns = now_ns();
+        }
+
+        r->fd = conn->sock;
+        r->pos = 0;
+        r->len = 0;
+        resend = 0;
+        for (i = first; reusable && i < count; i++) {
+            if (sink_open(&jobs[i]->sink, jobs[i]->tmpname, jobs[i]->res.meta.size) < 0) {
+                snprintf(jobs[i]->err_msg, sizeof(jobs[i]->err_msg), "Failed to create output file");
+                jobs[i]->state = JOB_FAILED;
+                reusable = 0;
+                i++;
+                break;
+            }
+            memset(&jobs[i]->st, 0, sizeof(jobs[i]->st));
+            rc = receive_content(r, &jobs[i]->sink, &jobs[i]->st, jobs[i]->req_id,
+                                 jobs[i]->base.manifest ? &jobs[i]->base : NULL,
+                                 jobs[i]->err_msg, sizeof(jobs[i]->err_msg));
+            jobs[i]->done_ns = now_ns();
+            if (sink_close(&jobs[i]->sink) < 0 && rc == 0) {
+                snprintf(jobs[i]->err_msg, sizeof(jobs[i]->err_msg), "Failed to write file");
+                rc = RECV_REMOTE_ERROR;
+            }
+            if (rc == 0) {
+                jobs[i]->state = JOB_DONE;
+                reusable = (jobs[i]->st.options & XFER_OPT_KEEPALIVE) != 0;
+                if (jobs[i]->base.manifest && !(jobs[i]->st.options & XFER_OPT_DELTA)) {
+                    // The item came in full and the server took our manifest
+                    // for more requests: fetch the rest in full on a fresh
+                    // connection
+                    for (j = i + 1; j < count; j++) {
+                        delta_release(&jobs[j]->base);
+                    }
+                    resend = 1;
+                    reusable = 0;
+                    i++;
+                    break;
+                }
+                continue;
+            }
+            unlink(jobs[i]->tmpname);
+            if (!plain && rc == RECV_REMOTE_ERROR && jobs[i]->st.options == 0 &&
+                strcmp(jobs[i]->err_msg, "Invalid download request") == 0) {
+                // A server from before XFER_REQ_TYPE: it takes the same
+                // request with a plain 'D' and ignores what follows the name
+                plain = 1;
+                resend = 1;
+                reusable = 0;
+                break;
+            }
+            if (rc == RECV_STREAM_ERROR) {
+                reusable = 0;
+            }
+            if (!conn->reused && (rc != RECV_STREAM_ERROR || i == first)) {
+                jobs[i]->state = JOB_FAILED;
+                jobs[i]->remote_failed = 1;
+                continue;
+            }
+            // Stale pooled connection, or a server that closed the
+            // connection after some of the responses (as upload children do
+            // when their registry changes): retry from here on a fresh one
+            resend = 1;
+            reusable = 0;
+            break;
+        }
+
+        if (i < count && !reusable && (conn->reused || resend)) {
+            conn_release(conn, 0);
+            first = i;
+            while (first < count && jobs[first]->state != JOB_PENDING) {
+                first++;
+            }
+            continue;
+        }
+        for (; i < count; i++) {
+            if (jobs[i]->state == JOB_PENDING) {
+                jobs[i]->state = JOB_FAILED;
+                snprintf(jobs[i]->err_msg, sizeof(jobs[i]->err_msg), "Connection aborted");
+            }
+        }
+        conn_release(conn, reusable);
+        break;
+    }
+
+    free(r);
+    free(reqs);
+}
+
+// Verify a fetched item, move it over the cached copy, report it, and add
+// it to the cache and the index. A failed fetch leaves the cached copy as it
+// was.
+void job_finish(struct download_job *job)
+{
+    struct content_meta local;
+    struct stat sb;
+    struct cache_entry *old;
+    struct registered_content *reg;
+    struct reg_update up;
+    struct xfer_stats *st = &job->st;
+
+    delta_release(&job->base);
+    if (job->state == JOB_DONE && job->res.meta.hash != 0 &&
+        job->sink.hash != job->res.meta.hash) {
+        snprintf(job->err_msg, sizeof(job->err_msg), "Content hash mismatch");
+        job->state = JOB_FAILED;
+        job->remote_failed = 1;
+    }
+    if (job->state == JOB_DONE && rename(job->tmpname, job->filename) < 0) {
+        snprintf(job->err_msg, sizeof(job->err_msg), "Cannot move the download into the cache");
+        job->state = JOB_FAILED;
+    }
+    if (job->state == JOB_FAILED) {
+        unlink(job->tmpname);
+    }
+    if (job->start_ns) {
+        stats_transfer(0, job->state == JOB_DONE, st, job->start_ns, job->done_ns);
+    }
+    if (job->state == JOB_FAILED) {
+        if (job->err_msg[0]) {
+            printf("Download of '%s' failed: %s\n", job->content_name, job->err_msg);
+        }
+        if (job->remote_failed) {
+            report_failure(FAIL_TRANSFER, job->content_name, &job->res.addr);
+        }
+        return;
+    }
+    if (batch_quiet) {
+        // download-batch reports aggregate progress instead
+    } else if (st->fast) {
+        printf("Downloaded %llu bytes to '%s' over UDP\n", (unsigned long long)st->raw_bytes,
+               job->filename);
+    } else if (st->reused_bytes > 0) {
+        printf("Downloaded %llu bytes to '%s' (%llu reused from the old copy, %llu on the wire)\n",
+               (unsigned long long)st->raw_bytes, job->filename,
+               (unsigned long long)st->reused_bytes, (unsigned long long)st->wire_bytes);
+    } else if (st->wire_bytes > 0 && st->wire_bytes != st->raw_bytes) {
+        printf("Downloaded %llu bytes to '%s' (%llu on the wire, ratio %.2f, %.2f ms decompress CPU)\n",
+               (unsigned long long)st->raw_bytes, job->filename,
+               (unsigned long long)st->wire_bytes,
+               (double)st->raw_bytes / st->wire_bytes, st->cpu_ns / 1e6);
+    } else {
+        printf("Downloaded %llu bytes to '%s'\n", (unsigned long long)st->raw_bytes, job->filename);
+    }
+
+    // Keep it in the cache in place of the old copy and auto-register as
+    // content server, updating the registration of the old copy if any
+    local.size = st->raw_bytes;
+    local.version = stat(job->filename, &sb) == 0 ? sb.st_mtime : 0;
+    local.hash = job->sink.hash;
+    old = cache_find(job->content_name);
+    if (old) {
+        cache_forget(old);
+    }
+    cache_insert(job->content_name, job->filename, &local);
+    cache_make_room(0);
+    if (!cache_find(job->content_name)) {
+        return;
+    }
+    reg = find_registered_content(job->content_name);
+    if (!reg) {
+        register_content_meta(job->content_name, job->filename, &local);
+        return;
+    }
+    memset(&up, 0, sizeof(up));
+    up.op = REG_ADD;
+    strncpy(up.content_name, job->content_name, CONTENT_NAME_SIZE);
+    strncpy(up.filename, job->filename, sizeof(up.filename) - 1);
+    up.meta = local;
+    up.shared = reg->shared;
+    reg_flush(&up, 1, batch_quiet);
+}
+
+// Fetch the pending items of at most fast_max bytes over the UDP fast path,
+// FAST_WINDOW at a time. Each item costs one 'G' datagram answered by one
+// datagram per segment, so it arrives a single round trip after the lookup.
+// Items that don't arrive, or that the server won't send this way, stay
+// JOB_PENDING for the TCP path; fetched ones are finished here and have
+// st.fast set.
+void fetch_small(struct download_job *jobs, int count)
+{
+    struct fast_fetch ff[FAST_WINDOW];
+    struct download_job *job;
+    int i = 0;
+    int k;
+
+    if (fast_max <= 0) {
+        return;
+    }
+    while (i < count) {
+        k = 0;
+        for (; i < count && k < FAST_WINDOW; i++) {
+            job = &jobs[i];
+            if (job->state != JOB_PENDING || job->res.meta.size == 0 ||
+                job->res.meta.size > (uint64_t)fast_max ||
+                job->res.meta.size > FAST_SEGMENT_SIZE * FAST_MAX_SEGMENTS ||
+                job->base.manifest || fast_server_off(&job->res.addr)) {
+                continue;
+            }
+            memset(&ff[k], 0, sizeof(ff[k]));
+            ff[k].job = job;
+            ff[k].segments = (job->res.meta.size + FAST_SEGMENT_SIZE - 1) / FAST_SEGMENT_SIZE;
+            k++;
+        }
+        if (k > 0) {
+            fast_fetch_window(ff, k);
+        }
+    }
+}
+
+// Run one window of fast-path fetches: send every request, then collect
+// segments until each item is complete or has been asked for FAST_TRIES
+// times. Items of the same server share a connected socket, so a server
+// without the fast path is noticed from the ICMP error as soon as it comes.
+void fast_fetch_window(struct fast_fetch *ff, int count)
+{
+    struct pollfd pfds[FAST_WINDOW];
+    long long rto_ns = fast_rto_ns();
+    long long now;
+    long long next;
+    int npfd;
+    int answered;
+    int i, j;
+
+    for (i = 0; i < count; i++) {
+        ff[i].sock = -1;
+        for (j = 0; j < i; j++) {
+            if (ff[j].sock >= 0 &&
+                ff[j].job->res.addr.sin_addr.s_addr == ff[i].job->res.addr.sin_addr.s_addr &&
+                ff[j].job->res.addr.sin_port == ff[i].job->res.addr.sin_port) {
+                ff[i].sock = ff[j].sock;
+                break;
+            }
+        }
+        if (ff[i].sock < 0) {
+            ff[i].sock = socket(AF_INET, SOCK_DGRAM, 0);
+            if (ff[i].sock >= 0 && connect(ff[i].sock, (struct sockaddr *)&ff[i].job->res.addr,
+                                           sizeof(ff[i].job->res.addr)) < 0) {
+                close(ff[i].sock);
+                ff[i].sock = -1;
+            }
+        }
+        ff[i].data = (char *)malloc(ff[i].segments * FAST_SEGMENT_SIZE);
+        if (ff[i].sock < 0 || !ff[i].data || fast_request(&ff[i], rto_ns) < 0) {
+            ff[i].done = -1;
+        }
+    }
+
+    for (;;) {
+        // Wait on every socket with items outstanding, until the earliest
+        // retransmission is due
+        npfd = 0;
+        next = 0;
+        for (i = 0; i < count; i++) {
+            if (ff[i].done) {
+                continue;
+            }
+            if (next == 0 || ff[i].deadline_ns < next) {
+                next = ff[i].deadline_ns;
+            }
+            for (j = 0; j < npfd && pfds[j].fd != ff[i].sock; j++) {
+            }
+            if (j == npfd) {
+                pfds[npfd].fd = ff[i].sock;
+                pfds[npfd].events = POLLIN;
+                npfd++;
+            }
+        }
+        if (npfd == 0) {
+            break;
+        }
+        now = now_ns();
+        if (poll(pfds, npfd, next > now ? (int)((next - now + 999999) / 1000000) : 0) > 0) {
+            for (j = 0; j < npfd; j++) {
+                if (pfds[j].revents) {
+                    fast_receive(ff, count, pfds[j].fd, rto_ns);
+                }
+            }
+        }
+
+        now = now_ns();
+        for (i = 0; i < count; i++) {
+            if (ff[i].done || ff[i].deadline_ns > now) {
+                continue;
+            }
+            if (ff[i].tries < FAST_TRIES && fast_request(&ff[i], rto_ns) == 0) {
+                continue;
+            }
+            ff[i].done = -1;
+
+            // Leave a server that never answered to TCP for a while
+            answered = 0;
+            for (j = 0; j < count; j++) {
+                if (ff[j].sock == ff[i].sock && (ff[j].have || ff[j].done > 0)) {
+                    answered = 1;
+                }
+            }
+            if (!answered) {
+                fast_server_note_off(&ff[i].job->res.addr);
+            }
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < i && ff[j].sock != ff[i].sock; j++) {
+        }
+        if (j == i && ff[i].sock >= 0) {
+            close(ff[i].sock);
+        }
+        free(ff[i].data);
+    }
+}
+
+// Ask for the segments of f not received yet, backing off exponentially.
+// Without a cookie from the server the request is padded to FAST_REQ_PAD,
+// which is what the server's first answer is measured against.
+// Returns 0, or -1 if the request can't be sent.
+int fast_request(struct fast_fetch *f, long long rto_ns)
+{
+    char req[FAST_REQ_PAD - PDU_HDR_SIZE];
+    struct pdu_cursor c;
+    struct pdu_hdr h;
+    struct iovec iov;
+    uint64_t cookie;
+    uint32_t all;
+
+    all = f->segments == 32 ? 0xffffffffU : (1U << f->segments) - 1;
+    if (f->tries == 0) {
+        f->job->req_id = fast_next_req_id++;
+        f->start_ns = now_ns();
+    }
+
+    // Format: Content Name (10 bytes) | Wanted (4 bytes) | Cookie (8 bytes) | padding
+    cookie = fast_cookie_for(&f->job->res.addr);
+    pdu_cursor_init(&c, req, sizeof(req));
+    pdu_put_name(&c, f->job->content_name, CONTENT_NAME_SIZE);
+    pdu_put_u32(&c, all & ~f->have & ~f->inflight);
+    pdu_put_u64(&c, cookie);
+    if (!cookie) {
+        pdu_put_zero(&c, sizeof(req) - c.pos);
+    }
+    f->inflight = 0;
+    iov.iov_base = req;
+    iov.iov_len = c.pos;
+    h.type = 'G';
+    h.flags = PDU_FLAG_HDR;
+    h.req_id = f->job->req_id;
+    if (pdu_sendv(f->sock, &h, &iov, 1, NULL, 0) < 0) {
+        return -1;
+    }
+    f->deadline_ns = now_ns() + (rto_ns << f->tries);
+    f->tries++;
+    return 0;
+}
+
+// Take the segments waiting on sock. An item whose server refuses the fast
+// path, or whose segments don't match the lookup, is left to TCP. A cookie
+// from the server is kept, and the segments its first answer left out are
+// asked for again with it straight away.
+void fast_receive(struct fast_fetch *ff, int count, int sock, long long rto_ns)
+{
+    char buf[PDU_HDR_SIZE + FAST_HDR_SIZE + FAST_SEGMENT_SIZE];
+    struct pdu_hdr h;
+    struct pdu_cursor c;
+    struct content_meta meta;
+    struct fast_fetch *f;
+    const char *data;
+    char *payload;
+    ssize_t n;
+    size_t len;
+    uint64_t cookie;
+    uint32_t sent;
+    uint32_t all;
+    int seg, segments;
+    int polls;
+    int i;
+
+    for (polls = 0; polls < FAST_WINDOW * 4; polls++) {
+        n = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno != ECONNREFUSED) {
+                return;
+            }
+            // Nothing listens on the server's UDP port: an older peer
+            for (i = 0; i < count; i++) {
+                if (ff[i].sock == sock && !ff[i].done) {
+                    ff[i].done = -1;
+                    fast_server_note_off(&ff[i].job->res.addr);
+                }
+            }
+            return;
+        }
+        if (pdu_decode(buf, n, &h, &payload) < 0 || !(h.flags & PDU_FLAG_HDR)) {
+            continue;
+        }
+        f = NULL;
+        for (i = 0; i < count; i++) {
+            if (ff[i].sock == sock && !ff[i].done && ff[i].tries > 0 &&
+                ff[i].job->req_id == h.req_id) {
+                f = &ff[i];
+                break;
+            }
+        }
+        if (!f) {
+            continue;   // late duplicate
+        }
+        all = f->segments == 32 ? 0xffffffffU : (1U << f->segments) - 1;
+        if (h.type == 'V') {
+            // Format: Cookie (8 bytes) | Sent (4 bytes)
+            pdu_cursor_init(&c, payload, h.len);
+            cookie = pdu_get_u64(&c);
+            sent = pdu_get_u32(&c);
+            if (c.err || cookie == 0) {
+                f->done = -1;
+                continue;
+            }
+            fast_cookie_keep(&f->job->res.addr, cookie);
+            f->inflight = sent;
+            if ((all & ~f->have & ~sent) && fast_request(f, rto_ns) < 0) {
+                f->done = -1;
+            }
+            continue;
+        }
+        if (h.type != 'C') {
+            f->done = -1;   // too large, unknown or unreadable there: TCP tells
+            continue;
+        }
+
+        // Format: Segment (1 byte) | Segments (1 byte) | metadata (24 bytes) | data
+        pdu_cursor_init(&c, payload, h.len);
+        seg = pdu_get_u8(&c);
+        segments = pdu_get_u8(&c);
+        pdu_get_meta(&c, &meta);
+        len = pdu_remaining(&c);
+        data = pdu_get_bytes(&c, len);
+        if (c.err || segments != f->segments || seg >= segments ||
+            meta.size != f->job->res.meta.size ||
+            len != (seg < segments - 1 ? FAST_SEGMENT_SIZE :
+                    meta.size - (uint64_t)seg * FAST_SEGMENT_SIZE)) {
+            f->done = -1;   // changed since the lookup
+            continue;
+        }
+        if (f->have & (1U << seg)) {
+            continue;
+        }
+        memcpy(f->data + seg * FAST_SEGMENT_SIZE, data, len);
+        f->have |= 1U << seg;
+        f->wire_bytes += n;
+        if (f->first_ns == 0) {
+            f->first_ns = now_ns();
+        }
+        if (f->have == all) {
+            fast_complete(f);
+        }
+    }
+}
+
+// Write out a fully received item and finish its job like a TCP download
+void fast_complete(struct fast_fetch *f)
+{
+    struct download_job *job = f->job;
+    size_t size = job->res.meta.size;
+    int fd;
+
+    fd = open(job->tmpname, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0 || write_all(fd, f->data, size) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        f->done = -1;
+        return;
+    }
+    close(fd);
+    f->done = 1;
+
+    job->sink.hash = content_hash_update(CONTENT_HASH_INIT, f->data, size);
+    job->st.raw_bytes = size;
+    job->st.wire_bytes = f->wire_bytes;
+    job->st.fast = 1;
+    job->st.first_ns = f->first_ns;
+    job->start_ns = f->start_ns;
+    job->done_ns = now_ns();
+    job->state = JOB_DONE;
+    job_finish(job);
+}
+
+// Retransmission timeout of the fast path, from the measured connect times
+long long fast_rto_ns(void)
+{
+    long long ms;
+
+    pthread_mutex_lock(&connect_lock);
+    ms = connect_srtt_us ? (connect_srtt_us + 4 * connect_rttvar_us) / 1000 : FAST_RTO_INIT;
+    pthread_mutex_unlock(&connect_lock);
+    if (ms < FAST_RTO_MIN) {
+        ms = FAST_RTO_MIN;
+    } else if (ms > FAST_RTO_MAX) {
+        ms = FAST_RTO_MAX;
+    }
+    return ms * 1000000LL;
+}
+
+// Whether addr recently failed to answer over UDP
+int fast_server_off(const struct sockaddr_in *addr)
+{
+    time_t now = time(NULL);
+    int i;
+
+    for (i = 0; i < FAST_OFF_SLOTS; i++) {
+        if (fast_off_until[i] > now &&
+            fast_off_addr[i].sin_addr.s_addr == addr->sin_addr.s_addr &&
+            fast_off_addr[i].sin_port == addr->sin_port) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void fast_server_note_off(const struct sockaddr_in *addr)
+{
+    if (fast_server_off(addr)) {
+        return;
+    }
+    fast_off_addr[fast_off_next] = *addr;
+    fast_off_until[fast_off_next] = time(NULL) + FAST_OFF_TIME;
+    fast_off_next = (fast_off_next + 1) % FAST_OFF_SLOTS;
+}
+
+// Cookie addr issued us for its fast path, 0 if none
+uint64_t fast_cookie_for(const struct sockaddr_in *addr)
+{
+    int i;
+
+    for (i = 0; i < FAST_OFF_SLOTS; i++) {
+        if (fast_cookie_addr[i].sin_addr.s_addr == addr->sin_addr.s_addr &&
+            fast_cookie_addr[i].sin_port == addr->sin_port) {
+            return fast_cookie_val[i];
+        }
+    }
+    return 0;
+}
+
+void fast_cookie_keep(const struct sockaddr_in *addr, uint64_t cookie)
+{
+    int i;
+
+    for (i = 0; i < FAST_OFF_SLOTS; i++) {
+        if (fast_cookie_addr[i].sin_addr.s_addr == addr->sin_addr.s_addr &&
+            fast_cookie_addr[i].sin_port == addr->sin_port) {
+            fast_cookie_val[i] = cookie;
+            return;
+        }
+    }
+    fast_cookie_addr[fast_cookie_next] = *addr;
+    fast_cookie_val[fast_cookie_next] = cookie;
+    fast_cookie_next = (fast_cookie_next + 1) % FAST_OFF_SLOTS;
+}
+
+// Cookie for a client address: the one it holds while that is fresh, a
+// new random one otherwise. Only a client that can read our replies to
+// that address learns it. Returns 0 if no randomness is to be had.
+uint64_t fast_cookie_issue(uint32_t ip)
+{
+    int i = ((ip * 2654435761U) >> 16) % FAST_COOKIE_SLOTS;
+    time_t now = time(NULL);
+    uint64_t cookie = 0;
+
+    if (fast_issued_ip[i] == ip && fast_issued_until[i] > now) {
+        return fast_issued_val[i];
+    }
+    if (getrandom(&cookie, sizeof(cookie), GRND_NONBLOCK) != sizeof(cookie)) {
+        return 0;
+    }
+    fast_issued_ip[i] = ip;
+    fast_issued_val[i] = cookie;
+    fast_issued_until[i] = now + FAST_COOKIE_TIME;
+    return cookie;
+}
+
+// Whether cookie is the fresh one issued to ip
+int fast_cookie_check(uint32_t ip, uint64_t cookie)
+{
+    int i = ((ip * 2654435761U) >> 16) % FAST_COOKIE_SLOTS;
+
+    return cookie != 0 && fast_issued_ip[i] == ip && fast_issued_val[i] == cookie &&
+           fast_issued_until[i] > time(NULL);
+}
+
+// After the server of job couldn't be reached, report it to the index
+// server and switch to another candidate: the rest of the lookup's, then
+// those of one fresh lookup, skipping servers tried already. Returns 1 if
+// the job is to be fetched again.
+int job_retry(struct download_job *job)
+{
+    struct sockaddr_in failed;
+
+    if (job->state != JOB_FAILED || !job->conn_failed) {
+        return 0;
+    }
+    failed = job->res.addr;
+    report_failure(FAIL_CONNECT, job->content_name, &failed);
+    if (job_failover(job) < 0) {
+        return 0;
+    }
+    if (!batch_quiet) {
+        printf("Can't reach %s:%d for '%s', ", inet_ntoa(failed.sin_addr), ntohs(failed.sin_port),
+               job->content_name);
+        printf("trying %s:%d\n", inet_ntoa(job->res.addr.sin_addr), ntohs(job->res.addr.sin_port));
+    }
+    job->state = JOB_PENDING;
+    job->conn_failed = 0;
+    job->err_msg[0] = '\0';
+    return 1;
+}
+
+// Move job to the next server it hasn't tried. Returns -1 if there is none.
+int job_failover(struct download_job *job)
+{
+    struct lookup_result *res = &job->res;
+
+    if (job->tried_count < (int)(sizeof(job->tried) / sizeof(job->tried[0]))) {
+        job->tried[job->tried_count++] = res->addr;
+    }
+    for (;;) {
+        while (res->alt_count > 0) {
+            res->addr = res->alt_addr[0];
+            res->meta = res->alt_meta[0];
+            res->alt_count--;
+            memmove(res->alt_addr, res->alt_addr + 1, res->alt_count * sizeof(res->alt_addr[0]));
+            memmove(res->alt_meta, res->alt_meta + 1, res->alt_count * sizeof(res->alt_meta[0]));
+            if (!job_tried(job, &res->addr)) {
+                return 0;
+            }
+        }
+        if (job->relooked) {
+            return -1;
+        }
+        job->relooked = 1;
+        if (lookup_content(job->content_name, res) < 0) {
+            return -1;
+        }
+        if (!job_tried(job, &res->addr)) {
+            return 0;
+        }
+    }
+}
+
+// Has job failed to reach addr before?
+int job_tried(const struct download_job *job, const struct sockaddr_in *addr)
+{
+    int i;
+
+    for (i = 0; i < job->tried_count; i++) {
+        if (job->tried[i].sin_addr.s_addr == addr->sin_addr.s_addr &&
+            job->tried[i].sin_port == addr->sin_port) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Tell the index server that a server it handed out failed. A server that
+// can't be reached is reported once for all the items that were waiting on it.
+void report_failure(int reason, const char *content_name, const struct sockaddr_in *addr)
+{
+    char req[FAIL_REPORT_SIZE];
+    struct pdu_hdr h;
+    struct pdu_cursor c;
+    struct iovec iov;
+    time_t now = time(NULL);
+
+    if (dht_mode) {
+        return;
+    }
+    if (reason == FAIL_CONNECT) {
+        if (now - fail_reported_at < FAIL_REPORT_GAP &&
+            fail_reported_addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+            fail_reported_addr.sin_port == addr->sin_port) {
+            return;
+        }
+        fail_reported_addr = *addr;
+        fail_reported_at = now;
+    }
+
+    // Format: Reason (1 byte) | Content Name (10 bytes) | IP (4 bytes) | Port (2 bytes)
+    pdu_cursor_init(&c, req, sizeof(req));
+    pdu_put_u8(&c, reason);
+    pdu_put_name(&c, content_name, CONTENT_NAME_SIZE);
+    pdu_put_addr(&c, addr);
+    iov.iov_base = req;
+    iov.iov_len = c.pos;
+
+    h.type = 'X'; // X for failure report
+    h.flags = PDU_FLAG_HDR;
+    h.req_id = 0;
+    pdu_sendv(udp_sock, &h, &iov, 1, NULL, 0);
+}
+
+// Download every item listed in path (one name per line, '#' starts a
+// comment) with up to max_parallel transfers in flight. Names are resolved
+// with multi-name lookups; items from the same peer are pipelined in units
+// of at most BATCH_PIPELINE_DEPTH.
+void download_batch(const char *path, int max_parallel)
+{
+    FILE *fp;
+    char line[BUFLEN];
+    char *name;
+    char *end;
+    struct download_job *jobs = NULL;
+    struct download_job *grown;
+    struct batch_run b;
+    pthread_t workers[BATCH_MAX_PARALLEL];
+    int cap = 0;
+    int count = 0;
+    int started;
+    int i, j, k;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        printf("Error: Cannot open file '%s'\n", path);
+        return;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        name = line + strspn(line, " \t");
+        end = name + strcspn(name, " \t\r\n#");
+        *end = '\0';
+        if (name[0] == '\0') {
+            continue;
+        }
+        if (strlen(name) > CONTENT_NAME_SIZE) {
+            printf("Error: Content name '%s' too long (max %d characters), skipped\n",
+                   name, CONTENT_NAME_SIZE);
+            continue;
+        }
+        for (i = 0; i < count && strcmp(jobs[i].content_name, name) != 0; i++) {
+        }
+        if (i < count) {
+            continue;   // listed twice
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            grown = (struct download_job *)realloc(jobs, cap * sizeof(*jobs));
+            if (!grown) {
+                printf("Error: Memory allocation failed\n");
+                free(jobs);
+                fclose(fp);
+                return;
+            }
+            jobs = grown;
+        }
+        memset(&jobs[count], 0, sizeof(jobs[count]));
+        strncpy(jobs[count].content_name, name, CONTENT_NAME_SIZE);
+        count++;
+    }
+    fclose(fp);
+    if (count == 0) {
+        printf("No content names in '%s'\n", path);
+        free(jobs);
+        return;
+    }
+
+    if (max_parallel < 1) {
+        max_parallel = 1;
+    } else if (max_parallel > BATCH_MAX_PARALLEL) {
+        max_parallel = BATCH_MAX_PARALLEL;
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.total = count;
+    b.order = (struct download_job **)calloc(count, sizeof(*b.order));
+    b.unit_start = (int *)calloc(count, sizeof(int));
+    b.unit_len = (int *)calloc(count, sizeof(int));
+    if (!b.order || !b.unit_start || !b.unit_len) {
+        printf("Error: Memory allocation failed\n");
+        free(b.order);
+        free(b.unit_start);
+        free(b.unit_len);
+        free(jobs);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &b.start);
+    b.last_report = b.start;
+
+    batch_quiet = 1;
+    lookup_contents(jobs, count);
+    for (i = 0; i < count; i++) {
+        if (jobs[i].state == JOB_PENDING) {
+            jobs[i].state = job_prepare(&jobs[i]);
+            if (jobs[i].state == JOB_DONE) {
+                b.skipped++;
+            }
+        }
+        if (jobs[i].state == JOB_FAILED) {
+            b.failed++;
+        }
+    }
+    fetch_small(jobs, count);
+    for (i = 0; i < count; i++) {
+        if (jobs[i].st.fast) {
+            if (jobs[i].state == JOB_DONE) {
+                b.done++;
+                b.bytes += jobs[i].st.raw_bytes;
+            } else {
+                b.failed++;
+            }
+        }
+    }
+
+    // Order pending jobs by server and cut each server's run into units
+    k = 0;
+    for (i = 0; i < count; i++) {
+        if (jobs[i].state != JOB_PENDING) {
+            continue;
+        }
+        for (j = i; j < count; j++) {
+            if (jobs[j].state == JOB_PENDING &&
+                jobs[j].res.addr.sin_addr.s_addr == jobs[i].res.addr.sin_addr.s_addr &&
+                jobs[j].res.addr.sin_port == jobs[i].res.addr.sin_port) {
+                if (j == i || b.unit_len[b.unit_count - 1] == BATCH_PIPELINE_DEPTH) {
+                    b.unit_start[b.unit_count] = k;
+                    b.unit_count++;
+                }
+                b.unit_len[b.unit_count - 1]++;
+                b.order[k++] = &jobs[j];
+                jobs[j].state = JOB_QUEUED;   // grouped, skip in later passes
+            }
+        }
+    }
+    for (i = 0; i < k; i++) {
+        b.order[i]->state = JOB_PENDING;
+    }
+
+    pthread_mutex_init(&b.lock, NULL);
+    started = 0;
+    while (started < max_parallel && started < b.unit_count &&
+           pthread_create(&workers[started], NULL, batch_worker_main, &b) == 0) {
+        started++;
+    }
+    if (started == 0 && b.unit_count > 0) {
+        batch_worker_main(&b);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&b.lock);
+    batch_quiet = 0;
+
+    batch_progress(&b, 1);
+    printf("Batch finished: %d downloaded, %d already up to date, %d failed (up to %d parallel)\n",
+           b.done, b.skipped, b.failed, max_parallel);
+
+    free(b.order);
+    free(b.unit_start);
+    free(b.unit_len);
+    free(jobs);
+}
+
+// Batch worker: fetch units until none are left, failing over and finishing
+// each item under the batch lock since that touches the cache and the UDP
+// socket
+void *batch_worker_main(void *arg)
+{
+    struct batch_run *b = (struct batch_run *)arg;
+    struct download_job **unit;
+    int u;
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        u = b->next_unit < b->unit_count ? b->next_unit++ : -1;
+        pthread_mutex_unlock(&b->lock);
+        if (u < 0) {
+            break;
+        }
+
+        unit = b->order + b->unit_start[u];
+        fetch_pipelined(unit, b->unit_len[u]);
+
+        pthread_mutex_lock(&b->lock);
+        for (i = 0; i < b->unit_len[u]; i++) {
+            while (job_retry(unit[i])) {
+                pthread_mutex_unlock(&b->lock);
+                fetch_pipelined(&unit[i], 1);
+                pthread_mutex_lock(&b->lock);
+            }
+            job_finish(unit[i]);
+            if (unit[i]->state == JOB_DONE) {
+                b->done++;
+                b->bytes += unit[i]->st.raw_bytes;
+            } else {
+                b->failed++;
+            }
+        }
+        batch_progress(b, 0);
+        pthread_mutex_unlock(&b->lock);
+    }
+    return NULL;
+}
+
+// Print aggregate batch progress, at most once per second unless final
+void batch_progress(struct batch_run *b, int final)
+{
+    struct timespec now;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!final && now.tv_sec - b->last_report.tv_sec < 1) {
+        return;
+    }
+    b->last_report = now;
+    elapsed = (now.tv_sec - b->start.tv_sec) + (now.tv_nsec - b->start.tv_nsec) / 1e9;
+    printf("Batch: %d/%d items, %.1f MB in %.2f s (%.2f MB/s)\n",
+           b->done + b->skipped + b->failed, b->total, b->bytes / 1e6, elapsed,
+           elapsed > 0 ? b->bytes / 1e6 / elapsed : 0.0);
+}
+
+// Take an idle pooled connection to addr, or open a new one. Safe to call
+// from batch workers.
+struct peer_conn *conn_acquire(const struct sockaddr_in *addr)
+{
+    struct peer_conn **link;
+    struct peer_conn *conn;
+
+    pthread_mutex_lock(&pool_lock);
+    for (link = &conn_pool; *link; link = &(*link)->next) {
+        conn = *link;
+        if (conn->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+            conn->addr.sin_port == addr->sin_port) {
+            *link = conn->next;
+            conn->next = NULL;
+            conn->reused = 1;
+            pthread_mutex_unlock(&pool_lock);
+            return conn;
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    conn = (struct peer_conn *)calloc(1, sizeof(*conn));
+    if (!conn) {
+        return NULL;
+    }
+    conn->sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (conn->sock < 0) {
+        free(conn);
+        return NULL;
+    }
+    if (connect_adaptive(conn->sock, addr) < 0) {
+        close(conn->sock);
+        free(conn);
+        return NULL;
+    }
+    conn->addr = *addr;
+    conn->next_req_id = 1;
+    return conn;
+}
+
+// Connect sock to addr, giving up after the adaptive connect timeout: about
+// the smoothed connect time plus four deviations, like a TCP retransmission
+// timeout, so a dead server costs a fraction of a second rather than the
+// kernel's minutes of SYN retries.
+int connect_adaptive(int sock, const struct sockaddr_in *addr)
+{
+    struct pollfd pfd;
+    socklen_t len = sizeof(int);
+    long long t0 = now_ns();
+    int flags, err, rc, timeout_ms;
+
+    pthread_mutex_lock(&connect_lock);
+    timeout_ms = connect_timeout;
+    pthread_mutex_unlock(&connect_lock);
+
+    flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+    rc = connect(sock, (const struct sockaddr *)addr, sizeof(*addr));
+    if (rc < 0 && errno == EINPROGRESS) {
+        pfd.fd = sock;
+        pfd.events = POLLOUT;
+        do {
+            rc = poll(&pfd, 1, timeout_ms);
+        } while (rc < 0 && errno == EINTR);
+        if (rc == 0) {
+            connect_sample(-1);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (rc < 0 || getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+            return -1;
+        }
+        if (err != 0) {
+            errno = err;
+            return -1;
+        }
+        rc = 0;
+    }
+    if (rc < 0) {
+        return -1;
+    }
+    fcntl(sock, F_SETFL, flags);
+    connect_sample((now_ns() - t0) / 1000);
+    return 0;
+}
+
+// Fold a connect time in microseconds into the connect timeout, or with -1
+// double it after a timeout
+void connect_sample(long long us)
+{
+    long long ms;
+
+    pthread_mutex_lock(&connect_lock);
+    if (us < 0) {
+        connect_timeout = connect_timeout * 2 > CONNECT_TIMEOUT_MAX ? CONNECT_TIMEOUT_MAX
+                                                                    : connect_timeout * 2;
+        pthread_mutex_unlock(&connect_lock);
+        return;
+    }
+    if (connect_srtt_us == 0) {
+        connect_srtt_us = us > 0 ? us : 1;
+        connect_rttvar_us = us / 2;
+    } else {
+        connect_rttvar_us = (3 * connect_rttvar_us + llabs(connect_srtt_us - us)) / 4;
+        connect_srtt_us = (7 * connect_srtt_us + us) / 8;
+    }
+    ms = (connect_srtt_us + 4 * connect_rttvar_us) / 1000;
+    if (ms < CONNECT_TIMEOUT_MIN) {
+        ms = CONNECT_TIMEOUT_MIN;
+    } else if (ms > CONNECT_TIMEOUT_MAX) {
+        ms = CONNECT_TIMEOUT_MAX;
+    }
+    connect_timeout = ms;
+    pthread_mutex_unlock(&connect_lock);
+}
+
+// Return a connection to the pool, or close it if it can't be reused
+void conn_release(struct peer_conn *conn, int reusable)
+{
+    if (!reusable) {
+        close(conn->sock);
+        free(conn);
+        return;
+    }
+    conn->last_used = time(NULL);
+    conn->reused = 0;
+    pthread_mutex_lock(&pool_lock);
+    conn->next = conn_pool;
+    conn_pool = conn;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// Close pooled connections that sat idle for POOL_IDLE_TIMEOUT seconds or
+// became readable, which for an idle connection means the server closed it
+void conn_pool_reap(fd_set *rfds)
+{
+    struct peer_conn **link;
+    struct peer_conn *conn;
+    time_t now = time(NULL);
+
+    link = &conn_pool;
+    while (*link) {
+        conn = *link;
+        if (now - conn->last_used >= POOL_IDLE_TIMEOUT ||
+            (rfds && FD_ISSET(conn->sock, rfds))) {
+            *link = conn->next;
+            close(conn->sock);
+            free(conn);
+            continue;
+        }
+        link = &conn->next;
+    }
+}
+
+// Close every pooled connection
+void conn_pool_close_all(void)
+{
+    struct peer_conn *conn;
+
+    while (conn_pool) {
+        conn = conn_pool;
+        conn_pool = conn->next;
+        close(conn->sock);
+        free(conn);
+    }
+}
+
+// Make sure at least one byte is buffered. Returns 0 on EOF, -1 on error.
+ssize_t reader_fill(struct stream_reader *r)
+{
+    ssize_t n;
+    long long t0;
+
+    if (r->pos < r->len) {
+        return r->len - r->pos;
+    }
+    t0 = now_ns();
+    do {
+        n = read(r->fd, r->buf, sizeof(r->buf));
+    } while (n < 0 && errno == EINTR);
+    if (stats && now_ns() - t0 > STATS_STALL_MS * 1000000LL) {
+        stats_add(&stats->recv_stalls, 1);
+    }
+    if (n <= 0) {
+        return n;
+    }
+    r->pos = 0;
+    r->len = n;
+    return n;
+}
+
+// Read exactly len bytes. Returns -1 if the stream ends first.
+int reader_read(struct stream_reader *r, char *dst, size_t len)
+{
+    size_t chunk;
+
+    while (len > 0) {
+        if (reader_fill(r) <= 0) {
+            return -1;
+        }
+        chunk = r->len - r->pos;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(dst, r->buf + r->pos, chunk);
+        r->pos += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Pass the next len bytes of the stream (or everything up to EOF if len is
+// -1) to the sink straight out of the read buffer
+int reader_drain(struct stream_reader *r, struct download_sink *sink, ssize_t len)
+{
+    size_t chunk;
+
+    while (len != 0) {
+        if (reader_fill(r) <= 0) {
+            return len < 0 ? 0 : -1;
+        }
+        chunk = r->len - r->pos;
+        if (len > 0 && chunk > (size_t)len) {
+            chunk = len;
+        }
+        if (sink_write(sink, r->buf + r->pos, chunk) < 0) {
+            return -1;
+        }
+        r->pos += chunk;
+        if (len > 0) {
+            len -= chunk;
+        }
+    }
+    return 0;
+}
+
+// Receive one item from the stream into sink. The response is either the
+// legacy stream of 'C' PDUs of exactly MAX_DATA_SIZE bytes ended by an 'F'
+// PDU that runs to EOF, or an 'A' PDU acknowledging our transfer options
+// followed by framed chunks for req_id (see CHUNK_HDR_SIZE). For a delta
+// download, 'K' chunks are copied from base. Returns 0 on success,
+// RECV_REMOTE_ERROR if the server reported an error, or RECV_STREAM_ERROR if
+// the connection can't be used any more.
+int receive_content(struct stream_reader *r, struct download_sink *sink, struct xfer_stats *st,
+                    uint32_t req_id, const struct delta_base *base, char *err_msg, size_t err_size)
+{
+    unsigned char hdr[CHUNK_HDR_SIZE];
+    struct pdu_hdr h;
+    struct pdu_cursor c;
+    char *payload;
+    char *raw;
+    size_t len;
+    size_t raw_len;
+    ssize_t n;
+    uint32_t first;
+    uint32_t count;
+    long long copied;
+    int framed = 0;
+    int rc = RECV_STREAM_ERROR;
+    struct timespec t0, t1;
+
+    payload = (char *)malloc(XFER_CHUNK_SIZE);
+    raw = (char *)malloc(XFER_CHUNK_SIZE);
+    if (!payload || !raw) {
+        snprintf(err_msg, err_size, "Memory allocation failed");
+        goto out;
+    }
+
+    for (;;) {
+        if (!framed) {
+            if (reader_read(r, (char *)hdr, 1) < 0) {
+                snprintf(err_msg, err_size, "Connection closed before end of content");
+                goto out;
+            }
+            if (st->first_ns == 0) {
+                st->first_ns = now_ns();
+            }
+            if (hdr[0] == 'C') {
+                if (reader_drain(r, sink, MAX_DATA_SIZE) < 0) {
+                    snprintf(err_msg, err_size, "Truncated content");
+                    goto out;
+                }
+                st->raw_bytes += MAX_DATA_SIZE;
+                st->wire_bytes += MAX_DATA_SIZE;
+            } else if (hdr[0] == 'F') {
+                off_t before = sink->total;
+                if (reader_drain(r, sink, -1) < 0) {
+                    snprintf(err_msg, err_size, "Failed to write content");
+                    goto out;
+                }
+                st->raw_bytes += sink->total - before;
+                st->wire_bytes += sink->total - before;
+                rc = 0;
+                goto out;
+            } else if (hdr[0] == 'A') {
+                // Server accepted our transfer options, framed chunks follow
+                if (reader_read(r, (char *)hdr, 1) < 0) {
+                    snprintf(err_msg, err_size, "Truncated transfer acknowledgement");
+                    goto out;
+                }
+                st->options = hdr[0];
+                framed = 1;
+            } else {
+                // 'E': the error text runs to EOF
+                len = 0;
+                while (len < err_size - 1 && reader_fill(r) > 0) {
+                    n = r->len - r->pos;
+                    if ((size_t)n > err_size - 1 - len) {
+                        n = err_size - 1 - len;
+                    }
+                    memcpy(err_msg + len, r->buf + r->pos, n);
+                    r->pos += n;
+                    len += n;
+                }
+                err_msg[len] = '\0';
+                rc = RECV_REMOTE_ERROR;
+                goto out;
+            }
+            continue;
+        }
+
+        if (reader_read(r, (char *)hdr, CHUNK_HDR_SIZE) < 0) {
+            snprintf(err_msg, err_size, "Connection closed before end of content");
+            goto out;
+        }
+        pdu_get_hdr((char *)hdr, &h);
+        len = h.len;
+        if (len > XFER_CHUNK_SIZE || h.req_id != req_id || reader_read(r, payload, len) < 0) {
+            snprintf(err_msg, err_size, "Malformed content chunk");
+            goto out;
+        }
+        st->wire_bytes += len;
+
+        if (h.type == 'E') {
+            if (len > err_size - 1) {
+                len = err_size - 1;
+            }
+            memcpy(err_msg, payload, len);
+            err_msg[len] = '\0';
+            rc = RECV_REMOTE_ERROR;
+            goto out;
+        }
+
+        if (h.type == 'K') {
+            // Run of chunks we already hold
+            pdu_cursor_init(&c, payload, len);
+            first = pdu_get_u32(&c);
+            count = pdu_get_u32(&c);
+            copied = len == DELTA_REF_SIZE && base ?
+                     delta_copy(base, first, count, sink, raw, XFER_CHUNK_SIZE) : -1;
+            if (copied < 0) {
+                snprintf(err_msg, err_size, "Bad reference to the old copy");
+                goto out;
+            }
+            st->raw_bytes += copied;
+            st->reused_bytes += copied;
+            continue;
+        }
+
+        if (h.flags & CHUNK_COMPRESSED) {
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+            raw_len = lz_decompress(payload, len, raw, XFER_CHUNK_SIZE);
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+            st->cpu_ns += (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+            if (raw_len == 0) {
+                snprintf(err_msg, err_size, "Corrupt compressed chunk");
+                goto out;
+            }
+            if (sink_write(sink, raw, raw_len) < 0) {
+                snprintf(err_msg, err_size, "Failed to write content");
+                goto out;
+            }
+        } else {
+            raw_len = len;
+            if (len > 0 && sink_write(sink, payload, len) < 0) {
+                snprintf(err_msg, err_size, "Failed to write content");
+                goto out;
+            }
+        }
+        st->raw_bytes += raw_len;
+
+        if (h.type == 'F') {
+            rc = 0;
+            goto out;
+        }
+    }
+
+out:
+    free(payload);
+    free(raw);
+    return rc;
+}
+
+// Open a download sink on filename and start its writer thread.
+// expected_size, when known, is preallocated up front.
+int sink_open(struct download_sink *sink, const char *filename, off_t expected_size)
+{
+    memset(sink, 0, sizeof(*sink));
+    sink->pending = -1;
+    sink->hash = CONTENT_HASH_INIT;
+
+    sink->fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (sink->fd < 0) {
+        return -1;
+    }
+
+    if (expected_size > 0 &&
+        fallocate(sink->fd, FALLOC_FL_KEEP_SIZE, 0, expected_size) < 0) {
+        // Not fatal, the file just grows as it is written
+    }
+
+    if (posix_memalign((void **)&sink->buf[0], SINK_ALIGN, SINK_BUF_SIZE) != 0) {
+        sink->buf[0] = NULL;
+    }
+    if (posix_memalign((void **)&sink->buf[1], SINK_ALIGN, SINK_BUF_SIZE) != 0) {
+        sink->buf[1] = NULL;
+    }
+    if (!sink->buf[0] || !sink->buf[1]) {
+        free(sink->buf[0]);
+        free(sink->buf[1]);
+        close(sink->fd);
+        return -1;
+    }
+
+    pthread_mutex_init(&sink->lock, NULL);
+    pthread_cond_init(&sink->cond, NULL);
+    if (pthread_create(&sink->writer, NULL, sink_writer_main, sink) != 0) {
+        pthread_mutex_destroy(&sink->lock);
+        pthread_cond_destroy(&sink->cond);
+        free(sink->buf[0]);
+        free(sink->buf[1]);
+        close(sink->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Copy received data into the current buffer, handing it to the writer
+// thread when full. Only blocks if the writer is still busy with the
+// other buffer. A failed write shows up at the next hand-off.
+int sink_write(struct download_sink *sink, const char *data, size_t len)
+{
+    size_t room;
+    int error;
+
+    sink->hash = content_hash_update(sink->hash, data, len);
+    while (len > 0) {
+        room = SINK_BUF_SIZE - sink->fill[sink->cur];
+        if (room > len) {
+            room = len;
+        }
+        memcpy(sink->buf[sink->cur] + sink->fill[sink->cur], data, room);
+        sink->fill[sink->cur] += room;
+        sink->total += room;
+        data += room;
+        len -= room;
+
+        if (sink->fill[sink->cur] == SINK_BUF_SIZE) {
+            pthread_mutex_lock(&sink->lock);
+            while (sink->pending >= 0 && !sink->error) {
+                pthread_cond_wait(&sink->cond, &sink->lock);
+            }
+            error = sink->error;    // set by the writer thread, read under the lock
+            if (!error) {
+                sink->pending = sink->cur;
+                sink->cur ^= 1;
+                pthread_cond_broadcast(&sink->cond);
+            }
+            pthread_mutex_unlock(&sink->lock);
+            if (error) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Flush the last partial buffer, stop the writer and close the file.
+// Returns -1 if any write failed.
+int sink_close(struct download_sink *sink)
+{
+    int error;
+
+    pthread_mutex_lock(&sink->lock);
+    while (sink->pending >= 0 && !sink->error) {
+        pthread_cond_wait(&sink->cond, &sink->lock);
+    }
+    if (sink->fill[sink->cur] > 0 && !sink->error) {
+        sink->pending = sink->cur;
+    }
+    sink->done = 1;
+    pthread_cond_broadcast(&sink->cond);
+    pthread_mutex_unlock(&sink->lock);
+    pthread_join(sink->writer, NULL);
+
+    error = sink->error;
+    // Drop any preallocated space past the received data
+    if (!error && ftruncate(sink->fd, sink->total) < 0) {
+        error = errno;
+    }
+    if (close(sink->fd) < 0 && !error) {
+        error = errno;
+    }
+
+    pthread_mutex_destroy(&sink->lock);
+    pthread_cond_destroy(&sink->cond);
+    free(sink->buf[0]);
+    free(sink->buf[1]);
+    return error ? -1 : 0;
+}
+
+// Writer thread: flushes whichever buffer the receive loop queued
+void *sink_writer_main(void *arg)
+{
+    struct download_sink *sink = (struct download_sink *)arg;
+    int idx;
+    size_t len;
+    size_t off;
+    ssize_t w;
+
+    pthread_mutex_lock(&sink->lock);
+    for (;;) {
+        while (sink->pending < 0 && !sink->done) {
+            pthread_cond_wait(&sink->cond, &sink->lock);
+        }
+        if (sink->pending < 0) {
+            break;
+        }
+        idx = sink->pending;
+        len = sink->fill[idx];
+        pthread_mutex_unlock(&sink->lock);
+
+        for (off = 0; off < len; off += w) {
+            w = pwrite(sink->fd, sink->buf[idx] + off, len - off, sink->offset + off);
+            if (w < 0) {
+                if (errno == EINTR) {
+                    w = 0;
+                    continue;
+                }
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&sink->lock);
+        if (off < len && !sink->error) {
+            sink->error = errno ? errno : EIO;
+        }
+        sink->offset += len;
+        sink->fill[idx] = 0;
+        sink->pending = -1;
+        pthread_cond_broadcast(&sink->cond);
+        if (sink->error) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sink->lock);
+    return NULL;
+}
+
+// List all registered contents
+void list_contents(void)
+{
+    char buf[PDU_MAX_DGRAM];
+    char text[BUFLEN];
+    struct pdu_hdr h;
+    struct pdu_cursor c;
+
+    if (dht_mode) {
+        dht_print();    // there is no global list, only what this node holds
+        return;
+    }
+
+    if (udp_transact('O', NULL, 0, buf, sizeof(buf), &h, &c) < 0) { // O for List of Online Registered Content
+        printf("Error: List request to index server failed\n");
+        return;
+    }
+
+    pdu_get_text(&c, text, sizeof(text));
+    if (h.type == 'O') {
+        printf("Registered contents:\n%s\n", text);
+    } else if (h.type == 'E') {
+        printf("Error: %s\n", text);
+    }
+}
+
+// Deregister content. Returns 0 once the index server no longer lists it.
+int deregister_content(const char *content_name)
+{
+    char req[PEER_NAME_SIZE + CONTENT_NAME_SIZE];
+    char buf[PDU_MAX_DGRAM];
+    char msg[MAX_DATA_SIZE];
+    struct pdu_hdr h;
+    struct pdu_cursor c;
+    struct iovec iov;
+    struct registered_content *reg;
+    struct sockaddr_in addr;
+    char name[CONTENT_NAME_SIZE + 1];
+
+    reg = find_registered_content(content_name);
+    if (!reg) {
+        printf("Error: Content '%s' not registered\n", content_name);
+        return -1;
+    }
+    // content_name may point into reg, which is freed below
+    strncpy(name, content_name, CONTENT_NAME_SIZE);
+    name[CONTENT_NAME_SIZE] = '\0';
+
+    if (dht_mode) {
+        // Records left on nodes we can't reach expire on their own
+        addr = dht_local_addr;
+        addr.sin_port = listen_addr.sin_port;
+        dht_publish(name, my_peer_name, &addr, &reg->meta, 0);
+    } else {
+        // Format: Peer Name (10 bytes) | Content Name (10 bytes)
+        pdu_cursor_init(&c, req, sizeof(req));
+        pdu_put_name(&c, my_peer_name, PEER_NAME_SIZE);
+        pdu_put_name(&c, name, CONTENT_NAME_SIZE);
+        iov.iov_base = req;
+        iov.iov_len = c.pos;
+
+        if (udp_transact('T', &iov, 1, buf, sizeof(buf), &h, &c) < 0) { // T for de-registration
+            printf("Error: Deregistration request to index server failed\n");
+            return -1;
+        }
+        if (h.type == 'E') {
+            pdu_get_text(&c, msg, sizeof(msg));
+            printf("Deregistration failed: %s\n", msg);
+            return -1;
+        }
+        if (h.type != 'A') { // A for Acknowledgement
+            return -1;
+        }
+    }
+
+    reg_remove_local(reg);
+    if (!batch_quiet) {
+        printf("Content '%s' deregistered successfully\n", name);
+    }
+    return 0;
+}
+
+// Deregister all content, in batches
+void deregister_all(void)
+{
+    struct registered_content *reg;
+    struct reg_update *ups;
+    int count = 0;
+    int failed;
+
+    for (reg = reg_list; reg; reg = reg->next) {
+        count++;
+    }
+    if (count == 0) {
+        return;
+    }
+    ups = (struct reg_update *)calloc(count, sizeof(*ups));
+    if (!ups) {
+        while (reg_list) {
+            if (deregister_content(reg_list->content_name) < 0) {
+                reg_remove_local(reg_list);
+            }
+        }
+        return;
+    }
+    count = 0;
+    for (reg = reg_list; reg; reg = reg->next) {
+        ups[count].op = REG_REMOVE;
+        strncpy(ups[count].content_name, reg->content_name, CONTENT_NAME_SIZE);
+        count++;
+    }
+    failed = reg_flush(ups, count, count > SHARE_LIST_QUIET);
+    if (count > SHARE_LIST_QUIET) {
+        printf("Deregistered %d item(s), %d failed\n", count - failed, failed);
+    }
+    free(ups);
+}
+
+// Subscribe to new registrations of a content name, or of every name
+// starting with pattern if it ends in '*'. With download set, matching items
+// are fetched when they appear; an exact name is then unsubscribed.
+int subscribe_content(const char *pattern, int download)
+{
+    struct subscription *sub;
+    struct subscription tmp;
+    size_t len = strlen(pattern);
+    int granted;
+    int matches;
+
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.prefix = len > 0 && pattern[len - 1] == '*';
+    if (tmp.prefix) {
+        len--;
+    }
+    if (len > CONTENT_NAME_SIZE) {
+        printf("Error: Content name too long (max %d characters)\n", CONTENT_NAME_SIZE);
+        return -1;
+    }
+    memcpy(tmp.name, pattern, len);
+    tmp.download = download;
+
+    if (sub_request(&tmp, SUB_LEASE, &granted, &matches) < 0) {
+        return -1;
+    }
+
+    sub = find_subscription(tmp.name, tmp.prefix);
+    if (!sub) {
+        sub = (struct subscription *)malloc(sizeof(*sub));
+        if (!sub) {
+            printf("Error: Memory allocation failed\n");
+            return -1;
+        }
+        *sub = tmp;
+        sub->next = sub_list;
+        sub_list = sub;
+    }
+    sub->download = download;
+    sub->renew_at = time(NULL) + (granted > 1 ? granted / 2 : 1);
+    printf("Subscribed to '%s%s' (lease %ds, %d matching already registered)\n",
+           sub->name, sub->prefix ? "*" : "", granted, matches);
+
+    // Already there: fetch it now rather than waiting for the next registration
+    if (download && !sub->prefix && matches > 0 && !find_registered_content(sub->name) &&
+        notify_count < MAX_DOWNLOAD_NAMES) {
+        strcpy(notify_names[notify_count++], sub->name);
+    }
+    return 0;
+}
+
+// Cancel a subscription. Returns 0 on success.
+int unsubscribe_content(const char *pattern)
+{
+    struct subscription **link;
+    struct subscription *sub;
+    char name[CONTENT_NAME_SIZE + 1];
+    size_t len = strlen(pattern);
+    int prefix;
+    int granted;
+    int matches;
+
+    prefix = len > 0 && pattern[len - 1] == '*';
+    if (prefix) {
+        len--;
+    }
+    memset(name, 0, sizeof(name));
+    memcpy(name, pattern, len > CONTENT_NAME_SIZE ? CONTENT_NAME_SIZE : len);
+    sub = find_subscription(name, prefix);
+    if (!sub) {
+        printf("Error: Not subscribed to '%s'\n", pattern);
+        return -1;
+    }
+
+    // The lease runs out on its own if the index server can't be reached
+    sub_request(sub, 0, &granted, &matches);
+    for (link = &sub_list; *link != sub; link = &(*link)->next) {
+    }
+    *link = sub->next;
+    printf("Unsubscribed from '%s%s'\n", sub->name, sub->prefix ? "*" : "");
+    free(sub);
+    return 0;
+}
+
+// Cancel every subscription
+void unsubscribe_all(void)
+{
+    struct subscription *sub;
+    int granted;
+    int matches;
+
+    while ((sub = sub_list) != NULL) {
+        sub_request(sub, 0, &granted, &matches);
+        sub_list = sub->next;
+        free(sub);
+    }
+}
+
+// Send a subscription PDU for sub asking for lease seconds (0 cancels).
+// Returns 0 with the granted lease and the number of matching items already
+// registered, or -1.
+int sub_request(const struct subscription *sub, int lease, int *granted, int *matches)
+{
+    char req[SUB_REQ_SIZE];
+    char buf[PDU_MAX_DGRAM];
+    char msg[MAX_DATA_SIZE];
+    struct pdu_hdr h;
+    struct pdu_cursor c;
+    struct iovec iov;
+
+    // Format: Lease (2 bytes) | Flags (1 byte) | Content Name or prefix (10 bytes)
+    pdu_cursor_init(&c, req, sizeof(req));
+    pdu_put_u16(&c, lease);
+    pdu_put_u8(&c, sub->prefix ? SUB_PREFIX : 0);
+    pdu_put_name(&c, sub->name, CONTENT_NAME_SIZE);
+    iov.iov_base = req;
+    iov.iov_len = c.pos;
+
+    if (udp_transact('U', &iov, 1, buf, sizeof(buf), &h, &c) < 0) { // U for Subscription
+        printf("Error: Subscription request to index server failed\n");
+        return -1;
+    }
+    if (h.type == 'E') {
+        pdu_get_text(&c, msg, sizeof(msg));
+        printf("Subscription to '%s%s' failed: %s\n", sub->name, sub->prefix ? "*" : "", msg);
+        return -1;
+    }
+
+    // Format: Granted lease (2 bytes) | Already registered (2 bytes)
+    *granted = pdu_get_u16(&c);
+    *matches = pdu_get_u16(&c);
+    if (h.type != 'A' || c.err) {
+        printf("Error: Index server does not support subscriptions\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Find a subscription by name and kind
+struct subscription *find_subscription(const char *name, int prefix)
+{
+    struct subscription *sub;
+
+    for (sub = sub_list; sub; sub = sub->next) {
+        if (sub->prefix == prefix && strncmp(sub->name, name, CONTENT_NAME_SIZE) == 0) {
+            return sub;
+        }
+    }
+    return NULL;
+}
+
+// Does content_name fall under sub?
+int sub_matches(const struct subscription *sub, const char *content_name)
+{
+    if (sub->prefix) {
+        return strncmp(sub->name, content_name, strlen(sub->name)) == 0;
+    }
+    return strncmp(sub->name, content_name, CONTENT_NAME_SIZE) == 0;
+}
+
+// Renew subscriptions whose lease is half used. This also re-creates them
+// after an index server restart.
+void subs_renew(void)
+{
+    struct subscription *sub;
+    time_t now = time(NULL);
+    int granted;
+    int matches;
+
+    for (sub = sub_list; sub; sub = sub->next) {
+        if (sub->renew_at > now) {
+            continue;
+        }
+        if (sub_request(sub, SUB_LEASE, &granted, &matches) == 0 && granted > 0) {
+            sub->renew_at = now + (granted > 1 ? granted / 2 : 1);
+        } else {
+            sub->renew_at = now + 5;    // try again shortly
+        }
+    }
+}
+
+// Report an 'N' PDU and queue the item for download if a subscription asks
+// for it. Downloads start from the main loop, since this may run in the
+// middle of another request.
+void handle_notification(struct pdu_cursor *c)
+{
+    struct subscription *sub;
+    char name[CONTENT_NAME_SIZE + 1];
+    struct sockaddr_in addr;
+    struct content_meta meta;
+    int matched = 0;
+    int download = 0;
+    int i;
+
+    // Format: Content Name (10 bytes) | IP (4 bytes) | Port (2 bytes) | metadata
+    pdu_get_name(c, name, CONTENT_NAME_SIZE);
+    pdu_get_addr(c, &addr);
+    pdu_get_meta(c, &meta);
+    if (c->err) {
+        return;
+    }
+    for (sub = sub_list; sub; sub = sub->next) {
+        if (sub_matches(sub, name)) {
+            matched = 1;
+            download |= sub->download;
+        }
+    }
+    if (!matched) {
+        return;     // cancelled in the meantime
+    }
+
+    printf("Content '%s' is now available from %s:%d (%llu bytes)\n", name,
+           inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), (unsigned long long)meta.size);
+    if (!download || find_registered_content(name)) {
+        return;
+    }
+    for (i = 0; i < notify_count; i++) {
+        if (strcmp(notify_names[i], name) == 0) {
+            return;
+        }
+    }
+    if (notify_count < MAX_DOWNLOAD_NAMES) {
+        strcpy(notify_names[notify_count++], name);
+    }
+}
+
+// Fetch the items queued by handle_notification() in one download command.
+// Exact-name subscriptions are done once their item has arrived.
+void notify_downloads(void)
+{
+    char names[MAX_DOWNLOAD_NAMES][CONTENT_NAME_SIZE + 1];
+    const char *ptrs[MAX_DOWNLOAD_NAMES];
+    struct subscription *sub;
+    int count;
+    int i;
+
+    if (notify_count == 0) {
+        return;
+    }
+    count = notify_count;
+    memcpy(names, notify_names, sizeof(names));
+    notify_count = 0;
+    for (i = 0; i < count; i++) {
+        ptrs[i] = names[i];
+    }
+    download_contents(ptrs, count);
+
+    for (i = 0; i < count; i++) {
+        sub = find_subscription(names[i], 0);
+        if (sub && sub->download && find_registered_content(names[i])) {
+            unsubscribe_content(names[i]);
+        }
+    }
+    printf("> ");
+    fflush(stdout);
+}
+
+// Dispatch a datagram the index server sent on its own rather than in
+// reply to a request
+void handle_index_push(const struct pdu_hdr *h, char *payload)
+{
+    struct pdu_cursor c;
+
+    if (h->req_id != 0) {
+        return;
+    }
+    pdu_cursor_init(&c, payload, h->len);
+    if (h->type == 'N') {
+        handle_notification(&c);
+    } else if (h->type == 'P') {
+        handle_replica_order(&c);
+    }
+}
+
+// Advertise spare capacity to the index server, or withdraw from
+// replication when enabled is clear. Heartbeats aren't answered.
+void heartbeat_send(int enabled)
+{
+    char req[HB_SIZE];
+    struct pdu_hdr h;
+    struct pdu_cursor c;
+    struct iovec iov;
+    long long spare = cache_budget - cache_used;
+
+    // Format: Peer Name (10 bytes) | Flags (1 byte) | Active uploads (2 bytes)
+    //         | Upload slots (2 bytes) | Spare cache (8 bytes)
+    pdu_cursor_init(&c, req, sizeof(req));
+    pdu_put_name(&c, my_peer_name, PEER_NAME_SIZE);
+    pdu_put_u8(&c, enabled ? HB_REPLICATE : 0);
+    pdu_put_u16(&c, (unsigned int)stats_get(&stats->uploads_active));
+    pdu_put_u16(&c, MAX_UPLOADS);
+    pdu_put_u64(&c, spare > 0 ? (uint64_t)spare : 0);
+    iov.iov_base = req;
+    iov.iov_len = c.pos;
+
+    h.type = 'H'; // H for Heartbeat
+    h.flags = PDU_FLAG_HDR;
+    h.req_id = 0;
+    pdu_sendv(udp_sock, &h, &iov, 1, NULL, 0);
+    heartbeat_at = time(NULL) + REPL_HEARTBEAT;
+}
+
+// Queue a replication order from the index server. Like downloads for
+// subscriptions it runs from the main loop, since this may be called in the
+// middle of another request.
+void handle_replica_order(struct pdu_cursor *c)
+{
+    struct repl_order *o;
+    int i;
+
+    if (!replicate_enabled || repl_count >= REPL_QUEUE) {
+        return;
+    }
+
+    // Format: Action (1 byte) | Content Name (10 bytes) | IP (4 bytes) | Port (2 bytes) | metadata
+    o = &repl_queue[repl_count];
+    o->action = pdu_get_u8(c);
+    pdu_get_name(c, o->content_name, CONTENT_NAME_SIZE);
+    pdu_get_addr(c, &o->src.addr);
+    pdu_get_meta(c, &o->src.meta);
+    if (c->err || (o->action != REPL_FETCH && o->action != REPL_DROP)) {
+        return;
+    }
+    for (i = 0; i < repl_count; i++) {
+        if (strcmp(repl_queue[i].content_name, o->content_name) == 0) {
+            repl_queue[i] = *o;     // the newer order wins
+            return;
+        }
+    }
+    repl_count++;
+}
+
+// Send the capacity heartbeat when it is due and carry out queued
+// replication orders. A fetch only uses spare room in the cache, so it never
+// evicts content the user downloaded; only replicas fetched this way can be
+// dropped.
+void replicate_tick(void)
+{
+    struct repl_order orders[REPL_QUEUE];
+    struct repl_order *o;
+    struct download_job *job;
+    struct registered_content *reg;
+    struct cache_entry *entry;
+    int count;
+    int i;
+
+    if (replicate_enabled && time(NULL) >= heartbeat_at) {
+        heartbeat_send(1);
+    }
+    if (repl_count == 0) {
+        return;
+    }
+    count = repl_count;
+    memcpy(orders, repl_queue, sizeof(orders));
+    repl_count = 0;
+
+    for (i = 0; i < count; i++) {
+        o = &orders[i];
+        reg = find_registered_content(o->content_name);
+        if (o->action == REPL_DROP) {
+            if (!reg || !reg->replica) {
+                continue;
+            }
+            printf("Dropping replica of '%s', demand has cooled\n", o->content_name);
+            entry = cache_find(o->content_name);
+            if (entry) {
+                cache_evict(entry);
+            } else {
+                deregister_content(o->content_name);
+            }
+            continue;
+        }
+
+        if (reg) {
+            continue;
+        }
+        if (cache_used + (long long)o->src.meta.size > cache_budget) {
+            printf("Not replicating '%s': no spare room in the cache\n", o->content_name);
+            continue;
+        }
+        job = (struct download_job *)calloc(1, sizeof(*job));
+        if (!job) {
+            continue;
+        }
+        printf("Replicating '%s' from %s:%d for the index server\n", o->content_name,
+               inet_ntoa(o->src.addr.sin_addr), ntohs(o->src.addr.sin_port));
+        strncpy(job->content_name, o->content_name, CONTENT_NAME_SIZE);
+        job->res = o->src;
+        job->state = job_prepare(job);
+        if (job->state == JOB_PENDING) {
+            fetch_pipelined(&job, 1);
+            while (job_retry(job)) {
+                fetch_pipelined(&job, 1);
+            }
+            job_finish(job);
+        }
+        free(job);
+        reg = find_registered_content(o->content_name);
+        if (reg) {
+            reg->replica = 1;
+        }
+    }
+    heartbeat_send(replicate_enabled);
+    printf("> ");
+    fflush(stdout);
+}
+
+// Serve download requests on an accepted connection. A request without the
+// keep-alive option is the only one on its connection; otherwise requests
+// are served in order until the client closes the connection, stays idle
+// for SERVE_IDLE_TIMEOUT seconds, or an item is deregistered or changes.
+// This child only has the registry as of its fork, so it then closes the
+// connection before the next request, and the client asks again on a fresh
+// one. It does the same when asked for an item registered after the fork.
+void handle_tcp_connection(int tcp_sock)
+{
+    struct stream_reader *r;
+    struct pdu_cursor c;
+    char req[XFER_REQ_SIZE];
+    char name[CONTENT_NAME_SIZE + 1];
+    struct delta_index delta;
+    size_t len;
+    uint32_t req_id;
+    int options;
+    int rc;
+    int served = 0;
+    int one = 1;
+
+    // Every write is a complete frame; don't let Nagle hold a response
+    // behind the client's delayed ACK on a kept-alive connection
+    setsockopt(tcp_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    r = (struct stream_reader *)malloc(sizeof(*r));
+    if (!r) {
+        return;
+    }
+    r->fd = tcp_sock;
+    r->pos = 0;
+    r->len = 0;
+
+    for (;;) {
+        if (r->pos == r->len && !serve_wait(tcp_sock, served > 0)) {
+            break;
+        }
+        if (served > 0 && reg_stale()) {
+            break;
+        }
+        if (reader_read(r, req, 1 + CONTENT_NAME_SIZE) < 0) {
+            break;
+        }
+
+        // The type byte tells whole requests from those of peers predating
+        // transfer options, which hold only the content name and leave
+        // options and request id reading as 0
+        len = 1 + CONTENT_NAME_SIZE;
+        if ((unsigned char)req[0] == XFER_REQ_TYPE) {
+            if (reader_read(r, req + len, XFER_REQ_SIZE - len) < 0) {
+                break;
+            }
+            len = XFER_REQ_SIZE;
+        } else if (req[0] != 'D' || served > 0) {
+            send_transfer_error(tcp_sock, 0, 0, "Invalid download request");
+            break;
+        }
+        pdu_cursor_init(&c, req + 1, len - 1);
+        pdu_get_name(&c, name, CONTENT_NAME_SIZE);
+        options = pdu_get_u8(&c) & (XFER_OPT_LZ | XFER_OPT_KEEPALIVE | XFER_OPT_DELTA);
+        req_id = pdu_get_u32(&c);
+
+        // An item registered since the fork: close, and the client asks for
+        // it again on a fresh connection
+        if (served > 0 && reg_missing(name)) {
+            break;
+        }
+
+        // A delta request carries the manifest of the client's old copy
+        if ((options & XFER_OPT_DELTA) && delta_read_manifest(r, &delta) < 0) {
+            send_transfer_error(tcp_sock, options, req_id, "Invalid chunk manifest");
+            break;
+        }
+        rc = serve_request(tcp_sock, name, options, req_id,
+                           (options & XFER_OPT_DELTA) ? &delta : NULL);
+        if (options & XFER_OPT_DELTA) {
+            delta_index_free(&delta);
+        }
+        if (rc < 0 || !(options & XFER_OPT_KEEPALIVE)) {
+            break;
+        }
+        served++;
+    }
+    free(r);
+}
+
+// Wait for the next request on a kept-alive connection. Returns 0 if the
+// connection is to be closed instead: it stayed idle for SERVE_IDLE_TIMEOUT
+// seconds, or, with check_registry, the registry changed meanwhile.
+int serve_wait(int tcp_sock, int check_registry)
+{
+    struct pollfd pfd;
+    int waited;
+    int rc;
+
+    pfd.fd = tcp_sock;
+    pfd.events = POLLIN;
+    for (waited = 0; waited < SERVE_IDLE_TIMEOUT; waited++) {
+        if (check_registry && reg_stale()) {
+            return 0;
+        }
+        rc = poll(&pfd, 1, 1000);
+        if (rc != 0) {
+            return rc > 0;
+        }
+    }
+    return 0;
+}
+
+// Send one registered item, as a delta against the client's old copy if
+// delta holds its manifest. Returns -1 if the connection is no longer usable.
+int serve_request(int tcp_sock, const char *content_name, int options, uint32_t req_id,
+                  const struct delta_index *delta)
+{
+    struct registered_content *reg;
+    int fd;
+    int rc = 0;
+    ssize_t r;
+    char buffer[BUFLEN];
+    char filename[256];
+    char msg[MAX_DATA_SIZE];
+    char ack[2];
+    char type;
+    struct iovec iov[2];
+    struct xfer_stats st;
+    struct stat sb;
+    struct upload_throttle th;
+    long long start_ns = now_ns();
+    int ok = 1;
+
+    reg = find_registered_content(content_name);
+    if (!reg) {
+        stats_transfer(1, 0, NULL, 0, 0);
+        return send_transfer_error(tcp_sock, options, req_id, "Content not found");
+    }
+
+    // Open the file using the stored filename
+    fd = open(reg->filename, O_RDONLY);
+    if (fd < 0) {
+        snprintf(filename, sizeof(filename), "%s/downloaded_%s", CACHE_DIR, reg->content_name);
+        fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            snprintf(msg, sizeof(msg), "Cannot open file for content '%s'", reg->content_name);
+            stats_transfer(1, 0, NULL, 0, 0);
+            return send_transfer_error(tcp_sock, options, req_id, msg);
+        }
+    }
+
+    throttle_start(&th, fstat(fd, &sb) == 0 ? sb.st_size : 0);
+    memset(&st, 0, sizeof(st));
+    stats_add(&stats->uploads_active, 1);
+
+    if (options) {
+        // Framed chunks, compressed if the client offered it
+        ack[0] = 'A';
+        ack[1] = (char)options;
+        if (write_all(tcp_sock, ack, 2) < 0) {
+            rc = -1;
+            ok = 0;
+        } else if (delta ? send_delta(fd, tcp_sock, &st, &th, req_id, options & XFER_OPT_LZ, delta) < 0 :
+                           send_chunks(fd, tcp_sock, &st, &th, req_id, options & XFER_OPT_LZ) < 0) {
+            rc = -1;
+            ok = 0;
+        }
+        if (st.reused_bytes > 0) {
+            printf("Upload '%s': %llu bytes, %llu of them reused from the client's copy, "
+                   "%llu on the wire\n", reg->content_name, (unsigned long long)st.raw_bytes,
+                   (unsigned long long)st.reused_bytes, (unsigned long long)st.wire_bytes);
+        } else if (st.wire_bytes != st.raw_bytes) {
+            printf("Upload '%s': %llu bytes -> %llu on the wire (ratio %.2f, %.2f ms compress CPU)\n",
+                   reg->content_name, (unsigned long long)st.raw_bytes,
+                   (unsigned long long)st.wire_bytes,
+                   st.wire_bytes ? (double)st.raw_bytes / st.wire_bytes : 1.0,
+                   st.cpu_ns / 1e6);
+        }
+    } else {
+        // Send file data as a type byte followed by the data just read
+        rc = -1;    // the legacy stream ends at EOF
+        iov[0].iov_base = &type;
+        iov[0].iov_len = 1;
+        iov[1].iov_base = buffer;
+        for (;;) {
+            r = read(fd, buffer, MAX_DATA_SIZE);
+            if (r < 0) {
+                ok = 0;
+                send_transfer_error(tcp_sock, 0, req_id, "Read error");
+                break;
+            }
+            if (r == 0) {
+                type = 'F';
+                write_all(tcp_sock, &type, 1);
+                break;
+            }
+            if (st.first_ns == 0) {
+                st.first_ns = now_ns();
+            }
+            st.raw_bytes += r;
+            st.wire_bytes += 1 + r;
+            type = r < MAX_DATA_SIZE ? 'F' : 'C';
+            iov[1].iov_len = r;
+            throttle_consume(&th, 1 + r);
+            if (writev_all(tcp_sock, iov, 2) < 0) {
+                ok = 0;
+                break;
+            }
+            if (type == 'F') {
+                break;
+            }
+        }
+    }
+
+    throttle_stop(&th);
+    close(fd);
+    stats_add(&stats->uploads_active, (uint64_t)-1);
+    stats_transfer(1, ok, &st, start_ns, now_ns());
+    if (ok) {
+        stats_content(reg->content_name, st.raw_bytes);
+    }
+
+    // Let the parent count the serve for its content cache
+    write(serve_pipe[1], reg->content_name, CONTENT_NAME_SIZE);
+    return rc;
+}
+
+// Report a failed request. Framed responses keep the connection usable.
+int send_transfer_error(int tcp_sock, int options, uint32_t req_id, const char *msg)
+{
+    struct iovec iov[3];
+    char ack[2];
+    char hdr[CHUNK_HDR_SIZE];
+    char type = 'E';
+    size_t len;
+
+    len = strlen(msg);
+    if (!options) {
+        // Old-style 'E' PDU: the NUL-terminated text, cut to a PDU's data field
+        if (len > MAX_DATA_SIZE - 1) {
+            len = MAX_DATA_SIZE - 1;
+        }
+        iov[0].iov_base = &type;
+        iov[0].iov_len = 1;
+        iov[1].iov_base = (void *)msg;
+        iov[1].iov_len = len;
+        iov[2].iov_base = (void *)"";
+        iov[2].iov_len = 1;
+        writev_all(tcp_sock, iov, 3);
+        return -1;
+    }
+    if (len > MAX_DATA_SIZE) {
+        len = MAX_DATA_SIZE;
+    }
+    ack[0] = 'A';
+    ack[1] = (char)options;
+    pdu_put_hdr(hdr, 'E', 0, len, req_id);
+    iov[0].iov_base = ack;
+    iov[0].iov_len = 2;
+    iov[1].iov_base = hdr;
+    iov[1].iov_len = CHUNK_HDR_SIZE;
+    iov[2].iov_base = (void *)msg;
+    iov[2].iov_len = len;
+    return writev_all(tcp_sock, iov, 3);
+}
+
+// Bind the small-item UDP socket to the port number the listen socket got,
+// so the registered address serves both
+int create_fast_socket(const struct sockaddr_in *listen)
+{
+    struct sockaddr_in addr;
+    int sock;
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    addr = *listen;
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    return sock;
+}
+
+// Answer the 'G' requests waiting on fast_sock. This runs in the main loop
+// rather than in an upload child: the items are at most fast_max bytes, so
+// reading and sending one costs less than a fork. They can't wait for the
+// upload scheduler there, so the bytes are taken from the global bucket
+// only if it has them at once; otherwise the client is sent to TCP, where
+// it queues like any other upload. The source address of a datagram can be
+// forged, so a request without the cookie issued to its address gets at
+// most FAST_AMPLIFY times its own size back: a 'V' with the cookie and the
+// segments that fit.
+void fast_serve(void)
+{
+    char buf[PDU_MAX_DGRAM];
+    char data[FAST_SEGMENT_SIZE * FAST_MAX_SEGMENTS + 1];
+    char seg_hdr[FAST_HDR_SIZE];
+    char cookie_msg[8 + 4];
+    char name[CONTENT_NAME_SIZE + 1];
+    char filename[256];
+    const char *msg;
+    char *payload;
+    struct sockaddr_in from;
+    socklen_t alen;
+    struct pdu_hdr h;
+    struct pdu_hdr out;
+    struct pdu_cursor c;
+    struct iovec iov[2];
+    struct registered_content *reg;
+    struct content_meta meta;
+    struct xfer_stats st;
+    long long start_ns;
+    uint64_t cookie;
+    uint32_t wanted;
+    uint32_t all;
+    uint32_t sent;
+    ssize_t n;
+    size_t size;
+    size_t off;
+    size_t budget;
+    size_t used;
+    size_t charge;
+    int segments;
+    int polls;
+    int fd;
+    int i;
+
+    for (polls = 0; polls < FAST_SERVE_BURST; polls++) {
+        alen = sizeof(from);
+        n = recvfrom(fast_sock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &alen);
+        if (n < 0) {
+            return;
+        }
+        if (pdu_decode(buf, n, &h, &payload) < 0 || !(h.flags & PDU_FLAG_HDR) || h.type != 'G') {
+            continue;
+        }
+        start_ns = now_ns();
+        budget = (size_t)n * FAST_AMPLIFY;
+
+        // Format: Content Name (10 bytes) | Wanted (4 bytes) | Cookie (8 bytes) | padding
+        pdu_cursor_init(&c, payload, h.len);
+        pdu_get_name(&c, name, CONTENT_NAME_SIZE);
+        wanted = pdu_get_u32(&c);
+        cookie = pdu_remaining(&c) >= 8 ? pdu_get_u64(&c) : 0;
+        if (c.err) {
+            continue;
+        }
+        if (fast_cookie_check(from.sin_addr.s_addr, cookie)) {
+            budget = 0;     // no limit
+        }
+
+        msg = NULL;
+        size = 0;
+        reg = find_registered_content(name);
+        if (!reg) {
+            msg = "Content not found";
+        } else if (fast_max <= 0 || reg->meta.size > (uint64_t)fast_max) {
+            msg = "Too large for UDP, use TCP";
+        } else {
+            fd = open(reg->filename, O_RDONLY);
+            if (fd < 0) {
+                snprintf(filename, sizeof(filename), "%s/downloaded_%s", CACHE_DIR,
+                         reg->content_name);
+                fd = open(filename, O_RDONLY);
+            }
+            if (fd < 0) {
+                msg = "Cannot open file";
+            } else {
+                // Read one byte more than fits to notice a file that grew
+                while (size < sizeof(data) && (n = read(fd, data + size, sizeof(data) - size)) > 0) {
+                    size += n;
+                }
+                close(fd);
+                if (n < 0) {
+                    msg = "Read error";
+                } else if (size > (size_t)fast_max) {
+                    msg = "Too large for UDP, use TCP";
+                }
+            }
+        }
+
+        if (!msg && budget) {
+            cookie = fast_cookie_issue(from.sin_addr.s_addr);
+            if (cookie == 0) {
+                msg = "Cannot issue a cookie, use TCP";
+            }
+        }
+
+        // One 'C' datagram per wanted segment; an empty item still has one
+        segments = size ? (size + FAST_SEGMENT_SIZE - 1) / FAST_SEGMENT_SIZE : 1;
+        charge = 0;
+        for (i = 0; i < segments; i++) {
+            off = (size_t)i * FAST_SEGMENT_SIZE;
+            if (wanted & (1U << i)) {
+                charge += PDU_HDR_SIZE + FAST_HDR_SIZE +
+                          (size - off < FAST_SEGMENT_SIZE ? size - off : FAST_SEGMENT_SIZE);
+            }
+        }
+        if (!msg && !budget && charge > 0 && throttle_try(charge) < 0) {
+            msg = "Upload limit reached, use TCP";
+        }
+
+        // Errors fit within the budget of any request, so they go out either way
+        out.flags = PDU_FLAG_HDR;
+        out.req_id = h.req_id;
+        if (msg) {
+            out.type = 'E';
+            iov[0].iov_base = (void *)msg;
+            iov[0].iov_len = strlen(msg) + 1;
+            pdu_sendv(fast_sock, &out, iov, 1, (struct sockaddr *)&from, alen);
+            continue;
+        }
+
+        all = segments == 32 ? 0xffffffffU : (1U << segments) - 1;
+        meta = reg->meta;
+        meta.size = size;
+        memset(&st, 0, sizeof(st));
+        st.fast = 1;
+
+        // Without a valid cookie: the cookie, and the wanted segments too
+        // if they all fit the budget with it. Otherwise the client asks for
+        // them again with the cookie, and that request counts as the serve.
+        // The same happens when the upload limit has no room for them now.
+        if (budget) {
+            used = PDU_HDR_SIZE + sizeof(cookie_msg) + charge;
+            sent = used <= budget && throttle_try(charge) == 0 ? wanted : 0;
+
+            // Format: Cookie (8 bytes) | Sent (4 bytes)
+            pdu_cursor_init(&c, cookie_msg, sizeof(cookie_msg));
+            pdu_put_u64(&c, cookie);
+            pdu_put_u32(&c, sent);
+            out.type = 'V';
+            iov[0].iov_base = cookie_msg;
+            iov[0].iov_len = c.pos;
+            pdu_sendv(fast_sock, &out, iov, 1, (struct sockaddr *)&from, alen);
+            wanted &= sent;
+        }
+
+        out.type = 'C';
+        for (i = 0; i < segments; i++) {
+            if (!(wanted & (1U << i))) {
+                continue;
+            }
+            off = (size_t)i * FAST_SEGMENT_SIZE;
+
+            // Format: Segment (1 byte) | Segments (1 byte) | metadata (24 bytes) | data
+            pdu_cursor_init(&c, seg_hdr, sizeof(seg_hdr));
+            pdu_put_u8(&c, i);
+            pdu_put_u8(&c, segments);
+            pdu_put_meta(&c, &meta);
+            iov[0].iov_base = seg_hdr;
+            iov[0].iov_len = c.pos;
+            iov[1].iov_base = data + off;
+            iov[1].iov_len = size - off < FAST_SEGMENT_SIZE ? size - off : FAST_SEGMENT_SIZE;
+            if (pdu_sendv(fast_sock, &out, iov, 2, (struct sockaddr *)&from, alen) < 0) {
+                break;
+            }
+            if (st.first_ns == 0) {
+                st.first_ns = now_ns();
+            }
+            st.raw_bytes += iov[1].iov_len;
+            st.wire_bytes += PDU_HDR_SIZE + c.pos + iov[1].iov_len;
+        }
+
+        // Count the first request for an item as a serve, not the retransmissions
+        if ((wanted & all) == all) {
+            stats_transfer(1, 1, &st, start_ns, now_ns());
+            stats_content(reg->content_name, st.raw_bytes);
+            cache_touch(reg->content_name, 1);
+        }
+    }
+}
+
+// Write all of buf, retrying short writes
+int write_all(int fd, const void *buf, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    return writev_all(fd, &iov, 1);
+}
+
+// Write every iovec in one writev() where possible, resuming after short
+// writes. iov is modified.
+int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t w;
+    long long t0;
+
+    while (iovcnt > 0 && iov[iovcnt - 1].iov_len == 0) {
+        iovcnt--;
+    }
+    while (iovcnt > 0) {
+        t0 = now_ns();
+        w = writev(fd, iov, iovcnt);
+        if (stats && now_ns() - t0 > STATS_STALL_MS * 1000000LL) {
+            stats_add(&stats->send_stalls, 1);
+        }
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        pdu_iov_advance(&iov, &iovcnt, w);
+    }
+    return 0;
+}
+
+// Send fd as framed chunks for req_id. A producer thread reads (and, if
+// compress is set, compresses) chunks while this thread writes the previous
+// ones to the socket. Returns -1 if the socket failed.
+int send_chunks(int fd, int tcp_sock, struct xfer_stats *st, struct upload_throttle *th,
+                uint32_t req_id, int compress)
+{
+    struct send_pipeline *sp;
+    pthread_t producer;
+    struct chunk_slot *slot;
+    struct iovec iov[2];
+    int last;
+    int rc = 0;
+
+    sp = (struct send_pipeline *)calloc(1, sizeof(*sp));
+    if (!sp) {
+        return -1;
+    }
+    sp->fd = fd;
+    sp->compress = compress;
+    sp->req_id = req_id;
+    sp->st = st;
+    pthread_mutex_init(&sp->lock, NULL);
+    pthread_cond_init(&sp->cond, NULL);
+    if (pthread_create(&producer, NULL, chunk_producer_main, sp) != 0) {
+        pthread_mutex_destroy(&sp->lock);
+        pthread_cond_destroy(&sp->cond);
+        free(sp);
+        return -1;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&sp->lock);
+        while (sp->count == 0) {
+            pthread_cond_wait(&sp->cond, &sp->lock);
+        }
+        slot = &sp->slot[sp->head];
+        pthread_mutex_unlock(&sp->lock);
+
+        // Header and payload go out together without being copied into one frame
+        last = slot->last;
+        iov[0].iov_base = slot->hdr;
+        iov[0].iov_len = CHUNK_HDR_SIZE;
+        iov[1].iov_base = (void *)slot->payload;
+        iov[1].iov_len = slot->len;
+        throttle_consume(th, CHUNK_HDR_SIZE + slot->len);
+        if (writev_all(tcp_sock, iov, 2) < 0) {
+            last = 1;
+            rc = -1;
+        } else if (st->first_ns == 0) {
+            st->first_ns = now_ns();
+        }
+
+        pthread_mutex_lock(&sp->lock);
+        sp->head = (sp->head + 1) % PIPE_SLOTS;
+        sp->count--;
+        if (last) {
+            sp->abort = 1;
+        }
+        pthread_cond_broadcast(&sp->cond);
+        pthread_mutex_unlock(&sp->lock);
+        if (last) {
+            break;
+        }
+    }
+
+    pthread_join(producer, NULL);
+    pthread_mutex_destroy(&sp->lock);
+    pthread_cond_destroy(&sp->cond);
+    free(sp);
+    return rc;
+}
+
+// Producer stage: read and compress chunks into free pipeline slots. Chunks
+// that don't shrink are sent as-is with the compressed flag clear.
+void *chunk_producer_main(void *arg)
+{
+    struct send_pipeline *sp = (struct send_pipeline *)arg;
+    struct chunk_slot *slot;
+    size_t fill;
+    size_t len;
+    ssize_t r;
+    int last = 0;
+    struct timespec t0, t1;
+
+    while (!last) {
+        pthread_mutex_lock(&sp->lock);
+        while (sp->count == PIPE_SLOTS && !sp->abort) {
+            pthread_cond_wait(&sp->cond, &sp->lock);
+        }
+        if (sp->abort) {
+            pthread_mutex_unlock(&sp->lock);
+            break;
+        }
+        slot = &sp->slot[sp->tail];
+        pthread_mutex_unlock(&sp->lock);
+
+        // Fill a whole chunk so only the final one is short
+        fill = 0;
+        r = 0;
+        while (fill < XFER_CHUNK_SIZE) {
+            r = read(sp->fd, slot->raw + fill, XFER_CHUNK_SIZE - fill);
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                break;
+            }
+            fill += r;
+        }
+
+        if (r < 0) {
+            slot->payload = "Read error";
+            len = strlen(slot->payload);
+            pdu_put_hdr(slot->hdr, 'E', 0, len, sp->req_id);
+            last = 1;
+        } else {
+            last = fill < XFER_CHUNK_SIZE;
+            len = 0;
+            if (sp->compress && fill > 1) {
+                clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+                len = lz_compress(slot->raw, fill, slot->packed, fill - 1);
+                clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+                sp->st->cpu_ns += (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+            }
+            if (len > 0) {
+                slot->payload = slot->packed;
+                pdu_put_hdr(slot->hdr, last ? 'F' : 'C', CHUNK_COMPRESSED, len, sp->req_id);
+            } else {
+                len = fill;
+                slot->payload = slot->raw;
+                pdu_put_hdr(slot->hdr, last ? 'F' : 'C', 0, len, sp->req_id);
+            }
+            sp->st->raw_bytes += fill;
+            sp->st->wire_bytes += len;
+        }
+        slot->len = len;
+        slot->last = last;
+
+        pthread_mutex_lock(&sp->lock);
+        sp->tail = (sp->tail + 1) % PIPE_SLOTS;
+        sp->count++;
+        pthread_cond_broadcast(&sp->cond);
+        pthread_mutex_unlock(&sp->lock);
+    }
+
+    return NULL;
+}
+
+// Start reading fd one content-defined chunk at a time
+int chunk_reader_open(struct chunk_reader *cr, int fd)
+{
+    cr->fd = fd;
+    cr->pos = 0;
+    cr->len = 0;
+    cr->eof = 0;
+    cr->buf = (char *)malloc(CDC_BUF_SIZE);
+    return cr->buf ? 0 : -1;
+}
+
+// Next chunk of the file as cut by cdc_cut(). Returns 1 with data and len
+// set, 0 at the end of the file or -1 on a read error. data stays valid
+// until the next call.
+int chunk_next(struct chunk_reader *cr, const char **data, size_t *len)
+{
+    ssize_t r;
+
+    // Keep at least a maximum-size chunk in the window until EOF
+    if (!cr->eof && cr->len - cr->pos < CDC_MAX_SIZE) {
+        memmove(cr->buf, cr->buf + cr->pos, cr->len - cr->pos);
+        cr->len -= cr->pos;
+        cr->pos = 0;
+        while (cr->len < CDC_BUF_SIZE) {
+            r = read(cr->fd, cr->buf + cr->len, CDC_BUF_SIZE - cr->len);
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r < 0) {
+                return -1;
+            }
+            if (r == 0) {
+                cr->eof = 1;
+                break;
+            }
+            cr->len += r;
+        }
+    }
+    if (cr->pos == cr->len) {
+        return 0;
+    }
+    *data = cr->buf + cr->pos;
+    *len = cdc_cut(*data, cr->len - cr->pos);
+    cr->pos += *len;
+    return 1;
+}
+
+// Open the old copy of a cached item and chunk it, so the download can ask
+// for a delta against it. The copy stays in place, and stays readable
+// through base->fd if it is evicted, until the new version replaces it.
+// Returns -1 if the item is to be fetched in full.
+int delta_prepare(struct download_job *job, const struct cache_entry *old)
+{
+    struct delta_base *base = &job->base;
+    struct delta_chunk *grown;
+    struct chunk_reader cr;
+    struct pdu_cursor c;
+    const char *data;
+    size_t len;
+    off_t offset = 0;
+    uint32_t cap = 0;
+    uint32_t i;
+    int rc;
+
+    memset(base, 0, sizeof(*base));
+    if (old->meta.size < DELTA_MIN_SIZE || job->res.meta.size < DELTA_MIN_SIZE) {
+        return -1;
+    }
+    base->fd = open(old->filename, O_RDONLY);
+    if (base->fd < 0 || chunk_reader_open(&cr, base->fd) < 0) {
+        if (base->fd >= 0) {
+            close(base->fd);
+        }
+        memset(base, 0, sizeof(*base));
+        return -1;
+    }
+
+    while ((rc = chunk_next(&cr, &data, &len)) > 0) {
+        if (base->count == cap) {
+            if (cap == DELTA_MAX_CHUNKS) {
+                rc = -1;
+                break;
+            }
+            cap = cap ? cap * 2 : 256;
+            grown = (struct delta_chunk *)realloc(base->chunks, cap * sizeof(*grown));
+            if (!grown) {
+                rc = -1;
+                break;
+            }
+            base->chunks = grown;
+        }
+        base->chunks[base->count].offset = offset;
+        base->chunks[base->count].len = len;
+        base->chunks[base->count].hash = content_hash_update(CONTENT_HASH_INIT, data, len);
+        base->count++;
+        offset += len;
+    }
+    free(cr.buf);
+
+    // Manifest: Count (4 bytes) | [Length (4 bytes) | Hash (8 bytes)] x Count
+    base->manifest_len = 4 + (size_t)base->count * DELTA_ENTRY_SIZE;
+    base->manifest = rc == 0 ? (char *)malloc(base->manifest_len) : NULL;
+    if (!base->manifest) {
+        close(base->fd);
+        free(base->chunks);
+        free(base->manifest);
+        memset(base, 0, sizeof(*base));
+        return -1;
+    }
+    pdu_cursor_init(&c, base->manifest, base->manifest_len);
+    pdu_put_u32(&c, base->count);
+    for (i = 0; i < base->count; i++) {
+        pdu_put_u32(&c, base->chunks[i].len);
+        pdu_put_u64(&c, base->chunks[i].hash);
+    }
+    return 0;
+}
+
+// Close the old copy of a delta download
+void delta_release(struct delta_base *base)
+{
+    if (base->manifest) {
+        close(base->fd);
+    }
+    free(base->chunks);
+    free(base->manifest);
+    memset(base, 0, sizeof(*base));
+}
+
+// Write count chunks of the old copy, starting with chunk first, to sink
+// using buf. Returns the number of bytes written, or -1 if the range isn't
+// in the manifest or can't be read.
+long long delta_copy(const struct delta_base *base, uint32_t first, uint32_t count,
+                     struct download_sink *sink, char *buf, size_t size)
+{
+    off_t start;
+    off_t off;
+    off_t end;
+    ssize_t r;
+    size_t n;
+
+    if (count == 0 || first >= base->count || count > base->count - first) {
+        return -1;
+    }
+    start = base->chunks[first].offset;
+    end = base->chunks[first + count - 1].offset + base->chunks[first + count - 1].len;
+    for (off = start; off < end; off += r) {
+        n = end - off < (off_t)size ? (size_t)(end - off) : size;
+        r = pread(base->fd, buf, n, off);
+        if (r <= 0 || sink_write(sink, buf, r) < 0) {
+            return -1;
+        }
+    }
+    return end - start;
+}
+
+// Read the chunk manifest following a delta request and index it by hash.
+// Returns -1 if it is malformed or doesn't fit in memory.
+int delta_read_manifest(struct stream_reader *r, struct delta_index *idx)
+{
+    char entry[DELTA_ENTRY_SIZE];
+    struct pdu_cursor c;
+    uint32_t size;
+    uint32_t i;
+    uint32_t k;
+
+    memset(idx, 0, sizeof(*idx));
+    if (reader_read(r, entry, 4) < 0) {
+        return -1;
+    }
+    pdu_cursor_init(&c, entry, 4);
+    idx->count = pdu_get_u32(&c);
+    if (idx->count > DELTA_MAX_CHUNKS) {
+        return -1;
+    }
+    for (size = 2; size < 2 * idx->count; size <<= 1) {
+        ;   // keep the table at most half full
+    }
+    idx->mask = size - 1;
+    idx->len = (uint32_t *)malloc((idx->count + 1) * sizeof(*idx->len));
+    idx->hash = (uint64_t *)malloc((idx->count + 1) * sizeof(*idx->hash));
+    idx->slot = (uint32_t *)calloc(size, sizeof(*idx->slot));
+    if (!idx->len || !idx->hash || !idx->slot) {
+        delta_index_free(idx);
+        return -1;
+    }
+
+    for (i = 0; i < idx->count; i++) {
+        if (reader_read(r, entry, DELTA_ENTRY_SIZE) < 0) {
+            delta_index_free(idx);
+            return -1;
+        }
+        pdu_cursor_init(&c, entry, DELTA_ENTRY_SIZE);
+        idx->len[i] = pdu_get_u32(&c);
+        idx->hash[i] = pdu_get_u64(&c);
+
+        // The first of identical chunks is the one referenced
+        k = idx->hash[i] & idx->mask;
+        while (idx->slot[k] && (idx->hash[idx->slot[k] - 1] != idx->hash[i] ||
+                                idx->len[idx->slot[k] - 1] != idx->len[i])) {
+            k = (k + 1) & idx->mask;
+        }
+        if (!idx->slot[k]) {
+            idx->slot[k] = i + 1;
+        }
+    }
+    return 0;
+}
+
+// Index of the client's chunk with this hash and length, -1 if it has none
+int delta_find(const struct delta_index *idx, uint64_t hash, uint32_t len)
+{
+    uint32_t k;
+
+    for (k = hash & idx->mask; idx->slot[k]; k = (k + 1) & idx->mask) {
+        if (idx->hash[idx->slot[k] - 1] == hash && idx->len[idx->slot[k] - 1] == len) {
+            return idx->slot[k] - 1;
+        }
+    }
+    return -1;
+}
+
+void delta_index_free(struct delta_index *idx)
+{
+    free(idx->len);
+    free(idx->hash);
+    free(idx->slot);
+    memset(idx, 0, sizeof(*idx));
+}
+
+// Send fd as framed chunks for req_id, replacing each run of chunks the
+// client already holds with one 'K' reference into its manifest. New data
+// goes out in frames of up to XFER_CHUNK_SIZE, compressed if compress is
+// set. Returns -1 if the socket failed.
+int send_delta(int fd, int tcp_sock, struct xfer_stats *st, struct upload_throttle *th,
+               uint32_t req_id, int compress, const struct delta_index *idx)
+{
+    struct chunk_reader cr;
+    struct pdu_cursor c;
+    char ref[DELTA_REF_SIZE];
+    char *lit;              // new data not sent yet
+    char *packed;
+    const char *data;
+    size_t len;
+    size_t n;
+    size_t fill = 0;
+    uint32_t run_first = 0;
+    uint32_t run_count = 0;
+    int got;
+    int k;
+    int rc = -1;
+
+    lit = (char *)malloc(XFER_CHUNK_SIZE);
+    packed = (char *)malloc(XFER_CHUNK_SIZE);
+    cr.buf = NULL;
+    if (!lit || !packed || chunk_reader_open(&cr, fd) < 0) {
+        goto out;
+    }
+
+    while ((got = chunk_next(&cr, &data, &len)) > 0) {
+        k = delta_find(idx, content_hash_update(CONTENT_HASH_INIT, data, len), len);
+        if (k >= 0) {
+            st->raw_bytes += len;
+            st->reused_bytes += len;
+            if (run_count > 0 && (uint32_t)k == run_first + run_count) {
+                run_count++;
+                continue;
+            }
+        }
+
+        // Whatever is pending before this chunk goes out first, in order
+        if (fill > 0 && (k >= 0 || fill == XFER_CHUNK_SIZE)) {
+            if (send_data_frame(tcp_sock, st, th, 'C', lit, fill, req_id, compress, packed) < 0) {
+                goto out;
+            }
+            fill = 0;
+        }
+        if (run_count > 0) {
+            pdu_cursor_init(&c, ref, sizeof(ref));
+            pdu_put_u32(&c, run_first);
+            pdu_put_u32(&c, run_count);
+            if (send_frame(tcp_sock, st, th, 'K', 0, ref, sizeof(ref), req_id) < 0) {
+                goto out;
+            }
+            run_count = 0;
+        }
+        if (k >= 0) {
+            run_first = k;
+            run_count = 1;
+            continue;
+        }
+
+        // New data, in full frames
+        while (len > 0) {
+            n = XFER_CHUNK_SIZE - fill < len ? XFER_CHUNK_SIZE - fill : len;
+            memcpy(lit + fill, data, n);
+            fill += n;
+            data += n;
+            len -= n;
+            if (fill == XFER_CHUNK_SIZE && len > 0) {
+                if (send_data_frame(tcp_sock, st, th, 'C', lit, fill, req_id, compress, packed) < 0) {
+                    goto out;
+                }
+                fill = 0;
+            }
+        }
+    }
+
+    if (got < 0) {
+        rc = send_frame(tcp_sock, st, th, 'E', 0, "Read error", strlen("Read error"), req_id);
+        goto out;
+    }
+    if (run_count > 0) {
+        if (fill > 0 && send_data_frame(tcp_sock, st, th, 'C', lit, fill, req_id, compress, packed) < 0) {
+            goto out;
+        }
+        fill = 0;
+        pdu_cursor_init(&c, ref, sizeof(ref));
+        pdu_put_u32(&c, run_first);
+        pdu_put_u32(&c, run_count);
+        if (send_frame(tcp_sock, st, th, 'K', 0, ref, sizeof(ref), req_id) < 0) {
+            goto out;
+        }
+    }
+    rc = send_data_frame(tcp_sock, st, th, 'F', lit, fill, req_id, compress, packed);
+
+out:
+    free(cr.buf);
+    free(lit);
+    free(packed);
+    return rc;
+}
+
+// Send new content data as one frame, compressed into packed if that helps
+int send_data_frame(int tcp_sock, struct xfer_stats *st, struct upload_throttle *th, int type,
+                    const char *data, size_t len, uint32_t req_id, int compress, char *packed)
+{
+    size_t plen = 0;
+    struct timespec t0, t1;
+
+    if (compress && len > 1) {
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+        plen = lz_compress(data, len, packed, len - 1);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+        st->cpu_ns += (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+    }
+    st->raw_bytes += len;
+    if (plen > 0) {
+        return send_frame(tcp_sock, st, th, type, CHUNK_COMPRESSED, packed, plen, req_id);
+    }
+    return send_frame(tcp_sock, st, th, type, 0, data, len, req_id);
+}
+
+// Write one framed chunk
+int send_frame(int tcp_sock, struct xfer_stats *st, struct upload_throttle *th, int type,
+               int flags, const char *payload, size_t len, uint32_t req_id)
+{
+    char hdr[CHUNK_HDR_SIZE];
+    struct iovec iov[2];
+
+    pdu_put_hdr(hdr, type, flags, len, req_id);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = CHUNK_HDR_SIZE;
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = len;
+    throttle_consume(th, CHUNK_HDR_SIZE + len);
+    if (writev_all(tcp_sock, iov, 2) < 0) {
+        return -1;
+    }
+    if (st->first_ns == 0) {
+        st->first_ns = now_ns();
+    }
+    st->wire_bytes += len;
+    return 0;
+}
+
+// Monotonic clock in nanoseconds
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Map the upload scheduler into memory shared with future upload children
+int sched_init(void)
+{
+    pthread_mutexattr_t attr;
+
+    sched = (struct upload_sched *)mmap(NULL, sizeof(*sched), PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sched == MAP_FAILED) {
+        sched = NULL;
+        return -1;
+    }
+    memset(sched, 0, sizeof(*sched));
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&sched->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    sched->last_refill_ns = now_ns();
+    return 0;
+}
+
+// Take the scheduler lock. If an upload child died holding it, the lock
+// is handed over anyway: every update under it leaves the state usable,
+// and the dead child's slot is released when it is reaped.
+void sched_lock(void)
+{
+    if (pthread_mutex_lock(&sched->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&sched->lock);
+    }
+}
+
+// Change the upload limits; running uploads pick them up on their next grant
+void sched_set_limits(long long global_rate, long long conn_rate)
+{
+    sched_lock();
+    sched->global_rate = global_rate > 0 ? global_rate : 0;
+    sched->conn_rate = conn_rate > 0 ? conn_rate : 0;
+    sched->tokens = 0;
+    sched->last_refill_ns = now_ns();
+    pthread_mutex_unlock(&sched->lock);
+}
+
+// Parse a rate in KB/s as given to the ratelimit command
+int parse_rate(const char *arg, long long *rate)
+{
+    char *end;
+    long long kbps;
+
+    errno = 0;
+    kbps = strtoll(arg, &end, 10);
+    if (errno || end == arg || *end != '\0' || kbps < 0 || kbps > LLONG_MAX / 1024) {
+        return -1;
+    }
+    *rate = kbps * 1024;
+    return 0;
+}
+
+// Parse a size in MB as given to the cache command. bytes is left alone on
+// bad input.
+int parse_megabytes(const char *arg, long long *bytes)
+{
+    char *end;
+    long long mb;
+
+    errno = 0;
+    mb = strtoll(arg, &end, 10);
+    if (errno || end == arg || *end != '\0' || mb < 0 || mb > LLONG_MAX / (1024 * 1024)) {
+        return -1;
+    }
+    *bytes = mb * 1024 * 1024;
+    return 0;
+}
+
+// Release the slot of an upload child that exited
+void sched_reap(pid_t pid)
+{
+    int i;
+
+    sched_lock();
+    for (i = 0; i < MAX_UPLOADS; i++) {
+        if (sched->slot[i].active && sched->slot[i].pid == pid) {
+            sched->slot[i].active = 0;
+            sched->slot[i].waiting = 0;
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+// Map the data-plane counters into memory shared with future upload children
+int stats_init(void)
+{
+    stats = (struct peer_stats *)mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        stats = NULL;
+        return -1;
+    }
+    memset(stats, 0, sizeof(*stats));
+    return 0;
+}
+
+// Lock-free counter update, safe from any thread or upload child
+void stats_add(uint64_t *counter, uint64_t v)
+{
+    __atomic_fetch_add(counter, v, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_get(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Record v in a histogram: bucket i holds values in [2^i, 2^(i+1)), bucket
+// 0 also holds 0 and the last bucket everything above
+void stats_observe(struct stats_hist *h, uint64_t v)
+{
+    int i = 0;
+
+    while (i < STATS_BUCKETS - 1 && v >> (i + 1)) {
+        i++;
+    }
+    stats_add(&h->bucket[i], 1);
+    stats_add(&h->count, 1);
+    stats_add(&h->sum, v);
+}
+
+// Account a finished upload (upload children) or download
+void stats_transfer(int upload, int ok, const struct xfer_stats *st, long long start_ns,
+                    long long end_ns)
+{
+    long long elapsed = end_ns - start_ns;
+
+    if (!stats) {
+        return;
+    }
+    if (!ok) {
+        stats_add(upload ? &stats->upload_errors : &stats->download_errors, 1);
+        return;
+    }
+    stats_add(upload ? &stats->uploads : &stats->downloads, 1);
+    stats_add(upload ? &stats->upload_bytes : &stats->download_bytes, st->raw_bytes);
+    stats_add(upload ? &stats->upload_wire_bytes : &stats->download_wire_bytes, st->wire_bytes);
+    stats_add(upload ? &stats->upload_reused_bytes : &stats->download_reused_bytes, st->reused_bytes);
+    if (st->fast) {
+        stats_add(upload ? &stats->uploads_fast : &stats->downloads_fast, 1);
+    }
+    stats_observe(upload ? &stats->upload_kbps : &stats->download_kbps,
+                  elapsed > 0 ? (uint64_t)(st->raw_bytes * 1e9 / 1024 / elapsed) : 0);
+    if (st->first_ns > start_ns) {
+        stats_observe(upload ? &stats->upload_ttfb_us : &stats->download_ttfb_us,
+                      (st->first_ns - start_ns) / 1000);
+    }
+}
+
+// Count a serve of content_name. A slot is claimed for a name by swapping
+// the name's hash into its key, so upload children add names without a
+// lock and never wait for each other. Whoever finds the name missing fills
+// it in (every writer writes the same bytes), so a child that dies after
+// the swap doesn't leave the slot unnamed.
+void stats_content(const char *content_name, uint64_t bytes)
+{
+    struct content_stats *cs;
+    uint64_t key;
+    uint64_t cur;
+    int i;
+
+    if (!stats) {
+        return;
+    }
+    key = content_hash_update(CONTENT_HASH_INIT, content_name,
+                              strnlen(content_name, CONTENT_NAME_SIZE));
+    if (key == 0) {
+        key = 1;
+    }
+    for (i = 0; i < STATS_MAX_CONTENT; i++) {
+        cs = &stats->content[i];
+        cur = __atomic_load_n(&cs->key, __ATOMIC_ACQUIRE);
+        if (cur == 0 && __atomic_compare_exchange_n(&cs->key, &cur, key, 0,
+                                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            cur = key;
+        }
+        if (cur != key) {
+            continue;
+        }
+        if (!__atomic_load_n(&cs->named, __ATOMIC_ACQUIRE)) {
+            strncpy(cs->content_name, content_name, CONTENT_NAME_SIZE);
+            __atomic_store_n(&cs->named, 1, __ATOMIC_RELEASE);
+        }
+        stats_add(&cs->serves, 1);
+        stats_add(&cs->bytes, bytes);
+        return;
+    }
+    stats_add(&stats->other_content_bytes, bytes);
+}
+
+// Print a histogram's non-empty buckets for the stats command
+void stats_print_hist(const char *title, const struct stats_hist *h)
+{
+    uint64_t n;
+    int i;
+
+    n = stats_get(&h->count);
+    printf("%s: %llu sample(s)", title, (unsigned long long)n);
+    if (n > 0) {
+        printf(", mean %llu", (unsigned long long)(stats_get(&h->sum) / n));
+    }
+    printf("\n");
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        n = stats_get(&h->bucket[i]);
+        if (n == 0) {
+            continue;
+        }
+        if (i == STATS_BUCKETS - 1) {
+            printf("  >= %-10llu %llu\n", 1ULL << i, (unsigned long long)n);
+        } else {
+            printf("  < %-11llu %llu\n", 1ULL << (i + 1), (unsigned long long)n);
+        }
+    }
+}
+
+// stats command
+void stats_print(void)
+{
+    struct content_stats *cs;
+    int i;
+
+    if (!stats) {
+        printf("Error: Stats are not available\n");
+        return;
+    }
+    printf("Uploads:   %llu active, %llu done (%llu over UDP), %llu failed, %llu bytes "
+           "(%llu on the wire, %llu reused by delta)\n",
+           (unsigned long long)stats_get(&stats->uploads_active),
+           (unsigned long long)stats_get(&stats->uploads),
+           (unsigned long long)stats_get(&stats->uploads_fast),
+           (unsigned long long)stats_get(&stats->upload_errors),
+           (unsigned long long)stats_get(&stats->upload_bytes),
+           (unsigned long long)stats_get(&stats->upload_wire_bytes),
+           (unsigned long long)stats_get(&stats->upload_reused_bytes));
+    printf("Downloads: %llu done (%llu over UDP), %llu failed, %llu bytes (%llu on the wire, "
+           "%llu reused by delta)\n",
+           (unsigned long long)stats_get(&stats->downloads),
+           (unsigned long long)stats_get(&stats->downloads_fast),
+           (unsigned long long)stats_get(&stats->download_errors),
+           (unsigned long long)stats_get(&stats->download_bytes),
+           (unsigned long long)stats_get(&stats->download_wire_bytes),
+           (unsigned long long)stats_get(&stats->download_reused_bytes));
+    printf("Stalls:    %llu send, %llu receive (socket calls blocked over %d ms)\n",
+           (unsigned long long)stats_get(&stats->send_stalls),
+           (unsigned long long)stats_get(&stats->recv_stalls), STATS_STALL_MS);
+    stats_print_hist("Upload throughput (KB/s)", &stats->upload_kbps);
+    stats_print_hist("Upload time to first byte (us)", &stats->upload_ttfb_us);
+    stats_print_hist("Download throughput (KB/s)", &stats->download_kbps);
+    stats_print_hist("Download time to first byte (us)", &stats->download_ttfb_us);
+    printf("Served per content:\n");
+    for (i = 0; i < STATS_MAX_CONTENT; i++) {
+        cs = &stats->content[i];
+        if (!__atomic_load_n(&cs->named, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        printf("  %-10s %llu serve(s), %llu bytes\n", cs->content_name,
+               (unsigned long long)stats_get(&cs->serves),
+               (unsigned long long)stats_get(&cs->bytes));
+    }
+    if (stats_get(&stats->other_content_bytes) > 0) {
+        printf("  (others)   %llu bytes\n", (unsigned long long)stats_get(&stats->other_content_bytes));
+    }
+}
+
+// Write one histogram in Prometheus text format
+void stats_export_hist(FILE *fp, const char *name, const struct stats_hist *h)
+{
+    uint64_t total = 0;
+    int i;
+
+    fprintf(fp, "# TYPE %s histogram\n", name);
+    for (i = 0; i < STATS_BUCKETS - 1; i++) {
+        total += stats_get(&h->bucket[i]);
+        fprintf(fp, "%s_bucket{le=\"%llu\"} %llu\n", name, (1ULL << (i + 1)) - 1,
+                (unsigned long long)total);
+    }
+    fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)stats_get(&h->count));
+    fprintf(fp, "%s_sum %llu\n", name, (unsigned long long)stats_get(&h->sum));
+    fprintf(fp, "%s_count %llu\n", name, (unsigned long long)stats_get(&h->count));
+}
+
+// Write a counter with its type line in Prometheus text format
+void stats_export_counter(FILE *fp, const char *name, const uint64_t *counter)
+{
+    fprintf(fp, "# TYPE %s counter\n%s %llu\n", name, name,
+            (unsigned long long)stats_get(counter));
+}
+
+// Write every counter in Prometheus text format
+void stats_export(FILE *fp)
+{
+    struct content_stats *cs;
+    int i;
+
+    fprintf(fp, "# TYPE peer_uploads_active gauge\npeer_uploads_active %llu\n",
+            (unsigned long long)stats_get(&stats->uploads_active));
+    stats_export_counter(fp, "peer_uploads_total", &stats->uploads);
+    stats_export_counter(fp, "peer_upload_errors_total", &stats->upload_errors);
+    stats_export_counter(fp, "peer_upload_bytes_total", &stats->upload_bytes);
+    stats_export_counter(fp, "peer_upload_wire_bytes_total", &stats->upload_wire_bytes);
+    stats_export_counter(fp, "peer_downloads_total", &stats->downloads);
+    stats_export_counter(fp, "peer_download_errors_total", &stats->download_errors);
+    stats_export_counter(fp, "peer_download_bytes_total", &stats->download_bytes);
+    stats_export_counter(fp, "peer_download_wire_bytes_total", &stats->download_wire_bytes);
+    stats_export_counter(fp, "peer_upload_reused_bytes_total", &stats->upload_reused_bytes);
+    stats_export_counter(fp, "peer_download_reused_bytes_total", &stats->download_reused_bytes);
+    stats_export_counter(fp, "peer_uploads_fast_total", &stats->uploads_fast);
+    stats_export_counter(fp, "peer_downloads_fast_total", &stats->downloads_fast);
+    stats_export_counter(fp, "peer_send_stalls_total", &stats->send_stalls);
+    stats_export_counter(fp, "peer_recv_stalls_total", &stats->recv_stalls);
+    stats_export_hist(fp, "peer_upload_throughput_kbps", &stats->upload_kbps);
+    stats_export_hist(fp, "peer_upload_ttfb_us", &stats->upload_ttfb_us);
+    stats_export_hist(fp, "peer_download_throughput_kbps", &stats->download_kbps);
+    stats_export_hist(fp, "peer_download_ttfb_us", &stats->download_ttfb_us);
+    fprintf(fp, "# TYPE peer_content_serves_total counter\n");
+    for (i = 0; i < STATS_MAX_CONTENT; i++) {
+        cs = &stats->content[i];
+        if (__atomic_load_n(&cs->named, __ATOMIC_ACQUIRE)) {
+            fprintf(fp, "peer_content_serves_total{content=\"%s\"} %llu\n", cs->content_name,
+                    (unsigned long long)stats_get(&cs->serves));
+        }
+    }
+    fprintf(fp, "# TYPE peer_content_served_bytes_total counter\n");
+    for (i = 0; i < STATS_MAX_CONTENT; i++) {
+        cs = &stats->content[i];
+        if (__atomic_load_n(&cs->named, __ATOMIC_ACQUIRE)) {
+            fprintf(fp, "peer_content_served_bytes_total{content=\"%s\"} %llu\n", cs->content_name,
+                    (unsigned long long)stats_get(&cs->bytes));
+        }
+    }
+    stats_export_counter(fp, "peer_other_content_served_bytes_total", &stats->other_content_bytes);
+}
+
+// Create the UNIX socket scrapers connect to for a stats snapshot
+int create_stats_socket(void)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    snprintf(stats_path, sizeof(stats_path), STATS_SOCKET, ntohs(listen_addr.sin_port));
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, stats_path, sizeof(addr.sun_path) - 1);
+    unlink(stats_path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 8) < 0) {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    return sock;
+}
+
+// Answer one scraper: write a snapshot and close. A scraper that stops
+// reading gives up its snapshot after STATS_SEND_TIMEOUT, and one that hangs
+// up (EPIPE) just loses the rest of it.
+void stats_serve(int sock)
+{
+    FILE *fp;
+    int fd;
+    struct timeval tv;
+
+    fd = accept(sock, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    tv.tv_sec = STATS_SEND_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    fp = fdopen(fd, "w");
+    if (!fp) {
+        close(fd);
+        return;
+    }
+    stats_export(fp);
+    fclose(fp);
+}
+
+// Join the scheduler for an upload of size bytes. Small uploads get a
+// bigger weight so they finish quickly next to large ones.
+void throttle_start(struct upload_throttle *t, off_t size)
+{
+    int i;
+
+    memset(t, 0, sizeof(*t));
+    t->slot = -1;
+    t->conn_last_ns = now_ns();
+
+    sched_lock();
+    for (i = 0; i < MAX_UPLOADS; i++) {
+        if (!sched->slot[i].active) {
+            sched->slot[i].active = 1;
+            sched->slot[i].waiting = 0;
+            sched->slot[i].pid = getpid();
+            sched->slot[i].weight = size <= SCHED_SMALL_SIZE ? SCHED_SMALL_WEIGHT : 1;
+            sched->slot[i].vstart = sched->vtime;
+            t->slot = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+// Block until bytes may be sent on this connection
+void throttle_consume(struct upload_throttle *t, size_t bytes)
+{
+    struct upload_slot *me;
+    long long now;
+    long long rate;
+    long long want;
+    double burst;
+    double wait_ns;
+    struct timespec ts;
+    int i;
+    int first;
+
+    // Per-connection bucket, checked locally
+    sched_lock();
+    rate = sched->conn_rate;
+    pthread_mutex_unlock(&sched->lock);
+    if (rate > 0) {
+        now = now_ns();
+        t->conn_tokens += (now - t->conn_last_ns) * (double)rate / 1e9;
+        t->conn_last_ns = now;
+        burst = rate * SCHED_BURST_MS / 1000.0;
+        if (t->conn_tokens > burst) {
+            t->conn_tokens = burst;
+        }
+        t->conn_tokens -= bytes;
+        if (t->conn_tokens < 0) {
+            wait_ns = -t->conn_tokens * 1e9 / rate;
+            ts.tv_sec = (time_t)(wait_ns / 1e9);
+            ts.tv_nsec = (long)(wait_ns - ts.tv_sec * 1e9);
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    if (t->credit >= (long long)bytes) {
+        t->credit -= bytes;
+        return;
+    }
+
+    // Global bucket, shared with every other upload. A connection without
+    // a slot has no start tag, so it only gets tokens when no connection
+    // with a slot is waiting for them.
+    want = bytes > SCHED_QUANTUM ? bytes : SCHED_QUANTUM;
+    me = t->slot >= 0 ? &sched->slot[t->slot] : NULL;
+    for (;;) {
+        sched_lock();
+        rate = sched->global_rate;
+        if (rate == 0) {
+            pthread_mutex_unlock(&sched->lock);
+            t->credit += want - bytes;
+            return;
+        }
+
+        now = now_ns();
+        sched->tokens += (now - sched->last_refill_ns) * (double)rate / 1e9;
+        sched->last_refill_ns = now;
+        burst = rate * SCHED_BURST_MS / 1000.0;
+        if (burst < want) {
+            burst = want;   // else a frame bigger than the bucket never gets its grant
+        }
+        if (sched->tokens > burst) {
+            sched->tokens = burst;
+        }
+
+        // A connection coming back from idle starts at the current virtual
+        // time, so it can't claim the grants it skipped while away
+        if (me && !me->waiting && me->vstart < sched->vtime) {
+            me->vstart = sched->vtime;
+        }
+
+        // Only the waiting connection with the smallest start tag is served
+        if (me) {
+            me->waiting = 1;
+        }
+        first = 1;
+        for (i = 0; i < MAX_UPLOADS; i++) {
+            if (sched->slot[i].active && sched->slot[i].waiting &&
+                (!me || sched->slot[i].vstart < me->vstart)) {
+                first = 0;
+                break;
+            }
+        }
+
+        if (first && sched->tokens >= want) {
+            sched->tokens -= want;
+            if (me) {
+                if (me->vstart > sched->vtime) {
+                    sched->vtime = me->vstart;
+                }
+                me->vstart += want / me->weight;
+                me->waiting = 0;
+            }
+            pthread_mutex_unlock(&sched->lock);
+            t->credit += want - bytes;
+            return;
+        }
+
+        wait_ns = first ? (want - sched->tokens) * 1e9 / rate : 1e6;
+        pthread_mutex_unlock(&sched->lock);
+
+        if (wait_ns < 2e5) {
+            wait_ns = 2e5;
+        } else if (wait_ns > 2e7) {
+            wait_ns = 2e7;
+        }
+        ts.tv_sec = 0;
+        ts.tv_nsec = (long)wait_ns;
+        nanosleep(&ts, NULL);
+    }
+}
+
+// Take bytes from the global bucket without waiting, for senders that
+// can't block. Fails if the tokens aren't there or a connection with a
+// slot is waiting for them. Returns 0 when the bytes may be sent.
+int throttle_try(size_t bytes)
+{
+    long long now;
+    double burst;
+    int i;
+
+    sched_lock();
+    if (sched->global_rate == 0) {
+        pthread_mutex_unlock(&sched->lock);
+        return 0;
+    }
+    now = now_ns();
+    sched->tokens += (now - sched->last_refill_ns) * (double)sched->global_rate / 1e9;
+    sched->last_refill_ns = now;
+    burst = sched->global_rate * SCHED_BURST_MS / 1000.0;
+    if (burst < bytes) {
+        burst = bytes;
+    }
+    if (sched->tokens > burst) {
+        sched->tokens = burst;
+    }
+    for (i = 0; i < MAX_UPLOADS; i++) {
+        if (sched->slot[i].active && sched->slot[i].waiting) {
+            break;
+        }
+    }
+    if (i < MAX_UPLOADS || sched->tokens < bytes) {
+        pthread_mutex_unlock(&sched->lock);
+        return -1;
+    }
+    sched->tokens -= bytes;
+    pthread_mutex_unlock(&sched->lock);
+    return 0;
+}
+
+// Leave the scheduler when the upload is done
+void throttle_stop(struct upload_throttle *t)
+{
+    if (t->slot < 0) {
+        return;
+    }
+    sched_lock();
+    sched->slot[t->slot].active = 0;
+    sched->slot[t->slot].waiting = 0;
+    pthread_mutex_unlock(&sched->lock);
+    t->slot = -1;
+}
+
+// FNV-1a 64 over data, continuing from hash
+uint64_t content_hash_update(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    while (len-- > 0) {
+        hash ^= *p++;
+        hash *= CONTENT_HASH_PRIME;
+    }
+    return hash;
+}
+
+// Fill in size, version (mtime) and content hash of a file
+int file_meta(const char *filename, struct content_meta *meta)
+{
+    struct stat sb;
+    char buf[RECV_BUF_SIZE];
+    ssize_t r;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &sb) < 0) {
+        close(fd);
+        return -1;
+    }
+    meta->size = sb.st_size;
+    meta->version = sb.st_mtime;
+    meta->hash = CONTENT_HASH_INIT;
+    while ((r = read(fd, buf, sizeof(buf))) > 0) {
+        meta->hash = content_hash_update(meta->hash, buf, r);
+    }
+    close(fd);
+    return r < 0 ? -1 : 0;
+}
+
+// Rebuild the cache index from CACHE_DIR at startup and re-register every
+// cached item. Hashes saved in CACHE_INDEX are reused when the file's size
+// and mtime still match, so only changed files are read.
+void cache_load(void)
+{
+    DIR *dir;
+    struct dirent *de;
+    FILE *fp;
+    char path[512];
+    char line[BUFLEN];
+    char name[CONTENT_NAME_SIZE + 1];
+    struct content_meta meta;
+    struct cache_entry *entry;
+    struct cache_entry **link;
+    struct stat sb;
+    unsigned long long size, version, hash;
+    unsigned long serves;
+    long long last;
+    struct reg_update *ups;
+    int rehashed = 0;
+    int count;
+    int failed;
+
+    if (mkdir(CACHE_DIR, 0755) < 0 && errno != EEXIST) {
+        printf("Warning: Cannot create cache directory '%s'\n", CACHE_DIR);
+        return;
+    }
+
+    // Saved index: name size version hash serve_count last_access
+    snprintf(path, sizeof(path), "%s/%s", CACHE_DIR, CACHE_INDEX);
+    fp = fopen(path, "r");
+    while (fp && fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%10s %llu %llu %llx %lu %lld", name, &size, &version,
+                   &hash, &serves, &last) != 6) {
+            continue;
+        }
+        entry = (struct cache_entry *)calloc(1, sizeof(*entry));
+        if (!entry) {
+            break;
+        }
+        strncpy(entry->content_name, name, CONTENT_NAME_SIZE);
+        entry->meta.size = size;
+        entry->meta.version = version;
+        entry->meta.hash = hash;
+        entry->serve_count = serves;
+        entry->last_access = (time_t)last;
+        entry->filename[0] = '\0';    // not seen on disk yet
+        entry->next = cache_list;
+        cache_list = entry;
+    }
+    if (fp) {
+        fclose(fp);
+    }
+
+    dir = opendir(CACHE_DIR);
+    while (dir && (de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, ".part_", 6) == 0) {
+            // Download interrupted by an earlier exit
+            snprintf(path, sizeof(path), "%s/%s", CACHE_DIR, de->d_name);
+            unlink(path);
+            continue;
+        }
+        if (strncmp(de->d_name, "downloaded_", 11) != 0 ||
+            strlen(de->d_name + 11) == 0 || strlen(de->d_name + 11) > CONTENT_NAME_SIZE) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", CACHE_DIR, de->d_name);
+        if (stat(path, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+            continue;
+        }
+
+        entry = cache_find(de->d_name + 11);
+        if (entry && entry->meta.size == (uint64_t)sb.st_size &&
+            entry->meta.version == (uint64_t)sb.st_mtime) {
+            strncpy(entry->filename, path, sizeof(entry->filename) - 1);
+            continue;
+        }
+        if (file_meta(path, &meta) < 0) {
+            continue;
+        }
+        rehashed++;
+        if (!entry) {
+            entry = (struct cache_entry *)calloc(1, sizeof(*entry));
+            if (!entry) {
+                break;
+            }
+            strncpy(entry->content_name, de->d_name + 11, CONTENT_NAME_SIZE);
+            entry->last_access = sb.st_mtime;
+            entry->next = cache_list;
+            cache_list = entry;
+        }
+        entry->meta = meta;
+        strncpy(entry->filename, path, sizeof(entry->filename) - 1);
+    }
+    if (dir) {
+        closedir(dir);
+    }
+
+    // Drop index entries whose file is gone, then account for the rest
+    cache_used = 0;
+    link = &cache_list;
+    while (*link) {
+        entry = *link;
+        if (entry->filename[0] == '\0') {
+            *link = entry->next;
+            free(entry);
+            continue;
+        }
+        cache_used += entry->meta.size;
+        link = &entry->next;
+    }
+
+    if (cache_list) {
+        printf("Content cache: %lld bytes in '%s' (%d file(s) rehashed)\n",
+               cache_used, CACHE_DIR, rehashed);
+    }
+    cache_make_room(0);
+    count = 0;
+    for (entry = cache_list; entry; entry = entry->next) {
+        count++;
+    }
+    ups = count ? (struct reg_update *)calloc(count, sizeof(*ups)) : NULL;
+    count = 0;
+    for (entry = cache_list; ups && entry; entry = entry->next) {
+        if (!find_registered_content(entry->content_name)) {
+            ups[count].op = REG_ADD;
+            strncpy(ups[count].content_name, entry->content_name, CONTENT_NAME_SIZE);
+            strncpy(ups[count].filename, entry->filename, sizeof(ups[count].filename) - 1);
+            ups[count].meta = entry->meta;
+            count++;
+        }
+    }
+    if (count > 0) {
+        failed = reg_flush(ups, count, count > SHARE_LIST_QUIET);
+        if (count > SHARE_LIST_QUIET) {
+            printf("Registered %d cached item(s), %d failed\n", count - failed, failed);
+        }
+    }
+    free(ups);
+    cache_save();
+}
+
+// Persist the cache index so the next startup can skip rehashing
+void cache_save(void)
+{
+    FILE *fp;
+    char path[512];
+    char tmp[sizeof(path) + 8];
+    struct cache_entry *entry;
+
+    snprintf(path, sizeof(path), "%s/%s", CACHE_DIR, CACHE_INDEX);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        return;
+    }
+    for (entry = cache_list; entry; entry = entry->next) {
+        fprintf(fp, "%s %llu %llu %016llx %lu %lld\n", entry->content_name,
+                (unsigned long long)entry->meta.size,
+                (unsigned long long)entry->meta.version,
+                (unsigned long long)entry->meta.hash,
+                entry->serve_count, (long long)entry->last_access);
+    }
+    if (fclose(fp) == 0) {
+        rename(tmp, path);
+    } else {
+        unlink(tmp);
+    }
+}
+
+// Find cached content by name
+struct cache_entry *cache_find(const char *content_name)
+{
+    struct cache_entry *current;
+
+    for (current = cache_list; current; current = current->next) {
+        if (strncmp(current->content_name, content_name, CONTENT_NAME_SIZE) == 0) {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+// Add a freshly downloaded file to the cache
+void cache_insert(const char *content_name, const char *filename,
+                  const struct content_meta *meta)
+{
+    struct cache_entry *entry;
+
+    entry = (struct cache_entry *)calloc(1, sizeof(*entry));
+    if (!entry) {
+        return;
+    }
+    strncpy(entry->content_name, content_name, CONTENT_NAME_SIZE);
+    strncpy(entry->filename, filename, sizeof(entry->filename) - 1);
+    entry->meta = *meta;
+    entry->last_access = time(NULL);
+    entry->next = cache_list;
+    cache_list = entry;
+    cache_used += meta->size;
+    cache_save();
+}
+
+// Record a use of cached content; served is set when a peer downloaded it
+void cache_touch(const char *content_name, int served)
+{
+    struct cache_entry *entry;
+
+    entry = cache_find(content_name);
+    if (entry) {
+        entry->last_access = time(NULL);
+        if (served) {
+            entry->serve_count++;
+        }
+    }
+}
+
+// Evict until incoming more bytes fit in the budget. The victim is the
+// entry with the oldest access time once each local serve has been credited
+// with CACHE_SERVE_CREDIT seconds. Returns -1 if it can't make enough room.
+int cache_make_room(long long incoming)
+{
+    struct cache_entry *entry;
+    struct cache_entry *victim;
+    long long score;
+    long long best;
+
+    if (incoming > cache_budget) {
+        return -1;
+    }
+    while (cache_used + incoming > cache_budget) {
+        victim = NULL;
+        best = 0;
+        for (entry = cache_list; entry; entry = entry->next) {
+            score = (long long)entry->last_access +
+                    (long long)entry->serve_count * CACHE_SERVE_CREDIT;
+            if (!victim || score < best) {
+                victim = entry;
+                best = score;
+            }
+        }
+        if (!victim || cache_evict(victim) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Deregister an item from the index server, and only once that succeeded
+// remove it from disk, so the index never points at a deleted file
+int cache_evict(struct cache_entry *victim)
+{
+    if (find_registered_content(victim->content_name) &&
+        deregister_content(victim->content_name) < 0) {
+        return -1;
+    }
+    printf("Evicting '%s' from content cache (%llu bytes, served %lu times)\n",
+           victim->content_name, (unsigned long long)victim->meta.size, victim->serve_count);
+    unlink(victim->filename);
+    cache_forget(victim);
+    cache_save();
+    return 0;
+}
+
+// Drop an entry from the cache index, leaving its file alone
+void cache_forget(struct cache_entry *entry)
+{
+    struct cache_entry **link;
+
+    for (link = &cache_list; *link; link = &(*link)->next) {
+        if (*link == entry) {
+            *link = entry->next;
+            break;
+        }
+    }
+    cache_used -= entry->meta.size;
+    free(entry);
+}
+
+// Print cache usage and contents
+void cache_status(void)
+{
+    struct cache_entry *entry;
+
+    printf("Content cache '%s': %.1f of %.1f MB used\n", CACHE_DIR,
+           cache_used / 1048576.0, cache_budget / 1048576.0);
+    for (entry = cache_list; entry; entry = entry->next) {
+        printf("  %-10s %12llu bytes  served %lu  idle %lds\n", entry->content_name,
+               (unsigned long long)entry->meta.size, entry->serve_count,
+               (long)(time(NULL) - entry->last_access));
+    }
+}
+
+// Handle a datagram from the index server outside of a request: a
+// notification or replication order, or a late reply that is dropped. In
+// DHT mode it is a request from another node.
+void handle_udp_response(void)
+{
+    char buf[PDU_MAX_DGRAM];
+    struct pdu_hdr h;
+    struct sockaddr_in from;
+    socklen_t alen = sizeof(from);
+    char *payload;
+    ssize_t n;
+
+    if (dht_mode) {
+        n = recvfrom(udp_sock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &alen);
+        if (n > 0) {
+            dht_handle(buf, n, &from);
+        }
+        return;
+    }
+    n = read(udp_sock, buf, sizeof(buf));
+    if (n < 0 && errno == ECONNREFUSED && index_standby) {
+        // A heartbeat or report bounced: nothing listens there any more
+        index_switch("is gone");
+        return;
+    }
+    if (n <= 0 || pdu_decode(buf, n, &h, &payload) < 0) {
+        return;
+    }
+    handle_index_push(&h, payload);
+}
+
+// Send a request to the index server and wait for its reply, which is
+// decoded in place into buf. Notifications and replication orders that
+// arrive in the meantime are handled; other datagrams not tagged with this request's id, such as late
+// replies to a request we gave up on, are skipped. When the server is too
+// busy to queue the request, it is sent again after the server's retry hint,
+// doubled on each attempt and jittered so turned-away peers don't come back
+// in step; the last busy reply is returned like any other error. A request
+// that isn't answered within INDEX_RTO_MS (doubled on each retry) is sent
+// again, to the other server of a primary/standby pair if there is one, as
+// is one that a standby turns away. A standby that turns the request away
+// right after the primary went silent is asked again after INDEX_RTO_MS
+// instead: it takes over once it has missed the primary for a second. Every
+// attempt carries the same request
+// id, so a late reply to an earlier one is as good as any. The index
+// server answers a repeated registration or deregistration like the first.
+// Returns 0, or -1 if the socket failed or no server answered.
+int udp_transact(int type, const struct iovec *iov, int iovcnt, char *buf, size_t size,
+                 struct pdu_hdr *h, struct pdu_cursor *in)
+{
+    struct pdu_hdr out;
+    char *payload;
+    int busy = 0;
+    int lost = 0;
+    int silent = 0;
+    int rc;
+    long retry_ms;
+
+    out.type = type;
+    out.flags = PDU_FLAG_HDR;
+    out.req_id = udp_next_req_id++;
+    if (udp_next_req_id == 0) {
+        udp_next_req_id = 1;    // 0 is what untagged datagrams decode to
+    }
+    for (;;) {
+        if (pdu_sendv(udp_sock, &out, iov, iovcnt, NULL, 0) < 0 && errno != ECONNREFUSED) {
+            return -1;
+        }
+
+        rc = udp_wait_reply(out.req_id, buf, size, h, &payload, INDEX_RTO_MS << lost);
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc == 0 || (index_standby && standby_reply(h, payload))) {
+            if (lost == INDEX_RETRIES) {
+                if (rc == 0) {
+                    return -1;
+                }
+                break;
+            }
+            lost++;
+            if (index_standby && rc == 1 && silent) {
+                usleep(INDEX_RTO_MS * 1000);    // the standby hasn't taken over yet
+            } else if (index_standby) {
+                index_switch(rc == 0 ? "doesn't answer" : "is a standby");
+                silent = rc == 0;
+            }
+            continue;
+        }
+        pdu_cursor_init(in, payload, h->len);
+
+        retry_ms = busy_retry_ms(h, in);
+        if (retry_ms < 0 || busy == UDP_BUSY_RETRIES) {
+            return 0;
+        }
+        retry_ms <<= busy;
+        retry_ms += rand() % (retry_ms / 2 + 1);
+        usleep(retry_ms * 1000);
+        busy++;
+    }
+    pdu_cursor_init(in, payload, h->len);
+    return 0;
+}
+
+// Wait up to timeout_ms for the reply tagged req_id, handling pushes that
+// arrive first. Returns 1 with the reply in buf, 0 on timeout or when the
+// server's port is closed, or -1 if the socket failed.
+int udp_wait_reply(uint32_t req_id, char *buf, size_t size, struct pdu_hdr *h, char **payload,
+                   int timeout_ms)
+{
+    struct pollfd pfd;
+    long long deadline = now_ns() + timeout_ms * 1000000LL;
+    long long left;
+    ssize_t n;
+    int rc;
+
+    pfd.fd = udp_sock;
+    pfd.events = POLLIN;
+    for (;;) {
+        left = deadline - now_ns();
+        if (left <= 0) {
+            return 0;
+        }
+        rc = poll(&pfd, 1, (int)((left + 999999) / 1000000));
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (rc == 0) {
+            return 0;
+        }
+        n = read(udp_sock, buf, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == ECONNREFUSED ? 0 : -1;
+        }
+        if (pdu_decode(buf, n, h, payload) < 0) {
+            continue;
+        }
+        if (h->req_id == req_id) {
+            return 1;
+        }
+        handle_index_push(h, *payload);
+    }
+}
+
+// Is h a standby index server turning a request away?
+int standby_reply(const struct pdu_hdr *h, const char *payload)
+{
+    return h->type == 'E' && h->len == sizeof(STANDBY_TEXT) &&
+           memcmp(payload, STANDBY_TEXT, sizeof(STANDBY_TEXT)) == 0;
+}
+
+// Send index server requests to the other server of the pair from now on.
+// It holds the same registrations, so nothing is registered again.
+void index_switch(const char *why)
+{
+    struct sockaddr_in old = index_server_addr;
+
+    index_server_addr = index_standby_addr;
+    index_standby_addr = old;
+    if (connect(udp_sock, (struct sockaddr *)&index_server_addr, sizeof(index_server_addr)) < 0) {
+        printf("Error: Cannot switch to index server %s:%d\n",
+               inet_ntoa(index_server_addr.sin_addr), ntohs(index_server_addr.sin_port));
+        return;
+    }
+    if (!batch_quiet) {
+        printf("Index server %s:%d %s, ", inet_ntoa(old.sin_addr), ntohs(old.sin_port), why);
+        printf("switching to %s:%d\n", inet_ntoa(index_server_addr.sin_addr),
+               ntohs(index_server_addr.sin_port));
+    }
+}
+
+// Parse host:port into addr. Returns 0, or -1 if it can't be resolved.
+int parse_host_port(const char *arg, struct sockaddr_in *addr)
+{
+    char host[BUFLEN];
+    const char *colon;
+    struct hostent *hp;
+
+    colon = strrchr(arg, ':');
+    if (!colon || colon == arg || (size_t)(colon - arg) >= sizeof(host) || atoi(colon + 1) <= 0) {
+        return -1;
+    }
+    memcpy(host, arg, colon - arg);
+    host[colon - arg] = '\0';
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(atoi(colon + 1));
+    hp = gethostbyname(host);
+    if (hp != NULL) {
+        memcpy(&addr->sin_addr, hp->h_addr, hp->h_length);
+    } else if ((addr->sin_addr.s_addr = inet_addr(host)) == INADDR_NONE) {
+        return -1;
+    }
+    return 0;
+}
+
+// If h is a busy reply, return the retry-after hint in milliseconds and
+// leave the cursor at the start of the message; otherwise -1.
+long busy_retry_ms(const struct pdu_hdr *h, struct pdu_cursor *in)
+{
+    struct pdu_cursor c = *in;
+    const char *text;
+    long ms;
+
+    if (h->type != 'E' || h->len != BUSY_SIZE) {
+        return -1;
+    }
+    text = pdu_get_bytes(&c, sizeof(BUSY_TEXT));
+    ms = pdu_get_u16(&c);
+    if (c.err || memcmp(text, BUSY_TEXT, sizeof(BUSY_TEXT)) != 0) {
+        return -1;
+    }
+    return ms;
+}
+
+// Find registered content by name
+struct registered_content *find_registered_content(const char *content_name)
+{
+    struct registered_content *current;
+
+    current = reg_table[reg_bucket(content_name)];
+    while (current) {
+        if (strncmp(current->content_name, content_name, CONTENT_NAME_SIZE) == 0) {
+            return current;
+        }
+        current = current->hash_next;
+    }
+    return NULL;
+}
+
+// Add an entry to reg_list. Returns NULL if out of memory.
+struct registered_content *reg_add_local(const char *content_name, const char *filename,
+                                         const struct content_meta *meta)
+{
+    struct registered_content *new_reg;
+    unsigned int bucket;
+
+    new_reg = (struct registered_content *)malloc(sizeof(struct registered_content));
+    if (!new_reg) {
+        return NULL;
+    }
+    memset(new_reg, 0, sizeof(*new_reg));
+    strncpy(new_reg->peer_name, my_peer_name, PEER_NAME_SIZE);
+    strncpy(new_reg->content_name, content_name, CONTENT_NAME_SIZE);
+    strncpy(new_reg->filename, filename, sizeof(new_reg->filename) - 1);
+    new_reg->meta = *meta;
+    new_reg->next = reg_list; // Add to the front of the list
+    new_reg->pprev = &reg_list;
+    if (reg_list) {
+        reg_list->pprev = &new_reg->next;
+    }
+    reg_list = new_reg;
+    bucket = reg_bucket(content_name);
+    new_reg->hash_next = reg_table[bucket];
+    reg_table[bucket] = new_reg;
+    reg_added++;
+    stats_add(&sched->reg_added, 1);
+    return new_reg;
+}
+
+// Unlink an entry from reg_list and free it
+void reg_remove_local(struct registered_content *reg)
+{
+    struct registered_content **link;
+
+    for (link = &reg_table[reg_bucket(reg->content_name)]; *link; link = &(*link)->hash_next) {
+        if (*link == reg) {
+            *link = reg->hash_next;
+            break;
+        }
+    }
+    *reg->pprev = reg->next;
+    if (reg->next) {
+        reg->next->pprev = reg->pprev;
+    }
+    free(reg);
+    reg_changed();
+}
+
+// Note an item removed from reg_list or changed. Upload children serve from
+// the copy they were forked with and stop taking requests once an item in it
+// is out of date. Items added meanwhile don't stop them; see reg_missing().
+void reg_changed(void)
+{
+    reg_generation++;
+    stats_add(&sched->reg_generation, 1);
+}
+
+// Has reg_list changed since this upload child was forked?
+int reg_stale(void)
+{
+    return stats_get(&sched->reg_generation) != reg_generation;
+}
+
+// Is content_name missing from this upload child's copy of reg_list only
+// because it was registered after the fork?
+int reg_missing(const char *content_name)
+{
+    return stats_get(&sched->reg_added) != reg_added && !find_registered_content(content_name);
+}
+
+// reg_table bucket of a content name (FNV-1a)
+unsigned int reg_bucket(const char *content_name)
+{
+    uint64_t hash = CONTENT_HASH_INIT;
+    int i;
+
+    for (i = 0; i < CONTENT_NAME_SIZE && content_name[i]; i++) {
+        hash = (hash ^ (unsigned char)content_name[i]) * CONTENT_HASH_PRIME;
+    }
+    return (unsigned int)(hash ^ (hash >> 32)) & (REG_BUCKETS - 1);
+}
+
+// Free registered content list
+void free_reg_list(void)
+{
+    struct registered_content *current;
+    struct registered_content *next;
+
+    current = reg_list;
+    while (current) {
+        next = current->next;
+        free(current);
+        current = next;
+    }
+    reg_list = NULL;
+    memset(reg_table, 0, sizeof(reg_table));
+}
+
+// Set up DHT mode: bind the UDP socket to port and join through the node at
+// bootstrap ("host:port"), if given. Without one this is the first node.
+int dht_start(int port, const char *bootstrap)
+{
+    struct sockaddr_in sin;
+    struct sockaddr_in boot;
+    struct hostent *hp;
+    char host[256];
+    const char *colon;
+    socklen_t alen;
+    int probe;
+    int contacts;
+
+    udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = INADDR_ANY;
+    sin.sin_port = htons(port);
+    if (udp_sock < 0 || bind(udp_sock, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+        fprintf(stderr, "Can't bind UDP port %d\n", port);
+        return -1;
+    }
+    alen = sizeof(sin);
+    getsockname(udp_sock, (struct sockaddr *)&sin, &alen);
+
+    memset(&boot, 0, sizeof(boot));
+    boot.sin_family = AF_INET;
+    if (bootstrap) {
+        colon = strrchr(bootstrap, ':');
+        if (!colon || colon == bootstrap || (size_t)(colon - bootstrap) >= sizeof(host)) {
+            fprintf(stderr, "Bootstrap node must be given as host:port\n");
+            return -1;
+        }
+        memcpy(host, bootstrap, colon - bootstrap);
+        host[colon - bootstrap] = '\0';
+        boot.sin_port = htons(atoi(colon + 1));
+        hp = gethostbyname(host);
+        if (hp != NULL) {
+            memcpy(&boot.sin_addr, hp->h_addr, hp->h_length);
+        } else if ((boot.sin_addr.s_addr = inet_addr(host)) == INADDR_NONE) {
+            fprintf(stderr, "Can't get bootstrap node address\n");
+            return -1;
+        }
+    } else {
+        // No packets are sent; this only picks the outgoing interface
+        boot.sin_addr.s_addr = inet_addr("8.8.8.8");
+        boot.sin_port = htons(53);
+    }
+
+    // Registrations carry the address other nodes reach us at
+    memset(&dht_local_addr, 0, sizeof(dht_local_addr));
+    probe = socket(AF_INET, SOCK_DGRAM, 0);
+    alen = sizeof(dht_local_addr);
+    if (probe < 0 || connect(probe, (struct sockaddr *)&boot, sizeof(boot)) < 0 ||
+        getsockname(probe, (struct sockaddr *)&dht_local_addr, &alen) < 0) {
+        dht_local_addr.sin_family = AF_INET;
+        dht_local_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    if (probe >= 0) {
+        close(probe);
+    }
 
-    printf("Found content server: %s:%d\n",
-           inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port));
+    dht_init(udp_sock, 0);
+    printf("DHT node %016llx on UDP port %d\n", (unsigned long long)dht_self_id(), ntohs(sin.sin_port));
+    if (bootstrap) {
+        contacts = dht_bootstrap(&boot);
+        if (contacts < 0) {
+            fprintf(stderr, "Bootstrap node %s didn't answer\n", bootstrap);
+            return -1;
+        }
+        printf("Joined the DHT through %s, %d contacts\n", bootstrap, contacts);
+    }
+    dht_republish_at = time(NULL) + DHT_RECORD_TTL / 2;
+    return 0;
+}
+
+// Look content up in the DHT, picking one of the providers found at random
+// to spread downloads over them
+int dht_lookup_content(const char *content_name, struct lookup_result *res)
+{
+    struct dht_value vals[DHT_MAX_VALUES];
+    struct dht_lookup_stats st;
+    int count;
+    int pick;
+    int i;
+
+    count = dht_find_value(content_name, vals, DHT_MAX_VALUES, &st);
+    if (count == 0) {
+        printf("Search for '%s' failed: Content not found (%d DHT requests)\n", content_name, st.rpcs);
+        return -1;
+    }
+    pick = rand() % count;
+    memset(res, 0, sizeof(*res));
+    res->addr = vals[pick].addr;
+    res->meta = vals[pick].meta;
+    for (i = 1; i < count && res->alt_count < SEARCH_MAX_CANDIDATES - 1; i++) {
+        res->alt_addr[res->alt_count] = vals[(pick + i) % count].addr;
+        res->alt_meta[res->alt_count] = vals[(pick + i) % count].meta;
+        res->alt_count++;
+    }
+    if (!batch_quiet) {
+        printf("Found content server for '%s': %s:%d (%d DHT requests)\n", content_name,
+               inet_ntoa(res->addr.sin_addr), ntohs(res->addr.sin_port), st.rpcs);
+    }
+    return 0;
+}
+
+// Keep the routing table fresh and renew our records before they expire
+void dht_maintain(void)
+{
+    struct registered_content *reg;
+    struct sockaddr_in addr;
 
-    // Connect to content server wioth TCP
-    tcp_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (tcp_sock < 0) {
-        printf("Error: Failed to create TCP socket\n");
+    dht_tick();
+    if (time(NULL) < dht_republish_at) {
         return;
     }
+    dht_republish_at = time(NULL) + DHT_RECORD_TTL / 2;
+    addr = dht_local_addr;
+    addr.sin_port = listen_addr.sin_port;
+    for (reg = reg_list; reg; reg = reg->next) {
+        dht_publish(reg->content_name, my_peer_name, &addr, &reg->meta, DHT_RECORD_TTL);
+    }
+}
 
-    if (connect(tcp_sock, (struct sockaddr *)&server_addr,
-                sizeof(server_addr)) < 0) {
-        printf("Error: Failed to connect to content server\n");
-        close(tcp_sock);
+// Start sharing every file of dir under its own name: register them all now
+// and keep the registrations in step with the directory from then on.
+// Sharing another directory first withdraws the previous one.
+void share_start(const char *dir)
+{
+    if (share_dir[0] && strcmp(share_dir, dir) != 0) {
+        share_stop(1);
+    }
+    if (share_watch(dir) < 0) {
         return;
     }
+    share_scan(NULL, 0);
+    share_save();
+}
 
-    // Send download req
-    out.type = 'D';
-    memset(out.data, 0, MAX_DATA_SIZE);
-    strncpy(out.data, content_name, CONTENT_NAME_SIZE);
+// Check dir and watch it for changes. Without inotify the directory is
+// still shared, just not kept up to date.
+int share_watch(const char *dir)
+{
+    struct stat sb;
 
-    n = write(tcp_sock, &out, 1 + CONTENT_NAME_SIZE);
-    if (n < 0) {
-        printf("Error: Failed to send download request\n");
-        close(tcp_sock);
-        return;
+    if (strlen(dir) >= sizeof(share_dir) || stat(dir, &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+        printf("Error: '%s' is not a directory\n", dir);
+        return -1;
+    }
+    strcpy(share_dir, dir);
+    if (share_fd >= 0) {
+        close(share_fd);
+    }
+    share_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (share_fd >= 0 && inotify_add_watch(share_fd, dir, SHARE_WATCH_MASK) < 0) {
+        close(share_fd);
+        share_fd = -1;
+    }
+    if (share_fd < 0) {
+        printf("Warning: Cannot watch '%s', changes won't be picked up\n", dir);
+    }
+    return 0;
+}
+
+// Stop sharing, optionally deregistering every shared file
+void share_stop(int deregister)
+{
+    struct registered_content *reg;
+    struct reg_update *ups;
+    struct share_change *change;
+    int count = 0;
+    int failed;
+
+    share_cancel();
+    if (share_fd >= 0) {
+        close(share_fd);
+        share_fd = -1;
+    }
+    while (share_changes) {
+        change = share_changes;
+        share_changes = change->next;
+        free(change);
+    }
+    share_pending = 0;
+    share_rescan = 0;
+
+    for (reg = reg_list; deregister && reg; reg = reg->next) {
+        count += reg->shared;
+    }
+    ups = count ? (struct reg_update *)calloc(count, sizeof(*ups)) : NULL;
+    if (ups) {
+        count = 0;
+        for (reg = reg_list; reg; reg = reg->next) {
+            if (reg->shared) {
+                ups[count].op = REG_REMOVE;
+                strncpy(ups[count].content_name, reg->content_name, CONTENT_NAME_SIZE);
+                count++;
+            }
+        }
+        failed = reg_flush(ups, count, count > SHARE_LIST_QUIET);
+        printf("Stopped sharing '%s': %d item(s) deregistered, %d failed\n",
+               share_dir, count - failed, failed);
+        free(ups);
     }
+    share_dir[0] = '\0';
+}
 
-    // Create output filename
-    snprintf(filename, sizeof(filename), "downloaded_%s", content_name);
+// Names usable as content names: no hidden files, nothing longer than a
+// content name and nothing that wouldn't survive the state file
+int share_valid_name(const char *name)
+{
+    const char *p;
 
-    fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0644);
-    if (fd < 0) {
-        printf("Error: Failed to create output file\n");
-        close(tcp_sock);
+    if (name[0] == '\0' || name[0] == '.' || strlen(name) > CONTENT_NAME_SIZE) {
+        return 0;
+    }
+    for (p = name; *p; p++) {
+        if ((unsigned char)*p <= ' ') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Look at every file of the shared directory and bring the registrations in
+// line: register new and changed files, deregister the ones that are gone.
+// Files whose size and mtime match what is registered, or what the saved
+// state (saved, sorted by name) recorded, aren't read again; the rest are
+// hashed in parallel off the main loop (see share_submit()).
+void share_scan(struct reg_update *saved, int nsaved)
+{
+    DIR *dir;
+    struct dirent *de;
+    struct stat sb;
+    struct registered_content *reg;
+    struct reg_update key;
+    struct reg_update *old;
+    struct share_batch *b;
+    struct share_file *files = NULL;
+    struct share_file *grown;
+    int count = 0;
+    int cap = 0;
+    int skipped = 0;
+    int in_use = 0;
+    int unchanged = 0;
+    long long t0;
+    struct share_file *f;
+
+    share_cancel();     // this scan covers whatever was being hashed
+    t0 = now_ns();
+    b = (struct share_batch *)calloc(1, sizeof(*b));
+    if (!b) {
+        printf("Error: Memory allocation failed\n");
         return;
     }
+    dir = opendir(share_dir);
+    if (!dir) {
+        printf("Error: Cannot read shared directory '%s'\n", share_dir);
+        free(b);
+        return;
+    }
+    share_generation++;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        if (!share_valid_name(de->d_name)) {
+            skipped++;
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            grown = (struct share_file *)realloc(files, cap * sizeof(*files));
+            if (!grown) {
+                break;
+            }
+            files = grown;
+        }
+        f = &files[count];
+        memset(f, 0, sizeof(*f));
+        strcpy(f->name, de->d_name);
+        if (snprintf(f->path, sizeof(f->path), "%s/%s", share_dir, de->d_name) >=
+            (int)sizeof(f->path)) {
+            skipped++;
+            continue;
+        }
+        if (stat(f->path, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+            continue;
+        }
+        f->meta.size = sb.st_size;
+        f->meta.version = sb.st_mtime;
 
-    // Receive content data
-    total = 0;
-    for (;;) {
-        n = read(tcp_sock, &in, sizeof(in));
-        if (n <= 0) {
-            break;
+        reg = find_registered_content(f->name);
+        if (reg && !reg->shared) {
+            in_use++;   // registered by hand or from the cache
+            continue;
+        }
+        if (reg && reg->meta.size == f->meta.size && reg->meta.version == f->meta.version &&
+            strcmp(reg->filename, f->path) == 0) {
+            reg->seen = share_generation;
+            unchanged++;
+            continue;
         }
+        strcpy(key.content_name, f->name);
+        old = saved ? (struct reg_update *)bsearch(&key, saved, nsaved, sizeof(*saved),
+                                                   reg_update_cmp) : NULL;
+        if (old && old->meta.size == f->meta.size && old->meta.version == f->meta.version) {
+            f->meta = old->meta;
+            f->ok = 1;
+        } else {
+            f->need_hash = 1;
+        }
+        if (reg) {
+            reg->seen = share_generation;
+        }
+        count++;
+    }
+    closedir(dir);
 
-        if (in.type == 'E') {
-            in.data[MAX_DATA_SIZE - 1] = '\0';
-            printf("Download error: %s\n", in.data);
-            close(fd);
-            unlink(filename);
-            close(tcp_sock);
-            return;
-        } else if (in.type == 'C' || in.type == 'F') {
-            data_size = n - 1;
-            if (data_size > 0) {
-                written = write(fd, in.data, data_size);
-                total += written;
-            }
-            if (in.type == 'F') {
+    // Shared files not found this time are gone
+    for (reg = reg_list; reg; reg = reg->next) {
+        if (!reg->shared || reg->seen == share_generation) {
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            grown = (struct share_file *)realloc(files, cap * sizeof(*files));
+            if (!grown) {
                 break;
             }
+            files = grown;
         }
+        memset(&files[count], 0, sizeof(files[count]));
+        strcpy(files[count].name, reg->content_name);
+        files[count].remove = 1;
+        count++;
     }
 
-    close(fd);
-    close(tcp_sock);
-    printf("Downloaded %zd bytes to '%s'\n", total, filename);
+    b->files = files;
+    b->count = count;
+    b->scan = 1;
+    b->unchanged = unchanged;
+    b->skipped = skipped + in_use;
+    b->t0 = t0;
+    share_submit(b);
+}
+
+// Hash the files of a batch that need it on a worker thread, to be
+// committed by share_tick() once it is done, so a large directory doesn't
+// hold up the main loop. A batch with nothing to hash, or one that can't
+// get a thread, is committed right away. One batch is in flight at a time.
+void share_submit(struct share_batch *b)
+{
+    int want = 0;
+    int i;
 
-    // Auto-register as content server
-    register_content(content_name, filename);
+    b->t1 = now_ns();
+    for (i = 0; i < b->count; i++) {
+        want += b->files[i].need_hash;
+    }
+    if (want == 0 || pthread_create(&b->tid, NULL, share_batch_main, b) != 0) {
+        b->hashed = share_hash(b->files, b->count, &b->stop);
+        share_finish(b);
+        return;
+    }
+    share_busy = b;
+    if (b->scan) {
+        printf("Hashing %d file(s) of '%s' in the background\n", want, share_dir);
+    }
 }
 
-// List all registered contents
-void list_contents(void)
+void *share_batch_main(void *arg)
 {
-    struct pdu out;
-    struct pdu in;
-    ssize_t n;
+    struct share_batch *b = (struct share_batch *)arg;
 
-    out.type = 'O'; // O for List of Online Registered Content
-    memset(out.data, 0, MAX_DATA_SIZE);
+    b->hashed = share_hash(b->files, b->count, &b->stop);
+    __atomic_store_n(&b->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-    n = write(udp_sock, &out, 1);
-    if (n < 0) {
-        printf("Error: Failed to send list request\n");
-        return;
+// Send the registrations of a hashed batch, report them and save the state
+void share_finish(struct share_batch *b)
+{
+    int added;
+    int removed;
+
+    if (b->prompt) {
+        printf("\n");
+    }
+    share_commit(b->files, b->count, b->count > SHARE_LIST_QUIET, &added, &removed);
+    if (b->scan) {
+        printf("Shared '%s': %d registered or updated, %d removed, %d unchanged (%d hashed in "
+               "%.2fs, %.2fs total)\n", share_dir, added, removed, b->unchanged, b->hashed,
+               (now_ns() - b->t1) / 1e9, (now_ns() - b->t0) / 1e9);
+        if (b->skipped) {
+            printf("  %d file(s) skipped: names longer than %d characters or already "
+                   "registered otherwise\n", b->skipped, CONTENT_NAME_SIZE);
+        }
+    } else {
+        printf("Shared directory changed: %d registered or updated, %d removed\n",
+               added, removed);
     }
+    share_save();
+    if (b->prompt) {
+        printf("> ");
+        fflush(stdout);
+    }
+    free(b->files);
+    free(b);
+}
 
-    n = read(udp_sock, &in, sizeof(in));
-    if (n < 0) {
-        printf("Error: Failed to receive list response\n");
+// Drop the batch being hashed, if any, without registering anything
+void share_cancel(void)
+{
+    if (!share_busy) {
         return;
     }
+    __atomic_store_n(&share_busy->stop, 1, __ATOMIC_RELAXED);
+    pthread_join(share_busy->tid, NULL);
+    free(share_busy->files);
+    free(share_busy);
+    share_busy = NULL;
+}
+
+// Hash every file that needs it, on up to SHARE_HASH_THREADS threads,
+// giving up early once *stop is set. Returns the number of files hashed.
+int share_hash(struct share_file *files, int count, const int *stop)
+{
+    struct share_hasher h;
+    pthread_t tids[SHARE_HASH_THREADS];
+    long ncpu;
+    int nthreads = 0;
+    int want = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        want += files[i].need_hash;
+    }
+    if (want == 0) {
+        return 0;
+    }
+    h.files = files;
+    h.count = count;
+    h.next = 0;
+    h.stop = stop;
+    pthread_mutex_init(&h.lock, NULL);
 
-    if (in.type == 'O') {
-        in.data[MAX_DATA_SIZE - 1] = '\0';
-        printf("Registered contents:\n%s\n", in.data);
-    } else if (in.type == 'E') {
-        in.data[MAX_DATA_SIZE - 1] = '\0';
-        printf("Error: %s\n", in.data);
+    // The calling thread hashes too
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > SHARE_HASH_THREADS) {
+        ncpu = SHARE_HASH_THREADS;
+    }
+    for (i = 1; i < ncpu && i < want; i++) {
+        if (pthread_create(&tids[nthreads], NULL, share_hash_main, &h) != 0) {
+            break;
+        }
+        nthreads++;
+    }
+    share_hash_main(&h);
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
     }
+    pthread_mutex_destroy(&h.lock);
+    return want;
 }
 
-// Deregister content
-void deregister_content(const char *content_name)
+// Hashing worker: take the next file that needs hashing until none are left
+void *share_hash_main(void *arg)
 {
-    struct pdu out;
-    struct pdu in;
-    struct registered_content *reg;
-    struct registered_content *prev;
-    ssize_t n;
+    struct share_hasher *h = (struct share_hasher *)arg;
+    struct share_file *f;
+    int i;
 
-    reg = find_registered_content(content_name);
-    if (!reg) {
-        printf("Error: Content '%s' not registered\n", content_name);
-        return;
+    for (;;) {
+        pthread_mutex_lock(&h->lock);
+        while (h->next < h->count && !h->files[h->next].need_hash) {
+            h->next++;
+        }
+        i = h->next++;
+        pthread_mutex_unlock(&h->lock);
+        if (i >= h->count || __atomic_load_n(h->stop, __ATOMIC_RELAXED)) {
+            return NULL;
+        }
+        f = &h->files[i];
+        f->ok = file_meta(f->path, &f->meta) == 0;
     }
+}
 
-    out.type = 'T'; // T for de-registration
-    memset(out.data, 0, MAX_DATA_SIZE);
-    strncpy(out.data, my_peer_name, PEER_NAME_SIZE);
-    strncpy(out.data + PEER_NAME_SIZE, content_name, CONTENT_NAME_SIZE);
+// Send the registrations for scanned or changed files in batches
+void share_commit(struct share_file *files, int count, int quiet, int *added, int *removed)
+{
+    struct reg_update *ups;
+    struct registered_content *reg;
+    int n = 0;
+    int i;
 
-    n = write(udp_sock, &out, 1 + PEER_NAME_SIZE + CONTENT_NAME_SIZE);
-    if (n < 0) {
-        printf("Error: Failed to send deregistration request\n");
+    *added = 0;
+    *removed = 0;
+    if (count == 0) {
         return;
     }
-
-    n = read(udp_sock, &in, sizeof(in));
-    if (n < 0) {
-        printf("Error: Failed to receive response\n");
+    ups = (struct reg_update *)calloc(count, sizeof(*ups));
+    if (!ups) {
+        printf("Error: Memory allocation failed\n");
         return;
     }
+    for (i = 0; i < count; i++) {
+        if (!files[i].remove && !files[i].ok) {
+            continue;   // vanished or unreadable while hashing
+        }
+        reg = find_registered_content(files[i].name);
+        if ((reg && !reg->shared) || (files[i].remove && !reg)) {
+            continue;   // registered by hand, or withdrawn, while hashing
+        }
+        ups[n].op = files[i].remove ? REG_REMOVE : REG_ADD;
+        strcpy(ups[n].content_name, files[i].name);
+        strcpy(ups[n].filename, files[i].path);
+        ups[n].meta = files[i].meta;
+        ups[n].shared = 1;
+        n++;
+    }
+    reg_flush(ups, n, quiet);
+    for (i = 0; i < n; i++) {
+        if (ups[i].op == REG_REMOVE && !find_registered_content(ups[i].content_name)) {
+            (*removed)++;
+        } else if (ups[i].op == REG_ADD && find_registered_content(ups[i].content_name)) {
+            (*added)++;
+        }
+    }
+    free(ups);
+}
 
-    if (in.type == 'A') { // A for Acknowledgement
-        // Remove from reg_list
-        if (reg == reg_list) { 
-            reg_list = reg->next;
-        } else {
-            prev = reg_list;
-            while (prev && prev->next != reg) {
-                prev = prev->next;
-            }
-            if (prev) {
-                prev->next = reg->next;
+// Read the events inotify queued for the shared directory
+void share_events(void)
+{
+    char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t n;
+    char *p;
+
+    while ((n = read(share_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                share_rescan = 1;   // events were lost
+            } else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                printf("\nShared directory '%s' went away\n", share_dir);
+                share_stop(1);
+                share_save();
+                printf("> ");
+                fflush(stdout);
+                return;
+            } else if (ev->len > 0 && !(ev->mask & IN_ISDIR) && share_valid_name(ev->name)) {
+                share_note(ev->name);
             }
         }
-        if (reg->tcp_socket >= 0) {
-            close(reg->tcp_socket);
-        }
-        free(reg);
-        printf("Content '%s' deregistered successfully\n", content_name);
-    } else if (in.type == 'E') {
-        in.data[MAX_DATA_SIZE - 1] = '\0';
-        printf("Deregistration failed: %s\n", in.data);
     }
 }
 
-// Deregister all content
-void deregister_all(void)
+// Remember a changed name until the next flush
+void share_note(const char *name)
 {
-    struct registered_content *reg;
-    struct registered_content *next;
+    struct share_change *change;
 
-    reg = reg_list;
-    while (reg) {
-        next = reg->next;
-        deregister_content(reg->content_name);
-        reg = next;
+    // A file being written reports every write (IN_MODIFY); one note is enough
+    if (share_changes && strcmp(share_changes->name, name) == 0) {
+        share_last_ns = now_ns();
+        return;
+    }
+    change = (struct share_change *)malloc(sizeof(*change));
+    if (!change) {
+        share_rescan = 1;
+        return;
+    }
+    strcpy(change->name, name);
+    change->next = share_changes;
+    share_changes = change;
+    share_last_ns = now_ns();
+    if (share_pending++ == 0) {
+        share_first_ns = share_last_ns;
     }
 }
 
-// Handle TCP connection for content download
-void handle_tcp_connection(int tcp_sock, const char *content_name)
+// Send the changes collected from inotify once the directory has been quiet
+// for SHARE_COALESCE_MS, or at the latest SHARE_MAX_DELAY_MS after the first
+// one, so a burst of writes becomes a few batches instead of one request per
+// event. Changes that come in while a batch is being hashed wait for it.
+void share_tick(void)
 {
-    struct pdu in;
-    struct pdu out;
+    struct share_change *change;
+    struct share_file *files;
+    struct share_batch *b;
     struct registered_content *reg;
-    int fd;
-    ssize_t n;
-    ssize_t r;
-    char buffer[BUFLEN];
-    char filename[256];
+    struct stat sb;
+    long long now;
+    int count = 0;
+    int n;
+    int i;
 
-    // Receive download request
-    n = read(tcp_sock, &in, sizeof(in));
-    if (n < 0 || in.type != 'D') {
-        out.type = 'E';
-        strncpy(out.data, "Invalid download request", MAX_DATA_SIZE - 1);
-        out.data[MAX_DATA_SIZE - 1] = '\0';
-        write(tcp_sock, &out, 1 + strlen(out.data) + 1);
+    if (share_busy) {
+        if (!__atomic_load_n(&share_busy->done, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+        b = share_busy;
+        share_busy = NULL;
+        pthread_join(b->tid, NULL);
+        b->prompt = 1;
+        share_finish(b);
+        return;
+    }
+    if (!share_dir[0] || (!share_pending && !share_rescan)) {
+        return;
+    }
+    now = now_ns();
+    if (now - share_last_ns < SHARE_COALESCE_MS * 1000000LL &&
+        now - share_first_ns < SHARE_MAX_DELAY_MS * 1000000LL) {
         return;
     }
 
-    // Use the content_name parameter to find the registered content
-    reg = find_registered_content(content_name);
-    if (!reg) {
-        out.type = 'E';
-        strncpy(out.data, "Content not found", MAX_DATA_SIZE - 1);
-        out.data[MAX_DATA_SIZE - 1] = '\0';
-        write(tcp_sock, &out, 1 + strlen(out.data) + 1);
+    if (share_rescan) {
+        printf("\n");
+        while (share_changes) {
+            change = share_changes;
+            share_changes = change->next;
+            free(change);
+        }
+        share_pending = 0;
+        share_rescan = 0;
+        share_scan(NULL, 0);
+        share_save();
+        printf("> ");
+        fflush(stdout);
         return;
     }
 
-    // Open the file using the stored filename
-    fd = open(reg->filename, O_RDONLY);
-    if (fd < 0) {
-        snprintf(filename, sizeof(filename), "downloaded_%s", reg->content_name);
-        fd = open(filename, O_RDONLY);
-        if (fd < 0) {
-            out.type = 'E';
-            snprintf(out.data, MAX_DATA_SIZE - 1,
-                     "Cannot open file '%s' for content '%s'",
-                     reg->filename, reg->content_name);
-            out.data[MAX_DATA_SIZE - 1] = '\0';
-            write(tcp_sock, &out, 1 + strlen(out.data) + 1);
-            return;
+    b = (struct share_batch *)calloc(1, sizeof(*b));
+    files = b ? (struct share_file *)calloc(share_pending, sizeof(*files)) : NULL;
+    while (share_changes) {
+        change = share_changes;
+        share_changes = change->next;
+        if (files) {
+            strcpy(files[count++].name, change->name);
         }
+        free(change);
+    }
+    share_pending = 0;
+    if (!files) {
+        free(b);
+        share_rescan = 1;
+        return;
     }
 
-    // Send file data
-    for (;;) {
-        r = read(fd, buffer, MAX_DATA_SIZE);
-        if (r < 0) {
-            out.type = 'E';
-            strncpy(out.data, "Read error", MAX_DATA_SIZE - 1);
-            out.data[MAX_DATA_SIZE - 1] = '\0';
-            write(tcp_sock, &out, 1 + strlen(out.data) + 1);
-            break;
+    // A name may have changed many times; settle it once
+    qsort(files, count, sizeof(*files), share_file_cmp);
+    n = 0;
+    for (i = 0; i < count; i++) {
+        if (n == 0 || strcmp(files[n - 1].name, files[i].name) != 0) {
+            files[n++] = files[i];
         }
-        if (r == 0) {
-            out.type = 'F';
-            write(tcp_sock, &out, 1);
-            break;
+    }
+    count = n;
+
+    // Settle each changed name against what is registered now
+    for (i = 0; i < count; i++) {
+        if (snprintf(files[i].path, sizeof(files[i].path), "%s/%s", share_dir, files[i].name) >=
+            (int)sizeof(files[i].path)) {
+            continue;   // can't be shared, as in share_scan()
         }
-        if (r < MAX_DATA_SIZE) {
-            out.type = 'F';
-            memcpy(out.data, buffer, r);
-            write(tcp_sock, &out, 1 + r);
-            break;
-        } else {
-            out.type = 'C';
-            memcpy(out.data, buffer, r);
-            write(tcp_sock, &out, 1 + r);
+        reg = find_registered_content(files[i].name);
+        if (reg && !reg->shared) {
+            continue;   // registered by hand or from the cache
+        }
+        if (stat(files[i].path, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+            files[i].remove = reg != NULL;
+            continue;
+        }
+        if (reg && reg->meta.size == (uint64_t)sb.st_size &&
+            reg->meta.version == (uint64_t)sb.st_mtime) {
+            continue;
         }
+        files[i].need_hash = 1;
     }
-
-    close(fd);
+    b->files = files;
+    b->count = count;
+    b->prompt = 1;
+    share_submit(b);
 }
 
-// Handle UDP response from index server
-void handle_udp_response(void)
+// Show what is being shared
+void share_status(void)
 {
-    char buf[1];
+    struct registered_content *reg;
+    int count = 0;
+    uint64_t bytes = 0;
 
-    if (read(udp_sock, buf, sizeof(buf)) < 0) {
-        // ignore
+    if (!share_dir[0]) {
+        printf("No shared directory\n");
+        return;
+    }
+    for (reg = reg_list; reg; reg = reg->next) {
+        if (reg->shared) {
+            count++;
+            bytes += reg->meta.size;
+        }
+    }
+    printf("Sharing '%s': %d item(s), %.1f MB, %s", share_dir, count, bytes / 1048576.0,
+           share_fd >= 0 ? "watching for changes" : "not watching");
+    if (share_pending) {
+        printf(", %d change(s) pending", share_pending);
     }
+    printf("\n");
 }
 
-// Find registered content by name
-struct registered_content *find_registered_content(const char *content_name)
+// Remember the shared directory and the hashes of its files so the next
+// startup only rereads files that changed in between
+void share_save(void)
 {
-    struct registered_content *current;
+    FILE *fp;
+    struct registered_content *reg;
 
-    current = reg_list;
-    while (current) {
-        if (strncmp(current->content_name, content_name, CONTENT_NAME_SIZE) == 0) {
-            return current;
+    if (!share_dir[0]) {
+        unlink(SHARE_STATE);
+        return;
+    }
+    fp = fopen(SHARE_STATE ".tmp", "w");
+    if (!fp) {
+        return;
+    }
+    fprintf(fp, "dir %s\n", share_dir);
+    for (reg = reg_list; reg; reg = reg->next) {
+        if (reg->shared) {
+            fprintf(fp, "%s %llu %llu %016llx\n", reg->content_name,
+                    (unsigned long long)reg->meta.size,
+                    (unsigned long long)reg->meta.version,
+                    (unsigned long long)reg->meta.hash);
         }
-        current = current->next;
     }
-    return NULL;
+    if (fclose(fp) == 0) {
+        rename(SHARE_STATE ".tmp", SHARE_STATE);
+    }
 }
 
-// Free registered content list
-void free_reg_list(void)
+// Share the directory shared before a restart again
+void share_load(void)
 {
-    struct registered_content *current;
-    struct registered_content *next;
+    FILE *fp;
+    char line[BUFLEN];
+    char dir[sizeof(share_dir)];
+    char name[CONTENT_NAME_SIZE + 1];
+    unsigned long long size, version, hash;
+    struct reg_update *saved = NULL;
+    struct reg_update *grown;
+    int count = 0;
+    int cap = 0;
 
-    current = reg_list;
-    while (current) {
-        next = current->next;
-        if (current->tcp_socket >= 0) {
-            close(current->tcp_socket);
+    fp = fopen(SHARE_STATE, "r");
+    if (!fp) {
+        return;
+    }
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, "dir ", 4) != 0 ||
+        strlen(line + 4) >= sizeof(dir)) {
+        fclose(fp);
+        return;
+    }
+    strcpy(dir, line + 4);
+    dir[strcspn(dir, "\r\n")] = '\0';
+
+    // Saved files: name size version hash
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%10s %llu %llu %llx", name, &size, &version, &hash) != 4) {
+            continue;
         }
-        free(current);
-        current = next;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            grown = (struct reg_update *)realloc(saved, cap * sizeof(*saved));
+            if (!grown) {
+                break;
+            }
+            saved = grown;
+        }
+        memset(&saved[count], 0, sizeof(saved[count]));
+        strcpy(saved[count].content_name, name);
+        saved[count].meta.size = size;
+        saved[count].meta.version = version;
+        saved[count].meta.hash = hash;
+        count++;
     }
-    reg_list = NULL;
+    fclose(fp);
+
+    qsort(saved, count, sizeof(*saved), reg_update_cmp);
+    if (share_watch(dir) == 0) {
+        share_scan(saved, count);
+        share_save();
+    }
+    free(saved);
+}
+
+// Order reg_updates by content name
+int reg_update_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct reg_update *)a)->content_name,
+                  ((const struct reg_update *)b)->content_name);
+}
+
+// Order share_files by name
+int share_file_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct share_file *)a)->name, ((const struct share_file *)b)->name);
 }